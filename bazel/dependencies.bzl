@@ -61,15 +61,6 @@ def fhirproto_dependencies():
         ],
     )
 
-    # Used for the FHIRPath parser runtime.
-    http_archive(
-        name = "antlr_cc_runtime",
-        url = "https://www.antlr.org/download/antlr4-cpp-runtime-4.7.1-source.zip",
-        sha256 = "23bebc0411052a260f43ae097aa1ab39869eb6b6aa558b046c367a4ea33d1ccc",
-        strip_prefix = "runtime/src",
-        build_file = "@com_google_fhir//bazel:antlr.BUILD",
-    )
-
     http_archive(
         name = "bazel_skylib",
         sha256 = "1dde365491125a3db70731e25658dfdd3bc5dbdfd11b840b3e987ecf043c7ca0",
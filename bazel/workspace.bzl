@@ -17,7 +17,6 @@ def fhirproto_workspace(core_lib = False):
 
     maven_install(
         artifacts = [
-            "org.antlr:antlr4:jar:4.7.1",
             "com.beust:jcommander:1.72",
             "com.fasterxml.jackson.core:jackson-core:2.9.5",
             "com.fasterxml.jackson.core:jackson-databind:2.9.5",
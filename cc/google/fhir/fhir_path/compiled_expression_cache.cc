@@ -0,0 +1,148 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "google/fhir/fhir_path/compiled_expression_cache.h"
+
+#include <algorithm>
+
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+
+namespace google {
+namespace fhir {
+namespace fhir_path {
+
+CompiledExpressionCache::CompiledExpressionCache(const Options& options)
+    : shard_capacity_(std::max<size_t>(
+          1, (options.capacity + std::max(options.num_shards, 1) - 1) /
+                 std::max(options.num_shards, 1))),
+      compile_options_(options.compile_options) {
+  for (int i = 0; i < std::max(options.num_shards, 1); ++i) {
+    shards_.push_back(absl::make_unique<Shard>());
+  }
+}
+
+CompiledExpressionCache& CompiledExpressionCache::Global() {
+  static CompiledExpressionCache* cache = new CompiledExpressionCache();
+  return *cache;
+}
+
+StatusOr<std::shared_ptr<const CompiledExpression>>
+CompiledExpressionCache::Compile(const ::google::protobuf::Descriptor* descriptor,
+                                 const PrimitiveHandler* primitive_handler,
+                                 absl::string_view fhir_path) {
+  const Key key{descriptor, primitive_handler, fhir_path};
+  Shard& shard = ShardFor(key);
+  std::shared_ptr<const CompiledExpression> cached = Lookup(shard, key);
+  if (cached != nullptr) {
+    return cached;
+  }
+
+  // Compiling is slow relative to a lookup, so it is done without holding the
+  // shard's lock. Concurrent misses on the same expression may each compile
+  // it, in which case the first to finish is kept.
+  FHIR_ASSIGN_OR_RETURN(
+      CompiledExpression expression,
+      CompiledExpression::Compile(descriptor, primitive_handler,
+                                  std::string(fhir_path), compile_options_));
+  return Insert(shard, key,
+                std::make_shared<const CompiledExpression>(
+                    std::move(expression)));
+}
+
+Status CompiledExpressionCache::WarmUp(
+    const ::google::protobuf::Descriptor* descriptor,
+    const PrimitiveHandler* primitive_handler,
+    absl::Span<const std::string> fhir_paths) {
+  Status status = absl::OkStatus();
+  for (const std::string& fhir_path : fhir_paths) {
+    StatusOr<std::shared_ptr<const CompiledExpression>> expression =
+        Compile(descriptor, primitive_handler, fhir_path);
+    if (status.ok() && !expression.ok()) {
+      status = expression.status();
+    }
+  }
+  return status;
+}
+
+CompiledExpressionCache::Stats CompiledExpressionCache::GetStats() const {
+  Stats stats;
+  for (const std::unique_ptr<Shard>& shard : shards_) {
+    absl::MutexLock lock(&shard->mutex);
+    stats.hits += shard->hits;
+    stats.misses += shard->misses;
+    stats.evictions += shard->evictions;
+    stats.size += shard->entries.size();
+  }
+  return stats;
+}
+
+void CompiledExpressionCache::Clear() {
+  for (const std::unique_ptr<Shard>& shard : shards_) {
+    absl::MutexLock lock(&shard->mutex);
+    shard->index.clear();
+    shard->entries.clear();
+    shard->hits = 0;
+    shard->misses = 0;
+    shard->evictions = 0;
+  }
+}
+
+CompiledExpressionCache::Shard& CompiledExpressionCache::ShardFor(
+    const Key& key) {
+  return *shards_[absl::Hash<Key>()(key) % shards_.size()];
+}
+
+std::shared_ptr<const CompiledExpression> CompiledExpressionCache::Lookup(
+    Shard& shard, const Key& key) {
+  absl::MutexLock lock(&shard.mutex);
+  auto it = shard.index.find(key);
+  if (it == shard.index.end()) {
+    ++shard.misses;
+    return nullptr;
+  }
+
+  ++shard.hits;
+  shard.entries.splice(shard.entries.begin(), shard.entries, it->second);
+  return it->second->expression;
+}
+
+std::shared_ptr<const CompiledExpression> CompiledExpressionCache::Insert(
+    Shard& shard, const Key& key,
+    std::shared_ptr<const CompiledExpression> expression) {
+  absl::MutexLock lock(&shard.mutex);
+  auto it = shard.index.find(key);
+  if (it != shard.index.end()) {
+    return it->second->expression;
+  }
+
+  shard.entries.push_front(
+      Entry{std::string(key.fhir_path), key, std::move(expression)});
+  Entry& entry = shard.entries.front();
+  // The key refers to the caller's text until it is repointed at the copy
+  // owned by the entry.
+  entry.key.fhir_path = entry.fhir_path;
+  shard.index.emplace(entry.key, shard.entries.begin());
+
+  if (shard.entries.size() > shard_capacity_) {
+    shard.index.erase(shard.entries.back().key);
+    shard.entries.pop_back();
+    ++shard.evictions;
+  }
+  return entry.expression;
+}
+
+}  // namespace fhir_path
+}  // namespace fhir
+}  // namespace google
@@ -0,0 +1,169 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GOOGLE_FHIR_FHIR_PATH_COMPILED_EXPRESSION_CACHE_H_
+#define GOOGLE_FHIR_FHIR_PATH_COMPILED_EXPRESSION_CACHE_H_
+
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "google/protobuf/descriptor.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/hash/hash.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/types/span.h"
+#include "google/fhir/fhir_path/fhir_path.h"
+#include "google/fhir/primitive_handler.h"
+#include "google/fhir/status/status.h"
+#include "google/fhir/status/statusor.h"
+
+namespace google {
+namespace fhir {
+namespace fhir_path {
+
+// A bounded cache of compiled FHIRPath expressions, keyed by the message type
+// they are compiled against, the primitive handler and the expression text.
+//
+// Compiling an expression parses it and resolves every field it navigates,
+// which costs far more than evaluating it. Callers that compile expressions
+// on demand (e.g. user-supplied rules) can compile through a cache so that
+// expressions they have seen before cost a hash lookup.
+//
+// The cache is split into shards, each with its own lock and least recently
+// used eviction, so that concurrent callers rarely contend. Expressions are
+// compiled outside of the lock. Expressions that fail to compile are not
+// cached.
+//
+// This class is thread safe.
+class CompiledExpressionCache {
+ public:
+  struct Options {
+    // The maximum number of expressions held by the cache. Each shard holds at
+    // most its share of this.
+    size_t capacity = 4096;
+
+    // The number of independently locked shards.
+    int num_shards = 16;
+
+    // The options that expressions are compiled with.
+    CompileOptions compile_options;
+  };
+
+  // Counters describing the use of the cache since it was created or last
+  // cleared.
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+
+    // The number of expressions currently held by the cache.
+    size_t size = 0;
+  };
+
+  CompiledExpressionCache() : CompiledExpressionCache(Options()) {}
+  explicit CompiledExpressionCache(const Options& options);
+
+  CompiledExpressionCache(const CompiledExpressionCache&) = delete;
+  CompiledExpressionCache& operator=(const CompiledExpressionCache&) = delete;
+
+  // Returns a cache shared by the whole process, created with the default
+  // options.
+  static CompiledExpressionCache& Global();
+
+  // Returns the expression compiled from the given FHIRPath against the given
+  // message type, compiling it if the cache does not hold it already.
+  StatusOr<std::shared_ptr<const CompiledExpression>> Compile(
+      const ::google::protobuf::Descriptor* descriptor,
+      const PrimitiveHandler* primitive_handler, absl::string_view fhir_path);
+
+  // Compiles each of the given FHIRPath expressions into the cache ahead of
+  // their first use. Every expression is attempted; the status of the first
+  // one that fails to compile is returned.
+  Status WarmUp(const ::google::protobuf::Descriptor* descriptor,
+                const PrimitiveHandler* primitive_handler,
+                absl::Span<const std::string> fhir_paths);
+
+  Stats GetStats() const;
+
+  // Removes every expression from the cache and resets its counters.
+  void Clear();
+
+ private:
+  // Identifies a compiled expression. The text is owned by the cache entry,
+  // or by the caller for the duration of a lookup.
+  struct Key {
+    const ::google::protobuf::Descriptor* descriptor;
+    const PrimitiveHandler* primitive_handler;
+    absl::string_view fhir_path;
+
+    template <typename H>
+    friend H AbslHashValue(H h, const Key& key) {
+      return H::combine(std::move(h), key.descriptor, key.primitive_handler,
+                        key.fhir_path);
+    }
+
+    bool operator==(const Key& other) const {
+      return descriptor == other.descriptor &&
+             primitive_handler == other.primitive_handler &&
+             fhir_path == other.fhir_path;
+    }
+  };
+
+  struct Entry {
+    std::string fhir_path;
+    Key key;
+    std::shared_ptr<const CompiledExpression> expression;
+  };
+
+  struct Shard {
+    mutable absl::Mutex mutex;
+
+    // Entries ordered from most to least recently used.
+    std::list<Entry> entries;
+
+    absl::flat_hash_map<Key, std::list<Entry>::iterator> index;
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+  };
+
+  Shard& ShardFor(const Key& key);
+
+  // Returns the cached expression for the key, marking it as the most
+  // recently used, or nullptr if it is not cached.
+  std::shared_ptr<const CompiledExpression> Lookup(Shard& shard,
+                                                   const Key& key);
+
+  // Adds the expression to the shard, unless another caller added one for the
+  // same key first, and returns the cached expression.
+  std::shared_ptr<const CompiledExpression> Insert(
+      Shard& shard, const Key& key,
+      std::shared_ptr<const CompiledExpression> expression);
+
+  const size_t shard_capacity_;
+  const CompileOptions compile_options_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+}  // namespace fhir_path
+}  // namespace fhir
+}  // namespace google
+
+#endif  // GOOGLE_FHIR_FHIR_PATH_COMPILED_EXPRESSION_CACHE_H_
@@ -0,0 +1,192 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "google/fhir/fhir_path/compiled_expression_cache.h"
+
+#include <memory>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "google/fhir/r4/primitive_handler.h"
+#include "google/fhir/status/statusor.h"
+#include "google/fhir/stu3/primitive_handler.h"
+#include "proto/r4/core/resources/encounter.pb.h"
+#include "proto/r4/core/resources/observation.pb.h"
+
+namespace google {
+namespace fhir {
+namespace fhir_path {
+
+namespace {
+
+using ::google::fhir::r4::core::Encounter;
+using ::google::fhir::r4::core::Observation;
+
+const PrimitiveHandler* R4Handler() {
+  return r4::R4PrimitiveHandler::GetInstance();
+}
+
+std::shared_ptr<const CompiledExpression> MustCompile(
+    CompiledExpressionCache* cache, const std::string& fhir_path) {
+  StatusOr<std::shared_ptr<const CompiledExpression>> expression =
+      cache->Compile(Observation::descriptor(), R4Handler(), fhir_path);
+  EXPECT_TRUE(expression.ok()) << expression.status();
+  return expression.ValueOrDie();
+}
+
+TEST(CompiledExpressionCacheTest, ReturnsSharedExpressionOnHit) {
+  CompiledExpressionCache cache;
+
+  std::shared_ptr<const CompiledExpression> first =
+      MustCompile(&cache, "status.exists()");
+  std::shared_ptr<const CompiledExpression> second =
+      MustCompile(&cache, "status.exists()");
+
+  EXPECT_EQ(first, second);
+  EXPECT_EQ(first->fhir_path(), "status.exists()");
+
+  CompiledExpressionCache::Stats stats = cache.GetStats();
+  EXPECT_EQ(stats.hits, 1);
+  EXPECT_EQ(stats.misses, 1);
+  EXPECT_EQ(stats.evictions, 0);
+  EXPECT_EQ(stats.size, 1);
+}
+
+TEST(CompiledExpressionCacheTest, KeysOnTypeHandlerAndText) {
+  CompiledExpressionCache cache;
+
+  std::shared_ptr<const CompiledExpression> observation =
+      MustCompile(&cache, "status.exists()");
+  std::shared_ptr<const CompiledExpression> encounter =
+      cache.Compile(Encounter::descriptor(), R4Handler(), "status.exists()")
+          .ValueOrDie();
+  std::shared_ptr<const CompiledExpression> stu3 =
+      cache
+          .Compile(Observation::descriptor(),
+                   stu3::Stu3PrimitiveHandler::GetInstance(), "status.exists()")
+          .ValueOrDie();
+  std::shared_ptr<const CompiledExpression> other_text =
+      MustCompile(&cache, "status.empty()");
+
+  EXPECT_NE(observation, encounter);
+  EXPECT_NE(observation, stu3);
+  EXPECT_NE(observation, other_text);
+  EXPECT_EQ(cache.GetStats().misses, 4);
+  EXPECT_EQ(cache.GetStats().size, 4);
+}
+
+TEST(CompiledExpressionCacheTest, EvictsLeastRecentlyUsed) {
+  CompiledExpressionCache::Options options;
+  options.capacity = 2;
+  options.num_shards = 1;
+  CompiledExpressionCache cache(options);
+
+  std::shared_ptr<const CompiledExpression> status =
+      MustCompile(&cache, "status");
+  MustCompile(&cache, "code");
+  // Using "status" again makes "code" the least recently used.
+  MustCompile(&cache, "status");
+  MustCompile(&cache, "subject");
+
+  CompiledExpressionCache::Stats stats = cache.GetStats();
+  EXPECT_EQ(stats.evictions, 1);
+  EXPECT_EQ(stats.size, 2);
+
+  EXPECT_EQ(MustCompile(&cache, "status"), status);
+  MustCompile(&cache, "code");
+  EXPECT_EQ(cache.GetStats().misses, 4);
+}
+
+TEST(CompiledExpressionCacheTest, DoesNotCacheErrors) {
+  CompiledExpressionCache cache;
+
+  EXPECT_FALSE(
+      cache.Compile(Observation::descriptor(), R4Handler(), "bogusField").ok());
+  EXPECT_FALSE(
+      cache.Compile(Observation::descriptor(), R4Handler(), "bogusField").ok());
+
+  CompiledExpressionCache::Stats stats = cache.GetStats();
+  EXPECT_EQ(stats.misses, 2);
+  EXPECT_EQ(stats.size, 0);
+}
+
+TEST(CompiledExpressionCacheTest, WarmUp) {
+  CompiledExpressionCache cache;
+
+  EXPECT_FALSE(cache
+                   .WarmUp(Observation::descriptor(), R4Handler(),
+                           {"status", "bogusField", "code"})
+                   .ok());
+  EXPECT_EQ(cache.GetStats().size, 2);
+
+  MustCompile(&cache, "status");
+  MustCompile(&cache, "code");
+  EXPECT_EQ(cache.GetStats().hits, 2);
+}
+
+TEST(CompiledExpressionCacheTest, Clear) {
+  CompiledExpressionCache cache;
+  MustCompile(&cache, "status");
+  MustCompile(&cache, "status");
+
+  cache.Clear();
+
+  CompiledExpressionCache::Stats stats = cache.GetStats();
+  EXPECT_EQ(stats.hits, 0);
+  EXPECT_EQ(stats.misses, 0);
+  EXPECT_EQ(stats.size, 0);
+}
+
+TEST(CompiledExpressionCacheTest, ConcurrentCompiles) {
+  CompiledExpressionCache::Options options;
+  options.capacity = 8;
+  options.num_shards = 2;
+  CompiledExpressionCache cache(options);
+
+  const std::vector<std::string> expressions = {
+      "status",         "code",           "subject",
+      "category",       "issued",         "method",
+      "interpretation", "component.code", "status.exists()",
+      "code.coding",    "category.coding", "subject.reference"};
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&cache, &expressions, t] {
+      for (int i = 0; i < 200; ++i) {
+        const std::string& fhir_path =
+            expressions[(i * 7 + t) % expressions.size()];
+        StatusOr<std::shared_ptr<const CompiledExpression>> expression =
+            cache.Compile(Observation::descriptor(), R4Handler(), fhir_path);
+        ASSERT_TRUE(expression.ok()) << expression.status();
+        EXPECT_EQ(expression.ValueOrDie()->fhir_path(), fhir_path);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  CompiledExpressionCache::Stats stats = cache.GetStats();
+  EXPECT_EQ(stats.hits + stats.misses, 8 * 200);
+  EXPECT_LE(stats.size, 8);
+}
+
+}  // namespace
+
+}  // namespace fhir_path
+}  // namespace fhir
+}  // namespace google
@@ -0,0 +1,328 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "google/fhir/fhir_path/decimal.h"
+
+#include <algorithm>
+
+#include "absl/status/status.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/strip.h"
+
+namespace google {
+namespace fhir {
+namespace fhir_path {
+namespace internal {
+
+namespace {
+
+constexpr uint32_t kBase = 1000000000;
+constexpr int kDigitsPerLimb = 9;
+
+constexpr uint32_t kPowersOfTen[kDigitsPerLimb] = {
+    1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000};
+
+// The largest exponent accepted by Parse. Decimals are expanded to plain
+// notation, so this bounds the number of digits an exponent can add.
+constexpr int kMaxExponent = 1000;
+
+template <typename Limbs>
+void TrimLimbs(Limbs* limbs) {
+  while (!limbs->empty() && limbs->back() == 0) {
+    limbs->pop_back();
+  }
+}
+
+template <typename Limbs>
+void MultiplyLimbs(Limbs* limbs, uint32_t factor) {
+  if (factor == 1) {
+    return;
+  }
+  uint64_t carry = 0;
+  for (uint32_t& limb : *limbs) {
+    const uint64_t product = uint64_t{limb} * factor + carry;
+    limb = product % kBase;
+    carry = product / kBase;
+  }
+  if (carry != 0) {
+    limbs->push_back(carry);
+  }
+}
+
+template <typename Limbs>
+int CompareLimbs(const Limbs& a, const Limbs& b) {
+  if (a.size() != b.size()) {
+    return a.size() < b.size() ? -1 : 1;
+  }
+  for (size_t i = a.size(); i-- > 0;) {
+    if (a[i] != b[i]) {
+      return a[i] < b[i] ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+template <typename Limbs>
+Limbs AddLimbs(const Limbs& a, const Limbs& b) {
+  const Limbs& longer = a.size() >= b.size() ? a : b;
+  const Limbs& shorter = a.size() >= b.size() ? b : a;
+  Limbs sum;
+  sum.reserve(longer.size() + 1);
+  uint32_t carry = 0;
+  for (size_t i = 0; i < longer.size(); ++i) {
+    uint32_t limb = longer[i] + carry + (i < shorter.size() ? shorter[i] : 0);
+    carry = limb >= kBase;
+    sum.push_back(carry ? limb - kBase : limb);
+  }
+  if (carry != 0) {
+    sum.push_back(carry);
+  }
+  return sum;
+}
+
+// Returns a - b, where a is not less than b.
+template <typename Limbs>
+Limbs SubtractLimbs(const Limbs& a, const Limbs& b) {
+  Limbs difference;
+  difference.reserve(a.size());
+  uint32_t borrow = 0;
+  for (size_t i = 0; i < a.size(); ++i) {
+    const uint32_t subtrahend = (i < b.size() ? b[i] : 0) + borrow;
+    borrow = a[i] < subtrahend;
+    difference.push_back(borrow ? a[i] + kBase - subtrahend
+                                : a[i] - subtrahend);
+  }
+  TrimLimbs(&difference);
+  return difference;
+}
+
+// Returns the length of the run of ASCII digits at the start of the text.
+size_t DigitCount(absl::string_view text) {
+  size_t count = 0;
+  while (count < text.size() && absl::ascii_isdigit(text[count])) {
+    ++count;
+  }
+  return count;
+}
+
+}  // namespace
+
+StatusOr<Decimal> Decimal::Parse(absl::string_view text) {
+  auto invalid = [&]() {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Invalid decimal: ", text));
+  };
+
+  absl::string_view rest = text;
+  const bool negative = absl::ConsumePrefix(&rest, "-");
+  const absl::string_view integer = rest.substr(0, DigitCount(rest));
+  if (integer.empty()) {
+    return invalid();
+  }
+  rest.remove_prefix(integer.size());
+
+  absl::string_view fraction;
+  if (absl::ConsumePrefix(&rest, ".")) {
+    fraction = rest.substr(0, DigitCount(rest));
+    if (fraction.empty()) {
+      return invalid();
+    }
+    rest.remove_prefix(fraction.size());
+  }
+
+  int exponent = 0;
+  if (absl::ConsumePrefix(&rest, "e") || absl::ConsumePrefix(&rest, "E")) {
+    const bool negative_exponent = absl::ConsumePrefix(&rest, "-");
+    if (!negative_exponent) {
+      absl::ConsumePrefix(&rest, "+");
+    }
+    const size_t digits = DigitCount(rest);
+    if (digits == 0 || digits > 4) {
+      return invalid();
+    }
+    for (char c : rest.substr(0, digits)) {
+      exponent = exponent * 10 + (c - '0');
+    }
+    if (exponent > kMaxExponent) {
+      return invalid();
+    }
+    exponent = negative_exponent ? -exponent : exponent;
+    rest.remove_prefix(digits);
+  }
+  if (!rest.empty()) {
+    return invalid();
+  }
+
+  // The digits of the coefficient are those of the integer part followed by
+  // those of the fraction, read into limbs from the least significant end.
+  Decimal decimal;
+  const size_t num_digits = integer.size() + fraction.size();
+  auto digit = [&](size_t i) -> uint32_t {
+    return (i < integer.size() ? integer[i]
+                               : fraction[i - integer.size()]) -
+           '0';
+  };
+  decimal.limbs_.reserve((num_digits + kDigitsPerLimb - 1) / kDigitsPerLimb);
+  for (size_t end = num_digits; end > 0;) {
+    const size_t begin = end > kDigitsPerLimb ? end - kDigitsPerLimb : 0;
+    uint32_t limb = 0;
+    for (size_t i = begin; i < end; ++i) {
+      limb = limb * 10 + digit(i);
+    }
+    decimal.limbs_.push_back(limb);
+    end = begin;
+  }
+  TrimLimbs(&decimal.limbs_);
+
+  decimal.scale_ = static_cast<int>(fraction.size()) - exponent;
+  if (decimal.scale_ < 0) {
+    // Positive exponents are expanded, e.g. "1.5e3" is 1500.
+    decimal.limbs_ = decimal.LimbsAtScale(0);
+    decimal.scale_ = 0;
+  }
+  decimal.negative_ = negative && !decimal.limbs_.empty();
+  return decimal;
+}
+
+Decimal Decimal::FromInteger(int64_t value) {
+  Decimal decimal;
+  decimal.negative_ = value < 0;
+  uint64_t magnitude =
+      value < 0 ? ~static_cast<uint64_t>(value) + 1 : value;
+  while (magnitude != 0) {
+    decimal.limbs_.push_back(magnitude % kBase);
+    magnitude /= kBase;
+  }
+  return decimal;
+}
+
+std::string Decimal::ToString() const {
+  std::string digits;
+  if (limbs_.empty()) {
+    digits = "0";
+  } else {
+    digits = absl::StrCat(limbs_.back());
+    digits.reserve(digits.size() + (limbs_.size() - 1) * kDigitsPerLimb +
+                   scale_ + 2);
+    char limb_digits[kDigitsPerLimb];
+    for (size_t i = limbs_.size() - 1; i-- > 0;) {
+      uint32_t limb = limbs_[i];
+      for (int j = kDigitsPerLimb - 1; j >= 0; --j) {
+        limb_digits[j] = '0' + limb % 10;
+        limb /= 10;
+      }
+      digits.append(limb_digits, kDigitsPerLimb);
+    }
+  }
+
+  if (scale_ > 0) {
+    if (digits.size() <= scale_) {
+      digits.insert(0, scale_ + 1 - digits.size(), '0');
+    }
+    digits.insert(digits.size() - scale_, 1, '.');
+  }
+  if (negative_) {
+    digits.insert(0, 1, '-');
+  }
+  return digits;
+}
+
+Decimal Decimal::operator-() const {
+  Decimal negated = *this;
+  negated.negative_ = !negative_ && !limbs_.empty();
+  return negated;
+}
+
+Decimal::Limbs Decimal::LimbsAtScale(int scale) const {
+  if (scale == scale_ || limbs_.empty()) {
+    return limbs_;
+  }
+  const int shift = scale - scale_;
+  // Each whole limb of shift is a multiplication by the base.
+  Limbs limbs(shift / kDigitsPerLimb, 0);
+  limbs.insert(limbs.end(), limbs_.begin(), limbs_.end());
+  MultiplyLimbs(&limbs, kPowersOfTen[shift % kDigitsPerLimb]);
+  return limbs;
+}
+
+void Decimal::SetSum(bool a_negative, const Limbs& a, bool b_negative,
+                     const Limbs& b) {
+  if (a_negative == b_negative) {
+    limbs_ = AddLimbs(a, b);
+    negative_ = a_negative;
+  } else if (CompareLimbs(a, b) >= 0) {
+    limbs_ = SubtractLimbs(a, b);
+    negative_ = a_negative;
+  } else {
+    limbs_ = SubtractLimbs(b, a);
+    negative_ = b_negative;
+  }
+  negative_ = negative_ && !limbs_.empty();
+}
+
+Decimal operator+(const Decimal& a, const Decimal& b) {
+  Decimal sum;
+  sum.scale_ = std::max(a.scale_, b.scale_);
+  if (a.scale_ == b.scale_) {
+    sum.SetSum(a.negative_, a.limbs_, b.negative_, b.limbs_);
+  } else {
+    sum.SetSum(a.negative_, a.LimbsAtScale(sum.scale_), b.negative_,
+               b.LimbsAtScale(sum.scale_));
+  }
+  return sum;
+}
+
+Decimal operator-(const Decimal& a, const Decimal& b) { return a + -b; }
+
+Decimal operator*(const Decimal& a, const Decimal& b) {
+  Decimal product;
+  product.scale_ = a.scale_ + b.scale_;
+  if (a.limbs_.empty() || b.limbs_.empty()) {
+    return product;
+  }
+
+  product.limbs_.assign(a.limbs_.size() + b.limbs_.size(), 0);
+  for (size_t i = 0; i < a.limbs_.size(); ++i) {
+    uint64_t carry = 0;
+    for (size_t j = 0; j < b.limbs_.size(); ++j) {
+      // At most (10^9 - 1)^2 + 2 * (10^9 - 1), which fits in 64 bits.
+      const uint64_t value = uint64_t{a.limbs_[i]} * b.limbs_[j] +
+                             product.limbs_[i + j] + carry;
+      product.limbs_[i + j] = value % kBase;
+      carry = value / kBase;
+    }
+    product.limbs_[i + b.limbs_.size()] = carry;
+  }
+  TrimLimbs(&product.limbs_);
+  product.negative_ = a.negative_ != b.negative_;
+  return product;
+}
+
+int Compare(const Decimal& a, const Decimal& b) {
+  if (a.negative_ != b.negative_) {
+    return a.negative_ ? -1 : 1;
+  }
+  const int magnitude =
+      a.scale_ == b.scale_
+          ? CompareLimbs(a.limbs_, b.limbs_)
+          : CompareLimbs(a.LimbsAtScale(std::max(a.scale_, b.scale_)),
+                         b.LimbsAtScale(std::max(a.scale_, b.scale_)));
+  return a.negative_ ? -magnitude : magnitude;
+}
+
+}  // namespace internal
+}  // namespace fhir_path
+}  // namespace fhir
+}  // namespace google
@@ -0,0 +1,118 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GOOGLE_FHIR_FHIR_PATH_DECIMAL_H_
+#define GOOGLE_FHIR_FHIR_PATH_DECIMAL_H_
+
+#include <cstdint>
+#include <string>
+
+#include "absl/container/inlined_vector.h"
+#include "absl/strings/string_view.h"
+#include "google/fhir/status/statusor.h"
+
+namespace google {
+namespace fhir {
+namespace fhir_path {
+namespace internal {
+
+// An exact decimal number of arbitrary precision, used for FHIRPath arithmetic
+// and comparisons of FHIR decimals and quantities.
+//
+// FHIR requires that the precision of a decimal be kept, so a Decimal is an
+// integer coefficient together with a scale, the number of digits after the
+// decimal point, and "1.50" keeps its scale of 2 rather than becoming 1.5.
+// Arithmetic is exact: the sum of two decimals has the larger of their scales
+// and the product has the sum of their scales. Comparisons are by value, so
+// "1.5" and "1.50" compare equal.
+//
+// The coefficient is held in base 10^9 limbs, and values of up to 18 digits,
+// which covers nearly all FHIR data, are stored without allocation.
+class Decimal {
+ public:
+  // Zero, with a scale of 0.
+  Decimal() = default;
+
+  // Parses a FHIR decimal (e.g. "-1.50" or "6.02e23"). Returns an
+  // InvalidArgument error if the text is not a decimal.
+  static StatusOr<Decimal> Parse(absl::string_view text);
+
+  static Decimal FromInteger(int64_t value);
+
+  // Returns the decimal in the plain notation of FHIR, with exactly scale()
+  // digits after the decimal point and no exponent.
+  std::string ToString() const;
+
+  // The number of digits after the decimal point.
+  int scale() const { return scale_; }
+
+  bool IsZero() const { return limbs_.empty(); }
+
+  bool IsNegative() const { return negative_; }
+
+  Decimal operator-() const;
+
+  friend Decimal operator+(const Decimal& a, const Decimal& b);
+  friend Decimal operator-(const Decimal& a, const Decimal& b);
+  friend Decimal operator*(const Decimal& a, const Decimal& b);
+
+  // Returns a negative number, zero or a positive number if a is less than,
+  // equal to or greater than b, respectively.
+  friend int Compare(const Decimal& a, const Decimal& b);
+
+  friend bool operator==(const Decimal& a, const Decimal& b) {
+    return Compare(a, b) == 0;
+  }
+  friend bool operator!=(const Decimal& a, const Decimal& b) {
+    return Compare(a, b) != 0;
+  }
+  friend bool operator<(const Decimal& a, const Decimal& b) {
+    return Compare(a, b) < 0;
+  }
+  friend bool operator<=(const Decimal& a, const Decimal& b) {
+    return Compare(a, b) <= 0;
+  }
+  friend bool operator>(const Decimal& a, const Decimal& b) {
+    return Compare(a, b) > 0;
+  }
+  friend bool operator>=(const Decimal& a, const Decimal& b) {
+    return Compare(a, b) >= 0;
+  }
+
+ private:
+  // Limbs of the coefficient, least significant first. A coefficient of zero
+  // has no limbs, and no other coefficient has a most significant limb of
+  // zero.
+  using Limbs = absl::InlinedVector<uint32_t, 2>;
+
+  // Returns the coefficient scaled up to the given scale, which must not be
+  // less than the scale of the decimal.
+  Limbs LimbsAtScale(int scale) const;
+
+  // Sets the sign and coefficient to those of the signed sum of the
+  // magnitudes, which are at the same scale.
+  void SetSum(bool a_negative, const Limbs& a, bool b_negative,
+              const Limbs& b);
+
+  bool negative_ = false;
+  int scale_ = 0;
+  Limbs limbs_;
+};
+
+}  // namespace internal
+}  // namespace fhir_path
+}  // namespace fhir
+}  // namespace google
+
+#endif  // GOOGLE_FHIR_FHIR_PATH_DECIMAL_H_
@@ -0,0 +1,154 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "google/fhir/fhir_path/decimal.h"
+
+#include <cstdint>
+#include <limits>
+#include <random>
+#include <string>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "google/fhir/status/statusor.h"
+
+namespace google {
+namespace fhir {
+namespace fhir_path {
+namespace internal {
+
+namespace {
+
+Decimal Parse(absl::string_view text) {
+  StatusOr<Decimal> decimal = Decimal::Parse(text);
+  EXPECT_TRUE(decimal.ok()) << text << ": " << decimal.status();
+  return decimal.ok() ? decimal.ValueOrDie() : Decimal();
+}
+
+TEST(DecimalTest, ParseKeepsScale) {
+  for (const std::string& text :
+       {"0", "0.0", "1", "-1", "1.50", "-0.001", "123456789", "1234567890",
+        "100000000000000000000000000000.000000000000000000000000000001",
+        "3.14159265358979323846264338327950288"}) {
+    EXPECT_EQ(Parse(text).ToString(), text);
+  }
+  EXPECT_EQ(Parse("1.50").scale(), 2);
+  EXPECT_EQ(Parse("007.10").ToString(), "7.10");
+  EXPECT_EQ(Parse("-0.00").ToString(), "0.00");
+  EXPECT_FALSE(Parse("-0.00").IsNegative());
+}
+
+TEST(DecimalTest, ParseExponents) {
+  EXPECT_EQ(Parse("1e3").ToString(), "1000");
+  EXPECT_EQ(Parse("1.5E+3").ToString(), "1500");
+  EXPECT_EQ(Parse("1.5e-3").ToString(), "0.0015");
+  EXPECT_EQ(Parse("-2.50e1").ToString(), "-25.0");
+  EXPECT_EQ(Parse("6.02e23").ToString(), "602000000000000000000000");
+}
+
+TEST(DecimalTest, InvalidDecimals) {
+  for (const std::string& text :
+       {"", "-", ".5", "1.", "1.5.", "1e", "1e+", "1e99999", "1e1001", "+1",
+        "1 ", " 1", "0x10", "1,5", "NaN", "Infinity"}) {
+    EXPECT_EQ(Decimal::Parse(text).status().code(),
+              absl::StatusCode::kInvalidArgument)
+        << text;
+  }
+}
+
+TEST(DecimalTest, FromInteger) {
+  EXPECT_EQ(Decimal::FromInteger(0).ToString(), "0");
+  EXPECT_EQ(Decimal::FromInteger(-42).ToString(), "-42");
+  EXPECT_EQ(Decimal::FromInteger(std::numeric_limits<int64_t>::min())
+                .ToString(),
+            "-9223372036854775808");
+  EXPECT_EQ(Decimal::FromInteger(std::numeric_limits<int64_t>::max())
+                .ToString(),
+            "9223372036854775807");
+}
+
+TEST(DecimalTest, Arithmetic) {
+  EXPECT_EQ((Parse("1.50") + Parse("1")).ToString(), "2.50");
+  EXPECT_EQ((Parse("0.1") + Parse("0.2")).ToString(), "0.3");
+  EXPECT_EQ((Parse("1.5") + Parse("-1.50")).ToString(), "0.00");
+  EXPECT_EQ((Parse("-1.5") + Parse("0.25")).ToString(), "-1.25");
+  EXPECT_EQ((Parse("999999999.999999999") + Parse("0.000000001")).ToString(),
+            "1000000000.000000000");
+  EXPECT_EQ((Parse("1") - Parse("1000000000000.5")).ToString(),
+            "-999999999999.5");
+  EXPECT_EQ((Parse("1.5") * Parse("2.0")).ToString(), "3.00");
+  EXPECT_EQ((Parse("-0.5") * Parse("0.5")).ToString(), "-0.25");
+  EXPECT_EQ((Parse("-0.5") * Parse("0")).ToString(), "0.0");
+  EXPECT_EQ((Parse("123456789123456789") * Parse("987654321987654321"))
+                .ToString(),
+            "121932631356500531347203169112635269");
+  EXPECT_EQ((-Parse("2.5")).ToString(), "-2.5");
+  EXPECT_EQ((-Parse("0.0")).ToString(), "0.0");
+}
+
+TEST(DecimalTest, Comparison) {
+  EXPECT_EQ(Parse("1.5"), Parse("1.50"));
+  EXPECT_EQ(Parse("0"), Parse("-0.000"));
+  EXPECT_LT(Parse("0.1"), Parse("0.10000000000000001"));
+  EXPECT_LT(Parse("-2"), Parse("-1.999"));
+  EXPECT_LT(Parse("-1"), Parse("0"));
+  EXPECT_GT(Parse("1000000000"), Parse("999999999.9999999999"));
+  EXPECT_LE(Parse("2.00"), Parse("2"));
+  EXPECT_GE(Parse("1e2"), Parse("99.99"));
+  EXPECT_NE(Parse("1.25"), Parse("1.3"));
+}
+
+// Checks arithmetic on integers of up to 19 digits against 128 bit integer
+// arithmetic.
+TEST(DecimalTest, AgreesWithIntegerArithmetic) {
+  std::mt19937_64 random(1234);
+  std::uniform_int_distribution<int64_t> coefficients(-4000000000000000000,
+                                                      4000000000000000000);
+  std::uniform_int_distribution<int> shifts(0, 4);
+  auto to_string = [](__int128 value) {
+    const bool negative = value < 0;
+    unsigned __int128 magnitude = negative ? -value : value;
+    std::string digits;
+    do {
+      digits.insert(0, 1, '0' + static_cast<int>(magnitude % 10));
+      magnitude /= 10;
+    } while (magnitude != 0);
+    return negative ? absl::StrCat("-", digits) : digits;
+  };
+
+  for (int i = 0; i < 1000; ++i) {
+    const int64_t a = coefficients(random) >> shifts(random) * 8;
+    const int64_t b = coefficients(random) >> shifts(random) * 8;
+    const Decimal decimal_a = Decimal::FromInteger(a);
+    const Decimal decimal_b = Decimal::FromInteger(b);
+
+    EXPECT_EQ((decimal_a + decimal_b).ToString(),
+              to_string(__int128{a} + b));
+    EXPECT_EQ((decimal_a - decimal_b).ToString(),
+              to_string(__int128{a} - b));
+    EXPECT_EQ((decimal_a * decimal_b).ToString(),
+              to_string(__int128{a} * b));
+    EXPECT_EQ(Compare(decimal_a, decimal_b) < 0, a < b);
+    EXPECT_EQ(Compare(decimal_a, decimal_b) == 0, a == b);
+  }
+}
+
+}  // namespace
+
+}  // namespace internal
+}  // namespace fhir_path
+}  // namespace fhir
+}  // namespace google
@@ -15,28 +15,41 @@
 #include "google/fhir/fhir_path/fhir_path.h"
 
 #include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <functional>
 #include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
 #include <utility>
 
 #include "google/protobuf/any.pb.h"
 #include "google/protobuf/descriptor.h"
 #include "google/protobuf/util/message_differencer.h"
+#include "absl/base/const_init.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/hash/hash.h"
 #include "absl/memory/memory.h"
 #include "absl/status/status.h"
 #include "absl/strings/escaping.h"
 #include "absl/strings/match.h"
 #include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
 #include "absl/strings/str_replace.h"
+#include "absl/strings/string_view.h"
 #include "absl/strings/strip.h"
+#include "absl/synchronization/mutex.h"
 #include "absl/time/civil_time.h"
 #include "absl/time/time.h"
 #include "absl/types/optional.h"
 #include "google/fhir/annotations.h"
-#include "google/fhir/fhir_path/FhirPathBaseVisitor.h"
-#include "google/fhir/fhir_path/FhirPathLexer.h"
-#include "google/fhir/fhir_path/FhirPathParser.h"
+#include "google/fhir/fhir_path/decimal.h"
+#include "google/fhir/fhir_path/parser.h"
 #include "google/fhir/fhir_path/utils.h"
+#include "google/fhir/fhir_types.h"
 #include "google/fhir/primitive_wrapper.h"
 #include "google/fhir/proto_util.h"
 #include "google/fhir/status/status.h"
@@ -53,19 +66,14 @@ using ::absl::InternalError;
 using ::absl::InvalidArgumentError;
 using ::absl::NotFoundError;
 using ::absl::UnimplementedError;
-using ::antlr4::ANTLRInputStream;
-using ::antlr4::BaseErrorListener;
-using ::antlr4::CommonTokenStream;
-using ::antlr4::tree::TerminalNode;
-using ::antlr_parser::FhirPathBaseVisitor;
-using ::antlr_parser::FhirPathLexer;
-using ::antlr_parser::FhirPathParser;
 using ::google::fhir::AreSameMessageType;
 using ::google::fhir::JsonPrimitive;
 using ::google::fhir::StatusOr;
 using ::google::fhir::r4::core::Boolean;
 using ::google::fhir::r4::core::Integer;
 using ::google::fhir::r4::core::String;
+using internal::AstNode;
+using internal::Decimal;
 using internal::ExpressionNode;
 using ::google::protobuf::Descriptor;
 using ::google::protobuf::FieldDescriptor;
@@ -77,11 +85,620 @@ namespace internal {
 // Default number of buckets to create when constructing a std::unordered_set.
 constexpr int kDefaultSetBucketCount = 10;
 
+using FieldSet = absl::flat_hash_set<const FieldDescriptor*>;
+
+// Returns true if the FHIR primitive holds its value as text that is
+// represented as a JSON string, in which case it converts to System.String.
+// Codes bound to a value set may hold an enum instead.
+bool IsStringLike(const Descriptor* descriptor, const FieldDescriptor* value) {
+  static const auto* kStringTypeUrls = new absl::flat_hash_set<std::string>({
+      "http://hl7.org/fhir/StructureDefinition/canonical",
+      "http://hl7.org/fhir/StructureDefinition/code",
+      "http://hl7.org/fhir/StructureDefinition/id",
+      "http://hl7.org/fhir/StructureDefinition/markdown",
+      "http://hl7.org/fhir/StructureDefinition/oid",
+      "http://hl7.org/fhir/StructureDefinition/string",
+      "http://hl7.org/fhir/StructureDefinition/uri",
+      "http://hl7.org/fhir/StructureDefinition/url",
+      "http://hl7.org/fhir/StructureDefinition/uuid",
+  });
+  return value->cpp_type() == FieldDescriptor::CPPTYPE_STRING &&
+         (kStringTypeUrls->contains(GetStructureDefinitionUrl(descriptor)) ||
+          IsProfileOfCode(descriptor));
+}
+
+// Returns a reference to the text of a string field, or nullopt if the field
+// is not stored as a std::string. Only string fields that are not stored as
+// std::string (e.g. cords) use the scratch string, which FHIR protos do not
+// have.
+absl::optional<absl::string_view> StringFieldReference(
+    const Message& message, const FieldDescriptor* field) {
+  std::string scratch;
+  const std::string& text =
+      message.GetReflection()->GetStringReference(message, field, &scratch);
+  if (&text == &scratch) {
+    return absl::nullopt;
+  }
+  return absl::string_view(text);
+}
+
+// The value of a FHIR primitive that converts to one of the FHIRPath System
+// types Boolean, Integer, Decimal or String. See
+// https://www.hl7.org/fhir/fhirpath.html#types
+//
+// Values are read from the primitive's "value" field without going through
+// the PrimitiveHandler, so that primitives can be tested and compared without
+// dynamic casts, JSON serialization or allocation. Strings and decimals
+// refer to the text held by the message, which must outlive the value.
+class SystemValue {
+ public:
+  enum class Type { kBoolean, kInteger, kDecimal, kString };
+
+  // Returns the System type that messages of the given type convert to, or
+  // nullopt if they don't convert to one of the types above.
+  static absl::optional<Type> TypeOf(const Descriptor* descriptor) {
+    return GetTypeInfo(descriptor).type;
+  }
+
+  // Returns the value of the message, or nullopt if its type does not convert
+  // to one of the types above.
+  static absl::optional<SystemValue> FromMessage(const Message& message) {
+    const TypeInfo& info = GetTypeInfo(message.GetDescriptor());
+    if (!info.type.has_value()) {
+      return absl::nullopt;
+    }
+
+    const ::google::protobuf::Reflection* reflection = message.GetReflection();
+    switch (info.value->cpp_type()) {
+      case FieldDescriptor::CPPTYPE_BOOL:
+        return SystemValue(info.type.value(),
+                           reflection->GetBool(message, info.value));
+      case FieldDescriptor::CPPTYPE_INT32:
+        return SystemValue(info.type.value(),
+                           reflection->GetInt32(message, info.value));
+      case FieldDescriptor::CPPTYPE_UINT32:
+        return SystemValue(info.type.value(),
+                           reflection->GetUInt32(message, info.value));
+      case FieldDescriptor::CPPTYPE_STRING: {
+        absl::optional<absl::string_view> text =
+            StringFieldReference(message, info.value);
+        if (!text.has_value()) {
+          return absl::nullopt;
+        }
+        return SystemValue(info.type.value(), *text);
+      }
+      default:
+        return absl::nullopt;
+    }
+  }
+
+  // Returns true if the message has neither an id nor extensions, in which
+  // case messages of the same type are equal if and only if their values are.
+  static bool HasOnlyValue(const Message& message) {
+    const TypeInfo& info = GetTypeInfo(message.GetDescriptor());
+    const ::google::protobuf::Reflection* reflection = message.GetReflection();
+    return (info.id == nullptr || !reflection->HasField(message, info.id)) &&
+           (info.extension == nullptr ||
+            reflection->FieldSize(message, info.extension) == 0);
+  }
+
+  Type type() const { return type_; }
+
+  bool boolean_value() const { return integer_ != 0; }
+
+  int64_t integer_value() const { return integer_; }
+
+  // The value of a string, or the text of a decimal.
+  absl::string_view string_value() const { return string_; }
+
+  bool operator==(const SystemValue& other) const {
+    return type_ == other.type_ && integer_ == other.integer_ &&
+           string_ == other.string_;
+  }
+
+ private:
+  struct TypeInfo {
+    absl::optional<Type> type;
+    const FieldDescriptor* value = nullptr;
+    const FieldDescriptor* id = nullptr;
+    const FieldDescriptor* extension = nullptr;
+  };
+
+  SystemValue(Type type, int64_t integer) : type_(type), integer_(integer) {}
+
+  SystemValue(Type type, absl::string_view string)
+      : type_(type), string_(string) {}
+
+  // Looking up the type of a message from its descriptor's options is costly
+  // relative to reading its value, so the result is cached per thread.
+  static const TypeInfo& GetTypeInfo(const Descriptor* descriptor) {
+    thread_local absl::flat_hash_map<const Descriptor*, TypeInfo> cache;
+    auto it = cache.find(descriptor);
+    if (it != cache.end()) {
+      return it->second;
+    }
+
+    TypeInfo info;
+    info.value = descriptor->FindFieldByName("value");
+    info.id = descriptor->FindFieldByName("id");
+    info.extension = descriptor->FindFieldByName("extension");
+    if (info.value != nullptr) {
+      if (IsBoolean(descriptor)) {
+        info.type = Type::kBoolean;
+      } else if (IsInteger(descriptor) || IsUnsignedInt(descriptor) ||
+                 IsPositiveInt(descriptor)) {
+        info.type = Type::kInteger;
+      } else if (IsDecimal(descriptor)) {
+        info.type = Type::kDecimal;
+      } else if (IsStringLike(descriptor, info.value)) {
+        info.type = Type::kString;
+      }
+    }
+    return cache.emplace(descriptor, info).first->second;
+  }
+
+  Type type_;
+  int64_t integer_ = 0;
+  absl::string_view string_;
+};
+
+// The value of a FHIR dateTime, read from its value_us and precision fields
+// without going through the PrimitiveHandler.
+struct DateTimeValue {
+  absl::Time time;
+  DateTimePrecision precision;
+
+  // Returns the value of the message, or nullopt if it does not have the
+  // fields of a FHIR dateTime.
+  static absl::optional<DateTimeValue> FromMessage(const Message& message) {
+    const TypeInfo& info = GetTypeInfo(message.GetDescriptor());
+    if (info.value_us == nullptr || info.precision == nullptr) {
+      return absl::nullopt;
+    }
+
+    const ::google::protobuf::Reflection* reflection = message.GetReflection();
+    auto precision =
+        info.precisions.find(reflection->GetEnumValue(message, info.precision));
+    return DateTimeValue{
+        absl::FromUnixMicros(reflection->GetInt64(message, info.value_us)),
+        precision == info.precisions.end() ? DateTimePrecision::kUnspecified
+                                           : precision->second};
+  }
+
+ private:
+  struct TypeInfo {
+    const FieldDescriptor* value_us = nullptr;
+    const FieldDescriptor* precision = nullptr;
+    absl::flat_hash_map<int, DateTimePrecision> precisions;
+  };
+
+  static const TypeInfo& GetTypeInfo(const Descriptor* descriptor) {
+    thread_local absl::flat_hash_map<const Descriptor*, TypeInfo> cache;
+    auto it = cache.find(descriptor);
+    if (it != cache.end()) {
+      return it->second;
+    }
+
+    TypeInfo info;
+    const FieldDescriptor* value_us = descriptor->FindFieldByName("value_us");
+    const FieldDescriptor* precision = descriptor->FindFieldByName("precision");
+    if (value_us != nullptr &&
+        value_us->cpp_type() == FieldDescriptor::CPPTYPE_INT64 &&
+        precision != nullptr &&
+        precision->cpp_type() == FieldDescriptor::CPPTYPE_ENUM) {
+      info.value_us = value_us;
+      info.precision = precision;
+      static const auto* kPrecisions =
+          new absl::flat_hash_map<std::string, DateTimePrecision>({
+              {"YEAR", DateTimePrecision::kYear},
+              {"MONTH", DateTimePrecision::kMonth},
+              {"DAY", DateTimePrecision::kDay},
+              {"SECOND", DateTimePrecision::kSecond},
+              {"MILLISECOND", DateTimePrecision::kMillisecond},
+              {"MICROSECOND", DateTimePrecision::kMicrosecond},
+          });
+      const ::google::protobuf::EnumDescriptor* precisions =
+          precision->enum_type();
+      for (int i = 0; i < precisions->value_count(); ++i) {
+        auto known = kPrecisions->find(precisions->value(i)->name());
+        if (known != kPrecisions->end()) {
+          info.precisions.emplace(precisions->value(i)->number(),
+                                  known->second);
+        }
+      }
+    }
+    return cache.emplace(descriptor, std::move(info)).first->second;
+  }
+};
+
+// The value and unit of a FHIR SimpleQuantity, read without going through the
+// PrimitiveHandler. The text refers to the message, which must outlive the
+// value.
+struct QuantityValue {
+  absl::string_view value;
+  absl::string_view code;
+  absl::string_view system;
+
+  // Returns the value of the message, or nullopt if it does not have the
+  // fields of a FHIR SimpleQuantity.
+  static absl::optional<QuantityValue> FromMessage(const Message& message) {
+    const TypeInfo& info = GetTypeInfo(message.GetDescriptor());
+    if (!info.valid) {
+      return absl::nullopt;
+    }
+
+    absl::optional<absl::string_view> value =
+        ReadText(message, info.value, info.value_text);
+    absl::optional<absl::string_view> code =
+        ReadText(message, info.code, info.code_text);
+    absl::optional<absl::string_view> system =
+        ReadText(message, info.system, info.system_text);
+    if (!value.has_value() || !code.has_value() || !system.has_value()) {
+      return absl::nullopt;
+    }
+    return QuantityValue{*value, *code, *system};
+  }
+
+ private:
+  // The value, code and system fields of the quantity, each a message
+  // holding its text in its own "value" field.
+  struct TypeInfo {
+    bool valid = false;
+    const FieldDescriptor* value = nullptr;
+    const FieldDescriptor* value_text = nullptr;
+    const FieldDescriptor* code = nullptr;
+    const FieldDescriptor* code_text = nullptr;
+    const FieldDescriptor* system = nullptr;
+    const FieldDescriptor* system_text = nullptr;
+  };
+
+  // Returns the text of the field of the quantity, which is empty if the
+  // field is not set.
+  static absl::optional<absl::string_view> ReadText(
+      const Message& message, const FieldDescriptor* field,
+      const FieldDescriptor* text) {
+    return StringFieldReference(
+        message.GetReflection()->GetMessage(message, field), text);
+  }
+
+  // Returns the "value" field of the message type of the given field if it
+  // holds text, or null otherwise.
+  static const FieldDescriptor* TextField(const FieldDescriptor* field) {
+    if (field == nullptr ||
+        field->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE ||
+        field->is_repeated()) {
+      return nullptr;
+    }
+    const FieldDescriptor* text =
+        field->message_type()->FindFieldByName("value");
+    if (text == nullptr ||
+        text->cpp_type() != FieldDescriptor::CPPTYPE_STRING ||
+        text->is_repeated()) {
+      return nullptr;
+    }
+    return text;
+  }
+
+  static const TypeInfo& GetTypeInfo(const Descriptor* descriptor) {
+    thread_local absl::flat_hash_map<const Descriptor*, TypeInfo> cache;
+    auto it = cache.find(descriptor);
+    if (it != cache.end()) {
+      return it->second;
+    }
+
+    TypeInfo info;
+    info.value = descriptor->FindFieldByName("value");
+    info.value_text = TextField(info.value);
+    info.code = descriptor->FindFieldByName("code");
+    info.code_text = TextField(info.code);
+    info.system = descriptor->FindFieldByName("system");
+    info.system_text = TextField(info.system);
+    info.valid = info.value_text != nullptr && info.code_text != nullptr &&
+                 info.system_text != nullptr;
+    return cache.emplace(descriptor, info).first->second;
+  }
+};
+
+// Returns a result holding a Boolean with the given value.
+WorkspaceMessage BooleanResult(WorkSpace* work_space, bool value) {
+  return WorkspaceMessage(
+      &work_space->GetPrimitiveHandler()->BooleanConstant(value));
+}
+
+// Combines the hash of a value into the hash of the values before it.
+size_t HashCombine(size_t hash, size_t value_hash) {
+  return hash ^ (value_hash + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2));
+}
+
+// Seeds that keep the hashes of JSON strings apart from other JSON values.
+constexpr size_t kJsonStringSeed = 0x5f3b;
+constexpr size_t kJsonValueSeed = 0x2c91;
+
+// Returns the longest prefix of a string that is written unchanged between
+// the quotes of its JSON representation. Quotes, backslashes and control
+// characters are escaped by JSON writers, and depending on the writer so is
+// non-ASCII text, so the prefix ends at the first such character in either
+// the raw or the escaped text.
+absl::string_view UnescapedPrefix(absl::string_view text) {
+  for (size_t i = 0; i < text.size(); ++i) {
+    const unsigned char c = text[i];
+    if (c == '"' || c == '\\' || c < 0x20 || c >= 0x7f) {
+      return text.substr(0, i);
+    }
+  }
+  return text;
+}
+
+// Hashes the JSON representation of a primitive, as produced by
+// PrimitiveHandler::WrapPrimitiveProto.
+size_t HashJsonValue(absl::string_view json) {
+  if (json.size() >= 2 && json.front() == '"' && json.back() == '"') {
+    return HashCombine(kJsonStringSeed,
+                       absl::Hash<absl::string_view>()(UnescapedPrefix(
+                           json.substr(1, json.size() - 2))));
+  }
+  return HashCombine(kJsonValueSeed, absl::Hash<absl::string_view>()(json));
+}
+
+// Returns the text of a FHIR decimal in a form shared by every decimal of the
+// same value: in plain notation, with neither trailing zeros after the decimal
+// point nor a sign on zero, so "1.50", "1.5" and "0.15e1" all become "1.5".
+// FHIR decimals have no leading zeros or plus sign, so only text with an
+// exponent is rewritten, into the buffer; other text is returned as a
+// substring of itself. Text that is not a decimal is returned unchanged.
+absl::string_view NormalizeDecimal(absl::string_view text,
+                                   std::string* buffer) {
+  if (text.find_first_of("eE") != absl::string_view::npos) {
+    StatusOr<Decimal> decimal = Decimal::Parse(text);
+    if (!decimal.ok()) {
+      return text;
+    }
+    *buffer = decimal.ValueOrDie().ToString();
+    text = *buffer;
+  }
+  if (text.find('.') != absl::string_view::npos) {
+    while (absl::ConsumeSuffix(&text, "0")) {
+    }
+    absl::ConsumeSuffix(&text, ".");
+  }
+  return text == "-0" ? "0" : text;
+}
+
+// Returns true if the texts of two FHIR decimals have the same value, e.g.
+// "1.0" and "1.00".
+bool DecimalsEqual(absl::string_view left, absl::string_view right) {
+  if (left == right) {
+    return true;
+  }
+  std::string left_buffer;
+  std::string right_buffer;
+  return NormalizeDecimal(left, &left_buffer) ==
+         NormalizeDecimal(right, &right_buffer);
+}
+
+// Hashes a FHIR primitive consistently with EqualsOperator::AreEqual, which
+// compares primitives of different types by their JSON representation. The
+// hash of a primitive that converts to a System type is computed from its
+// native value, as HashJsonValue would hash its JSON representation but
+// without building it. Decimals are hashed by their normalized text, so that
+// decimals of equal value (e.g. 1.0 and 1.00) have the same hash.
+size_t HashPrimitive(const PrimitiveHandler* primitive_handler,
+                     const Message& message) {
+  absl::optional<SystemValue> value = SystemValue::FromMessage(message);
+  if (value.has_value() && SystemValue::HasOnlyValue(message)) {
+    switch (value->type()) {
+      case SystemValue::Type::kBoolean:
+        return HashJsonValue(value->boolean_value() ? "true" : "false");
+      case SystemValue::Type::kInteger: {
+        char buffer[absl::numbers_internal::kFastToBufferSize];
+        const char* end = absl::numbers_internal::FastIntToBuffer(
+            value->integer_value(), buffer);
+        return HashJsonValue(absl::string_view(buffer, end - buffer));
+      }
+      case SystemValue::Type::kDecimal: {
+        std::string buffer;
+        return HashJsonValue(NormalizeDecimal(value->string_value(), &buffer));
+      }
+      case SystemValue::Type::kString:
+        return HashCombine(kJsonStringSeed,
+                           absl::Hash<absl::string_view>()(
+                               UnescapedPrefix(value->string_value())));
+    }
+  }
+
+  // Primitives with extensions may have no value, and are rare enough to
+  // hash by their JSON representation. Primitives that the handler does not
+  // support are only equal to messages of the same type, and share a hash.
+  StatusOr<JsonPrimitive> json = primitive_handler->WrapPrimitiveProto(message);
+  return json.ok() ? HashJsonValue(json.ValueOrDie().value) : kJsonValueSeed;
+}
+
+bool IsAny(const Descriptor* descriptor) {
+  return descriptor == google::protobuf::Any::descriptor();
+}
+
+// Hashes the value of a non-repeated field, or the value at the given index
+// of a repeated field.
+size_t HashFieldValue(const Message& message, const FieldDescriptor* field,
+                      int index);
+
+// Hashes a message from its fields by reflection, consistently with
+// StructurallyEqual. Any messages are hashed by their type alone, as
+// MessageDifferencer compares their unpacked contents rather than their bytes.
+size_t StructuralHash(const Message& message) {
+  size_t hash = absl::Hash<const Descriptor*>()(message.GetDescriptor());
+  if (IsAny(message.GetDescriptor())) {
+    return hash;
+  }
+
+  const ::google::protobuf::Reflection* reflection = message.GetReflection();
+  std::vector<const FieldDescriptor*> fields;
+  reflection->ListFields(message, &fields);
+  for (const FieldDescriptor* field : fields) {
+    hash = HashCombine(hash, field->number());
+    if (field->is_map()) {
+      // Map entries are compared regardless of order.
+      hash = HashCombine(hash, reflection->FieldSize(message, field));
+    } else if (field->is_repeated()) {
+      for (int i = 0; i < reflection->FieldSize(message, field); ++i) {
+        hash = HashCombine(hash, HashFieldValue(message, field, i));
+      }
+    } else {
+      hash = HashCombine(hash, HashFieldValue(message, field, -1));
+    }
+  }
+  return hash;
+}
+
+size_t HashFieldValue(const Message& message, const FieldDescriptor* field,
+                      int index) {
+  const ::google::protobuf::Reflection* reflection = message.GetReflection();
+  const bool repeated = index >= 0;
+  switch (field->cpp_type()) {
+    case FieldDescriptor::CPPTYPE_INT32:
+      return absl::Hash<int64_t>()(
+          repeated ? reflection->GetRepeatedInt32(message, field, index)
+                   : reflection->GetInt32(message, field));
+    case FieldDescriptor::CPPTYPE_INT64:
+      return absl::Hash<int64_t>()(
+          repeated ? reflection->GetRepeatedInt64(message, field, index)
+                   : reflection->GetInt64(message, field));
+    case FieldDescriptor::CPPTYPE_UINT32:
+      return absl::Hash<uint64_t>()(
+          repeated ? reflection->GetRepeatedUInt32(message, field, index)
+                   : reflection->GetUInt32(message, field));
+    case FieldDescriptor::CPPTYPE_UINT64:
+      return absl::Hash<uint64_t>()(
+          repeated ? reflection->GetRepeatedUInt64(message, field, index)
+                   : reflection->GetUInt64(message, field));
+    case FieldDescriptor::CPPTYPE_DOUBLE:
+      return absl::Hash<double>()(
+          repeated ? reflection->GetRepeatedDouble(message, field, index)
+                   : reflection->GetDouble(message, field));
+    case FieldDescriptor::CPPTYPE_FLOAT:
+      return absl::Hash<double>()(
+          repeated ? reflection->GetRepeatedFloat(message, field, index)
+                   : reflection->GetFloat(message, field));
+    case FieldDescriptor::CPPTYPE_BOOL:
+      return absl::Hash<bool>()(
+          repeated ? reflection->GetRepeatedBool(message, field, index)
+                   : reflection->GetBool(message, field));
+    case FieldDescriptor::CPPTYPE_ENUM:
+      return absl::Hash<int>()(
+          repeated ? reflection->GetRepeatedEnumValue(message, field, index)
+                   : reflection->GetEnumValue(message, field));
+    case FieldDescriptor::CPPTYPE_STRING: {
+      std::string scratch;
+      return absl::Hash<absl::string_view>()(
+          repeated ? reflection->GetRepeatedStringReference(message, field,
+                                                            index, &scratch)
+                   : reflection->GetStringReference(message, field, &scratch));
+    }
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+      return StructuralHash(
+          repeated ? reflection->GetRepeatedMessage(message, field, index)
+                   : reflection->GetMessage(message, field));
+  }
+  return 0;
+}
+
+// Returns true if the value of a non-repeated field, or the values at the
+// given index of a repeated field, are equal in both messages.
+bool FieldValuesEqual(const Message& left, const Message& right,
+                      const FieldDescriptor* field, int index);
+
+// Returns true if two messages of the same type are equal, comparing their
+// fields by reflection. Gives the same result as MessageDifferencer::Equals,
+// which is used for the parts of messages that are rare in FHIR and that it
+// compares specially: Any messages, maps and unknown fields.
+bool StructurallyEqual(const Message& left, const Message& right) {
+  const ::google::protobuf::Reflection* reflection = left.GetReflection();
+  if (IsAny(left.GetDescriptor()) ||
+      !reflection->GetUnknownFields(left).empty() ||
+      !reflection->GetUnknownFields(right).empty()) {
+    return MessageDifferencer::Equals(left, right);
+  }
+
+  std::vector<const FieldDescriptor*> left_fields;
+  std::vector<const FieldDescriptor*> right_fields;
+  reflection->ListFields(left, &left_fields);
+  reflection->ListFields(right, &right_fields);
+  if (left_fields != right_fields) {
+    return false;
+  }
+
+  for (const FieldDescriptor* field : left_fields) {
+    if (field->is_map()) {
+      return MessageDifferencer::Equals(left, right);
+    }
+    if (field->is_repeated()) {
+      const int size = reflection->FieldSize(left, field);
+      if (size != reflection->FieldSize(right, field)) {
+        return false;
+      }
+      for (int i = 0; i < size; ++i) {
+        if (!FieldValuesEqual(left, right, field, i)) {
+          return false;
+        }
+      }
+    } else if (!FieldValuesEqual(left, right, field, -1)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool FieldValuesEqual(const Message& left, const Message& right,
+                      const FieldDescriptor* field, int index) {
+  const ::google::protobuf::Reflection* reflection = left.GetReflection();
+  const bool repeated = index >= 0;
+  switch (field->cpp_type()) {
+#define FHIR_FIELD_VALUES_EQUAL(CPPTYPE, TYPE)                             \
+  case FieldDescriptor::CPPTYPE_##CPPTYPE:                                 \
+    return repeated                                                        \
+               ? reflection->GetRepeated##TYPE(left, field, index) ==      \
+                     reflection->GetRepeated##TYPE(right, field, index)    \
+               : reflection->Get##TYPE(left, field) ==                     \
+                     reflection->Get##TYPE(right, field);
+    FHIR_FIELD_VALUES_EQUAL(INT32, Int32)
+    FHIR_FIELD_VALUES_EQUAL(INT64, Int64)
+    FHIR_FIELD_VALUES_EQUAL(UINT32, UInt32)
+    FHIR_FIELD_VALUES_EQUAL(UINT64, UInt64)
+    FHIR_FIELD_VALUES_EQUAL(DOUBLE, Double)
+    FHIR_FIELD_VALUES_EQUAL(FLOAT, Float)
+    FHIR_FIELD_VALUES_EQUAL(BOOL, Bool)
+    FHIR_FIELD_VALUES_EQUAL(ENUM, EnumValue)
+#undef FHIR_FIELD_VALUES_EQUAL
+    case FieldDescriptor::CPPTYPE_STRING: {
+      std::string left_scratch;
+      std::string right_scratch;
+      return repeated
+                 ? reflection->GetRepeatedStringReference(left, field, index,
+                                                          &left_scratch) ==
+                       reflection->GetRepeatedStringReference(
+                           right, field, index, &right_scratch)
+                 : reflection->GetStringReference(left, field,
+                                                  &left_scratch) ==
+                       reflection->GetStringReference(right, field,
+                                                      &right_scratch);
+    }
+    case FieldDescriptor::CPPTYPE_MESSAGE:
+      return repeated
+                 ? StructurallyEqual(
+                       reflection->GetRepeatedMessage(left, field, index),
+                       reflection->GetRepeatedMessage(right, field, index))
+                 : StructurallyEqual(reflection->GetMessage(left, field),
+                                     reflection->GetMessage(right, field));
+  }
+  return false;
+}
+
 // Returns true if the provided FHIR message converts to System.Integer.
 //
 // See https://www.hl7.org/fhir/fhirpath.html#types
 bool IsSystemInteger(const Message& message) {
-  return IsInteger(message) || IsUnsignedInt(message) || IsPositiveInt(message);
+  return SystemValue::TypeOf(message.GetDescriptor()) ==
+         SystemValue::Type::kInteger;
 }
 
 // Returns the integer value of the FHIR message if it can be converted to
@@ -93,16 +710,9 @@ StatusOr<int32_t> ToSystemInteger(
   // It isn't necessary to widen the values from 32 to 64 bits when converting
   // a UnsignedInt or PositiveInt to an int32_t because FHIR restricts the
   // values of those types to 31 bits.
-  if (IsInteger(message)) {
-    return primitive_handler->GetIntegerValue(message).ValueOrDie();
-  }
-
-  if (IsUnsignedInt(message)) {
-    return primitive_handler->GetUnsignedIntValue(message).ValueOrDie();
-  }
-
-  if (IsPositiveInt(message)) {
-    return primitive_handler->GetPositiveIntValue(message).ValueOrDie();
+  absl::optional<SystemValue> value = SystemValue::FromMessage(message);
+  if (value.has_value() && value->type() == SystemValue::Type::kInteger) {
+    return static_cast<int32_t>(value->integer_value());
   }
 
   return InvalidArgumentError(
@@ -140,13 +750,13 @@ StatusOr<absl::optional<bool>> BooleanOrEmpty(
         "Expression must be empty or contain a single value.");
   }
 
-  if (!IsBoolean(*messages[0].Message())) {
+  absl::optional<SystemValue> value =
+      SystemValue::FromMessage(*messages[0].Message());
+  if (!value.has_value() || value->type() != SystemValue::Type::kBoolean) {
     return absl::optional<bool>(true);
   }
 
-  FHIR_ASSIGN_OR_RETURN(
-      bool value, primitive_handler->GetBooleanValue(*messages[0].Message()));
-  return absl::optional<bool>(value);
+  return absl::optional<bool>(value->boolean_value());
 }
 
 // Returns the string representation of the provided message for messages that
@@ -242,19 +852,242 @@ std::vector<const google::protobuf::Message*> WorkspaceMessage::Ancestry() const
   return stack;
 }
 
+// The fields of a message type by JSON name.
+using JsonFieldMap = absl::flat_hash_map<std::string, const FieldDescriptor*>;
+
+// Returns the fields of messages of the given type by JSON name, as
+// FindFieldByJsonName would find them. The map of each type is built once and
+// shared by every expression; like the descriptors it indexes, it is never
+// freed. Each thread also keeps a table of the maps it has used, so lookups
+// only take a lock the first time a thread sees a type.
+const JsonFieldMap& JsonFieldsOf(const Descriptor* descriptor) {
+  thread_local absl::flat_hash_map<const Descriptor*, const JsonFieldMap*>
+      cache;
+  auto it = cache.find(descriptor);
+  if (it != cache.end()) {
+    return *it->second;
+  }
+
+  static absl::Mutex mutex(absl::kConstInit);
+  static auto* shared =
+      new absl::flat_hash_map<const Descriptor*, const JsonFieldMap*>();
+  const JsonFieldMap* fields;
+  {
+    absl::MutexLock lock(&mutex);
+    const JsonFieldMap*& entry = (*shared)[descriptor];
+    if (entry == nullptr) {
+      auto* map = new JsonFieldMap();
+      // The first field with a given JSON name wins, as it does in
+      // FindFieldByJsonName.
+      for (int i = 0; i < descriptor->field_count(); ++i) {
+        map->emplace(descriptor->field(i)->json_name(), descriptor->field(i));
+      }
+      entry = map;
+    }
+    fields = entry;
+  }
+  cache.emplace(descriptor, fields);
+  return *fields;
+}
+
+// The field that a member invocation navigates to. The field is resolved at
+// compile time when the type of the invocation's input is known. Otherwise it
+// is looked up by its JSON name in the descriptor of each input message,
+// through an inline cache of the last few descriptors seen. Inputs of more
+// types than the cache holds (e.g. "descendants().element") fall back to the
+// shared maps of JsonFieldsOf, so every lookup after the first for a
+// descriptor is a hash lookup rather than a linear search.
+//
+// Expressions are evaluated concurrently, so the cache is lock free: each slot
+// is filled at most once with an immutable entry, and is never changed after.
+class FieldReference {
+ public:
+  FieldReference(const FieldDescriptor* field, std::string field_name)
+      : field_(field), field_name_(std::move(field_name)) {
+    for (std::atomic<const CacheEntry*>& slot : cache_) {
+      slot.store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  ~FieldReference() {
+    for (std::atomic<const CacheEntry*>& slot : cache_) {
+      delete slot.load(std::memory_order_relaxed);
+    }
+  }
+
+  FieldReference(const FieldReference&) = delete;
+  FieldReference& operator=(const FieldReference&) = delete;
+
+  // Returns the field of messages with the given descriptor, or nullptr if
+  // they have no such field.
+  const FieldDescriptor* Resolve(const Descriptor* descriptor) const {
+    if (field_ != nullptr) {
+      return field_;
+    }
+
+    for (const std::atomic<const CacheEntry*>& slot : cache_) {
+      const CacheEntry* entry = slot.load(std::memory_order_acquire);
+      if (entry == nullptr) {
+        return ResolveAndCache(descriptor);
+      }
+      if (entry->descriptor == descriptor) {
+        return entry->field;
+      }
+    }
+
+    // Every slot holds another descriptor.
+    const JsonFieldMap& fields = JsonFieldsOf(descriptor);
+    auto it = fields.find(field_name_);
+    return it != fields.end() ? it->second : nullptr;
+  }
+
+  // Returns the field resolved at compile time, or nullptr if it is resolved
+  // for each message.
+  const FieldDescriptor* field() const { return field_; }
+
+ private:
+  struct CacheEntry {
+    const Descriptor* descriptor;
+    const FieldDescriptor* field;
+  };
+
+  // The number of descriptors cached. Invocations whose input has a mixed
+  // type (e.g. "children().element") rarely see more than a few.
+  static constexpr int kCacheSize = 4;
+
+  const FieldDescriptor* ResolveAndCache(const Descriptor* descriptor) const {
+    const FieldDescriptor* field = FindFieldByJsonName(descriptor, field_name_);
+    auto entry = absl::make_unique<CacheEntry>(CacheEntry{descriptor, field});
+    for (std::atomic<const CacheEntry*>& slot : cache_) {
+      const CacheEntry* expected = nullptr;
+      if (slot.compare_exchange_strong(expected, entry.get(),
+                                       std::memory_order_acq_rel,
+                                       std::memory_order_acquire)) {
+        entry.release();
+        break;
+      }
+      // Another evaluation filled the slot first, possibly with the same
+      // descriptor.
+      if (expected->descriptor == descriptor) {
+        break;
+      }
+    }
+    return field;
+  }
+
+  const FieldDescriptor* const field_;
+  const std::string field_name_;
+  mutable std::atomic<const CacheEntry*> cache_[kCacheSize];
+};
+
+// Appends the values of the given field of the message to results, each
+// wrapped in a WorkspaceMessage that records the message as its parent. If
+// field is null the result is empty.
+Status AppendFieldValues(WorkSpace* work_space, const WorkspaceMessage& message,
+                         const FieldDescriptor* field,
+                         std::vector<WorkspaceMessage>* results) {
+  // If the field cannot be found the result is an empty collection. This
+  // matches the behavior of https://github.com/HL7/fhirpath.js and is
+  // empirically necessitated by expressions such as "children().element"
+  // where not every child necessarily has an "element" field (see FHIRPath
+  // constraints on Bundle for a full example.)
+  if (field == nullptr) {
+    return absl::OkStatus();
+  }
+
+  std::vector<const Message*> result_protos;
+  FHIR_RETURN_IF_ERROR(RetrieveField(*message.Message(), *field,
+                                     MakeWorkSpaceMessageFactory(work_space),
+                                     &result_protos));
+  for (const Message* result : result_protos) {
+    results->push_back(WorkspaceMessage(message, result));
+  }
+
+  return absl::OkStatus();
+}
+
+// Appends the values of the referenced field of the message to results. In
+// the case where the field descriptor was not known at compile time (because
+// ExpressionNode.ReturnType() currently doesn't support collections with mixed
+// types) it is found at evaluation time.
+Status AppendFieldValues(WorkSpace* work_space, const WorkspaceMessage& message,
+                         const FieldReference& field,
+                         std::vector<WorkspaceMessage>* results) {
+  return AppendFieldValues(
+      work_space, message,
+      field.Resolve(message.Message()->GetDescriptor()), results);
+}
+
+Status ExpressionNode::Stream(
+    WorkSpace* work_space,
+    absl::FunctionRef<bool(const WorkspaceMessage&)> visitor) const {
+  std::vector<WorkspaceMessage> results;
+  FHIR_RETURN_IF_ERROR(Evaluate(work_space, &results));
+  for (const WorkspaceMessage& result : results) {
+    if (!visitor(result)) {
+      break;
+    }
+  }
+  return absl::OkStatus();
+}
+
+// Calls the visitor with each of the values of the given field of the message,
+// as AppendFieldValues would append them, until the visitor returns false.
+// Returns false if the visitor did.
+StatusOr<bool> VisitFieldValues(
+    WorkSpace* work_space, const WorkspaceMessage& message,
+    const FieldDescriptor* field,
+    absl::FunctionRef<bool(const WorkspaceMessage&)> visitor) {
+  if (field == nullptr) {
+    return true;
+  }
+  const Message& parent = *message.Message();
+  if (internal::IsFhirPrimitiveValue(*field)) {
+    return visitor(WorkspaceMessage(message, &parent));
+  }
+
+  // Values are retrieved one at a time so that a visitor that stops early
+  // does not pay for unpacking the rest, e.g. the contained resources of
+  // "contained.exists()".
+  const auto message_factory = MakeWorkSpaceMessageFactory(work_space);
+  std::vector<const Message*> value_messages;
+  const int size = PotentiallyRepeatedFieldSize(parent, field);
+  for (int i = 0; i < size; ++i) {
+    value_messages.clear();
+    FHIR_RETURN_IF_ERROR(internal::RetrieveFieldValue(
+        GetPotentiallyRepeatedMessage(parent, field, i), *field,
+        message_factory, &value_messages));
+    for (const Message* value : value_messages) {
+      if (!visitor(WorkspaceMessage(message, value))) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
 // Expression node that returns literals wrapped in the corresponding
 // protbuf wrapper
+//
+// The literal is created once, when the expression is compiled, and shared
+// by all evaluations. Errors creating it are reported by each evaluation.
 class Literal : public ExpressionNode {
  public:
   Literal(const Descriptor* descriptor,
           std::function<StatusOr<Message*>()> factory)
-      : descriptor_(descriptor), factory_(factory) {}
+      : descriptor_(descriptor) {
+    StatusOr<Message*> value = factory();
+    if (value.ok()) {
+      value_.reset(value.ValueOrDie());
+    } else {
+      status_ = value.status();
+    }
+  }
 
   Status Evaluate(WorkSpace* work_space,
                   std::vector<WorkspaceMessage>* results) const override {
-    FHIR_ASSIGN_OR_RETURN(Message * value, factory_());
-    work_space->DeleteWhenFinished(value);
-    results->push_back(WorkspaceMessage(value));
+    FHIR_RETURN_IF_ERROR(status_);
+    results->push_back(WorkspaceMessage(value_.get()));
 
     return absl::OkStatus();
   }
@@ -263,7 +1096,8 @@ class Literal : public ExpressionNode {
 
  private:
   const Descriptor* descriptor_;
-  std::function<StatusOr<Message*>()> factory_;
+  std::unique_ptr<Message> value_;
+  Status status_;
 };
 
 // Expression node for the empty literal.
@@ -341,44 +1175,31 @@ class InvokeTermNode : public ExpressionNode {
  public:
   explicit InvokeTermNode(const FieldDescriptor* field,
                           const std::string& field_name)
-      : field_(field), field_name_(field_name) {}
+      : field_(field, field_name) {}
 
   Status Evaluate(WorkSpace* work_space,
                   std::vector<WorkspaceMessage>* results) const override {
-    const WorkspaceMessage& message = work_space->MessageContext();
-    const FieldDescriptor* field =
-        field_ != nullptr
-            ? field_
-            : FindFieldByJsonName(message.Message()->GetDescriptor(),
-                                  field_name_);
-
-    // If the field cannot be found an empty collection is returned. This
-    // matches the behavior of https://github.com/HL7/fhirpath.js and is
-    // empirically necessitated by expressions such as "children().element"
-    // where not every child necessarily has an "element" field (see FHIRPath
-    // constraints on Bundle for a full example.)
-    if (field == nullptr) {
-      return absl::OkStatus();
-    }
-
-    std::vector<const Message*> result_protos;
-    FHIR_RETURN_IF_ERROR(RetrieveField(*message.Message(), *field,
-                                       MakeWorkSpaceMessageFactory(work_space),
-                                       &result_protos));
-    for (const Message* result : result_protos) {
-      results->push_back(WorkspaceMessage(message, result));
-    }
+    return AppendFieldValues(work_space, work_space->MessageContext(), field_,
+                             results);
+  }
 
-    return absl::OkStatus();
+  Status Stream(WorkSpace* work_space,
+                absl::FunctionRef<bool(const WorkspaceMessage&)> visitor)
+      const override {
+    const WorkspaceMessage& context = work_space->MessageContext();
+    return VisitFieldValues(
+               work_space, context,
+               field_.Resolve(context.Message()->GetDescriptor()), visitor)
+        .status();
   }
 
   const Descriptor* ReturnType() const override {
-    return field_ != nullptr ? field_->message_type() : nullptr;
+    return field_.field() != nullptr ? field_.field()->message_type()
+                                     : nullptr;
   }
 
  private:
-  const FieldDescriptor* field_;
-  const std::string field_name_;
+  const FieldReference field_;
 };
 
 // Handles the InvocationExpression from the FHIRPath grammar,
@@ -390,8 +1211,7 @@ class InvokeExpressionNode : public ExpressionNode {
                        const FieldDescriptor* field,
                        const std::string& field_name)
       : child_expression_(std::move(child_expression)),
-        field_(field),
-        field_name_(field_name) {}
+        field_(field, field_name) {}
 
   Status Evaluate(WorkSpace* work_space,
                   std::vector<WorkspaceMessage>* results) const override {
@@ -403,46 +1223,52 @@ class InvokeExpressionNode : public ExpressionNode {
     // Iterate through the results of the child expression and invoke
     // the appropriate field.
     for (const WorkspaceMessage& child_message : child_results) {
-      // In the case where the field descriptor was not known at compile time
-      // (because ExpressionNode.ReturnType() currently doesn't support
-      // collections with mixed types) we attempt to find it at evaluation time.
-      const FieldDescriptor* field =
-          field_ != nullptr
-              ? field_
-              : FindFieldByJsonName(child_message.Message()->GetDescriptor(),
-                                    field_name_);
-
-      // If the field cannot be found the result is an empty collection. This
-      // matches the behavior of https://github.com/HL7/fhirpath.js and is
-      // empirically necessitated by expressions such as "children().element"
-      // where not every child necessarily has an "element" field (see FHIRPath
-      // constraints on Bundle for a full example.)
-      if (field == nullptr) {
-        continue;
-      }
-
-      std::vector<const Message*> result_protos;
-      FHIR_RETURN_IF_ERROR(RetrieveField(
-          *child_message.Message(), *field,
-          MakeWorkSpaceMessageFactory(work_space), &result_protos));
-      for (const Message* result : result_protos) {
-        results->push_back(WorkspaceMessage(child_message, result));
-      }
+      FHIR_RETURN_IF_ERROR(
+          AppendFieldValues(work_space, child_message, field_, results));
     }
 
     return absl::OkStatus();
   }
 
+  Status Stream(WorkSpace* work_space,
+                absl::FunctionRef<bool(const WorkspaceMessage&)> visitor)
+      const override {
+    Status status = absl::OkStatus();
+    FHIR_RETURN_IF_ERROR(child_expression_->Stream(
+        work_space, [&](const WorkspaceMessage& child_message) {
+          StatusOr<bool> more = VisitFieldValues(
+              work_space, child_message,
+              field_.Resolve(child_message.Message()->GetDescriptor()),
+              visitor);
+          status = more.status();
+          return status.ok() && more.ValueOrDie();
+        }));
+    return status;
+  }
+
   const Descriptor* ReturnType() const override {
-    return field_ != nullptr ? field_->message_type() : nullptr;
+    return field_.field() != nullptr ? field_.field()->message_type()
+                                     : nullptr;
   }
 
  private:
   const std::shared_ptr<ExpressionNode> child_expression_;
-  // Null if the child_expression_ may evaluate to a collection that contains
-  // multiple types.
-  const FieldDescriptor* field_;
-  const std::string field_name_;
+  // Resolved for each message if the child_expression_ may evaluate to a
+  // collection that contains multiple types.
+  const FieldReference field_;
+};
+
+// Compiles subexpressions of a FHIRPath expression, such as the parameters of
+// a function, into ExpressionNodes.
+class ExpressionCompiler {
+ public:
+  virtual ~ExpressionCompiler() {}
+
+  virtual StatusOr<std::shared_ptr<ExpressionNode>> Compile(
+      const AstNode& node) = 0;
+
+  // The value sets available to memberOf(), or null if there are none.
+  virtual const TerminologyIndex* Terminology() const = 0;
 };
 
 class FunctionNode : public ExpressionNode {
@@ -450,35 +1276,33 @@ class FunctionNode : public ExpressionNode {
   template <class T>
   StatusOr<T*> static Create(
       const std::shared_ptr<ExpressionNode>& child_expression,
-      const std::vector<FhirPathParser::ExpressionContext*>& params,
-      FhirPathBaseVisitor* base_context_visitor,
-      FhirPathBaseVisitor* child_context_visitor) {
+      const std::vector<const AstNode*>& params,
+      ExpressionCompiler* base_context_compiler,
+      ExpressionCompiler* child_context_compiler) {
     FHIR_ASSIGN_OR_RETURN(
         std::vector<std::shared_ptr<ExpressionNode>> compiled_params,
-        T::CompileParams(params, base_context_visitor, child_context_visitor));
+        T::CompileParams(params, base_context_compiler,
+                         child_context_compiler));
     FHIR_RETURN_IF_ERROR(T::ValidateParams(compiled_params));
     return new T(child_expression, compiled_params);
   }
 
   static StatusOr<std::vector<std::shared_ptr<ExpressionNode>>> CompileParams(
-      const std::vector<FhirPathParser::ExpressionContext*>& params,
-      FhirPathBaseVisitor* base_context_visitor,
-      FhirPathBaseVisitor*) {
-    return CompileParams(params, base_context_visitor);
+      const std::vector<const AstNode*>& params,
+      ExpressionCompiler* base_context_compiler,
+      ExpressionCompiler*) {
+    return CompileParams(params, base_context_compiler);
   }
 
   static StatusOr<std::vector<std::shared_ptr<ExpressionNode>>> CompileParams(
-      const std::vector<FhirPathParser::ExpressionContext*>& params,
-      FhirPathBaseVisitor* visitor) {
+      const std::vector<const AstNode*>& params,
+      ExpressionCompiler* compiler) {
     std::vector<std::shared_ptr<ExpressionNode>> compiled_params;
 
-    for (auto it = params.begin(); it != params.end(); ++it) {
-      antlrcpp::Any param_any = (*it)->accept(visitor);
-      if (param_any.isNull()) {
-        return InvalidArgumentError("Failed to compile parameter.");
-      }
-      compiled_params.push_back(
-          param_any.as<std::shared_ptr<ExpressionNode>>());
+    for (const AstNode* param : params) {
+      FHIR_ASSIGN_OR_RETURN(std::shared_ptr<ExpressionNode> compiled_param,
+                            compiler->Compile(*param));
+      compiled_params.push_back(compiled_param);
     }
 
     return compiled_params;
@@ -592,13 +1416,15 @@ class ExistsFunction : public ZeroParameterFunctionNode {
 
   Status Evaluate(WorkSpace* work_space,
                   std::vector<WorkspaceMessage>* results) const override {
-    std::vector<WorkspaceMessage> child_results;
-    FHIR_RETURN_IF_ERROR(child_->Evaluate(work_space, &child_results));
+    // Evaluation of the child stops at its first result.
+    bool exists = false;
+    FHIR_RETURN_IF_ERROR(
+        child_->Stream(work_space, [&](const WorkspaceMessage&) {
+          exists = true;
+          return false;
+        }));
 
-    Message* result =
-        work_space->GetPrimitiveHandler()->NewBoolean(!child_results.empty());
-    work_space->DeleteWhenFinished(result);
-    results->push_back(WorkspaceMessage(result));
+    results->push_back(BooleanResult(work_space, exists));
 
     return absl::OkStatus();
   }
@@ -619,9 +1445,13 @@ class NotFunction : public ZeroParameterFunctionNode {
   Status Evaluate(WorkSpace* work_space,
                   std::vector<WorkspaceMessage>* results) const override {
     std::vector<WorkspaceMessage> child_results;
-
     FHIR_RETURN_IF_ERROR(child_->Evaluate(work_space, &child_results));
+    return EvaluateOnChildResults(work_space, child_results, results);
+  }
 
+  Status EvaluateOnChildResults(
+      WorkSpace* work_space, const std::vector<WorkspaceMessage>& child_results,
+      std::vector<WorkspaceMessage>* results) const {
     // Per the FHIRPath spec, boolean operations on empty collection
     // propagate the empty collection.
     if (child_results.empty()) {
@@ -640,10 +1470,7 @@ class NotFunction : public ZeroParameterFunctionNode {
                           work_space->GetPrimitiveHandler()->GetBooleanValue(
                               *child_results[0].Message()));
 
-    Message* result =
-        work_space->GetPrimitiveHandler()->NewBoolean(!child_result);
-    work_space->DeleteWhenFinished(result);
-    results->push_back(WorkspaceMessage(result));
+    results->push_back(BooleanResult(work_space, !child_result));
 
     return absl::OkStatus();
   }
@@ -664,14 +1491,17 @@ class HasValueFunction : public ZeroParameterFunctionNode {
   Status Evaluate(WorkSpace* work_space,
                   std::vector<WorkspaceMessage>* results) const override {
     std::vector<WorkspaceMessage> child_results;
-
     FHIR_RETURN_IF_ERROR(child_->Evaluate(work_space, &child_results));
+    return EvaluateOnChildResults(work_space, child_results, results);
+  }
 
-    Message* result = work_space->GetPrimitiveHandler()->NewBoolean(
+  Status EvaluateOnChildResults(
+      WorkSpace* work_space, const std::vector<WorkspaceMessage>& child_results,
+      std::vector<WorkspaceMessage>* results) const {
+    results->push_back(BooleanResult(
+        work_space,
         child_results.size() == 1 &&
-        IsPrimitive(child_results[0].Message()->GetDescriptor()));
-    work_space->DeleteWhenFinished(result);
-    results->push_back(WorkspaceMessage(result));
+            IsPrimitive(child_results[0].Message()->GetDescriptor())));
     return absl::OkStatus();
   }
 
@@ -748,10 +1578,7 @@ class StringTestFunction : public SingleValueFunctionNode {
         std::string test_string,
         MessageToString(work_space->GetPrimitiveHandler(), param));
 
-    Message* result =
-        work_space->GetPrimitiveHandler()->NewBoolean(Test(item, test_string));
-    work_space->DeleteWhenFinished(result);
-    results->push_back(WorkspaceMessage(result));
+    results->push_back(BooleanResult(work_space, Test(item, test_string)));
     return absl::OkStatus();
   }
 
@@ -908,10 +1735,7 @@ class MatchesFunction : public SingleValueFunctionNode {
                        "'. ", re.error()));
     }
 
-    Message* result =
-        work_space->GetPrimitiveHandler()->NewBoolean(RE2::FullMatch(item, re));
-    work_space->DeleteWhenFinished(result);
-    results->push_back(WorkspaceMessage(result));
+    results->push_back(BooleanResult(work_space, RE2::FullMatch(item, re)));
     return absl::OkStatus();
   }
 
@@ -1161,13 +1985,15 @@ class EmptyFunction : public ZeroParameterFunctionNode {
 
   Status Evaluate(WorkSpace* work_space,
                   std::vector<WorkspaceMessage>* results) const override {
-    std::vector<WorkspaceMessage> child_results;
-    FHIR_RETURN_IF_ERROR(child_->Evaluate(work_space, &child_results));
+    // Evaluation of the child stops at its first result.
+    bool empty = true;
+    FHIR_RETURN_IF_ERROR(
+        child_->Stream(work_space, [&](const WorkspaceMessage&) {
+          empty = false;
+          return false;
+        }));
 
-    Message* result =
-        work_space->GetPrimitiveHandler()->NewBoolean(child_results.empty());
-    work_space->DeleteWhenFinished(result);
-    results->push_back(WorkspaceMessage(result));
+    results->push_back(BooleanResult(work_space, empty));
     return absl::OkStatus();
   }
 
@@ -1190,7 +2016,12 @@ class CountFunction : public ZeroParameterFunctionNode {
                   std::vector<WorkspaceMessage>* results) const override {
     std::vector<WorkspaceMessage> child_results;
     FHIR_RETURN_IF_ERROR(child_->Evaluate(work_space, &child_results));
+    return EvaluateOnChildResults(work_space, child_results, results);
+  }
 
+  Status EvaluateOnChildResults(
+      WorkSpace* work_space, const std::vector<WorkspaceMessage>& child_results,
+      std::vector<WorkspaceMessage>* results) const {
     Message* result =
         work_space->GetPrimitiveHandler()->NewInteger(child_results.size());
     work_space->DeleteWhenFinished(result);
@@ -1217,7 +2048,12 @@ class SingleFunction : public ZeroParameterFunctionNode {
                   std::vector<WorkspaceMessage>* results) const override {
     std::vector<WorkspaceMessage> child_results;
     FHIR_RETURN_IF_ERROR(child_->Evaluate(work_space, &child_results));
+    return EvaluateOnChildResults(work_space, child_results, results);
+  }
 
+  Status EvaluateOnChildResults(
+      WorkSpace* work_space, const std::vector<WorkspaceMessage>& child_results,
+      std::vector<WorkspaceMessage>* results) const {
     if (child_results.size() > 1) {
       return absl::FailedPreconditionError(
           "single() may not be called on a collection with size greater than "
@@ -1247,14 +2083,20 @@ class FirstFunction : public ZeroParameterFunctionNode {
 
   Status Evaluate(WorkSpace* work_space,
                   std::vector<WorkspaceMessage>* results) const override {
-    std::vector<WorkspaceMessage> child_results;
-    FHIR_RETURN_IF_ERROR(child_->Evaluate(work_space, &child_results));
-
-    if (!child_results.empty()) {
-      results->push_back(child_results[0]);
-    }
+    return Stream(work_space, [&](const WorkspaceMessage& message) {
+      results->push_back(message);
+      return false;
+    });
+  }
 
-    return absl::OkStatus();
+  Status Stream(WorkSpace* work_space,
+                absl::FunctionRef<bool(const WorkspaceMessage&)> visitor)
+      const override {
+    // Evaluation of the child stops at its first result.
+    return child_->Stream(work_space, [&](const WorkspaceMessage& message) {
+      visitor(message);
+      return false;
+    });
   }
 
   const Descriptor* ReturnType() const override {
@@ -1276,7 +2118,12 @@ class LastFunction : public ZeroParameterFunctionNode {
                   std::vector<WorkspaceMessage>* results) const override {
     std::vector<WorkspaceMessage> child_results;
     FHIR_RETURN_IF_ERROR(child_->Evaluate(work_space, &child_results));
+    return EvaluateOnChildResults(work_space, child_results, results);
+  }
 
+  Status EvaluateOnChildResults(
+      WorkSpace* work_space, const std::vector<WorkspaceMessage>& child_results,
+      std::vector<WorkspaceMessage>* results) const {
     if (!child_results.empty()) {
       results->push_back(child_results.back());
     }
@@ -1527,10 +2374,9 @@ class EqualsOperator : public BinaryOperator {
       return absl::OkStatus();
     }
 
-    Message* result = work_space->GetPrimitiveHandler()->NewBoolean(AreEqual(
-        work_space->GetPrimitiveHandler(), left_results, right_results));
-    work_space->DeleteWhenFinished(result);
-    out_results->push_back(WorkspaceMessage(result));
+    out_results->push_back(BooleanResult(
+        work_space, AreEqual(work_space->GetPrimitiveHandler(), left_results,
+                             right_results)));
     return absl::OkStatus();
   }
 
@@ -1553,8 +2399,26 @@ class EqualsOperator : public BinaryOperator {
 
   static bool AreEqual(const PrimitiveHandler* primitive_handler,
                        const Message& left, const Message& right) {
-    if (AreSameMessageType(left, right)) {
-      return MessageDifferencer::Equals(left, right);
+    // Primitives that are nothing but a value of the same System type are
+    // compared by value, without reflection or JSON serialization. Decimals
+    // are equal if their values are, regardless of precision (1.0 = 1.00), as
+    // in the comparison operators.
+    absl::optional<SystemValue> left_value = SystemValue::FromMessage(left);
+    if (left_value.has_value()) {
+      absl::optional<SystemValue> right_value = SystemValue::FromMessage(right);
+      if (right_value.has_value() &&
+          left_value->type() == right_value->type() &&
+          SystemValue::HasOnlyValue(left) && SystemValue::HasOnlyValue(right)) {
+        if (left_value->type() == SystemValue::Type::kDecimal) {
+          return DecimalsEqual(left_value->string_value(),
+                               right_value->string_value());
+        }
+        return left_value.value() == right_value.value();
+      }
+    }
+
+    if (AreSameMessageType(left, right)) {
+      return StructurallyEqual(left, right);
     } else {
       // When dealing with different types we might be comparing a
       // primitive type (like an enum) to a literal string, which is
@@ -1596,6 +2460,8 @@ struct ProtoPtrSameTypeAndEqual {
   }
 };
 
+// Hashes messages consistently with ProtoPtrSameTypeAndEqual, by reflection
+// rather than by serializing them.
 struct ProtoPtrHash {
   explicit ProtoPtrHash(const PrimitiveHandler* primitive_handler)
       : primitive_handler(primitive_handler) {}
@@ -1607,14 +2473,11 @@ struct ProtoPtrHash {
       return 0;
     }
 
-    // TODO: This will crash on a non-STU3 or R4 primitive.
-    // That's probably ok for now but we should fix this to never crash ASAP.
     if (IsPrimitive(message->GetDescriptor())) {
-      return std::hash<std::string>{}(
-          primitive_handler->WrapPrimitiveProto(*message).ValueOrDie().value);
+      return HashPrimitive(primitive_handler, *message);
     }
 
-    return std::hash<std::string>{}(message->SerializeAsString());
+    return StructuralHash(*message);
   }
 };
 
@@ -1674,10 +2537,8 @@ class IsDistinctFunction : public ZeroParameterFunctionNode {
             ProtoPtrHash(work_space->GetPrimitiveHandler()),
             ProtoPtrSameTypeAndEqual(work_space->GetPrimitiveHandler()));
 
-    Message* result = work_space->GetPrimitiveHandler()->NewBoolean(
-        child_results_set.size() == child_results.size());
-    work_space->DeleteWhenFinished(result);
-    results->push_back(WorkspaceMessage(result));
+    results->push_back(BooleanResult(
+        work_space, child_results_set.size() == child_results.size()));
     return absl::OkStatus();
   }
 
@@ -1751,16 +2612,16 @@ class CombineFunction : public SingleParameterFunctionNode {
 // Factory method for creating FHIRPath's union() function.
 StatusOr<ExpressionNode*> static CreateUnionFunction(
     const std::shared_ptr<ExpressionNode>& child_expression,
-    const std::vector<FhirPathParser::ExpressionContext*>& params,
-    FhirPathBaseVisitor* base_context_visitor,
-    FhirPathBaseVisitor* child_context_visitor) {
+    const std::vector<const AstNode*>& params,
+    ExpressionCompiler* base_context_compiler,
+    ExpressionCompiler* child_context_compiler) {
   if (params.size() != 1) {
     return InvalidArgumentError("union() requires exactly one argument.");
   }
 
   FHIR_ASSIGN_OR_RETURN(
       std::vector<std::shared_ptr<ExpressionNode>> compiled_params,
-      FunctionNode::CompileParams(params, base_context_visitor));
+      FunctionNode::CompileParams(params, base_context_compiler));
 
   return new UnionOperator(child_expression, compiled_params[0]);
 }
@@ -1778,10 +2639,10 @@ class WhereFunction : public FunctionNode {
   }
 
   static StatusOr<std::vector<std::shared_ptr<ExpressionNode>>> CompileParams(
-      const std::vector<FhirPathParser::ExpressionContext*>& params,
-      FhirPathBaseVisitor*,
-      FhirPathBaseVisitor* child_context_visitor) {
-    return FunctionNode::CompileParams(params, child_context_visitor);
+      const std::vector<const AstNode*>& params,
+      ExpressionCompiler*,
+      ExpressionCompiler* child_context_compiler) {
+    return FunctionNode::CompileParams(params, child_context_compiler);
   }
 
   WhereFunction(const std::shared_ptr<ExpressionNode>& child,
@@ -1794,18 +2655,28 @@ class WhereFunction : public FunctionNode {
                   std::vector<WorkspaceMessage>* results) const override {
     std::vector<WorkspaceMessage> child_results;
     FHIR_RETURN_IF_ERROR(child_->Evaluate(work_space, &child_results));
+    return EvaluateOnChildResults(work_space, child_results, results);
+  }
+
+  Status Stream(WorkSpace* work_space,
+                absl::FunctionRef<bool(const WorkspaceMessage&)> visitor)
+      const override {
+    Status status = absl::OkStatus();
+    FHIR_RETURN_IF_ERROR(
+        child_->Stream(work_space, [&](const WorkspaceMessage& message) {
+          StatusOr<bool> allowed = Allows(work_space, message);
+          status = allowed.status();
+          return status.ok() && (!allowed.ValueOrDie() || visitor(message));
+        }));
+    return status;
+  }
 
+  Status EvaluateOnChildResults(
+      WorkSpace* work_space, const std::vector<WorkspaceMessage>& child_results,
+      std::vector<WorkspaceMessage>* results) const {
     for (const WorkspaceMessage& message : child_results) {
-      std::vector<WorkspaceMessage> param_results;
-      WorkSpace expression_work_space(work_space->GetPrimitiveHandler(),
-                                      work_space->MessageContextStack(),
-                                      message);
-      FHIR_RETURN_IF_ERROR(
-          params_[0]->Evaluate(&expression_work_space, &param_results));
-      FHIR_ASSIGN_OR_RETURN(
-          StatusOr<absl::optional<bool>> allowed,
-          (BooleanOrEmpty(work_space->GetPrimitiveHandler(), param_results)));
-      if (allowed.ValueOrDie().value_or(false)) {
+      FHIR_ASSIGN_OR_RETURN(bool allowed, Allows(work_space, message));
+      if (allowed) {
         results->push_back(message);
       }
     }
@@ -1814,14 +2685,30 @@ class WhereFunction : public FunctionNode {
   }
 
   const Descriptor* ReturnType() const override { return child_->ReturnType(); }
+
+ private:
+  // Returns true if the message meets the criteria.
+  StatusOr<bool> Allows(WorkSpace* work_space,
+                        const WorkspaceMessage& message) const {
+    std::vector<WorkspaceMessage> param_results;
+    WorkSpace expression_work_space(work_space->GetPrimitiveHandler(),
+                                    work_space->MessageContextStack(),
+                                    message);
+    FHIR_RETURN_IF_ERROR(
+        params_[0]->Evaluate(&expression_work_space, &param_results));
+    FHIR_ASSIGN_OR_RETURN(
+        absl::optional<bool> allowed,
+        (BooleanOrEmpty(work_space->GetPrimitiveHandler(), param_results)));
+    return allowed.value_or(false);
+  }
 };
 
 // Factory method for creating FHIRPath's anyTrue() function.
 StatusOr<FunctionNode*> static CreateAnyTrueFunction(
     const std::shared_ptr<ExpressionNode>& child_expression,
-    const std::vector<FhirPathParser::ExpressionContext*>& params,
-    FhirPathBaseVisitor* base_context_visitor,
-    FhirPathBaseVisitor* child_context_visitor) {
+    const std::vector<const AstNode*>& params,
+    ExpressionCompiler* base_context_compiler,
+    ExpressionCompiler* child_context_compiler) {
   if (!params.empty()) {
     return InvalidArgumentError("anyTrue() requires zero arguments.");
   }
@@ -1836,9 +2723,9 @@ StatusOr<FunctionNode*> static CreateAnyTrueFunction(
 // Factory method for creating FHIRPath's anyFalse() function.
 StatusOr<FunctionNode*> static CreateAnyFalseFunction(
     const std::shared_ptr<ExpressionNode>& child_expression,
-    const std::vector<FhirPathParser::ExpressionContext*>& params,
-    FhirPathBaseVisitor* base_context_visitor,
-    FhirPathBaseVisitor* child_context_visitor) {
+    const std::vector<const AstNode*>& params,
+    ExpressionCompiler* base_context_compiler,
+    ExpressionCompiler* child_context_compiler) {
   if (!params.empty()) {
     return InvalidArgumentError("anyFalse() requires zero arguments.");
   }
@@ -1863,10 +2750,10 @@ class AllFunction : public FunctionNode {
   }
 
   static StatusOr<std::vector<std::shared_ptr<ExpressionNode>>> CompileParams(
-      const std::vector<FhirPathParser::ExpressionContext*>& params,
-      FhirPathBaseVisitor*,
-      FhirPathBaseVisitor* child_context_visitor) {
-    return FunctionNode::CompileParams(params, child_context_visitor);
+      const std::vector<const AstNode*>& params,
+      ExpressionCompiler*,
+      ExpressionCompiler* child_context_compiler) {
+    return FunctionNode::CompileParams(params, child_context_compiler);
   }
 
   AllFunction(
@@ -1878,14 +2765,20 @@ class AllFunction : public FunctionNode {
 
   Status Evaluate(WorkSpace* work_space,
                   std::vector<WorkspaceMessage>* results) const override {
-    std::vector<WorkspaceMessage> child_results;
-    FHIR_RETURN_IF_ERROR(child_->Evaluate(work_space, &child_results));
-    FHIR_ASSIGN_OR_RETURN(bool result, Evaluate(work_space, child_results));
+    // Evaluation of the child stops at the first result that does not meet
+    // the criteria.
+    bool result = true;
+    Status status = absl::OkStatus();
+    FHIR_RETURN_IF_ERROR(
+        child_->Stream(work_space, [&](const WorkspaceMessage& message) {
+          StatusOr<bool> criteria_met = CriteriaMet(work_space, message);
+          status = criteria_met.status();
+          result = status.ok() && criteria_met.ValueOrDie();
+          return result;
+        }));
+    FHIR_RETURN_IF_ERROR(status);
 
-    Message* result_message =
-        work_space->GetPrimitiveHandler()->NewBoolean(result);
-    work_space->DeleteWhenFinished(result_message);
-    results->push_back(WorkspaceMessage(result_message));
+    results->push_back(BooleanResult(work_space, result));
     return absl::OkStatus();
   }
 
@@ -1894,25 +2787,18 @@ class AllFunction : public FunctionNode {
   }
 
  private:
-  StatusOr<bool> Evaluate(
-      WorkSpace* work_space,
-      const std::vector<WorkspaceMessage>& child_results) const {
-    for (const WorkspaceMessage& message : child_results) {
-      std::vector<WorkspaceMessage> param_results;
-      WorkSpace expression_work_space(work_space->GetPrimitiveHandler(),
-                                      work_space->MessageContextStack(),
-                                      message);
-      FHIR_RETURN_IF_ERROR(
-          params_[0]->Evaluate(&expression_work_space, &param_results));
-      FHIR_ASSIGN_OR_RETURN(
-          StatusOr<absl::optional<bool>> criteria_met,
-          (BooleanOrEmpty(work_space->GetPrimitiveHandler(), param_results)));
-      if (!criteria_met.ValueOrDie().value_or(false)) {
-        return false;
-      }
-    }
-
-    return true;
+  StatusOr<bool> CriteriaMet(WorkSpace* work_space,
+                             const WorkspaceMessage& message) const {
+    std::vector<WorkspaceMessage> param_results;
+    WorkSpace expression_work_space(work_space->GetPrimitiveHandler(),
+                                    work_space->MessageContextStack(),
+                                    message);
+    FHIR_RETURN_IF_ERROR(
+        params_[0]->Evaluate(&expression_work_space, &param_results));
+    FHIR_ASSIGN_OR_RETURN(
+        absl::optional<bool> criteria_met,
+        (BooleanOrEmpty(work_space->GetPrimitiveHandler(), param_results)));
+    return criteria_met.value_or(false);
   }
 };
 
@@ -1960,10 +2846,10 @@ class SelectFunction : public FunctionNode {
   }
 
   static StatusOr<std::vector<std::shared_ptr<ExpressionNode>>> CompileParams(
-      const std::vector<FhirPathParser::ExpressionContext*>& params,
-      FhirPathBaseVisitor*,
-      FhirPathBaseVisitor* child_context_visitor) {
-    return FunctionNode::CompileParams(params, child_context_visitor);
+      const std::vector<const AstNode*>& params,
+      ExpressionCompiler*,
+      ExpressionCompiler* child_context_compiler) {
+    return FunctionNode::CompileParams(params, child_context_compiler);
   }
 
   SelectFunction(const std::shared_ptr<ExpressionNode>& child,
@@ -1976,7 +2862,38 @@ class SelectFunction : public FunctionNode {
                   std::vector<WorkspaceMessage>* results) const override {
     std::vector<WorkspaceMessage> child_results;
     FHIR_RETURN_IF_ERROR(child_->Evaluate(work_space, &child_results));
+    return EvaluateOnChildResults(work_space, child_results, results);
+  }
+
+  Status Stream(WorkSpace* work_space,
+                absl::FunctionRef<bool(const WorkspaceMessage&)> visitor)
+      const override {
+    // The projection of each input is collected before it is visited so that
+    // the visitor runs in the caller's message context.
+    Status status = absl::OkStatus();
+    std::vector<WorkspaceMessage> projection;
+    FHIR_RETURN_IF_ERROR(
+        child_->Stream(work_space, [&](const WorkspaceMessage& message) {
+          projection.clear();
+          work_space->PushMessageContext(message);
+          status = params_[0]->Evaluate(work_space, &projection);
+          work_space->PopMessageContext();
+          if (!status.ok()) {
+            return false;
+          }
+          for (const WorkspaceMessage& result : projection) {
+            if (!visitor(result)) {
+              return false;
+            }
+          }
+          return true;
+        }));
+    return status;
+  }
 
+  Status EvaluateOnChildResults(
+      WorkSpace* work_space, const std::vector<WorkspaceMessage>& child_results,
+      std::vector<WorkspaceMessage>* results) const {
     for (const WorkspaceMessage& message : child_results) {
       work_space->PushMessageContext(message);
       Status status = params_[0]->Evaluate(work_space, results);
@@ -1996,35 +2913,27 @@ class SelectFunction : public FunctionNode {
 class IifFunction : public FunctionNode {
  public:
   static StatusOr<std::vector<std::shared_ptr<ExpressionNode>>> CompileParams(
-      const std::vector<FhirPathParser::ExpressionContext*>& params,
-      FhirPathBaseVisitor* base_context_visitor,
-      FhirPathBaseVisitor* child_context_visitor) {
+      const std::vector<const AstNode*>& params,
+      ExpressionCompiler* base_context_compiler,
+      ExpressionCompiler* child_context_compiler) {
     if (params.size() < 2 || params.size() > 3) {
       return InvalidArgumentError("iif() requires 2 or 3 arugments.");
     }
 
     std::vector<std::shared_ptr<ExpressionNode>> compiled_params;
 
-    antlrcpp::Any criterion = params[0]->accept(child_context_visitor);
-    if (criterion.isNull()) {
-      return InvalidArgumentError("Failed to compile parameter.");
-    }
-    compiled_params.push_back(criterion.as<std::shared_ptr<ExpressionNode>>());
+    FHIR_ASSIGN_OR_RETURN(std::shared_ptr<ExpressionNode> criterion,
+                          child_context_compiler->Compile(*params[0]));
+    compiled_params.push_back(criterion);
 
-    antlrcpp::Any true_result = params[1]->accept(base_context_visitor);
-    if (true_result.isNull()) {
-      return InvalidArgumentError("Failed to compile parameter.");
-    }
-    compiled_params.push_back(
-        true_result.as<std::shared_ptr<ExpressionNode>>());
+    FHIR_ASSIGN_OR_RETURN(std::shared_ptr<ExpressionNode> true_result,
+                          base_context_compiler->Compile(*params[1]));
+    compiled_params.push_back(true_result);
 
     if (params.size() > 2) {
-      antlrcpp::Any otherwise_result = params[2]->accept(base_context_visitor);
-      if (otherwise_result.isNull()) {
-        return InvalidArgumentError("Failed to compile parameter.");
-      }
-      compiled_params.push_back(
-          otherwise_result.as<std::shared_ptr<ExpressionNode>>());
+      FHIR_ASSIGN_OR_RETURN(std::shared_ptr<ExpressionNode> otherwise_result,
+                            base_context_compiler->Compile(*params[2]));
+      compiled_params.push_back(otherwise_result);
     }
 
     return compiled_params;
@@ -2072,6 +2981,13 @@ class IifFunction : public FunctionNode {
   const Descriptor* ReturnType() const override { return child_->ReturnType(); }
 };
 
+// If the expression is a call to descendants(), returns an equivalent call that
+// skips subtrees that cannot contain messages of the named type. Otherwise
+// returns the expression.
+std::shared_ptr<ExpressionNode> PruneDescendants(
+    const std::shared_ptr<ExpressionNode>& expression,
+    const std::string& type_name);
+
 // Implements the FHIRPath .ofType() function.
 //
 // TODO: This does not currently validate that the tested type exists.
@@ -2087,14 +3003,16 @@ class OfTypeFunction : public ExpressionNode {
  public:
   StatusOr<OfTypeFunction*> static Create(
       const std::shared_ptr<ExpressionNode>& child_expression,
-      const std::vector<FhirPathParser::ExpressionContext*>& params,
-      FhirPathBaseVisitor* base_context_visitor,
-      FhirPathBaseVisitor* child_context_visitor) {
+      const std::vector<const AstNode*>& params,
+      ExpressionCompiler* base_context_compiler,
+      ExpressionCompiler* child_context_compiler) {
     if (params.size() != 1) {
       return InvalidArgumentError("ofType() requires a single argument.");
     }
 
-    return new OfTypeFunction(child_expression, params[0]->getText());
+    const std::string type_name = params[0]->Text();
+    return new OfTypeFunction(PruneDescendants(child_expression, type_name),
+                              type_name);
   }
 
   OfTypeFunction(const std::shared_ptr<ExpressionNode>& child,
@@ -2105,7 +3023,22 @@ class OfTypeFunction : public ExpressionNode {
                   std::vector<WorkspaceMessage>* results) const override {
     std::vector<WorkspaceMessage> child_results;
     FHIR_RETURN_IF_ERROR(child_->Evaluate(work_space, &child_results));
+    return EvaluateOnChildResults(work_space, child_results, results);
+  }
+
+  Status Stream(WorkSpace* work_space,
+                absl::FunctionRef<bool(const WorkspaceMessage&)> visitor)
+      const override {
+    return child_->Stream(work_space, [&](const WorkspaceMessage& message) {
+      return !absl::EqualsIgnoreCase(message.Message()->GetDescriptor()->name(),
+                                     type_name_) ||
+             visitor(message);
+    });
+  }
 
+  Status EvaluateOnChildResults(
+      WorkSpace* work_space, const std::vector<WorkspaceMessage>& child_results,
+      std::vector<WorkspaceMessage>* results) const {
     for (const WorkspaceMessage& message : child_results) {
       if (absl::EqualsIgnoreCase(
             message.Message()->GetDescriptor()->name(), type_name_)) {
@@ -2140,14 +3073,14 @@ class IsFunction : public ExpressionNode {
  public:
   StatusOr<IsFunction*> static Create(
       const std::shared_ptr<ExpressionNode>& child_expression,
-      const std::vector<FhirPathParser::ExpressionContext*>& params,
-      FhirPathBaseVisitor* base_context_visitor,
-      FhirPathBaseVisitor* child_context_visitor) {
+      const std::vector<const AstNode*>& params,
+      ExpressionCompiler* base_context_compiler,
+      ExpressionCompiler* child_context_compiler) {
     if (params.size() != 1) {
       return InvalidArgumentError("is() requires a single argument.");
     }
 
-    return new IsFunction(child_expression, params[0]->getText());
+    return new IsFunction(child_expression, params[0]->Text());
   }
 
   IsFunction(const std::shared_ptr<ExpressionNode>& child,
@@ -2168,11 +3101,10 @@ class IsFunction : public ExpressionNode {
       return absl::OkStatus();
     }
 
-    Message* result =
-        work_space->GetPrimitiveHandler()->NewBoolean(absl::EqualsIgnoreCase(
-            child_results[0].Message()->GetDescriptor()->name(), type_name_));
-    work_space->DeleteWhenFinished(result);
-    results->push_back(WorkspaceMessage(result));
+    results->push_back(BooleanResult(
+        work_space,
+        absl::EqualsIgnoreCase(
+            child_results[0].Message()->GetDescriptor()->name(), type_name_)));
     return absl::OkStatus();
   }
 
@@ -2200,14 +3132,14 @@ class AsFunction : public ExpressionNode {
  public:
   StatusOr<AsFunction*> static Create(
       const std::shared_ptr<ExpressionNode>& child_expression,
-      const std::vector<FhirPathParser::ExpressionContext*>& params,
-      FhirPathBaseVisitor* base_context_visitor,
-      FhirPathBaseVisitor* child_context_visitor) {
+      const std::vector<const AstNode*>& params,
+      ExpressionCompiler* base_context_compiler,
+      ExpressionCompiler* child_context_compiler) {
     if (params.size() != 1) {
       return InvalidArgumentError("as() requires a single argument.");
     }
 
-    return new AsFunction(child_expression, params[0]->getText());
+    return new AsFunction(child_expression, params[0]->Text());
   }
 
   AsFunction(const std::shared_ptr<ExpressionNode>& child,
@@ -2251,23 +3183,46 @@ class ChildrenFunction : public ZeroParameterFunctionNode {
 
   Status Evaluate(WorkSpace* work_space,
                   std::vector<WorkspaceMessage>* results) const override {
-    std::vector<WorkspaceMessage> child_results;
-    FHIR_RETURN_IF_ERROR(child_->Evaluate(work_space, &child_results));
+    return Stream(work_space, [&](const WorkspaceMessage& message) {
+      results->push_back(message);
+      return true;
+    });
+  }
 
-    for (const WorkspaceMessage& child : child_results) {
-      const Descriptor* descriptor = child.Message()->GetDescriptor();
-      for (int i = 0; i < descriptor->field_count(); i++) {
-        std::vector<const Message*> messages;
-        FHIR_RETURN_IF_ERROR(
-            RetrieveField(*child.Message(), *descriptor->field(i),
-                          MakeWorkSpaceMessageFactory(work_space), &messages));
-        for (const Message* message : messages) {
-            results->push_back(WorkspaceMessage(child, message));
-        }
+  Status Stream(WorkSpace* work_space,
+                absl::FunctionRef<bool(const WorkspaceMessage&)> visitor)
+      const override {
+    Status status = absl::OkStatus();
+    FHIR_RETURN_IF_ERROR(
+        child_->Stream(work_space, [&](const WorkspaceMessage& child) {
+          StatusOr<bool> more = VisitChildren(child, work_space, visitor);
+          status = more.status();
+          return status.ok() && more.ValueOrDie();
+        }));
+    return status;
+  }
+
+  // Calls the visitor with each child of the parent until it returns false.
+  // Returns false if the visitor did. Fields in skipped_fields, if given, are
+  // not visited.
+  static StatusOr<bool> VisitChildren(
+      const WorkspaceMessage& parent, WorkSpace* work_space,
+      absl::FunctionRef<bool(const WorkspaceMessage&)> visitor,
+      const FieldSet* skipped_fields = nullptr) {
+    const Descriptor* descriptor = parent.Message()->GetDescriptor();
+    for (int i = 0; i < descriptor->field_count(); i++) {
+      if (skipped_fields != nullptr &&
+          skipped_fields->contains(descriptor->field(i))) {
+        continue;
+      }
+      FHIR_ASSIGN_OR_RETURN(
+          bool more, VisitFieldValues(work_space, parent, descriptor->field(i),
+                                      visitor));
+      if (!more) {
+        return false;
       }
     }
-
-    return absl::OkStatus();
+    return true;
   }
 
   const Descriptor* ReturnType() const override {
@@ -2275,6 +3230,94 @@ class ChildrenFunction : public ZeroParameterFunctionNode {
   }
 };
 
+// Returns the types of the messages that RetrieveField produces from values of
+// the field, looking through choice type and contained resource containers.
+// The contents of a google.protobuf.Any are not known until evaluation, so they
+// are represented by nullptr.
+std::vector<const Descriptor*> FieldValueTypes(const FieldDescriptor* field) {
+  const Descriptor* type = field->message_type();
+  if (IsMessageType<google::protobuf::Any>(type)) {
+    return {nullptr};
+  }
+  if (!IsChoiceType(field) && !IsContainedResource(type)) {
+    return {type};
+  }
+
+  std::vector<const Descriptor*> types;
+  if (type->oneof_decl_count() > 0) {
+    const google::protobuf::OneofDescriptor* oneof = type->oneof_decl(0);
+    for (int i = 0; i < oneof->field_count(); ++i) {
+      types.push_back(oneof->field(i)->message_type());
+    }
+  }
+  return types;
+}
+
+// Returns the fields of message types reachable from the root type whose
+// values can neither be of the named type nor contain a message of it. Types
+// are matched by name, as ofType() does.
+std::shared_ptr<const FieldSet> FieldsThatCannotContain(
+    const Descriptor* root, absl::string_view type_name) {
+  // Find every message type whose fields descendants() may visit.
+  std::vector<const Descriptor*> types = {root};
+  absl::flat_hash_set<const Descriptor*> seen = {root};
+  for (size_t i = 0; i < types.size(); ++i) {
+    for (int j = 0; j < types[i]->field_count(); ++j) {
+      const FieldDescriptor* field = types[i]->field(j);
+      if (field->message_type() == nullptr) {
+        continue;
+      }
+      for (const Descriptor* type : FieldValueTypes(field)) {
+        if (type != nullptr && !IsPrimitive(type) && seen.insert(type).second) {
+          types.push_back(type);
+        }
+      }
+    }
+  }
+
+  // Find the types that can contain the named type. Types reference each
+  // other recursively (e.g. Extension and Identifier), so this iterates until
+  // nothing changes.
+  absl::flat_hash_set<const Descriptor*> containing;
+  auto may_produce = [&](const FieldDescriptor* field) {
+    if (field->message_type() == nullptr) {
+      return true;
+    }
+    for (const Descriptor* type : FieldValueTypes(field)) {
+      if (type == nullptr || absl::EqualsIgnoreCase(type->name(), type_name) ||
+          containing.contains(type)) {
+        return true;
+      }
+    }
+    return false;
+  };
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (const Descriptor* type : types) {
+      if (containing.contains(type)) {
+        continue;
+      }
+      for (int i = 0; i < type->field_count(); ++i) {
+        if (may_produce(type->field(i))) {
+          containing.insert(type);
+          changed = true;
+          break;
+        }
+      }
+    }
+  }
+
+  auto fields = std::make_shared<FieldSet>();
+  for (const Descriptor* type : types) {
+    for (int i = 0; i < type->field_count(); ++i) {
+      if (!may_produce(type->field(i))) {
+        fields->insert(type->field(i));
+      }
+    }
+  }
+  return fields;
+}
+
 class DescendantsFunction : public ZeroParameterFunctionNode {
  public:
   DescendantsFunction(
@@ -2282,42 +3325,86 @@ class DescendantsFunction : public ZeroParameterFunctionNode {
       const std::vector<std::shared_ptr<ExpressionNode>>& params)
       : ZeroParameterFunctionNode(child, params) {}
 
-  Status Evaluate(WorkSpace* work_space,
-                  std::vector<WorkspaceMessage>* results) const override {
-    std::vector<WorkspaceMessage> child_results;
-    FHIR_RETURN_IF_ERROR(child_->Evaluate(work_space, &child_results));
-
-    for (const WorkspaceMessage& child : child_results) {
-      FHIR_RETURN_IF_ERROR(AppendDescendants(child, work_space, results));
+  // Returns an equivalent call to descendants() for a consumer that only
+  // needs the descendants of the named type, e.g. ofType(). The call skips
+  // fields that cannot lead to the type. A google.protobuf.Any, such as an R4
+  // contained resource, may hold any type, so it is always visited, and so are
+  // the fields of types only reachable through one. Returns nullptr if the
+  // type of the input is not known at compile time.
+  std::shared_ptr<ExpressionNode> PrunedFor(absl::string_view type_name) const {
+    const Descriptor* descriptor = child_->ReturnType();
+    if (descriptor == nullptr) {
+      return nullptr;
     }
-
-    return absl::OkStatus();
+    return std::make_shared<DescendantsFunction>(
+        child_, params_, FieldsThatCannotContain(descriptor, type_name));
   }
 
-  Status AppendDescendants(const WorkspaceMessage& parent,
-                           WorkSpace* work_space,
-                           std::vector<WorkspaceMessage>* results) const {
-    const Descriptor* descriptor = parent.Message()->GetDescriptor();
-    if (IsPrimitive(descriptor)) {
-      return absl::OkStatus();
-    }
+  DescendantsFunction(const std::shared_ptr<ExpressionNode>& child,
+                      const std::vector<std::shared_ptr<ExpressionNode>>& params,
+                      std::shared_ptr<const FieldSet> skipped_fields)
+      : ZeroParameterFunctionNode(child, params),
+        skipped_fields_(std::move(skipped_fields)) {}
 
-    for (int i = 0; i < descriptor->field_count(); i++) {
-      std::vector<const Message*> messages;
-      FHIR_RETURN_IF_ERROR(
-          RetrieveField(*parent.Message(), *descriptor->field(i),
-                        MakeWorkSpaceMessageFactory(work_space), &messages));
-      for (const Message* message : messages) {
-        WorkspaceMessage child(parent, message);
-        results->push_back(child);
-        FHIR_RETURN_IF_ERROR(AppendDescendants(child, work_space, results));
-      }
+  Status Evaluate(WorkSpace* work_space,
+                  std::vector<WorkspaceMessage>* results) const override {
+    return Stream(work_space, [&](const WorkspaceMessage& message) {
+      results->push_back(message);
+      return true;
+    });
+  }
+
+  // Visits descendants depth first, so consumers such as exists() stop
+  // traversing the resource as soon as they have seen enough.
+  Status Stream(WorkSpace* work_space,
+                absl::FunctionRef<bool(const WorkspaceMessage&)> visitor)
+      const override {
+    Status status = absl::OkStatus();
+    FHIR_RETURN_IF_ERROR(
+        child_->Stream(work_space, [&](const WorkspaceMessage& child) {
+          StatusOr<bool> more = VisitDescendants(child, work_space, visitor,
+                                                 skipped_fields_.get());
+          status = more.status();
+          return status.ok() && more.ValueOrDie();
+        }));
+    return status;
+  }
+
+  // Calls the visitor with each descendant of the parent, in pre-order, until
+  // it returns false. Returns false if the visitor did. Fields in
+  // skipped_fields, if given, are not visited.
+  static StatusOr<bool> VisitDescendants(
+      const WorkspaceMessage& parent, WorkSpace* work_space,
+      absl::FunctionRef<bool(const WorkspaceMessage&)> visitor,
+      const FieldSet* skipped_fields = nullptr) {
+    if (IsPrimitive(parent.Message()->GetDescriptor())) {
+      return true;
     }
 
-    return absl::OkStatus();
+    Status status = absl::OkStatus();
+    FHIR_ASSIGN_OR_RETURN(
+        bool more,
+        ChildrenFunction::VisitChildren(
+            parent, work_space,
+            [&](const WorkspaceMessage& child) {
+              if (!visitor(child)) {
+                return false;
+              }
+              StatusOr<bool> more = VisitDescendants(child, work_space,
+                                                     visitor, skipped_fields);
+              status = more.status();
+              return status.ok() && more.ValueOrDie();
+            },
+            skipped_fields));
+    FHIR_RETURN_IF_ERROR(status);
+    return more;
   }
 
   const Descriptor* ReturnType() const override { return nullptr; }
+
+ private:
+  // Null if every field is visited.
+  const std::shared_ptr<const FieldSet> skipped_fields_;
 };
 
 // Implements the FHIRPath .intersect() function.
@@ -2366,27 +3453,159 @@ class IntersectFunction : public SingleParameterFunctionNode {
   }
 };
 
-// Converts decimal or integer container messages to a double value
-static Status MessageToDouble(const PrimitiveHandler* primitive_handler,
-                              const Message& message, double* value) {
-  if (IsDecimal(message)) {
-    FHIR_ASSIGN_OR_RETURN(std::string string_value,
-                          primitive_handler->GetDecimalValue(message));
+// Implements the FHIRPath memberOf() function, which returns true if the
+// input code, Coding or CodeableConcept is in the value set with the given
+// URL, as recorded in the TerminologyIndex of the CompileOptions. A
+// CodeableConcept is a member if any of its codings are. Codes and strings
+// have no system, and are members if the value set has the code in any
+// system.
+//
+// Returns the empty collection if the input is empty or the value set is not
+// in the index. See https://www.hl7.org/fhir/fhirpath.html#functions.
+class MemberOfFunction : public SingleValueFunctionNode {
+ public:
+  MemberOfFunction(const std::shared_ptr<ExpressionNode>& child,
+                   const std::vector<std::shared_ptr<ExpressionNode>>& params,
+                   const TerminologyIndex* terminology)
+      : SingleValueFunctionNode(child, params), terminology_(terminology) {}
+
+  Status EvaluateWithParam(
+      WorkSpace* work_space, const WorkspaceMessage& param,
+      std::vector<WorkspaceMessage>* results) const override {
+    std::vector<WorkspaceMessage> child_results;
+    FHIR_RETURN_IF_ERROR(child_->Evaluate(work_space, &child_results));
 
-    if (!absl::SimpleAtod(string_value, value)) {
+    if (child_results.size() > 1) {
       return InvalidArgumentError(
-          "Could not convert decimal to numeric double.");
+          "memberOf() must be invoked on a single code, Coding or "
+          "CodeableConcept.");
     }
 
-    return absl::OkStatus();
+    FHIR_ASSIGN_OR_RETURN(
+        std::string value_set,
+        MessageToString(work_space->GetPrimitiveHandler(), param));
+    if (child_results.empty() || !terminology_->HasValueSet(value_set)) {
+      return absl::OkStatus();
+    }
 
-  } else if (IsSystemInteger(message)) {
-    FHIR_ASSIGN_OR_RETURN(*value, ToSystemInteger(primitive_handler, message));
+    FHIR_ASSIGN_OR_RETURN(
+        bool member, IsMember(work_space->GetPrimitiveHandler(), value_set,
+                              *child_results[0].Message()));
+    results->push_back(BooleanResult(work_space, member));
     return absl::OkStatus();
   }
 
+  const Descriptor* ReturnType() const override {
+    return Boolean::descriptor();
+  }
+
+ private:
+  StatusOr<bool> IsMember(const PrimitiveHandler* primitive_handler,
+                          const std::string& value_set,
+                          const Message& message) const {
+    if (IsTypeOrProfileOfCoding(message)) {
+      return IsCodingMember(primitive_handler, value_set, message);
+    }
+
+    if (IsTypeOrProfileOfCodeableConcept(message)) {
+      // Profiles of CodeableConcept may hold codings in fields other than
+      // "coding", e.g. slices for particular systems.
+      const Descriptor* descriptor = message.GetDescriptor();
+      const ::google::protobuf::Reflection* reflection = message.GetReflection();
+      for (int i = 0; i < descriptor->field_count(); ++i) {
+        const FieldDescriptor* field = descriptor->field(i);
+        if (field->type() != FieldDescriptor::TYPE_MESSAGE ||
+            !IsTypeOrProfileOfCoding(field->message_type())) {
+          continue;
+        }
+        const int size =
+            field->is_repeated() ? reflection->FieldSize(message, field)
+            : reflection->HasField(message, field) ? 1 : 0;
+        for (int j = 0; j < size; ++j) {
+          const Message& coding =
+              field->is_repeated()
+                  ? reflection->GetRepeatedMessage(message, field, j)
+                  : reflection->GetMessage(message, field);
+          FHIR_ASSIGN_OR_RETURN(
+              bool member,
+              IsCodingMember(primitive_handler, value_set, coding));
+          if (member) {
+            return true;
+          }
+        }
+      }
+      return false;
+    }
+
+    FHIR_ASSIGN_OR_RETURN(
+        std::string code,
+        MessageToString(primitive_handler, WorkspaceMessage(&message)));
+    return terminology_->Contains(value_set, "", code);
+  }
+
+  StatusOr<bool> IsCodingMember(const PrimitiveHandler* primitive_handler,
+                                const std::string& value_set,
+                                const Message& coding) const {
+    const Descriptor* descriptor = coding.GetDescriptor();
+    const ::google::protobuf::Reflection* reflection = coding.GetReflection();
+    const FieldDescriptor* code_field = descriptor->FindFieldByName("code");
+    if (code_field == nullptr || !reflection->HasField(coding, code_field)) {
+      return false;
+    }
+    FHIR_ASSIGN_OR_RETURN(
+        std::string code,
+        MessageToString(primitive_handler,
+                        WorkspaceMessage(
+                            &reflection->GetMessage(coding, code_field))));
+
+    // Profiles of Coding with a fixed system have no system field.
+    std::string system;
+    const FieldDescriptor* system_field = descriptor->FindFieldByName("system");
+    if (system_field != nullptr && reflection->HasField(coding, system_field)) {
+      FHIR_ASSIGN_OR_RETURN(
+          system, MessageToString(primitive_handler,
+                                  WorkspaceMessage(&reflection->GetMessage(
+                                      coding, system_field))));
+    }
+    return terminology_->Contains(value_set, system, code);
+  }
+
+  const TerminologyIndex* const terminology_;
+};
+
+// Factory method for creating FHIRPath's memberOf() function, which requires
+// a TerminologyIndex in the CompileOptions.
+StatusOr<ExpressionNode*> static CreateMemberOfFunction(
+    const std::shared_ptr<ExpressionNode>& child_expression,
+    const std::vector<const AstNode*>& params,
+    ExpressionCompiler* base_context_compiler,
+    ExpressionCompiler* child_context_compiler) {
+  if (base_context_compiler->Terminology() == nullptr) {
+    return UnimplementedError(
+        "memberOf() requires a terminology index in the CompileOptions.");
+  }
+
+  FHIR_ASSIGN_OR_RETURN(
+      std::vector<std::shared_ptr<ExpressionNode>> compiled_params,
+      MemberOfFunction::CompileParams(params, base_context_compiler));
+  FHIR_RETURN_IF_ERROR(MemberOfFunction::ValidateParams(compiled_params));
+  return new MemberOfFunction(child_expression, compiled_params,
+                              base_context_compiler->Terminology());
+}
+
+// Converts decimal or integer container messages to an exact decimal value.
+static StatusOr<Decimal> MessageToDecimal(const Message& message) {
+  absl::optional<SystemValue> system_value = SystemValue::FromMessage(message);
+  if (system_value.has_value() &&
+      system_value->type() == SystemValue::Type::kDecimal) {
+    return Decimal::Parse(system_value->string_value());
+  } else if (system_value.has_value() &&
+             system_value->type() == SystemValue::Type::kInteger) {
+    return Decimal::FromInteger(system_value->integer_value());
+  }
+
   return InvalidArgumentError(
-      absl::StrCat("Message type cannot be converted to double: ",
+      absl::StrCat("Message type cannot be converted to decimal: ",
                    message.GetDescriptor()->full_name()));
 }
 
@@ -2419,10 +3638,7 @@ class ComparisonOperator : public BinaryOperator {
                                          left_results[0], right_results[0]));
 
     if (result.has_value()) {
-      Message* result_message =
-          work_space->GetPrimitiveHandler()->NewBoolean(result.value());
-      work_space->DeleteWhenFinished(result_message);
-      out_results->push_back(WorkspaceMessage(result_message));
+      out_results->push_back(BooleanResult(work_space, result.value()));
     }
     return absl::OkStatus();
   }
@@ -2450,18 +3666,15 @@ class ComparisonOperator : public BinaryOperator {
           ToSystemInteger(primitive_handler, *right_result)
               .ValueOrDie());
     } else if (IsDecimal(*left_result) || IsDecimal(*right_result)) {
-      return EvalDecimalComparison(primitive_handler, left_result,
-                                   right_result);
+      return EvalDecimalComparison(left_result, right_result);
 
     } else if (IsString(*left_result) && IsString(*right_result)) {
       return EvalStringComparison(primitive_handler, left_result, right_result);
     } else if (IsDateTime(*left_result) && IsDateTime(*right_result)) {
-      return EvalDateTimeComparison(primitive_handler, *left_result,
-                                    *right_result);
+      return EvalDateTimeComparison(*left_result, *right_result);
     } else if (IsSimpleQuantity(*left_result) &&
                IsSimpleQuantity(*right_result)) {
-      return EvalSimpleQuantityComparison(primitive_handler, *left_result,
-                                          *right_result);
+      return EvalSimpleQuantityComparison(*left_result, *right_result);
     } else {
       return InvalidArgumentError(absl::StrCat(
           "Unsupported comparison value types: ", left_result->GetTypeName(),
@@ -2484,39 +3697,26 @@ class ComparisonOperator : public BinaryOperator {
   }
 
   StatusOr<absl::optional<bool>> EvalDecimalComparison(
-      const PrimitiveHandler* primitive_handler, const Message* left_message,
-      const Message* right_message) const {
+      const Message* left_message, const Message* right_message) const {
     // Handle decimal comparisons, converting integer types
     // if necessary.
-    double left;
-    FHIR_RETURN_IF_ERROR(
-        MessageToDouble(primitive_handler, *left_message, &left));
-    double right;
-    FHIR_RETURN_IF_ERROR(
-        MessageToDouble(primitive_handler, *right_message, &right));
+    FHIR_ASSIGN_OR_RETURN(Decimal left, MessageToDecimal(*left_message));
+    FHIR_ASSIGN_OR_RETURN(Decimal right, MessageToDecimal(*right_message));
+    return EvalDecimalComparison(left, right);
+  }
 
+  absl::optional<bool> EvalDecimalComparison(const Decimal& left,
+                                             const Decimal& right) const {
     switch (comparison_type_) {
       case kLessThan:
         return absl::make_optional(left < right);
       case kGreaterThan:
         return absl::make_optional(left > right);
       case kLessThanEqualTo:
-        // Fallback to literal comparison for equality to avoid
-        // rounding errors.
-        return
-            absl::make_optional(left <= right ||
-            (left_message->GetDescriptor() == right_message->GetDescriptor() &&
-             MessageDifferencer::Equals(*left_message, *right_message)));
+        return absl::make_optional(left <= right);
       case kGreaterThanEqualTo:
-        // Fallback to literal comparison for equality to avoid
-        // rounding errors.
-        return
-            absl::make_optional(left >= right ||
-            (left_message->GetDescriptor() == right_message->GetDescriptor() &&
-             MessageDifferencer::Equals(*left_message, *right_message)));
+        return absl::make_optional(left >= right);
     }
-
-    return absl::OkStatus();
   }
 
   StatusOr<absl::optional<bool>> EvalStringComparison(
@@ -2560,32 +3760,29 @@ class ComparisonOperator : public BinaryOperator {
   }
 
   StatusOr<absl::optional<bool>> EvalDateTimeComparison(
-      const PrimitiveHandler* primitive_handler, const Message& left_message,
-      const Message& right_message) const {
-    FHIR_ASSIGN_OR_RETURN(
-        DateTimePrecision left_precision,
-        primitive_handler->GetDateTimePrecision(left_message));
-    FHIR_ASSIGN_OR_RETURN(
-        DateTimePrecision right_precision,
-        primitive_handler->GetDateTimePrecision(right_message));
+      const Message& left_message, const Message& right_message) const {
+    absl::optional<DateTimeValue> left =
+        DateTimeValue::FromMessage(left_message);
+    absl::optional<DateTimeValue> right =
+        DateTimeValue::FromMessage(right_message);
+    if (!left.has_value() || !right.has_value()) {
+      return InvalidArgumentError(absl::StrCat(
+          "Unsupported dateTime types: ", left_message.GetTypeName(), " and ",
+          right_message.GetTypeName()));
+    }
 
     // The FHIRPath spec (http://hl7.org/fhirpath/#comparison) states that "If
     // one value is specified to a different level of precision than the other,
     // the result is empty ({ }) to indicate that the result of the comparison
     // is unknown."
-    if (NormalizePrecisionForComparison(left_precision) !=
-        NormalizePrecisionForComparison(right_precision)) {
+    if (NormalizePrecisionForComparison(left->precision) !=
+        NormalizePrecisionForComparison(right->precision)) {
       return absl::optional<bool>();
     }
 
-    FHIR_ASSIGN_OR_RETURN(absl::Time left_time,
-                          primitive_handler->GetDateTimeValue(left_message));
-    FHIR_ASSIGN_OR_RETURN(absl::Time right_time,
-                          primitive_handler->GetDateTimeValue(right_message));
-
     // negative if left < right, positive if left > right, 0 if equal
     absl::civil_diff_t time_difference =
-        absl::ToInt64Microseconds(left_time - right_time);
+        absl::ToInt64Microseconds(left->time - right->time);
 
     switch (comparison_type_) {
       case kLessThan:
@@ -2600,46 +3797,31 @@ class ComparisonOperator : public BinaryOperator {
   }
 
   StatusOr<absl::optional<bool>> EvalSimpleQuantityComparison(
-      const PrimitiveHandler* primitive_handler,
-      const Message& left_wrapper,
-      const Message& right_wrapper) const {
-    FHIR_ASSIGN_OR_RETURN(
-        std::string left_code,
-        primitive_handler->GetSimpleQuantityCode(left_wrapper));
-    FHIR_ASSIGN_OR_RETURN(
-        std::string left_system,
-        primitive_handler->GetSimpleQuantitySystem(left_wrapper));
-    FHIR_ASSIGN_OR_RETURN(
-        std::string right_code,
-        primitive_handler->GetSimpleQuantityCode(right_wrapper));
-    FHIR_ASSIGN_OR_RETURN(
-        std::string right_system,
-        primitive_handler->GetSimpleQuantitySystem(right_wrapper));
+      const Message& left_wrapper, const Message& right_wrapper) const {
+    absl::optional<QuantityValue> left_quantity =
+        QuantityValue::FromMessage(left_wrapper);
+    absl::optional<QuantityValue> right_quantity =
+        QuantityValue::FromMessage(right_wrapper);
+    if (!left_quantity.has_value() || !right_quantity.has_value()) {
+      return InvalidArgumentError(absl::StrCat(
+          "Unsupported quantity types: ", left_wrapper.GetTypeName(), " and ",
+          right_wrapper.GetTypeName()));
+    }
 
-    if (left_code != right_code || left_system != right_system) {
+    if (left_quantity->code != right_quantity->code ||
+        left_quantity->system != right_quantity->system) {
       // From the FHIRPath spec: "Implementations are not required to fully
       // support operations on units, but they must at least respect units,
       // recognizing when units differ."
-      return InvalidArgumentError(
-          absl::StrCat("Compared quantities must have the same units. Got ",
-                       "[", left_code, ", ", left_system, "] and ", "[",
-                       right_code, ", ", right_system, "]"));
+      return InvalidArgumentError(absl::StrCat(
+          "Compared quantities must have the same units. Got ", "[",
+          left_quantity->code, ", ", left_quantity->system, "] and ", "[",
+          right_quantity->code, ", ", right_quantity->system, "]"));
     }
 
-    FHIR_ASSIGN_OR_RETURN(
-        std::string left_value,
-        primitive_handler->GetSimpleQuantityValue(left_wrapper));
-    FHIR_ASSIGN_OR_RETURN(
-        std::string right_value,
-        primitive_handler->GetSimpleQuantityValue(right_wrapper));
-
-    auto left_value_wrapper =
-        std::unique_ptr<Message>(primitive_handler->NewDecimal(left_value));
-    auto right_value_wrapper =
-        std::unique_ptr<Message>(primitive_handler->NewDecimal(right_value));
-
-    return EvalDecimalComparison(primitive_handler, left_value_wrapper.get(),
-                                 right_value_wrapper.get());
+    FHIR_ASSIGN_OR_RETURN(Decimal left, Decimal::Parse(left_quantity->value));
+    FHIR_ASSIGN_OR_RETURN(Decimal right, Decimal::Parse(right_quantity->value));
+    return EvalDecimalComparison(left, right);
   }
 
   ComparisonType comparison_type_;
@@ -2680,9 +3862,19 @@ class AdditionOperator : public BinaryOperator {
       Message* result = work_space->GetPrimitiveHandler()->NewString(value);
       work_space->DeleteWhenFinished(result);
       out_results->push_back(WorkspaceMessage(result));
+    } else if ((IsDecimal(*left_result) || IsDecimal(*right_result)) &&
+               (IsDecimal(*left_result) || IsSystemInteger(*left_result)) &&
+               (IsDecimal(*right_result) || IsSystemInteger(*right_result))) {
+      // Integers are converted to decimals, and the sum keeps the larger
+      // precision of the operands (e.g. 1.50 + 1 is 2.50).
+      FHIR_ASSIGN_OR_RETURN(Decimal left, MessageToDecimal(*left_result));
+      FHIR_ASSIGN_OR_RETURN(Decimal right, MessageToDecimal(*right_result));
+      Message* result = work_space->GetPrimitiveHandler()->NewDecimal(
+          (left + right).ToString());
+      work_space->DeleteWhenFinished(result);
+      out_results->push_back(WorkspaceMessage(result));
     } else {
-      // TODO: Add implementation for Date, DateTime, Time, and Decimal
-      // addition.
+      // TODO: Add implementation for Date, DateTime and Time addition.
       return InvalidArgumentError(absl::StrCat(
           "Addition not supported for ", left_result->GetTypeName(), " and ",
           right_result->GetTypeName()));
@@ -2720,6 +3912,70 @@ class AdditionOperator : public BinaryOperator {
   }
 };
 
+// Implementation for FHIRPath's multiplication operator.
+class MultiplicationOperator : public BinaryOperator {
+ public:
+  Status EvaluateOperator(
+      const std::vector<WorkspaceMessage>& left_results,
+      const std::vector<WorkspaceMessage>& right_results, WorkSpace* work_space,
+      std::vector<WorkspaceMessage>* out_results) const override {
+    // Per the FHIRPath spec, arithmetic operators propagate empty results.
+    if (left_results.empty() || right_results.empty()) {
+      return absl::OkStatus();
+    }
+
+    if (left_results.size() > 1 || right_results.size() > 1) {
+      return InvalidArgumentError(
+          "Multiplication operators must have one element on each side.");
+    }
+
+    const Message* left_result = left_results[0].Message();
+    const Message* right_result = right_results[0].Message();
+    const PrimitiveHandler* primitive_handler =
+        work_space->GetPrimitiveHandler();
+
+    if (IsSystemInteger(*left_result) && IsSystemInteger(*right_result)) {
+      FHIR_ASSIGN_OR_RETURN(int32_t left,
+                            ToSystemInteger(primitive_handler, *left_result));
+      FHIR_ASSIGN_OR_RETURN(int32_t right,
+                            ToSystemInteger(primitive_handler, *right_result));
+      const int64_t product = int64_t{left} * right;
+      if (product < std::numeric_limits<int32_t>::min() ||
+          product > std::numeric_limits<int32_t>::max()) {
+        return InvalidArgumentError("Integer multiplication overflowed.");
+      }
+      Message* result =
+          primitive_handler->NewInteger(static_cast<int32_t>(product));
+      work_space->DeleteWhenFinished(result);
+      out_results->push_back(WorkspaceMessage(result));
+    } else if ((IsDecimal(*left_result) || IsDecimal(*right_result)) &&
+               (IsDecimal(*left_result) || IsSystemInteger(*left_result)) &&
+               (IsDecimal(*right_result) || IsSystemInteger(*right_result))) {
+      // Integers are converted to decimals, and the product keeps the sum of
+      // the precisions of the operands (e.g. 1.5 * 2.0 is 3.00).
+      FHIR_ASSIGN_OR_RETURN(Decimal left, MessageToDecimal(*left_result));
+      FHIR_ASSIGN_OR_RETURN(Decimal right, MessageToDecimal(*right_result));
+      Message* result =
+          primitive_handler->NewDecimal((left * right).ToString());
+      work_space->DeleteWhenFinished(result);
+      out_results->push_back(WorkspaceMessage(result));
+    } else {
+      // TODO: Add implementation for Quantity multiplication.
+      return InvalidArgumentError(absl::StrCat(
+          "Multiplication not supported for ", left_result->GetTypeName(),
+          " and ", right_result->GetTypeName()));
+    }
+
+    return absl::OkStatus();
+  }
+
+  const Descriptor* ReturnType() const override { return left_->ReturnType(); }
+
+  MultiplicationOperator(std::shared_ptr<ExpressionNode> left,
+                         std::shared_ptr<ExpressionNode> right)
+      : BinaryOperator(std::move(left), std::move(right)) {}
+};
+
 // Implementation for FHIRPath's string concatenation operator (&).
 class StrCatOperator : public BinaryOperator {
  public:
@@ -2843,17 +4099,48 @@ class BooleanOperator : public ExpressionNode {
                   std::shared_ptr<ExpressionNode> right)
       : left_(left), right_(right) {}
 
- protected:
-  void SetResult(bool eval_result, WorkSpace* work_space,
-                 std::vector<WorkspaceMessage>* results) const {
-    Message* result =
-        work_space->GetPrimitiveHandler()->NewBoolean(eval_result);
-    work_space->DeleteWhenFinished(result);
-    results->push_back(WorkspaceMessage(result));
-  }
-
-  StatusOr<absl::optional<bool>> EvaluateBooleanNode(
-      std::shared_ptr<ExpressionNode> node, WorkSpace* work_space) const {
+  Status Evaluate(WorkSpace* work_space,
+                  std::vector<WorkspaceMessage>* results) const override {
+    FHIR_ASSIGN_OR_RETURN(absl::optional<bool> left_result,
+                          EvaluateBooleanNode(left_, work_space));
+
+    absl::optional<bool> right_result;
+    if (!ShortCircuits(left_result)) {
+      FHIR_ASSIGN_OR_RETURN(right_result,
+                            EvaluateBooleanNode(right_, work_space));
+    }
+
+    SetResult(Apply(left_result, right_result), work_space, results);
+    return absl::OkStatus();
+  }
+
+ protected:
+  // Returns true if the result of the operator is determined by the result of
+  // the left operand alone, in which case the right operand is not evaluated.
+  virtual bool ShortCircuits(absl::optional<bool> left_result) const = 0;
+
+  // Returns the result of the operator, or an empty optional if the result is
+  // the empty collection. The right result is empty if the left result
+  // short circuits the operator.
+  //
+  // Logic from truth table spec: http://hl7.org/fhirpath/#boolean-logic
+  virtual absl::optional<bool> Apply(
+      absl::optional<bool> left_result,
+      absl::optional<bool> right_result) const = 0;
+
+  void SetResult(absl::optional<bool> eval_result, WorkSpace* work_space,
+                 std::vector<WorkspaceMessage>* results) const {
+    // Per the FHIRPath spec, boolean operations on empty collection
+    // propagate the empty collection.
+    if (!eval_result.has_value()) {
+      return;
+    }
+
+    results->push_back(BooleanResult(work_space, eval_result.value()));
+  }
+
+  StatusOr<absl::optional<bool>> EvaluateBooleanNode(
+      std::shared_ptr<ExpressionNode> node, WorkSpace* work_space) const {
     std::vector<WorkspaceMessage> results;
     FHIR_RETURN_IF_ERROR(node->Evaluate(work_space, &results));
     FHIR_ASSIGN_OR_RETURN(
@@ -2874,29 +4161,20 @@ class ImpliesOperator : public BooleanOperator {
                   std::shared_ptr<ExpressionNode> right)
       : BooleanOperator(left, right) {}
 
-  Status Evaluate(WorkSpace* work_space,
-                  std::vector<WorkspaceMessage>* results) const override {
-    FHIR_ASSIGN_OR_RETURN(absl::optional<bool> left_result,
-                          EvaluateBooleanNode(left_, work_space));
-
-    // Short circuit evaluation when left_result == "false"
-    if (left_result.has_value() && !left_result.value()) {
-      SetResult(true, work_space, results);
-      return absl::OkStatus();
-    }
-
-    FHIR_ASSIGN_OR_RETURN(absl::optional<bool> right_result,
-                          EvaluateBooleanNode(right_, work_space));
+ protected:
+  bool ShortCircuits(absl::optional<bool> left_result) const override {
+    return left_result.has_value() && !left_result.value();
+  }
 
+  absl::optional<bool> Apply(
+      absl::optional<bool> left_result,
+      absl::optional<bool> right_result) const override {
     if (!left_result.has_value()) {
-      if (right_result.value_or(false)) {
-        SetResult(true, work_space, results);
-      }
-    } else if (right_result.has_value()) {
-      SetResult(right_result.value(), work_space, results);
+      return right_result.value_or(false) ? absl::optional<bool>(true)
+                                          : absl::nullopt;
     }
 
-    return absl::OkStatus();
+    return left_result.value() ? right_result : absl::optional<bool>(true);
   }
 };
 
@@ -2906,23 +4184,19 @@ class XorOperator : public BooleanOperator {
               std::shared_ptr<ExpressionNode> right)
       : BooleanOperator(left, right) {}
 
-  Status Evaluate(WorkSpace* work_space,
-                  std::vector<WorkspaceMessage>* results) const override {
-    // Logic from truth table spec: http://hl7.org/fhirpath/#boolean-logic
-    FHIR_ASSIGN_OR_RETURN(absl::optional<bool> left_result,
-                          EvaluateBooleanNode(left_, work_space));
-    if (!left_result.has_value()) {
-      return absl::OkStatus();
-    }
+ protected:
+  bool ShortCircuits(absl::optional<bool> left_result) const override {
+    return !left_result.has_value();
+  }
 
-    FHIR_ASSIGN_OR_RETURN(absl::optional<bool> right_result,
-                          EvaluateBooleanNode(right_, work_space));
-    if (!right_result.has_value()) {
-      return absl::OkStatus();
+  absl::optional<bool> Apply(
+      absl::optional<bool> left_result,
+      absl::optional<bool> right_result) const override {
+    if (!left_result.has_value() || !right_result.has_value()) {
+      return absl::nullopt;
     }
 
-    SetResult(left_result.value() != right_result.value(), work_space, results);
-    return absl::OkStatus();
+    return left_result.value() != right_result.value();
   }
 };
 
@@ -2932,33 +4206,27 @@ class OrOperator : public BooleanOperator {
              std::shared_ptr<ExpressionNode> right)
       : BooleanOperator(left, right) {}
 
-  Status Evaluate(WorkSpace* work_space,
-                  std::vector<WorkspaceMessage>* results) const override {
-    // Logic from truth table spec: http://hl7.org/fhirpath/#boolean-logic
-    // Short circuit and return true on the first true result.
-    FHIR_ASSIGN_OR_RETURN(absl::optional<bool> left_result,
-                          EvaluateBooleanNode(left_, work_space));
-    if (left_result.has_value() && left_result.value()) {
-      SetResult(true, work_space, results);
-      return absl::OkStatus();
-    }
+ protected:
+  // Short circuit and return true on the first true result.
+  bool ShortCircuits(absl::optional<bool> left_result) const override {
+    return left_result.has_value() && left_result.value();
+  }
 
-    FHIR_ASSIGN_OR_RETURN(absl::optional<bool> right_result,
-                          EvaluateBooleanNode(right_, work_space));
-    if (right_result.has_value() && right_result.value()) {
-      SetResult(true, work_space, results);
-      return absl::OkStatus();
+  absl::optional<bool> Apply(
+      absl::optional<bool> left_result,
+      absl::optional<bool> right_result) const override {
+    if (left_result.value_or(false) || right_result.value_or(false)) {
+      return true;
     }
 
     if (left_result.has_value() && right_result.has_value()) {
       // Both children must be false to get here, so return false.
-      SetResult(false, work_space, results);
-      return absl::OkStatus();
+      return false;
     }
 
     // Neither child is true and at least one is empty, so propagate
     // empty per the FHIRPath spec.
-    return absl::OkStatus();
+    return absl::nullopt;
   }
 };
 
@@ -2968,33 +4236,27 @@ class AndOperator : public BooleanOperator {
               std::shared_ptr<ExpressionNode> right)
       : BooleanOperator(left, right) {}
 
-  Status Evaluate(WorkSpace* work_space,
-                  std::vector<WorkspaceMessage>* results) const override {
-    // Logic from truth table spec: http://hl7.org/fhirpath/#boolean-logic
-    // Short circuit and return false on the first false result.
-    FHIR_ASSIGN_OR_RETURN(absl::optional<bool> left_result,
-                          EvaluateBooleanNode(left_, work_space));
-    if (left_result.has_value() && !left_result.value()) {
-      SetResult(false, work_space, results);
-      return absl::OkStatus();
-    }
+ protected:
+  // Short circuit and return false on the first false result.
+  bool ShortCircuits(absl::optional<bool> left_result) const override {
+    return left_result.has_value() && !left_result.value();
+  }
 
-    FHIR_ASSIGN_OR_RETURN(absl::optional<bool> right_result,
-                          EvaluateBooleanNode(right_, work_space));
-    if (right_result.has_value() && !right_result.value()) {
-      SetResult(false, work_space, results);
-      return absl::OkStatus();
+  absl::optional<bool> Apply(
+      absl::optional<bool> left_result,
+      absl::optional<bool> right_result) const override {
+    if (!left_result.value_or(true) || !right_result.value_or(true)) {
+      return false;
     }
 
     if (left_result.has_value() && right_result.has_value()) {
       // Both children must be true to get here, so return true.
-      SetResult(true, work_space, results);
-      return absl::OkStatus();
+      return true;
     }
 
     // Neither child is false and at least one is empty, so propagate
     // empty per the FHIRPath spec.
-    return absl::OkStatus();
+    return absl::nullopt;
   }
 };
 
@@ -3031,9 +4293,7 @@ class ContainsOperator : public BinaryOperator {
                                    *right_operand, *message.Message());
                              });
 
-    Message* result = work_space->GetPrimitiveHandler()->NewBoolean(found);
-    work_space->DeleteWhenFinished(result);
-    results->push_back(WorkspaceMessage(result));
+    results->push_back(BooleanResult(work_space, found));
 
     return absl::OkStatus();
   }
@@ -3043,493 +4303,632 @@ class ContainsOperator : public BinaryOperator {
   }
 };
 
-// Produces a shared pointer explicitly of ExpressionNode rather
-// than a subclass to work well with ANTLR's "Any" semantics.
-inline std::shared_ptr<ExpressionNode> ToAny(
-    std::shared_ptr<ExpressionNode> node) {
-  return node;
-}
-
-// Internal structure that defines an invocation. This is used
-// at points when visiting the AST that do not have enough context
-// to produce an ExpressionNode (e.g., they do not see the type of
-// the calling object), and is a placeholder for a higher-level
-// visitor to transform into an ExpressionNode
-struct InvocationDefinition {
-  InvocationDefinition(const std::string& name, const bool is_function)
-      : name(name), is_function(is_function) {}
-
-  InvocationDefinition(
-      const std::string& name, const bool is_function,
-      const std::vector<FhirPathParser::ExpressionContext*>& params)
-      : name(name), is_function(is_function), params(params) {}
-
-  const std::string name;
-
-  // Indicates it is a function invocation rather than a member lookup.
-  const bool is_function;
+// Wraps a subexpression that may be shared by several expressions (or by
+// several parts of one expression) so that it is only computed once per
+// evaluation.
+//
+// Results are memoized in the WorkSpace and so are only valid for the message
+// context the workspace was created with. Hence only subexpressions evaluated
+// directly against that context, and not against the input of an enclosing
+// function (e.g. the criteria of where()), may be wrapped.
+class SharedSubexpression : public ExpressionNode {
+ public:
+  explicit SharedSubexpression(std::shared_ptr<ExpressionNode> expression)
+      : expression_(std::move(expression)), shared_(false) {}
 
-  const std::vector<FhirPathParser::ExpressionContext*> params;
-};
+  Status Evaluate(WorkSpace* work_space,
+                  std::vector<WorkspaceMessage>* results) const override {
+    // Subexpressions that ended up being used only once are not worth the
+    // cost of memoizing.
+    if (!shared_.load(std::memory_order_relaxed)) {
+      return expression_->Evaluate(work_space, results);
+    }
 
-StatusOr<ExpressionNode*> UnimplementedFunction(
-    std::shared_ptr<ExpressionNode>,
-    const std::vector<FhirPathParser::ExpressionContext*>&,
-    FhirPathBaseVisitor*, FhirPathBaseVisitor*) {
-  return UnimplementedError("Function is not yet supported.");
-}
+    const std::vector<WorkspaceMessage>* memoized_results =
+        work_space->FindMemoizedResult(this);
+    if (memoized_results == nullptr) {
+      std::vector<WorkspaceMessage> expression_results;
+      FHIR_RETURN_IF_ERROR(
+          expression_->Evaluate(work_space, &expression_results));
+      memoized_results =
+          work_space->MemoizeResult(this, std::move(expression_results));
+    }
 
-// ANTLR Visitor implementation to translate the AST
-// into ExpressionNodes that can run the expression over
-// given protocol buffers.
-//
-// Note that the return value of antlrcpp::Any assumes returned values
-// have copy constructors, which means we cannot use std::unique_ptr even
-// if that's the most logical choice. Therefore we'll use std:shared_ptr
-// more frequently here, but the costs in this case are negligible.
-class FhirPathCompilerVisitor : public FhirPathBaseVisitor {
- public:
-  FhirPathCompilerVisitor(const Descriptor* descriptor,
-                          const PrimitiveHandler* primitive_handler)
-      : error_listener_(this),
-        descriptor_stack_({descriptor}),
-        primitive_handler_(primitive_handler) {}
+    results->insert(results->end(), memoized_results->begin(),
+                    memoized_results->end());
+    return absl::OkStatus();
+  }
 
-  FhirPathCompilerVisitor(
-      const std::vector<const Descriptor*>& descriptor_stack_history,
-      const Descriptor* descriptor, const PrimitiveHandler* primitive_handler)
-      : error_listener_(this),
-        descriptor_stack_(descriptor_stack_history),
-        primitive_handler_(primitive_handler) {
-    descriptor_stack_.push_back(descriptor);
+  const Descriptor* ReturnType() const override {
+    return expression_->ReturnType();
   }
 
-  antlrcpp::Any visitInvocationExpression(
-      FhirPathParser::InvocationExpressionContext* node) override {
-    antlrcpp::Any expression = node->children[0]->accept(this);
+  // Marks the subexpression as being referenced from more than one place.
+  void MarkShared() { shared_.store(true, std::memory_order_relaxed); }
 
-    // This could be a simple member name or a parameterized function...
-    antlrcpp::Any invocation = node->children[2]->accept(this);
+  const std::shared_ptr<ExpressionNode>& expression() const {
+    return expression_;
+  }
 
-    if (!GetError().ok()) {
-      return nullptr;
-    }
+ private:
+  const std::shared_ptr<ExpressionNode> expression_;
 
-    auto definition = invocation.as<std::shared_ptr<InvocationDefinition>>();
+  // Whether memoization is enabled. Expressions may be added to a
+  // CompiledExpressionSet that shares this node while other expressions in
+  // the set are being evaluated, so this is atomic. Either value produces the
+  // same results.
+  std::atomic<bool> shared_;
+};
 
-    std::shared_ptr<ExpressionNode> expr =
-        expression.as<std::shared_ptr<ExpressionNode>>();
+// The statistics an EvaluationProfiler records for a compiled expression.
+class ExpressionProfile {
+ public:
+  struct Node {
+    Node(std::string expression, int depth)
+        : expression(std::move(expression)), depth(depth) {}
+
+    const std::string expression;
+    const int depth;
+    std::atomic<int64_t> evaluations{0};
+    std::atomic<int64_t> input_size{0};
+    std::atomic<int64_t> output_size{0};
+    std::atomic<int64_t> temporaries{0};
+    std::atomic<int64_t> wall_nanos{0};
+  };
 
-    if (definition->is_function) {
-      auto function_node =
-          createFunction(definition->name, expr, definition->params);
+  ExpressionProfile(const Descriptor* descriptor, std::string fhir_path)
+      : descriptor_(descriptor), fhir_path_(std::move(fhir_path)) {}
 
-      if (function_node == nullptr || !GetError().ok()) {
-        return nullptr;
-      } else {
-        return ToAny(function_node);
-      }
-    } else {
-      const Descriptor* descriptor = expr->ReturnType();
-
-      // If we know the return type of the expression, and the return type
-      // doesn't have the referenced field, set an error and return.
-      if (descriptor != nullptr && !HasFieldWithJsonName(descriptor,
-                                                         definition->name)) {
-        SetError(NotFoundError(
-            absl::StrCat("Unable to find field ", definition->name)));
-        return nullptr;
-      }
+  // Adds a subexpression. Subexpressions must be added in pre-order.
+  Node* AddNode(const std::string& expression, int depth) {
+    nodes_.push_back(absl::make_unique<Node>(expression, depth));
+    return nodes_.back().get();
+  }
 
-      const FieldDescriptor* field =
-          descriptor != nullptr &&
-                  !IsMessageType<google::protobuf::Any>(descriptor)
-              ? FindFieldByJsonName(descriptor, definition->name)
-              : nullptr;
-      return ToAny(std::make_shared<InvokeExpressionNode>(expression, field,
-                                                          definition->name));
+  EvaluationProfiler::ExpressionStats GetStats() const {
+    EvaluationProfiler::ExpressionStats stats;
+    stats.fhir_path = fhir_path_;
+    stats.descriptor = descriptor_;
+    for (const std::unique_ptr<Node>& node : nodes_) {
+      EvaluationProfiler::NodeStats node_stats;
+      node_stats.expression = node->expression;
+      node_stats.depth = node->depth;
+      node_stats.evaluations = node->evaluations.load();
+      node_stats.input_size = node->input_size.load();
+      node_stats.output_size = node->output_size.load();
+      node_stats.temporaries = node->temporaries.load();
+      node_stats.wall_time = absl::Nanoseconds(node->wall_nanos.load());
+      stats.nodes.push_back(std::move(node_stats));
     }
+    return stats;
   }
 
-  antlrcpp::Any visitInvocationTerm(
-      FhirPathParser::InvocationTermContext* ctx) override {
-    antlrcpp::Any invocation = visitChildren(ctx);
-
-    if (!GetError().ok()) {
-      return nullptr;
+  void Clear() {
+    for (const std::unique_ptr<Node>& node : nodes_) {
+      node->evaluations = 0;
+      node->input_size = 0;
+      node->output_size = 0;
+      node->temporaries = 0;
+      node->wall_nanos = 0;
     }
+  }
 
-    if (invocation.is<std::shared_ptr<ExpressionNode>>()) {
-      return invocation;
-    }
+ private:
+  const Descriptor* descriptor_;
+  const std::string fhir_path_;
+  std::vector<std::unique_ptr<Node>> nodes_;
+};
 
-    auto definition = invocation.as<std::shared_ptr<InvocationDefinition>>();
+// Evaluates a subexpression, recording statistics in an ExpressionProfile.
+class ProfiledNode : public ExpressionNode {
+ public:
+  ProfiledNode(std::shared_ptr<ExpressionNode> expression,
+               ExpressionProfile::Node* profile)
+      : expression_(std::move(expression)), profile_(profile) {}
 
-    if (definition->is_function) {
-      auto function_node = createFunction(
-          definition->name,
-          std::make_shared<ThisReference>(descriptor_stack_.back()),
-          definition->params);
+  Status Evaluate(WorkSpace* work_space,
+                  std::vector<WorkspaceMessage>* results) const override {
+    Frame frame(work_space);
+    const size_t size = results->size();
+    Status status = expression_->Evaluate(work_space, results);
+    frame.Finish(*profile_, results->size() - size);
+    return status;
+  }
+
+  Status Stream(WorkSpace* work_space,
+                absl::FunctionRef<bool(const WorkspaceMessage&)> visitor)
+      const override {
+    Frame frame(work_space);
+    int64_t output_size = 0;
+    Status status =
+        expression_->Stream(work_space, [&](const WorkspaceMessage& message) {
+          ++output_size;
+          return frame.Yield([&]() { return visitor(message); });
+        });
+    frame.Finish(*profile_, output_size);
+    return status;
+  }
 
-      return function_node == nullptr || !GetError().ok()
-                 ? nullptr
-                 : ToAny(function_node);
-    }
+  const Descriptor* ReturnType() const override {
+    return expression_->ReturnType();
+  }
 
-    const Descriptor* descriptor = descriptor_stack_.back();
+  const std::shared_ptr<ExpressionNode>& expression() const {
+    return expression_;
+  }
 
-    // If we know the return type of the expression, and the return type
-    // doesn't have the referenced field, set an error and return.
-    if (descriptor != nullptr && !HasFieldWithJsonName(descriptor,
-                                                       definition->name)) {
-      SetError(NotFoundError(
-          absl::StrCat("Unable to find field ", definition->name)));
-      return nullptr;
+  // Returns a node that records the given expression in the same profile.
+  std::shared_ptr<ExpressionNode> WithExpression(
+      std::shared_ptr<ExpressionNode> expression) const {
+    return std::make_shared<ProfiledNode>(std::move(expression), profile_);
+  }
+
+ private:
+  // The evaluation of a profiled node. Results produced by profiled nodes
+  // evaluated within it are counted as its input.
+  class Frame {
+   public:
+    explicit Frame(WorkSpace* work_space)
+        : work_space_(work_space),
+          parent_(current_),
+          temporaries_(work_space->TemporaryCount()),
+          start_(absl::Now()) {
+      current_ = this;
+    }
+
+    // Calls the consumer of the node's results, which is not part of the
+    // node's evaluation.
+    template <typename F>
+    bool Yield(F consumer) {
+      current_ = parent_;
+      const absl::Time start = absl::Now();
+      bool more = consumer();
+      excluded_ += absl::Now() - start;
+      current_ = this;
+      return more;
+    }
+
+    void Finish(ExpressionProfile::Node& profile, int64_t output_size) {
+      current_ = parent_;
+      if (parent_ != nullptr) {
+        parent_->input_size_ += output_size;
+      }
+      profile.evaluations.fetch_add(1, std::memory_order_relaxed);
+      profile.input_size.fetch_add(input_size_, std::memory_order_relaxed);
+      profile.output_size.fetch_add(output_size, std::memory_order_relaxed);
+      profile.temporaries.fetch_add(
+          work_space_->TemporaryCount() - temporaries_,
+          std::memory_order_relaxed);
+      profile.wall_nanos.fetch_add(
+          absl::ToInt64Nanoseconds(absl::Now() - start_ - excluded_),
+          std::memory_order_relaxed);
     }
 
-    const FieldDescriptor* field =
-        descriptor != nullptr &&
-                !IsMessageType<google::protobuf::Any>(descriptor)
-            ? FindFieldByJsonName(descriptor, definition->name)
-            : nullptr;
-    return ToAny(std::make_shared<InvokeTermNode>(field, definition->name));
-  }
+   private:
+    WorkSpace* const work_space_;
+    Frame* const parent_;
+    const size_t temporaries_;
+    const absl::Time start_;
+    absl::Duration excluded_;
+    int64_t input_size_ = 0;
+  };
 
-  antlrcpp::Any visitIndexerExpression(
-      FhirPathParser::IndexerExpressionContext* ctx) override {
-    antlrcpp::Any left_any = ctx->children[0]->accept(this);
-    antlrcpp::Any right_any = ctx->children[2]->accept(this);
+  // The innermost profiled node being evaluated by this thread.
+  static thread_local Frame* current_;
 
-    if (!GetError().ok()) {
-      return nullptr;
-    }
+  const std::shared_ptr<ExpressionNode> expression_;
+  ExpressionProfile::Node* const profile_;
+};
 
-    auto left = left_any.as<std::shared_ptr<ExpressionNode>>();
-    auto right = right_any.as<std::shared_ptr<ExpressionNode>>();
+thread_local ProfiledNode::Frame* ProfiledNode::current_ = nullptr;
 
-    return ToAny(
-        std::make_shared<IndexerExpression>(primitive_handler_, left, right));
+std::shared_ptr<ExpressionNode> PruneDescendants(
+    const std::shared_ptr<ExpressionNode>& expression,
+    const std::string& type_name) {
+  const ExpressionNode* node = expression.get();
+  if (const auto* profiled = dynamic_cast<const ProfiledNode*>(node)) {
+    std::shared_ptr<ExpressionNode> pruned =
+        PruneDescendants(profiled->expression(), type_name);
+    return pruned != profiled->expression() ? profiled->WithExpression(pruned)
+                                            : expression;
   }
+  if (const auto* shared = dynamic_cast<const SharedSubexpression*>(node)) {
+    node = shared->expression().get();
+  }
+  const auto* descendants = dynamic_cast<const DescendantsFunction*>(node);
+  if (descendants == nullptr) {
+    return expression;
+  }
+  std::shared_ptr<ExpressionNode> pruned = descendants->PrunedFor(type_name);
+  return pruned != nullptr ? pruned : expression;
+}
 
-  antlrcpp::Any visitUnionExpression(
-      FhirPathParser::UnionExpressionContext* ctx) override {
-    antlrcpp::Any left_any = ctx->children[0]->accept(this);
-    antlrcpp::Any right_any = ctx->children[2]->accept(this);
+// Produces a shared pointer explicitly of ExpressionNode rather than a
+// subclass, from which the compiler's StatusOr results can be constructed.
+inline std::shared_ptr<ExpressionNode> ToExpressionNode(
+    std::shared_ptr<ExpressionNode> node) {
+  return node;
+}
 
-    if (!GetError().ok()) {
-      return nullptr;
-    }
+StatusOr<ExpressionNode*> UnimplementedFunction(
+    std::shared_ptr<ExpressionNode>, const std::vector<const AstNode*>&,
+    ExpressionCompiler*, ExpressionCompiler*) {
+  return UnimplementedError("Function is not yet supported.");
+}
 
-    auto left = left_any.as<std::shared_ptr<ExpressionNode>>();
-    auto right = right_any.as<std::shared_ptr<ExpressionNode>>();
+// Translates the syntax tree produced by ParseFhirPath into ExpressionNodes
+// that can run the expression over given protocol buffers.
+class FhirPathCompiler : public ExpressionCompiler {
+ public:
+  FhirPathCompiler(const Descriptor* descriptor,
+                   const PrimitiveHandler* primitive_handler)
+      : descriptor_stack_({descriptor}),
+        primitive_handler_(primitive_handler) {}
 
-    return ToAny(std::make_shared<UnionOperator>(left, right));
+  FhirPathCompiler(
+      const std::vector<const Descriptor*>& descriptor_stack_history,
+      const Descriptor* descriptor, const PrimitiveHandler* primitive_handler)
+      : descriptor_stack_(descriptor_stack_history),
+        primitive_handler_(primitive_handler) {
+    descriptor_stack_.push_back(descriptor);
   }
 
-  antlrcpp::Any visitAdditiveExpression(
-      FhirPathParser::AdditiveExpressionContext* ctx) override {
-    antlrcpp::Any left_any = ctx->children[0]->accept(this);
-    std::string op = ctx->children[1]->getText();
-    antlrcpp::Any right_any = ctx->children[2]->accept(this);
-
-    if (!GetError().ok()) {
-      return nullptr;
-    }
+  // Enables reuse of invocations (e.g. "text.div" or "extension.exists()")
+  // across all expressions compiled with the given map. Invocations compiled
+  // by this compiler are added to the map, and invocations already in the map
+  // are returned instead of being compiled again.
+  void ShareSubexpressions(
+      std::map<std::string, std::shared_ptr<ExpressionNode>>*
+          shared_subexpressions) {
+    shared_subexpressions_ = shared_subexpressions;
+  }
 
-    auto left = left_any.as<std::shared_ptr<ExpressionNode>>();
-    auto right = right_any.as<std::shared_ptr<ExpressionNode>>();
+  // Records statistics of every evaluation of the compiled subexpressions in
+  // the given profile.
+  void Profile(ExpressionProfile* profile) { profile_ = profile; }
 
-    if (op == "+") {
-      return ToAny(std::make_shared<AdditionOperator>(left, right));
-    }
+  // Checks memberOf() calls against the value sets of the given index.
+  void UseTerminology(const TerminologyIndex* terminology) {
+    terminology_ = terminology;
+  }
 
-    if (op == "&") {
-      return ToAny(std::make_shared<StrCatOperator>(left, right));
-    }
+  const TerminologyIndex* Terminology() const override { return terminology_; }
 
-    if (op == "-") {
-      // TODO: Support "-"
-      SetError(UnimplementedError("'-' operator is not supported yet."));
-      return nullptr;
+  StatusOr<std::shared_ptr<ExpressionNode>> Compile(
+      const AstNode& node) override {
+    // Parentheses do not change the subexpression they contain.
+    if (profile_ == nullptr || node.type == AstNode::Type::kParenthesized) {
+      return CompileNode(node);
     }
 
-    // FhirPath.g4 does not define any additional additive operators.
-    SetError(InternalError(absl::StrCat("Unknown additive operator: ", op)));
-    return nullptr;
+    ExpressionProfile::Node* profile =
+        profile_->AddNode(node.Key(), profile_depth_);
+    ++profile_depth_;
+    StatusOr<std::shared_ptr<ExpressionNode>> result = CompileNode(node);
+    --profile_depth_;
+    FHIR_RETURN_IF_ERROR(result.status());
+    return ToExpressionNode(
+        std::make_shared<ProfiledNode>(result.ValueOrDie(), profile));
   }
 
-  antlrcpp::Any visitPolarityExpression(
-      FhirPathParser::PolarityExpressionContext* ctx) override {
-    std::string op = ctx->children[0]->getText();
-    antlrcpp::Any operand_any = ctx->children[1]->accept(this);
+ private:
+  typedef std::function<StatusOr<ExpressionNode*>(
+      std::shared_ptr<ExpressionNode>, const std::vector<const AstNode*>&,
+      ExpressionCompiler*, ExpressionCompiler*)>
+      FunctionFactory;
 
-    if (!GetError().ok()) {
-      return nullptr;
-    }
+  StatusOr<std::shared_ptr<ExpressionNode>> CompileNode(const AstNode& node) {
+    switch (node.type) {
+      case AstNode::Type::kIdentifier:
+      case AstNode::Type::kFunction:
+      case AstNode::Type::kThis:
+        return CompileShared(node,
+                             [&]() { return CompileInvocationTerm(node); });
 
-    auto operand = operand_any.as<std::shared_ptr<ExpressionNode>>();
+      case AstNode::Type::kIndex:
+        // TODO: Add support for $index.
+        return UnimplementedError("$index is not implemented");
 
-    if (op == "+") {
-      return ToAny(std::make_shared<PolarityOperator>(
-          PolarityOperator::kPositive, operand));
-    }
+      case AstNode::Type::kTotal:
+        // TODO: Add support for $total.
+        return UnimplementedError("$total is not implemented");
 
-    if (op == "-") {
-      return ToAny(std::make_shared<PolarityOperator>(
-          PolarityOperator::kNegative, operand));
-    }
+      case AstNode::Type::kNullLiteral:
+        return ToExpressionNode(std::make_shared<EmptyLiteral>());
 
-    // FhirPath.g4 does not define any additional polarity operators.
-    SetError(InternalError(absl::StrCat("Unknown polarity operator: ", op)));
-    return nullptr;
-  }
+      case AstNode::Type::kBooleanLiteral:
+        return CompileBooleanLiteral(node);
 
-  antlrcpp::Any visitTypeExpression(
-      FhirPathParser::TypeExpressionContext* ctx) override {
-    antlrcpp::Any left_any = ctx->children[0]->accept(this);
-    std::string op = ctx->children[1]->getText();
-    std::string type = ctx->children[2]->getText();
+      case AstNode::Type::kStringLiteral:
+        return CompileStringLiteral(node);
 
-    if (!GetError().ok()) {
-      return nullptr;
-    }
+      case AstNode::Type::kNumberLiteral:
+        return CompileNumberLiteral(node);
 
-    auto left = left_any.as<std::shared_ptr<ExpressionNode>>();
+      case AstNode::Type::kDateLiteral:
+        // TODO: Add support for Date literals.
+        return UnimplementedError("Date literals are not yet supported.");
 
-    if (op == "is") {
-      return ToAny(std::make_shared<IsFunction>(left, type));
-    }
+      case AstNode::Type::kDateTimeLiteral: {
+        FHIR_ASSIGN_OR_RETURN(std::shared_ptr<Literal> literal,
+                              ParseDateTime(node.text));
+        return ToExpressionNode(literal);
+      }
 
-    if (op == "as") {
-      return ToAny(std::make_shared<AsFunction>(left, type));
-    }
+      case AstNode::Type::kTimeLiteral:
+        // TODO: Add spport for time literals.
+        return UnimplementedError("Time literals are not yet supported.");
 
-    // FhirPath.g4 does not define any additional type operators.
-    SetError(InternalError(absl::StrCat("Unknown type operator: ", op)));
-    return nullptr;
-  }
+      case AstNode::Type::kQuantityLiteral:
+        // TODO: Add support for Quantity literals.
+        return UnimplementedError("Quantity literals are not yet supported.");
 
-  antlrcpp::Any visitEqualityExpression(
-      FhirPathParser::EqualityExpressionContext* ctx) override {
-    antlrcpp::Any left_any = ctx->children[0]->accept(this);
-    std::string op = ctx->children[1]->getText();
-    antlrcpp::Any right_any = ctx->children[2]->accept(this);
+      case AstNode::Type::kExternalConstant:
+        return CompileExternalConstant(node);
 
-    if (!GetError().ok()) {
-      return nullptr;
-    }
+      case AstNode::Type::kParenthesized:
+        // Simply propagate the value of the parenthesized term.
+        return Compile(*node.children[0]);
 
-    auto left = left_any.as<std::shared_ptr<ExpressionNode>>();
-    auto right = right_any.as<std::shared_ptr<ExpressionNode>>();
+      case AstNode::Type::kInvocation:
+        return CompileShared(
+            node, [&]() { return CompileInvocationExpression(node); });
 
-    if (op == "=") {
-      return ToAny(std::make_shared<EqualsOperator>(left, right));
-    }
-    if (op == "!=") {
-      // Negate the equals function to implement !=
-      auto equals_op = std::make_shared<EqualsOperator>(left, right);
-      return ToAny(std::make_shared<NotFunction>(equals_op));
-    }
+      case AstNode::Type::kIndexer:
+        return CompileIndexerExpression(node);
 
-    if (op == "~" || op == "!~") {
-      SetError(
-          UnimplementedError("'~' and '!~' operators are not yet supported"));
-      return nullptr;
+      case AstNode::Type::kPolarity:
+        return CompilePolarityExpression(node);
+
+      case AstNode::Type::kBinary:
+        return CompileBinaryExpression(node);
+
+      case AstNode::Type::kTypeOperator:
+        return CompileTypeExpression(node);
     }
 
-    // FhirPath.g4 does not define any additional equality operators.
-    SetError(InternalError(absl::StrCat("Unknown equality operator: ", op)));
-    return nullptr;
+    return InternalError(
+        absl::StrCat("Unknown syntax tree node: ", node.Key()));
   }
 
-  antlrcpp::Any visitInequalityExpression(
-      FhirPathParser::InequalityExpressionContext* ctx) override {
-    antlrcpp::Any left_any = ctx->children[0]->accept(this);
-    std::string op = ctx->children[1]->getText();
-    antlrcpp::Any right_any = ctx->children[2]->accept(this);
+  StatusOr<std::shared_ptr<ExpressionNode>> CompileInvocationExpression(
+      const AstNode& node) {
+    FHIR_ASSIGN_OR_RETURN(std::shared_ptr<ExpressionNode> expression,
+                          Compile(*node.children[0]));
 
-    if (!GetError().ok()) {
-      return nullptr;
+    // This could be a simple member name or a parameterized function...
+    const AstNode& invocation = *node.children[1];
+
+    if (invocation.type == AstNode::Type::kFunction) {
+      return CreateFunction(invocation, expression);
     }
 
-    auto left = left_any.as<std::shared_ptr<ExpressionNode>>();
-    auto right = right_any.as<std::shared_ptr<ExpressionNode>>();
+    if (invocation.type != AstNode::Type::kIdentifier) {
+      return UnimplementedError(absl::StrCat(
+          invocation.text, " is only supported at the start of an expression"));
+    }
 
-    ComparisonOperator::ComparisonType op_type;
+    const Descriptor* descriptor = expression->ReturnType();
 
-    if (op == "<") {
-      op_type = ComparisonOperator::kLessThan;
-    } else if (op == ">") {
-      op_type = ComparisonOperator::kGreaterThan;
-    } else if (op == "<=") {
-      op_type = ComparisonOperator::kLessThanEqualTo;
-    } else if (op == ">=") {
-      op_type = ComparisonOperator::kGreaterThanEqualTo;
-    } else {
-      SetError(
-          InternalError(absl::StrCat("Unknown comparison operator: ", op)));
-      return nullptr;
+    // If we know the return type of the expression, and the return type
+    // doesn't have the referenced field, return an error.
+    if (descriptor != nullptr &&
+        !HasFieldWithJsonName(descriptor, invocation.text)) {
+      return NotFoundError(
+          absl::StrCat("Unable to find field ", invocation.text));
     }
 
-    return ToAny(std::make_shared<ComparisonOperator>(left, right, op_type));
+    const FieldDescriptor* field =
+        descriptor != nullptr &&
+                !IsMessageType<google::protobuf::Any>(descriptor)
+            ? FindFieldByJsonName(descriptor, invocation.text)
+            : nullptr;
+    return ToExpressionNode(std::make_shared<InvokeExpressionNode>(
+        expression, field, invocation.text));
   }
 
-  antlrcpp::Any visitMembershipExpression(
-      FhirPathParser::MembershipExpressionContext* ctx) override {
-    antlrcpp::Any left_any = ctx->children[0]->accept(this);
-    std::string op = ctx->children[1]->getText();
-    antlrcpp::Any right_any = ctx->children[2]->accept(this);
+  StatusOr<std::shared_ptr<ExpressionNode>> CompileInvocationTerm(
+      const AstNode& node) {
+    if (node.type == AstNode::Type::kThis) {
+      return ToExpressionNode(
+          std::make_shared<ThisReference>(descriptor_stack_.back()));
+    }
 
-    if (!GetError().ok()) {
-      return nullptr;
+    if (node.type == AstNode::Type::kFunction) {
+      return CreateFunction(
+          node, std::make_shared<ThisReference>(descriptor_stack_.back()));
     }
 
-    auto left = left_any.as<std::shared_ptr<ExpressionNode>>();
-    auto right = right_any.as<std::shared_ptr<ExpressionNode>>();
+    const Descriptor* descriptor = descriptor_stack_.back();
 
-    if (op == "in") {
-      return ToAny(std::make_shared<ContainsOperator>(right, left));
-    } else if (op == "contains") {
-      return ToAny(std::make_shared<ContainsOperator>(left, right));
+    // If we know the return type of the expression, and the return type
+    // doesn't have the referenced field, return an error.
+    if (descriptor != nullptr && !HasFieldWithJsonName(descriptor, node.text)) {
+      return NotFoundError(absl::StrCat("Unable to find field ", node.text));
     }
 
-    SetError(InternalError(absl::StrCat("Unknown membership operator: ", op)));
-    return nullptr;
-  }
-
-  antlrcpp::Any visitMemberInvocation(
-      FhirPathParser::MemberInvocationContext* ctx) override {
-    std::string text = ctx->identifier()->IDENTIFIER()->getSymbol()->getText();
-    return std::make_shared<InvocationDefinition>(text, false);
+    const FieldDescriptor* field =
+        descriptor != nullptr &&
+                !IsMessageType<google::protobuf::Any>(descriptor)
+            ? FindFieldByJsonName(descriptor, node.text)
+            : nullptr;
+    return ToExpressionNode(std::make_shared<InvokeTermNode>(field, node.text));
   }
 
-  antlrcpp::Any visitFunctionInvocation(
-      FhirPathParser::FunctionInvocationContext* ctx) override {
-    if (!GetError().ok()) {
-      return nullptr;
-    }
-
-    std::string text = ctx->function()->identifier()->getText();
-    std::vector<FhirPathParser::ExpressionContext*> params;
-    if (ctx->function()->paramList()) {
-      params = ctx->function()->paramList()->expression();
-    }
+  StatusOr<std::shared_ptr<ExpressionNode>> CompileIndexerExpression(
+      const AstNode& node) {
+    FHIR_ASSIGN_OR_RETURN(std::shared_ptr<ExpressionNode> left,
+                          Compile(*node.children[0]));
+    FHIR_ASSIGN_OR_RETURN(std::shared_ptr<ExpressionNode> right,
+                          Compile(*node.children[1]));
 
-    return std::make_shared<InvocationDefinition>(text, true, params);
+    return ToExpressionNode(
+        std::make_shared<IndexerExpression>(primitive_handler_, left, right));
   }
 
-  antlrcpp::Any visitImpliesExpression(
-      FhirPathParser::ImpliesExpressionContext* ctx) override {
-    antlrcpp::Any left_any = ctx->children[0]->accept(this);
-    antlrcpp::Any right_any = ctx->children[2]->accept(this);
+  StatusOr<std::shared_ptr<ExpressionNode>> CompilePolarityExpression(
+      const AstNode& node) {
+    const std::string& op = node.text;
+    FHIR_ASSIGN_OR_RETURN(std::shared_ptr<ExpressionNode> operand,
+                          Compile(*node.children[0]));
 
-    if (!GetError().ok()) {
-      return nullptr;
+    if (op == "+") {
+      return ToExpressionNode(std::make_shared<PolarityOperator>(
+          PolarityOperator::kPositive, operand));
     }
 
-    auto left = left_any.as<std::shared_ptr<ExpressionNode>>();
-    auto right = right_any.as<std::shared_ptr<ExpressionNode>>();
+    if (op == "-") {
+      return ToExpressionNode(std::make_shared<PolarityOperator>(
+          PolarityOperator::kNegative, operand));
+    }
 
-    return ToAny(std::make_shared<ImpliesOperator>(left, right));
+    // The FHIRPath grammar does not define any additional polarity operators.
+    return InternalError(absl::StrCat("Unknown polarity operator: ", op));
   }
 
-  antlrcpp::Any visitOrExpression(
-      FhirPathParser::OrExpressionContext* ctx) override {
-    antlrcpp::Any left_any = ctx->children[0]->accept(this);
-    std::string op = ctx->children[1]->getText();
-    antlrcpp::Any right_any = ctx->children[2]->accept(this);
+  StatusOr<std::shared_ptr<ExpressionNode>> CompileTypeExpression(
+      const AstNode& node) {
+    const std::string& op = node.text;
+    FHIR_ASSIGN_OR_RETURN(std::shared_ptr<ExpressionNode> left,
+                          Compile(*node.children[0]));
 
-    if (!GetError().ok()) {
-      return nullptr;
+    if (op == "is") {
+      return ToExpressionNode(
+          std::make_shared<IsFunction>(left, node.type_name));
     }
 
-    auto left = left_any.as<std::shared_ptr<ExpressionNode>>();
-    auto right = right_any.as<std::shared_ptr<ExpressionNode>>();
+    if (op == "as") {
+      return ToExpressionNode(
+          std::make_shared<AsFunction>(left, node.type_name));
+    }
 
-    return op == "or"
-        ? ToAny(std::make_shared<OrOperator>(left, right))
-        : ToAny(std::make_shared<XorOperator>(left, right));
+    // The FHIRPath grammar does not define any additional type operators.
+    return InternalError(absl::StrCat("Unknown type operator: ", op));
   }
 
-  antlrcpp::Any visitAndExpression(
-      FhirPathParser::AndExpressionContext* ctx) override {
-    antlrcpp::Any left_any = ctx->children[0]->accept(this);
-    antlrcpp::Any right_any = ctx->children[2]->accept(this);
+  StatusOr<std::shared_ptr<ExpressionNode>> CompileBinaryExpression(
+      const AstNode& node) {
+    const std::string& op = node.text;
+    FHIR_ASSIGN_OR_RETURN(std::shared_ptr<ExpressionNode> left,
+                          Compile(*node.children[0]));
+    FHIR_ASSIGN_OR_RETURN(std::shared_ptr<ExpressionNode> right,
+                          Compile(*node.children[1]));
 
-    if (!GetError().ok()) {
-      return nullptr;
+    if (op == "*") {
+      return ToExpressionNode(
+          std::make_shared<MultiplicationOperator>(left, right));
+    }
+    if (op == "/" || op == "div" || op == "mod") {
+      // TODO: Support the remaining multiplicative operators.
+      return UnimplementedError(
+          absl::StrCat("'", op, "' operator is not supported yet."));
     }
 
-    auto left = left_any.as<std::shared_ptr<ExpressionNode>>();
-    auto right = right_any.as<std::shared_ptr<ExpressionNode>>();
-
-    return ToAny(std::make_shared<AndOperator>(left, right));
-  }
-
-  antlrcpp::Any visitParenthesizedTerm(
-      FhirPathParser::ParenthesizedTermContext* ctx) override {
-    // Simply propagate the value of the parenthesized term.
-    return ctx->children[1]->accept(this);
-  }
+    if (op == "+") {
+      return ToExpressionNode(std::make_shared<AdditionOperator>(left, right));
+    }
+    if (op == "&") {
+      return ToExpressionNode(std::make_shared<StrCatOperator>(left, right));
+    }
+    if (op == "-") {
+      // TODO: Support "-"
+      return UnimplementedError("'-' operator is not supported yet.");
+    }
 
-  antlrcpp::Any visitThisInvocation(
-      FhirPathParser::ThisInvocationContext* ctx) override {
-    return ToAny(std::make_shared<ThisReference>(descriptor_stack_.back()));
-  }
+    if (op == "|") {
+      return ToExpressionNode(std::make_shared<UnionOperator>(left, right));
+    }
 
-  antlrcpp::Any visitTotalInvocation(
-      FhirPathParser::TotalInvocationContext* ctx) override {
-    // TODO: Add support for $total.
-    SetError(UnimplementedError("$total is not implemented"));
-    return nullptr;
-  }
+    if (op == "<") {
+      return ToExpressionNode(std::make_shared<ComparisonOperator>(
+          left, right, ComparisonOperator::kLessThan));
+    }
+    if (op == ">") {
+      return ToExpressionNode(std::make_shared<ComparisonOperator>(
+          left, right, ComparisonOperator::kGreaterThan));
+    }
+    if (op == "<=") {
+      return ToExpressionNode(std::make_shared<ComparisonOperator>(
+          left, right, ComparisonOperator::kLessThanEqualTo));
+    }
+    if (op == ">=") {
+      return ToExpressionNode(std::make_shared<ComparisonOperator>(
+          left, right, ComparisonOperator::kGreaterThanEqualTo));
+    }
 
-  antlrcpp::Any visitIndexInvocation(
-      FhirPathParser::IndexInvocationContext* ctx) override {
-    // TODO: Add support for $index.
-    SetError(UnimplementedError("$index is not implemented"));
-    return nullptr;
+    if (op == "=") {
+      return ToExpressionNode(std::make_shared<EqualsOperator>(left, right));
+    }
+    if (op == "!=") {
+      // Negate the equals function to implement !=
+      auto equals_op = std::make_shared<EqualsOperator>(left, right);
+      return ToExpressionNode(std::make_shared<NotFunction>(equals_op));
+    }
+    if (op == "~" || op == "!~") {
+      return UnimplementedError(
+          "'~' and '!~' operators are not yet supported");
+    }
+
+    if (op == "in") {
+      return ToExpressionNode(std::make_shared<ContainsOperator>(right, left));
+    }
+    if (op == "contains") {
+      return ToExpressionNode(std::make_shared<ContainsOperator>(left, right));
+    }
+
+    if (op == "and") {
+      return ToExpressionNode(std::make_shared<AndOperator>(left, right));
+    }
+    if (op == "or") {
+      return ToExpressionNode(std::make_shared<OrOperator>(left, right));
+    }
+    if (op == "xor") {
+      return ToExpressionNode(std::make_shared<XorOperator>(left, right));
+    }
+    if (op == "implies") {
+      return ToExpressionNode(std::make_shared<ImpliesOperator>(left, right));
+    }
+
+    // The FHIRPath grammar does not define any additional binary operators.
+    return InternalError(absl::StrCat("Unknown binary operator: ", op));
   }
 
-  antlrcpp::Any visitExternalConstant(
-      FhirPathParser::ExternalConstantContext* ctx) override {
-    std::string name = ctx->children[1]->getText();
+  StatusOr<std::shared_ptr<ExpressionNode>> CompileExternalConstant(
+      const AstNode& node) {
+    const std::string& name = node.text;
     const PrimitiveHandler* primitive_handler = primitive_handler_;
     if (name == "ucum") {
-      return ToAny(std::make_shared<Literal>(
+      return ToExpressionNode(std::make_shared<Literal>(
           primitive_handler_->StringDescriptor(), [primitive_handler]() {
             return primitive_handler->NewString("http://unitsofmeasure.org");
           }));
     } else if (name == "sct") {
-      return ToAny(std::make_shared<Literal>(
+      return ToExpressionNode(std::make_shared<Literal>(
           primitive_handler_->StringDescriptor(), [primitive_handler]() {
             return primitive_handler->NewString("http://snomed.info/sct");
           }));
     } else if (name == "loinc") {
-      return ToAny(std::make_shared<Literal>(
+      return ToExpressionNode(std::make_shared<Literal>(
           primitive_handler_->StringDescriptor(), [primitive_handler]() {
             return primitive_handler->NewString("http://loinc.org");
           }));
     } else if (name == "context") {
-      return ToAny(
+      return ToExpressionNode(
           std::make_shared<ContextReference>(descriptor_stack_.front()));
     } else if (name == "resource") {
-      return ToAny(std::make_shared<ResourceReference>());
+      return ToExpressionNode(std::make_shared<ResourceReference>());
     } else if (name == "rootResource") {
       // TODO: Add suport for %rootResource
-      SetError(UnimplementedError("%rootResource is not implemented"));
+      return UnimplementedError("%rootResource is not implemented");
     } else if (absl::StartsWith(name, "vs-")) {
       // TODO: Add support for %vs-[name]
-      SetError(UnimplementedError("%vs-[name] is not implemented"));
+      return UnimplementedError("%vs-[name] is not implemented");
     } else if (absl::StartsWith(name, "ext-")) {
       // TODO: Add support for %ext-[name]
-      SetError(UnimplementedError("%ext-[name] is not implemented"));
-    } else {
-      SetError(
-          NotFoundError(absl::StrCat("Unknown external constant: ", name)));
+      return UnimplementedError("%ext-[name] is not implemented");
     }
 
-    return nullptr;
+    return NotFoundError(absl::StrCat("Unknown external constant: ", name));
   }
 
   StatusOr<std::shared_ptr<Literal>> ParseDateTime(absl::string_view text) {
@@ -3559,38 +4958,24 @@ class FhirPathCompilerVisitor : public FhirPathBaseVisitor {
         });
   }
 
-  antlrcpp::Any visitDateTimeLiteral(
-      FhirPathParser::DateTimeLiteralContext* ctx) override {
-    StatusOr<std::shared_ptr<Literal>> status_or_date_time_literal =
-        ParseDateTime(ctx->getText());
-    if (status_or_date_time_literal.ok()) {
-      return ToAny(status_or_date_time_literal.ValueOrDie());
-    } else {
-      SetError(status_or_date_time_literal.status());
-      return nullptr;
-    }
-  }
-
-  antlrcpp::Any visitNumberLiteral(
-      FhirPathParser::NumberLiteralContext* ctx) override {
-    const std::string& text = ctx->getText();
+  StatusOr<std::shared_ptr<ExpressionNode>> CompileNumberLiteral(
+      const AstNode& node) {
+    const std::string& text = node.text;
     const PrimitiveHandler* primitive_handler = primitive_handler_;
     // Determine if the number is an integer or decimal, propagating
     // decimal types in string form to preserve precision.
     if (text.find(".") != std::string::npos) {
-      return ToAny(std::make_shared<Literal>(
+      return ToExpressionNode(std::make_shared<Literal>(
           primitive_handler_->DecimalDescriptor(), [primitive_handler, text]() {
             return primitive_handler->NewDecimal(text);
           }));
     } else {
       int32_t value;
       if (!absl::SimpleAtoi(text, &value)) {
-        SetError(
-            InvalidArgumentError(absl::StrCat("Malformed integer ", text)));
-        return nullptr;
+        return InvalidArgumentError(absl::StrCat("Malformed integer ", text));
       }
 
-      return ToAny(std::make_shared<Literal>(
+      return ToExpressionNode(std::make_shared<Literal>(
           primitive_handler_->IntegerDescriptor(),
           [primitive_handler, value]() {
             return primitive_handler->NewInteger(value);
@@ -3598,244 +4983,1349 @@ class FhirPathCompilerVisitor : public FhirPathBaseVisitor {
     }
   }
 
-  antlrcpp::Any visitStringLiteral(
-      FhirPathParser::StringLiteralContext* ctx) override {
-    const std::string& text = ctx->getText();
+  StatusOr<std::shared_ptr<ExpressionNode>> CompileStringLiteral(
+      const AstNode& node) {
+    const std::string& text = node.text;
     const PrimitiveHandler* primitive_handler = primitive_handler_;
-    // The lexer keeps the quotes around string literals,
+    // The parser keeps the quotes around string literals,
     // so we remove them here. The following assert simply reflects
-    // the lexer's guarantees as defined.
+    // the parser's guarantees as defined.
     assert(text.length() >= 2);
     const std::string& trimmed = text.substr(1, text.length() - 2);
     std::string unescaped;
     // CUnescape handles additional escape sequences not allowed by
     // FHIRPath. However, these additional sequences are disallowed by the
-    // grammar rules (FhirPath.g4) which are enforced by the parser. In
+    // grammar rules which are enforced by the parser. In
     // addition, CUnescape does not handle escaped forward slashes.
     absl::CUnescape(trimmed, &unescaped);
-    return ToAny(std::make_shared<Literal>(
+    return ToExpressionNode(std::make_shared<Literal>(
         primitive_handler_->StringDescriptor(),
         [primitive_handler, unescaped]() {
           return primitive_handler->NewString(unescaped);
         }));
   }
 
-  antlrcpp::Any visitBooleanLiteral(
-      FhirPathParser::BooleanLiteralContext* ctx) override {
-    const bool value = ctx->getText() == "true";
+  StatusOr<std::shared_ptr<ExpressionNode>> CompileBooleanLiteral(
+      const AstNode& node) {
+    const bool value = node.text == "true";
     const PrimitiveHandler* primitive_handler = primitive_handler_;
 
-    return ToAny(std::make_shared<Literal>(
+    return ToExpressionNode(std::make_shared<Literal>(
         primitive_handler_->BooleanDescriptor(), [primitive_handler, value]() {
           return primitive_handler->NewBoolean(value);
         }));
   }
 
-  antlrcpp::Any visitNullLiteral(
-      FhirPathParser::NullLiteralContext* ctx) override {
-    return ToAny(std::make_shared<EmptyLiteral>());
+  // The factories of the supported FHIRPath functions, by name. The map is
+  // shared by all compilers since one is created for every function call.
+  static const std::map<std::string, FunctionFactory>& FunctionMap() {
+    static const auto* function_map =
+        new std::map<std::string, FunctionFactory>{
+            {"exists", FunctionNode::Create<ExistsFunction>},
+            {"not", FunctionNode::Create<NotFunction>},
+            {"hasValue", FunctionNode::Create<HasValueFunction>},
+            {"startsWith", FunctionNode::Create<StartsWithFunction>},
+            {"contains", FunctionNode::Create<ContainsFunction>},
+            {"empty", FunctionNode::Create<EmptyFunction>},
+            {"first", FunctionNode::Create<FirstFunction>},
+            {"tail", FunctionNode::Create<TailFunction>},
+            {"trace", FunctionNode::Create<TraceFunction>},
+            {"toInteger", FunctionNode::Create<ToIntegerFunction>},
+            {"count", FunctionNode::Create<CountFunction>},
+            {"combine", FunctionNode::Create<CombineFunction>},
+            {"distinct", FunctionNode::Create<DistinctFunction>},
+            {"matches", FunctionNode::Create<MatchesFunction>},
+            {"replaceMatches", FunctionNode::Create<ReplaceMatchesFunction>},
+            {"length", FunctionNode::Create<LengthFunction>},
+            {"isDistinct", FunctionNode::Create<IsDistinctFunction>},
+            {"intersect", FunctionNode::Create<IntersectFunction>},
+            {"where", FunctionNode::Create<WhereFunction>},
+            {"select", FunctionNode::Create<SelectFunction>},
+            {"all", FunctionNode::Create<AllFunction>},
+            {"toString", FunctionNode::Create<ToStringFunction>},
+            {"iif", FunctionNode::Create<IifFunction>},
+            {"is", IsFunction::Create},
+            {"as", AsFunction::Create},
+            {"ofType", OfTypeFunction::Create},
+            {"children", FunctionNode::Create<ChildrenFunction>},
+            {"descendants", FunctionNode::Create<DescendantsFunction>},
+            {"allTrue", FunctionNode::Create<AllTrueFunction>},
+            {"anyTrue", CreateAnyTrueFunction},
+            {"allFalse", FunctionNode::Create<AllFalseFunction>},
+            {"anyFalse", CreateAnyFalseFunction},
+            {"subsetOf", UnimplementedFunction},
+            {"supersetOf", UnimplementedFunction},
+            {"repeat", UnimplementedFunction},
+            {"single", FunctionNode::Create<SingleFunction>},
+            {"last", FunctionNode::Create<LastFunction>},
+            {"skip", FunctionNode::Create<SkipFunction>},
+            {"take", FunctionNode::Create<TakeFunction>},
+            {"exclude", UnimplementedFunction},
+            {"union", CreateUnionFunction},
+            {"convertsToBoolean", UnimplementedFunction},
+            {"toBoolean", UnimplementedFunction},
+            {"convertsToInteger", UnimplementedFunction},
+            {"convertsToDate", UnimplementedFunction},
+            {"toDate", UnimplementedFunction},
+            {"convertsToDateTime", UnimplementedFunction},
+            {"toDateTime", UnimplementedFunction},
+            {"convertsToDecimal", UnimplementedFunction},
+            {"toDecimal", UnimplementedFunction},
+            {"convertsToQuantity", UnimplementedFunction},
+            {"toQuantity", UnimplementedFunction},
+            {"convertsToString", UnimplementedFunction},
+            {"convertsToTime", UnimplementedFunction},
+            {"toTime", UnimplementedFunction},
+            {"indexOf", FunctionNode::Create<IndexOfFunction>},
+            {"substring", UnimplementedFunction},
+            {"upper", FunctionNode::Create<UpperFunction>},
+            {"lower", FunctionNode::Create<LowerFunction>},
+            {"replace", FunctionNode::Create<ReplaceFunction>},
+            {"endsWith", FunctionNode::Create<EndsWithFunction>},
+            {"toChars", UnimplementedFunction},
+            {"today", UnimplementedFunction},
+            {"now", UnimplementedFunction},
+            {"getValue", UnimplementedFunction},
+            {"elementDefinition", UnimplementedFunction},
+            {"slice", UnimplementedFunction},
+            {"checkModifiers", UnimplementedFunction},
+            {"memberOf", CreateMemberOfFunction},
+            {"subsumes", UnimplementedFunction},
+            {"subsumedBy", UnimplementedFunction},
+        };
+    return *function_map;
+  }
+
+  // Returns an ExpressionNode that implements the FHIRPath function called by
+  // the given kFunction node.
+  StatusOr<std::shared_ptr<ExpressionNode>> CreateFunction(
+      const AstNode& function,
+      std::shared_ptr<ExpressionNode> child_expression) {
+    const std::string& function_name = function.text;
+    auto function_factory = FunctionMap().find(function_name);
+    if (function_factory == FunctionMap().end()) {
+      return NotFoundError(
+          absl::StrCat("The function ", function_name, " does not exist."));
+    }
+
+    std::vector<const AstNode*> params;
+    params.reserve(function.children.size());
+    for (const std::unique_ptr<AstNode>& param : function.children) {
+      params.push_back(param.get());
+    }
+
+    // Some functions accept parameters that are expressions evaluated using
+    // the child expression's result as context, not the base context of the
+    // FHIRPath expression. In order to compile such parameters, we need to
+    // compile it with the child expression's type and not the base type of the
+    // current compiler. Therefore, both the current compiler and a compiler
+    // with the child expression as the context are provided. The function
+    // factory will use whichever compiler (or both) is needed to compile the
+    // function invocation.
+    FhirPathCompiler child_context_compiler(
+        descriptor_stack_, child_expression->ReturnType(), primitive_handler_);
+    child_context_compiler.profile_ = profile_;
+    child_context_compiler.profile_depth_ = profile_depth_;
+    child_context_compiler.terminology_ = terminology_;
+    StatusOr<ExpressionNode*> result = function_factory->second(
+        child_expression, params, this, &child_context_compiler);
+    if (!result.ok()) {
+      return InvalidArgumentError(
+          absl::StrCat("Failed to compile call to ", function_name,
+                       "(): ", result.status().message()));
+    }
+
+    return std::shared_ptr<ExpressionNode>(result.ValueOrDie());
   }
 
-  antlrcpp::Any visitTerminal(TerminalNode* node) override {
-    switch (node->getSymbol()->getType()) {
-      case FhirPathLexer::DATE:
-        // TODO: Add support for Date literals.
-        SetError(UnimplementedError("Date literals are not yet supported."));
-        return nullptr;
+  // Compiles the subexpression rooted at the given node with the provided
+  // function, or returns the existing compiled form of an identical
+  // subexpression if subexpressions are being shared. See
+  // ShareSubexpressions.
+  StatusOr<std::shared_ptr<ExpressionNode>> CompileShared(
+      const AstNode& node,
+      const std::function<StatusOr<std::shared_ptr<ExpressionNode>>()>&
+          compile) {
+    // Subexpressions compiled in the context of a function's input are
+    // evaluated in a different context for each input, so their results
+    // cannot be reused.
+    if (shared_subexpressions_ == nullptr || descriptor_stack_.size() != 1) {
+      return compile();
+    }
 
-      case FhirPathLexer::TIME:
-        // TODO: Add spport for time literals.
-        SetError(UnimplementedError("Time literals are not yet supported."));
-        return nullptr;
+    std::string key = node.Key();
+    auto shared = shared_subexpressions_->find(key);
+    if (shared != shared_subexpressions_->end()) {
+      std::static_pointer_cast<SharedSubexpression>(shared->second)
+          ->MarkShared();
+      return shared->second;
+    }
+
+    FHIR_ASSIGN_OR_RETURN(std::shared_ptr<ExpressionNode> result, compile());
+    auto shared_expression = std::make_shared<SharedSubexpression>(result);
+    (*shared_subexpressions_)[key] = shared_expression;
+    return ToExpressionNode(shared_expression);
+  }
+
+  std::vector<const Descriptor*> descriptor_stack_;
+  const PrimitiveHandler* primitive_handler_;
+  std::map<std::string, std::shared_ptr<ExpressionNode>>*
+      shared_subexpressions_ = nullptr;
+
+  ExpressionProfile* profile_ = nullptr;
+  // The depth in the syntax tree of the next subexpression to be compiled.
+  int profile_depth_ = 0;
+  const TerminologyIndex* terminology_ = nullptr;
+};
+
+// Determines the fields of the message an expression is evaluated against
+// (the context message) that the expression reads, from its syntax tree.
+class ContextFieldAnalysis {
+ public:
+  explicit ContextFieldAnalysis(const Descriptor* descriptor)
+      : descriptor_(descriptor) {}
+
+  // Adds the fields of the context message read by the subexpression, which is
+  // evaluated against the context message, to the set. Returns false if the
+  // subexpression depends on the context message other than through the
+  // values of its fields.
+  bool AddContextReads(const AstNode& node, FieldSet* fields) const {
+    switch (node.type) {
+      case AstNode::Type::kIdentifier: {
+        const FieldDescriptor* field =
+            IsMessageType<google::protobuf::Any>(descriptor_)
+                ? nullptr
+                : FindFieldByJsonName(descriptor_, node.text);
+        if (field == nullptr) {
+          return false;
+        }
+        fields->insert(field);
+        return true;
+      }
+
+      // $this, and functions whose input is $this, see the whole message.
+      case AstNode::Type::kFunction:
+      case AstNode::Type::kThis:
+      case AstNode::Type::kIndex:
+      case AstNode::Type::kTotal:
+        return false;
+
+      case AstNode::Type::kExternalConstant:
+        return IsConstant(node);
+
+      case AstNode::Type::kInvocation: {
+        if (!AddContextReads(*node.children[0], fields)) {
+          return false;
+        }
+        // Members of the elements read so far are nested in fields that have
+        // already been added.
+        const AstNode& invocation = *node.children[1];
+        if (invocation.type != AstNode::Type::kFunction) {
+          return true;
+        }
+        const std::string& name = invocation.text;
+        // The parameters of these functions are type specifiers.
+        if (name == "is" || name == "as" || name == "ofType") {
+          return true;
+        }
+        for (int i = 0; i < invocation.children.size(); ++i) {
+          // As in the CompileParams of the functions, these parameters are
+          // evaluated against the elements of the function's input, and the
+          // others against the context message.
+          const bool element_context =
+              name == "where" || name == "select" || name == "all" ||
+              (name == "iif" && i == 0);
+          if (element_context ? !IsSelfContained(*invocation.children[i])
+                              : !AddContextReads(*invocation.children[i],
+                                                 fields)) {
+            return false;
+          }
+        }
+        return true;
+      }
 
       default:
-        SetError(InternalError(absl::StrCat("Unknown terminal type: ",
-                                            node->getSymbol()->getText())));
-        return nullptr;
+        for (const std::unique_ptr<AstNode>& child : node.children) {
+          if (!AddContextReads(*child, fields)) {
+            return false;
+          }
+        }
+        return true;
+    }
+  }
+
+ private:
+  // Returns true if the external constant is a literal, such as %ucum.
+  static bool IsConstant(const AstNode& node) {
+    return node.text == "ucum" || node.text == "sct" || node.text == "loinc";
+  }
+
+  // Returns true if the subexpression, which is evaluated against elements
+  // nested in the context message, reads nothing but those elements and
+  // constants. Unlike %context and %resource, $this is the element.
+  static bool IsSelfContained(const AstNode& node) {
+    if (node.type == AstNode::Type::kExternalConstant) {
+      return IsConstant(node);
     }
+    return std::all_of(node.children.begin(), node.children.end(),
+                       [](const std::unique_ptr<AstNode>& child) {
+                         return IsSelfContained(*child);
+                       });
   }
 
-  antlrcpp::Any visitErrorNode(antlr4::tree::ErrorNode* node) override {
-    SetError(InternalError(
-        absl::StrCat("Unknown error encountered: ", node->toString())));
+  const Descriptor* descriptor_;
+};
+
+// Returns the fields of messages of the given type that the expression reads,
+// in field number order, or null if they are not statically known. See
+// CompiledExpression::context_fields.
+std::shared_ptr<const std::vector<const FieldDescriptor*>> ContextFields(
+    const Descriptor* descriptor, const AstNode& root) {
+  FieldSet fields;
+  if (!ContextFieldAnalysis(descriptor).AddContextReads(root, &fields)) {
     return nullptr;
   }
+  auto sorted = std::make_shared<std::vector<const FieldDescriptor*>>(
+      fields.begin(), fields.end());
+  std::sort(sorted->begin(), sorted->end(),
+            [](const FieldDescriptor* a, const FieldDescriptor* b) {
+              return a->number() < b->number();
+            });
+  return sorted;
+}
+
+// Parses and compiles the given FHIRPath expression against the descriptor,
+// as configured by the options. If shared_subexpressions is not null,
+// subexpressions are shared with other expressions compiled with the same map.
+// The fields the expression reads are stored in context_fields.
+StatusOr<std::shared_ptr<ExpressionNode>> CompileFhirPath(
+    const Descriptor* descriptor, const PrimitiveHandler* primitive_handler,
+    const std::string& fhir_path, const CompileOptions& options,
+    std::map<std::string, std::shared_ptr<ExpressionNode>>*
+        shared_subexpressions,
+    std::shared_ptr<const std::vector<const FieldDescriptor*>>*
+        context_fields) {
+  const AstNode* root = options.parsed_expressions != nullptr
+                            ? options.parsed_expressions->Find(fhir_path)
+                            : nullptr;
+  std::unique_ptr<AstNode> parsed;
+  if (root == nullptr) {
+    FHIR_ASSIGN_OR_RETURN(parsed, ParseFhirPath(fhir_path));
+    root = parsed.get();
+  }
+  *context_fields = ContextFields(descriptor, *root);
+
+  FhirPathCompiler compiler(descriptor, primitive_handler);
+  compiler.UseTerminology(options.terminology);
+  if (shared_subexpressions != nullptr) {
+    compiler.ShareSubexpressions(shared_subexpressions);
+  }
+  if (options.profiler == nullptr) {
+    return compiler.Compile(*root);
+  }
+
+  // Expressions are only registered with the profiler once they compile.
+  auto profile = absl::make_unique<ExpressionProfile>(descriptor, fhir_path);
+  compiler.Profile(profile.get());
+  FHIR_ASSIGN_OR_RETURN(std::shared_ptr<ExpressionNode> expression,
+                        compiler.Compile(*root));
+  options.profiler->AddExpression(std::move(profile));
+  return expression;
+}
+
+// The collections produced by a subexpression for each of a sequence of
+// contexts (e.g. the messages of a batch), stored as a single column. The
+// elements produced for context i are elements[offsets[i]] up to, but not
+// including, elements[offsets[i + 1]].
+struct Column {
+  std::vector<uint32_t> offsets = {0};
+  std::vector<const Message*> elements;
+
+  // The (context, status) pairs of the contexts whose evaluation failed,
+  // ordered by context. Evaluation fails after producing the elements
+  // recorded for the context, so functions that stop reading their input
+  // early, like exists(), may still succeed. See ExpressionNode::Stream.
+  std::vector<std::pair<size_t, Status>> errors;
+
+  size_t size() const { return offsets.size() - 1; }
+
+  uint32_t count(size_t context) const {
+    return offsets[context + 1] - offsets[context];
+  }
 
-  antlrcpp::Any defaultResult() override { return nullptr; }
+  // Ends the collection of the next context.
+  void EndContext() { offsets.push_back(elements.size()); }
+};
 
-  absl::Status GetError() { return error_; }
+// The results of a boolean subexpression for each of a sequence of contexts.
+// Each value is one of the constants below.
+struct BooleanColumn {
+  static constexpr uint8_t kFalse = 0;
+  static constexpr uint8_t kTrue = 1;
+  // The empty collection.
+  static constexpr uint8_t kEmpty = 2;
+  // Evaluation failed with the status recorded in errors.
+  static constexpr uint8_t kError = 3;
+
+  explicit BooleanColumn(size_t size) : values(size, kEmpty) {}
+
+  void SetError(size_t context, Status status) {
+    values[context] = kError;
+    errors.emplace_back(context, std::move(status));
+  }
 
-  BaseErrorListener* GetErrorListener() { return &error_listener_; }
+  std::vector<uint8_t> values;
+
+  // The (context, status) pairs of the contexts whose value is kError,
+  // ordered by context.
+  std::vector<std::pair<size_t, Status>> errors;
+};
+
+constexpr uint8_t BooleanColumn::kFalse;
+constexpr uint8_t BooleanColumn::kTrue;
+constexpr uint8_t BooleanColumn::kEmpty;
+constexpr uint8_t BooleanColumn::kError;
+
+// Returns the status recorded for the context, which must have failed.
+const Status& ErrorAt(const std::vector<std::pair<size_t, Status>>& errors,
+                      size_t context) {
+  return std::lower_bound(errors.begin(), errors.end(), context,
+                          [](const std::pair<size_t, Status>& error,
+                             size_t context) { return error.first < context; })
+      ->second;
+}
+
+// Fails every context of a column-wise operator whose input failed. Unlike
+// exists(), operators read their whole input, so the elements produced before
+// the failure do not matter.
+void PropagateErrors(const Column& input, BooleanColumn* result) {
+  for (const std::pair<size_t, Status>& error : input.errors) {
+    result->SetError(error.first, error.second);
+  }
+}
+
+// A subexpression producing a collection, evaluated column-wise. See
+// ColumnarExpression.
+class ColumnarCollection {
+ public:
+  virtual ~ColumnarCollection() {}
+
+  // Evaluates the subexpression with each of the contexts as $this.
+  virtual Column Evaluate(
+      absl::Span<const Message* const> contexts) const = 0;
+};
+
+// A subexpression producing a single boolean or the empty collection,
+// evaluated column-wise. See ColumnarExpression.
+class ColumnarPredicate {
+ public:
+  virtual ~ColumnarPredicate() {}
+
+  // Evaluates the subexpression with each of the contexts as $this.
+  virtual BooleanColumn Evaluate(
+      absl::Span<const Message* const> contexts) const = 0;
+};
+
+// $this, or the input of a field navigation or function invocation that has
+// no explicit input.
+class ColumnarThis : public ColumnarCollection {
+ public:
+  Column Evaluate(absl::Span<const Message* const> contexts) const override {
+    Column column;
+    column.elements.assign(contexts.begin(), contexts.end());
+    column.offsets.resize(contexts.size() + 1);
+    for (size_t i = 0; i < column.offsets.size(); ++i) {
+      column.offsets[i] = i;
+    }
+    return column;
+  }
+};
+
+// The values of a field of each element of the input.
+class ColumnarField : public ColumnarCollection {
+ public:
+  ColumnarField(std::shared_ptr<const ColumnarCollection> input,
+                const FieldDescriptor* field)
+      : input_(std::move(input)), field_(field) {}
+
+  Column Evaluate(absl::Span<const Message* const> contexts) const override {
+    Column input = input_->Evaluate(contexts);
+
+    Column column;
+    column.offsets.reserve(input.offsets.size());
+    column.elements.reserve(input.elements.size());
+    for (size_t context = 0; context < input.size(); ++context) {
+      for (uint32_t i = input.offsets[context]; i < input.offsets[context + 1];
+           ++i) {
+        const Message& message = *input.elements[i];
+        const int size = PotentiallyRepeatedFieldSize(message, field_);
+        for (int j = 0; j < size; ++j) {
+          column.elements.push_back(
+              &GetPotentiallyRepeatedMessage(message, field_, j));
+        }
+      }
+      column.EndContext();
+    }
+    column.errors = std::move(input.errors);
+    return column;
+  }
 
  private:
-  typedef std::function<StatusOr<ExpressionNode*>(
-      std::shared_ptr<ExpressionNode>,
-      const std::vector<FhirPathParser::ExpressionContext*>&,
-      FhirPathBaseVisitor*, FhirPathBaseVisitor*)>
-      FunctionFactory;
+  const std::shared_ptr<const ColumnarCollection> input_;
+  const FieldDescriptor* const field_;
+};
 
-  std::map<std::string, FunctionFactory> function_map_{
-      {"exists", FunctionNode::Create<ExistsFunction>},
-      {"not", FunctionNode::Create<NotFunction>},
-      {"hasValue", FunctionNode::Create<HasValueFunction>},
-      {"startsWith", FunctionNode::Create<StartsWithFunction>},
-      {"contains", FunctionNode::Create<ContainsFunction>},
-      {"empty", FunctionNode::Create<EmptyFunction>},
-      {"first", FunctionNode::Create<FirstFunction>},
-      {"tail", FunctionNode::Create<TailFunction>},
-      {"trace", FunctionNode::Create<TraceFunction>},
-      {"toInteger", FunctionNode::Create<ToIntegerFunction>},
-      {"count", FunctionNode::Create<CountFunction>},
-      {"combine", FunctionNode::Create<CombineFunction>},
-      {"distinct", FunctionNode::Create<DistinctFunction>},
-      {"matches", FunctionNode::Create<MatchesFunction>},
-      {"replaceMatches", FunctionNode::Create<ReplaceMatchesFunction>},
-      {"length", FunctionNode::Create<LengthFunction>},
-      {"isDistinct", FunctionNode::Create<IsDistinctFunction>},
-      {"intersect", FunctionNode::Create<IntersectFunction>},
-      {"where", FunctionNode::Create<WhereFunction>},
-      {"select", FunctionNode::Create<SelectFunction>},
-      {"all", FunctionNode::Create<AllFunction>},
-      {"toString", FunctionNode::Create<ToStringFunction>},
-      {"iif", FunctionNode::Create<IifFunction>},
-      {"is", IsFunction::Create},
-      {"as", AsFunction::Create},
-      {"ofType", OfTypeFunction::Create},
-      {"children", FunctionNode::Create<ChildrenFunction>},
-      {"descendants", FunctionNode::Create<DescendantsFunction>},
-      {"allTrue", FunctionNode::Create<AllTrueFunction>},
-      {"anyTrue", CreateAnyTrueFunction},
-      {"allFalse", FunctionNode::Create<AllFalseFunction>},
-      {"anyFalse", CreateAnyFalseFunction},
-      {"subsetOf", UnimplementedFunction},
-      {"supersetOf", UnimplementedFunction},
-      {"repeat", UnimplementedFunction},
-      {"single", FunctionNode::Create<SingleFunction>},
-      {"last", FunctionNode::Create<LastFunction>},
-      {"skip", FunctionNode::Create<SkipFunction>},
-      {"take", FunctionNode::Create<TakeFunction>},
-      {"exclude", UnimplementedFunction},
-      {"union", CreateUnionFunction},
-      {"convertsToBoolean", UnimplementedFunction},
-      {"toBoolean", UnimplementedFunction},
-      {"convertsToInteger", UnimplementedFunction},
-      {"convertsToDate", UnimplementedFunction},
-      {"toDate", UnimplementedFunction},
-      {"convertsToDateTime", UnimplementedFunction},
-      {"toDateTime", UnimplementedFunction},
-      {"convertsToDecimal", UnimplementedFunction},
-      {"toDecimal", UnimplementedFunction},
-      {"convertsToQuantity", UnimplementedFunction},
-      {"toQuantity", UnimplementedFunction},
-      {"convertsToString", UnimplementedFunction},
-      {"convertsToTime", UnimplementedFunction},
-      {"toTime", UnimplementedFunction},
-      {"indexOf", FunctionNode::Create<IndexOfFunction>},
-      {"substring", UnimplementedFunction},
-      {"upper", FunctionNode::Create<UpperFunction>},
-      {"lower", FunctionNode::Create<LowerFunction>},
-      {"replace", FunctionNode::Create<ReplaceFunction>},
-      {"endsWith", FunctionNode::Create<EndsWithFunction>},
-      {"toChars", UnimplementedFunction},
-      {"today", UnimplementedFunction},
-      {"now", UnimplementedFunction},
-      {"getValue", UnimplementedFunction},
-      {"elementDefinition", UnimplementedFunction},
-      {"slice", UnimplementedFunction},
-      {"checkModifiers", UnimplementedFunction},
-      {"memberOf", UnimplementedFunction},
-      {"subsumes", UnimplementedFunction},
-      {"subsumedBy", UnimplementedFunction},
-  };
+// The elements of the input that meet the criteria.
+class ColumnarWhere : public ColumnarCollection {
+ public:
+  ColumnarWhere(std::shared_ptr<const ColumnarCollection> input,
+                std::shared_ptr<const ColumnarPredicate> criteria)
+      : input_(std::move(input)), criteria_(std::move(criteria)) {}
+
+  Column Evaluate(absl::Span<const Message* const> contexts) const override {
+    Column input = input_->Evaluate(contexts);
+    // The criteria is evaluated with every element of the input as a context
+    // of its own.
+    BooleanColumn criteria = criteria_->Evaluate(input.elements);
+
+    Column column;
+    column.offsets.reserve(input.offsets.size());
+    auto input_error = input.errors.begin();
+    for (size_t context = 0; context < input.size(); ++context) {
+      bool failed = false;
+      for (uint32_t i = input.offsets[context]; i < input.offsets[context + 1];
+           ++i) {
+        if (criteria.values[i] == BooleanColumn::kTrue) {
+          column.elements.push_back(input.elements[i]);
+        } else if (criteria.values[i] == BooleanColumn::kError) {
+          column.errors.emplace_back(context, ErrorAt(criteria.errors, i));
+          failed = true;
+          break;
+        }
+      }
+      if (input_error != input.errors.end() && input_error->first == context) {
+        if (!failed) {
+          column.errors.push_back(std::move(*input_error));
+        }
+        ++input_error;
+      }
+      column.EndContext();
+    }
+    return column;
+  }
+
+ private:
+  const std::shared_ptr<const ColumnarCollection> input_;
+  const std::shared_ptr<const ColumnarPredicate> criteria_;
+};
+
+// exists() or empty().
+class ColumnarExists : public ColumnarPredicate {
+ public:
+  ColumnarExists(std::shared_ptr<const ColumnarCollection> input, bool empty)
+      : input_(std::move(input)), empty_(empty) {}
+
+  BooleanColumn Evaluate(
+      absl::Span<const Message* const> contexts) const override {
+    Column input = input_->Evaluate(contexts);
+
+    BooleanColumn result(input.size());
+    const uint8_t empty = empty_;
+    for (size_t context = 0; context < input.size(); ++context) {
+      result.values[context] =
+          (input.offsets[context + 1] != input.offsets[context]) ^ empty;
+    }
 
-  // Returns an ExpressionNode that implements the specified FHIRPath function.
-  std::shared_ptr<ExpressionNode> createFunction(
-      const std::string& function_name,
-      std::shared_ptr<ExpressionNode> child_expression,
-      const std::vector<FhirPathParser::ExpressionContext*>& params) {
-    std::map<std::string, FunctionFactory>::iterator function_factory =
-        function_map_.find(function_name);
-    if (function_factory != function_map_.end()) {
-      // Some functions accept parameters that are expressions evaluated using
-      // the child expression's result as context, not the base context of the
-      // FHIRPath expression. In order to compile such parameters, we need to
-      // visit it with the child expression's type and not the base type of the
-      // current visitor. Therefore, both the current visitor and a visitor with
-      // the child expression as the context are provided. The function factory
-      // will use whichever visitor (or both) is needed to compile the function
-      // invocation.
-      FhirPathCompilerVisitor child_context_visitor(
-          descriptor_stack_, child_expression->ReturnType(),
-          primitive_handler_);
-      StatusOr<ExpressionNode*> result = function_factory->second(
-          child_expression, params, this, &child_context_visitor);
-      if (!result.ok()) {
-        this->SetError(absl::InvalidArgumentError(absl::StrCat(
-            "Failed to compile call to ", function_name,
-            "(): ", result.status().message(),
-            !child_context_visitor.GetError().ok()
-                ? absl::StrCat("; ", child_context_visitor.GetError().message())
-                : "")));
-        return std::shared_ptr<ExpressionNode>(nullptr);
+    // Both functions stop reading their input at its first element.
+    for (std::pair<size_t, Status>& error : input.errors) {
+      if (input.count(error.first) == 0) {
+        result.SetError(error.first, std::move(error.second));
       }
+    }
+    return result;
+  }
 
-      return std::shared_ptr<ExpressionNode>(result.ValueOrDie());
-    } else {
-      SetError(NotFoundError(
-          absl::StrCat("The function ", function_name, " does not exist.")));
+ private:
+  const std::shared_ptr<const ColumnarCollection> input_;
+  const bool empty_;
+};
 
-      return std::shared_ptr<ExpressionNode>(nullptr);
+// not() of a boolean subexpression.
+class ColumnarNot : public ColumnarPredicate {
+ public:
+  explicit ColumnarNot(std::shared_ptr<const ColumnarPredicate> input)
+      : input_(std::move(input)) {}
+
+  BooleanColumn Evaluate(
+      absl::Span<const Message* const> contexts) const override {
+    BooleanColumn result = input_->Evaluate(contexts);
+    for (uint8_t& value : result.values) {
+      value = value < BooleanColumn::kEmpty ? value ^ 1 : value;
     }
+    return result;
   }
 
-  // ANTLR listener to report syntax errors.
-  class FhirPathErrorListener : public BaseErrorListener {
-   public:
-    explicit FhirPathErrorListener(FhirPathCompilerVisitor* visitor)
-        : visitor_(visitor) {}
+ private:
+  const std::shared_ptr<const ColumnarPredicate> input_;
+};
 
-    void syntaxError(antlr4::Recognizer* recognizer,
-                     antlr4::Token* offending_symbol, size_t line,
-                     size_t position_in_line, const std::string& message,
-                     std::exception_ptr e) override {
-      visitor_->SetError(absl::InvalidArgumentError(message));
+// A collection used where a boolean is expected, such as the operand of
+// "and". See BooleanOrEmpty.
+class ColumnarBooleanOrEmpty : public ColumnarPredicate {
+ public:
+  explicit ColumnarBooleanOrEmpty(
+      std::shared_ptr<const ColumnarCollection> input)
+      : input_(std::move(input)) {}
+
+  BooleanColumn Evaluate(
+      absl::Span<const Message* const> contexts) const override {
+    Column input = input_->Evaluate(contexts);
+
+    BooleanColumn result(input.size());
+    auto input_error = input.errors.begin();
+    for (size_t context = 0; context < input.size(); ++context) {
+      const uint32_t count = input.count(context);
+      if (input_error != input.errors.end() && input_error->first == context) {
+        result.SetError(context, std::move(input_error->second));
+        ++input_error;
+      } else if (count > 1) {
+        result.SetError(context,
+                        InvalidArgumentError("Expression must be empty or "
+                                             "contain a single value."));
+      } else if (count == 1) {
+        absl::optional<SystemValue> value = SystemValue::FromMessage(
+            *input.elements[input.offsets[context]]);
+        result.values[context] =
+            !value.has_value() ||
+            value->type() != SystemValue::Type::kBoolean ||
+            value->boolean_value();
+      }
     }
+    return result;
+  }
 
-   private:
-    FhirPathCompilerVisitor* visitor_;
+ private:
+  const std::shared_ptr<const ColumnarCollection> input_;
+};
+
+// "=" or "!=" between a collection and a literal.
+class ColumnarEquals : public ColumnarPredicate {
+ public:
+  ColumnarEquals(const PrimitiveHandler* primitive_handler,
+                 std::shared_ptr<const ColumnarCollection> input,
+                 std::unique_ptr<Message> literal, bool negated)
+      : primitive_handler_(primitive_handler),
+        input_(std::move(input)),
+        literal_(std::move(literal)),
+        literal_value_(SystemValue::FromMessage(*literal_)),
+        negated_(negated) {}
+
+  BooleanColumn Evaluate(
+      absl::Span<const Message* const> contexts) const override {
+    Column input = input_->Evaluate(contexts);
+    std::vector<uint8_t> equal = CompareElements(input.elements);
+
+    BooleanColumn result(input.size());
+    const uint8_t negated = negated_;
+    for (size_t context = 0; context < input.size(); ++context) {
+      const uint32_t count = input.count(context);
+      // Collections of different sizes are never equal.
+      const uint8_t value =
+          count == 1 ? equal[input.offsets[context]] : uint8_t{0};
+      result.values[context] =
+          count == 0 ? BooleanColumn::kEmpty : value ^ negated;
+    }
+    PropagateErrors(input, &result);
+    return result;
+  }
+
+ private:
+  // Returns whether each of the elements equals the literal, with the
+  // semantics of EqualsOperator::AreEqual.
+  std::vector<uint8_t> CompareElements(
+      const std::vector<const Message*>& elements) const {
+    const size_t size = elements.size();
+    std::vector<uint8_t> equal(size);
+
+    // Elements that are nothing but a value of the literal's System type are
+    // compared by value, in a loop over the extracted values. The rest are
+    // compared one at a time.
+    std::vector<uint8_t> by_value(size);
+    if (literal_value_.has_value()) {
+      const SystemValue::Type type = literal_value_->type();
+      if (type == SystemValue::Type::kBoolean ||
+          type == SystemValue::Type::kInteger) {
+        std::vector<int64_t> values(size);
+        for (size_t i = 0; i < size; ++i) {
+          absl::optional<SystemValue> value =
+              SystemValue::FromMessage(*elements[i]);
+          if (value.has_value() && value->type() == type &&
+              SystemValue::HasOnlyValue(*elements[i])) {
+            values[i] = value->integer_value();
+            by_value[i] = 1;
+          }
+        }
+        const int64_t literal = literal_value_->integer_value();
+        for (size_t i = 0; i < size; ++i) {
+          equal[i] = values[i] == literal;
+        }
+      } else {
+        std::vector<absl::string_view> values(size);
+        for (size_t i = 0; i < size; ++i) {
+          absl::optional<SystemValue> value =
+              SystemValue::FromMessage(*elements[i]);
+          if (value.has_value() && value->type() == type &&
+              SystemValue::HasOnlyValue(*elements[i])) {
+            values[i] = value->string_value();
+            by_value[i] = 1;
+          }
+        }
+        const absl::string_view literal = literal_value_->string_value();
+        if (type == SystemValue::Type::kDecimal) {
+          for (size_t i = 0; i < size; ++i) {
+            equal[i] = by_value[i] && DecimalsEqual(values[i], literal);
+          }
+        } else {
+          for (size_t i = 0; i < size; ++i) {
+            equal[i] = values[i] == literal;
+          }
+        }
+      }
+    }
+
+    // Codes with an enum value, such as Observation.status, are compared to
+    // strings through their JSON representation. Codes of the same type and
+    // value are equal to the literal alike, so each is compared once.
+    absl::flat_hash_map<std::pair<const Descriptor*, int>, bool> enum_codes;
+    for (size_t i = 0; i < size; ++i) {
+      if (by_value[i]) {
+        continue;
+      }
+      const Message& element = *elements[i];
+      const Descriptor* descriptor = element.GetDescriptor();
+      const FieldDescriptor* value = descriptor->FindFieldByName("value");
+      if (value != nullptr &&
+          value->cpp_type() == FieldDescriptor::CPPTYPE_ENUM &&
+          SystemValue::HasOnlyValue(element)) {
+        const std::pair<const Descriptor*, int> key(
+            descriptor, element.GetReflection()->GetEnumValue(element, value));
+        auto it = enum_codes.find(key);
+        if (it == enum_codes.end()) {
+          it = enum_codes
+                   .emplace(key, EqualsOperator::AreEqual(primitive_handler_,
+                                                          element, *literal_))
+                   .first;
+        }
+        equal[i] = it->second;
+      } else {
+        equal[i] =
+            EqualsOperator::AreEqual(primitive_handler_, element, *literal_);
+      }
+    }
+    return equal;
+  }
+
+  const PrimitiveHandler* const primitive_handler_;
+  const std::shared_ptr<const ColumnarCollection> input_;
+  const std::unique_ptr<Message> literal_;
+  // The value of literal_, which refers to its text.
+  const absl::optional<SystemValue> literal_value_;
+  const bool negated_;
+};
+
+// "<", "<=", ">" or ">=" between an integer field and an integer literal.
+class ColumnarIntegerComparison : public ColumnarPredicate {
+ public:
+  ColumnarIntegerComparison(std::shared_ptr<const ColumnarCollection> input,
+                            ComparisonOperator::ComparisonType comparison_type,
+                            int32_t literal)
+      : input_(std::move(input)),
+        comparison_type_(comparison_type),
+        literal_(literal) {}
+
+  BooleanColumn Evaluate(
+      absl::Span<const Message* const> contexts) const override {
+    Column input = input_->Evaluate(contexts);
+
+    // The value of each context with a single element, and zero for the
+    // others, whose result does not depend on it.
+    std::vector<int32_t> values(input.size());
+    for (size_t context = 0; context < input.size(); ++context) {
+      if (input.count(context) == 1) {
+        values[context] = static_cast<int32_t>(
+            SystemValue::FromMessage(*input.elements[input.offsets[context]])
+                ->integer_value());
+      }
+    }
+
+    BooleanColumn result(input.size());
+    switch (comparison_type_) {
+      case ComparisonOperator::kLessThan:
+        Compare(values, std::less<int32_t>(), &result.values);
+        break;
+      case ComparisonOperator::kGreaterThan:
+        Compare(values, std::greater<int32_t>(), &result.values);
+        break;
+      case ComparisonOperator::kLessThanEqualTo:
+        Compare(values, std::less_equal<int32_t>(), &result.values);
+        break;
+      case ComparisonOperator::kGreaterThanEqualTo:
+        Compare(values, std::greater_equal<int32_t>(), &result.values);
+        break;
+    }
+
+    auto input_error = input.errors.begin();
+    for (size_t context = 0; context < input.size(); ++context) {
+      const uint32_t count = input.count(context);
+      if (input_error != input.errors.end() && input_error->first == context) {
+        result.SetError(context, std::move(input_error->second));
+        ++input_error;
+      } else if (count > 1) {
+        result.SetError(context,
+                        InvalidArgumentError("Comparison operators must have "
+                                             "one element on each side."));
+      } else if (count == 0) {
+        result.values[context] = BooleanColumn::kEmpty;
+      }
+    }
+    return result;
+  }
+
+ private:
+  template <typename Comparison>
+  void Compare(const std::vector<int32_t>& values, Comparison comparison,
+               std::vector<uint8_t>* results) const {
+    const int32_t literal = literal_;
+    for (size_t i = 0; i < values.size(); ++i) {
+      (*results)[i] = comparison(values[i], literal);
+    }
+  }
+
+  const std::shared_ptr<const ColumnarCollection> input_;
+  const ComparisonOperator::ComparisonType comparison_type_;
+  const int32_t literal_;
+};
+
+// "and" or "or". The right operand is evaluated for every context, and its
+// errors are ignored for contexts where the left operand short circuits the
+// operator, as they would not be evaluated one at a time.
+class ColumnarBooleanOperator : public ColumnarPredicate {
+ public:
+  ColumnarBooleanOperator(bool is_and,
+                          std::shared_ptr<const ColumnarPredicate> left,
+                          std::shared_ptr<const ColumnarPredicate> right)
+      : table_(is_and ? kAnd : kOr),
+        left_(std::move(left)),
+        right_(std::move(right)) {}
+
+  BooleanColumn Evaluate(
+      absl::Span<const Message* const> contexts) const override {
+    BooleanColumn left = left_->Evaluate(contexts);
+    BooleanColumn right = right_->Evaluate(contexts);
+
+    BooleanColumn result(contexts.size());
+    const uint8_t* table = table_;
+    for (size_t context = 0; context < contexts.size(); ++context) {
+      result.values[context] =
+          table[left.values[context] << 2 | right.values[context]];
+    }
+
+    // Merges the errors of the operands in context order.
+    auto left_error = left.errors.begin();
+    auto right_error = right.errors.begin();
+    while (left_error != left.errors.end() ||
+           right_error != right.errors.end()) {
+      const size_t context =
+          right_error == right.errors.end() ||
+                  (left_error != left.errors.end() &&
+                   left_error->first <= right_error->first)
+              ? left_error->first
+              : right_error->first;
+      if (result.values[context] == BooleanColumn::kError) {
+        result.errors.emplace_back(
+            context, left.values[context] == BooleanColumn::kError
+                         ? left_error->second
+                         : right_error->second);
+      }
+      if (left_error != left.errors.end() && left_error->first == context) {
+        ++left_error;
+      }
+      if (right_error != right.errors.end() && right_error->first == context) {
+        ++right_error;
+      }
+    }
+    return result;
+  }
+
+ private:
+  // The result of the operator, indexed by left << 2 | right. See
+  // http://hl7.org/fhirpath/#boolean-logic
+  static constexpr uint8_t kF = BooleanColumn::kFalse;
+  static constexpr uint8_t kT = BooleanColumn::kTrue;
+  static constexpr uint8_t kE = BooleanColumn::kEmpty;
+  static constexpr uint8_t kX = BooleanColumn::kError;
+  static constexpr uint8_t kAnd[16] = {
+      kF, kF, kF, kF,  // false and ...
+      kF, kT, kE, kX,  // true and ...
+      kF, kE, kE, kX,  // {} and ...
+      kX, kX, kX, kX,  // error and ...
+  };
+  static constexpr uint8_t kOr[16] = {
+      kF, kT, kE, kX,  // false or ...
+      kT, kT, kT, kT,  // true or ...
+      kE, kT, kE, kX,  // {} or ...
+      kX, kX, kX, kX,  // error or ...
   };
 
-  void SetError(const absl::Status& error) { error_ = error; }
+  const uint8_t* const table_;
+  const std::shared_ptr<const ColumnarPredicate> left_;
+  const std::shared_ptr<const ColumnarPredicate> right_;
+};
 
-  FhirPathErrorListener error_listener_;
-  std::vector<const Descriptor*> descriptor_stack_;
-  absl::Status error_;
+constexpr uint8_t ColumnarBooleanOperator::kAnd[16];
+constexpr uint8_t ColumnarBooleanOperator::kOr[16];
+
+// Compiles the supported subset of FHIRPath into columnar subexpressions. See
+// ColumnarExpression.
+class ColumnarCompiler {
+ public:
+  ColumnarCompiler(const Descriptor* descriptor,
+                   const PrimitiveHandler* primitive_handler)
+      : descriptor_(descriptor), primitive_handler_(primitive_handler) {}
+
+  // Returns true if the node is compiled as a predicate rather than a
+  // collection.
+  static bool IsPredicate(const AstNode& node) {
+    switch (node.type) {
+      case AstNode::Type::kParenthesized:
+        return IsPredicate(*node.children[0]);
+      case AstNode::Type::kBinary:
+        return true;
+      case AstNode::Type::kInvocation:
+        return IsPredicate(*node.children[1]);
+      case AstNode::Type::kFunction:
+        return node.text == "exists" || node.text == "empty" ||
+               node.text == "not";
+      default:
+        return false;
+    }
+  }
+
+  StatusOr<std::shared_ptr<const ColumnarPredicate>> CompilePredicate(
+      const AstNode& node, const Descriptor* this_type) {
+    if (!IsPredicate(node)) {
+      FHIR_ASSIGN_OR_RETURN(TypedCollection collection,
+                            CompileCollection(node, this_type));
+      return std::shared_ptr<const ColumnarPredicate>(
+          std::make_shared<ColumnarBooleanOrEmpty>(collection.collection));
+    }
+
+    switch (node.type) {
+      case AstNode::Type::kParenthesized:
+        return CompilePredicate(*node.children[0], this_type);
+
+      case AstNode::Type::kBinary:
+        if (node.text == "and" || node.text == "or") {
+          FHIR_ASSIGN_OR_RETURN(
+              std::shared_ptr<const ColumnarPredicate> left,
+              CompilePredicate(*node.children[0], this_type));
+          FHIR_ASSIGN_OR_RETURN(
+              std::shared_ptr<const ColumnarPredicate> right,
+              CompilePredicate(*node.children[1], this_type));
+          return std::shared_ptr<const ColumnarPredicate>(
+              std::make_shared<ColumnarBooleanOperator>(node.text == "and",
+                                                        left, right));
+        }
+        if (node.text == "=" || node.text == "!=") {
+          return CompileEquals(node, this_type);
+        }
+        if (node.text == "<" || node.text == "<=" || node.text == ">" ||
+            node.text == ">=") {
+          return CompileIntegerComparison(node, this_type);
+        }
+        break;
+
+      case AstNode::Type::kInvocation:
+      case AstNode::Type::kFunction: {
+        const bool invocation = node.type == AstNode::Type::kInvocation;
+        const AstNode& function = invocation ? *node.children[1] : node;
+        if (!function.children.empty()) {
+          break;
+        }
+        if (function.text == "not") {
+          if (!invocation || !IsPredicate(*node.children[0])) {
+            break;
+          }
+          FHIR_ASSIGN_OR_RETURN(
+              std::shared_ptr<const ColumnarPredicate> input,
+              CompilePredicate(*node.children[0], this_type));
+          return std::shared_ptr<const ColumnarPredicate>(
+              std::make_shared<ColumnarNot>(input));
+        }
+        std::shared_ptr<const ColumnarCollection> input =
+            std::make_shared<ColumnarThis>();
+        if (invocation) {
+          FHIR_ASSIGN_OR_RETURN(
+              TypedCollection collection,
+              CompileCollection(*node.children[0], this_type));
+          input = collection.collection;
+        }
+        return std::shared_ptr<const ColumnarPredicate>(
+            std::make_shared<ColumnarExists>(input, function.text == "empty"));
+      }
+
+      default:
+        break;
+    }
+    return Unsupported(node);
+  }
+
+  StatusOr<std::shared_ptr<const ColumnarCollection>> CompileRootCollection(
+      const AstNode& node) {
+    FHIR_ASSIGN_OR_RETURN(TypedCollection collection,
+                          CompileCollection(node, descriptor_));
+    return collection.collection;
+  }
+
+ private:
+  struct TypedCollection {
+    std::shared_ptr<const ColumnarCollection> collection;
+    // The type of the elements of the collection.
+    const Descriptor* type;
+  };
+
+  StatusOr<TypedCollection> CompileCollection(const AstNode& node,
+                                              const Descriptor* this_type) {
+    switch (node.type) {
+      case AstNode::Type::kParenthesized:
+        return CompileCollection(*node.children[0], this_type);
+
+      case AstNode::Type::kThis:
+        return TypedCollection{std::make_shared<ColumnarThis>(), this_type};
+
+      case AstNode::Type::kIdentifier:
+        return CompileField(std::make_shared<ColumnarThis>(), this_type,
+                            node.text);
+
+      case AstNode::Type::kFunction:
+        if (node.text == "where" && node.children.size() == 1) {
+          return CompileWhere(
+              TypedCollection{std::make_shared<ColumnarThis>(), this_type},
+              node);
+        }
+        break;
+
+      case AstNode::Type::kInvocation: {
+        const AstNode& invocation = *node.children[1];
+        const bool where = invocation.type == AstNode::Type::kFunction &&
+                           invocation.text == "where" &&
+                           invocation.children.size() == 1;
+        if (invocation.type != AstNode::Type::kIdentifier && !where) {
+          break;
+        }
+        FHIR_ASSIGN_OR_RETURN(TypedCollection input,
+                              CompileCollection(*node.children[0], this_type));
+        if (where) {
+          return CompileWhere(input, invocation);
+        }
+        return CompileField(input.collection, input.type, invocation.text);
+      }
+
+      default:
+        break;
+    }
+    return Unsupported(node);
+  }
+
+  StatusOr<TypedCollection> CompileField(
+      std::shared_ptr<const ColumnarCollection> input, const Descriptor* type,
+      const std::string& name) {
+    const FieldDescriptor* field =
+        IsPrimitive(type) ? nullptr : FindFieldByJsonName(type, name);
+    if (field == nullptr || field->message_type() == nullptr) {
+      return UnimplementedError(absl::StrCat(
+          "Navigation to ", name, " is not supported by columnar evaluation"));
+    }
+
+    // The elements of choice types and contained resources are of several
+    // types, which the columns do not track.
+    const Descriptor* field_type = field->message_type();
+    if (IsChoiceType(field) || IsContainedResource(field_type) ||
+        field_type->full_name() ==
+            ::google::protobuf::Any::descriptor()->full_name()) {
+      return UnimplementedError(absl::StrCat(
+          "Navigation to ", name, " is not supported by columnar evaluation"));
+    }
+
+    return TypedCollection{std::make_shared<ColumnarField>(input, field),
+                           field_type};
+  }
+
+  StatusOr<TypedCollection> CompileWhere(const TypedCollection& input,
+                                         const AstNode& function) {
+    FHIR_ASSIGN_OR_RETURN(std::shared_ptr<const ColumnarPredicate> criteria,
+                          CompilePredicate(*function.children[0], input.type));
+    return TypedCollection{
+        std::make_shared<ColumnarWhere>(input.collection, criteria),
+        input.type};
+  }
+
+  // Returns the operands of a binary operator between a collection and a
+  // literal, with the literal evaluated as the full implementation does so
+  // that it has the same value and type. Sets swapped if the literal is the
+  // left operand.
+  StatusOr<std::pair<TypedCollection, std::unique_ptr<Message>>>
+  CompileLiteralOperands(const AstNode& node, const Descriptor* this_type,
+                         bool* swapped) {
+    const AstNode* path = node.children[0].get();
+    const AstNode* literal = node.children[1].get();
+    *swapped = IsLiteral(*path);
+    if (*swapped) {
+      std::swap(path, literal);
+    }
+    if (!IsLiteral(*literal)) {
+      return Unsupported(node);
+    }
+
+    FHIR_ASSIGN_OR_RETURN(TypedCollection collection,
+                          CompileCollection(*path, this_type));
+
+    FHIR_ASSIGN_OR_RETURN(
+        CompiledExpression expression,
+        CompiledExpression::Compile(descriptor_, primitive_handler_,
+                                    literal->Text()));
+    FHIR_ASSIGN_OR_RETURN(
+        EvaluationResult result,
+        expression.Evaluate(
+            *::google::protobuf::MessageFactory::generated_factory()->GetPrototype(
+                descriptor_)));
+    if (result.GetMessages().size() != 1) {
+      return Unsupported(node);
+    }
+    std::unique_ptr<Message> value(result.GetMessages()[0]->New());
+    value->CopyFrom(*result.GetMessages()[0]);
+    return std::make_pair(collection, std::move(value));
+  }
+
+  StatusOr<std::shared_ptr<const ColumnarPredicate>> CompileEquals(
+      const AstNode& node, const Descriptor* this_type) {
+    bool swapped;
+    FHIR_ASSIGN_OR_RETURN(auto operands,
+                          CompileLiteralOperands(node, this_type, &swapped));
+    return std::shared_ptr<const ColumnarPredicate>(
+        std::make_shared<ColumnarEquals>(
+            primitive_handler_, operands.first.collection,
+            std::move(operands.second), node.text == "!="));
+  }
+
+  StatusOr<std::shared_ptr<const ColumnarPredicate>> CompileIntegerComparison(
+      const AstNode& node, const Descriptor* this_type) {
+    bool swapped;
+    FHIR_ASSIGN_OR_RETURN(auto operands,
+                          CompileLiteralOperands(node, this_type, &swapped));
+    if (SystemValue::TypeOf(operands.first.type) !=
+            SystemValue::Type::kInteger ||
+        !IsSystemInteger(*operands.second)) {
+      return UnimplementedError(absl::StrCat(
+          "Comparison ", node.Key(),
+          " is not supported by columnar evaluation"));
+    }
+
+    // With the literal on the left, "3 < x" is evaluated as "x > 3".
+    const bool less = node.text[0] == '<';
+    const bool or_equal = node.text.size() == 2;
+    ComparisonOperator::ComparisonType comparison_type;
+    if (less != swapped) {
+      comparison_type = or_equal ? ComparisonOperator::kLessThanEqualTo
+                                 : ComparisonOperator::kLessThan;
+    } else {
+      comparison_type = or_equal ? ComparisonOperator::kGreaterThanEqualTo
+                                 : ComparisonOperator::kGreaterThan;
+    }
+    return std::shared_ptr<const ColumnarPredicate>(
+        std::make_shared<ColumnarIntegerComparison>(
+            operands.first.collection, comparison_type,
+            static_cast<int32_t>(
+                SystemValue::FromMessage(*operands.second)->integer_value())));
+  }
+
+  static bool IsLiteral(const AstNode& node) {
+    return node.type == AstNode::Type::kStringLiteral ||
+           node.type == AstNode::Type::kBooleanLiteral ||
+           node.type == AstNode::Type::kNumberLiteral;
+  }
+
+  static Status Unsupported(const AstNode& node) {
+    return UnimplementedError(absl::StrCat(
+        "FHIRPath expression is not supported by columnar evaluation: ",
+        node.Key()));
+  }
+
+  const Descriptor* descriptor_;
   const PrimitiveHandler* primitive_handler_;
 };
 
 }  // namespace internal
 
+EvaluationProfiler::EvaluationProfiler() {}
+EvaluationProfiler::~EvaluationProfiler() {}
+
+void EvaluationProfiler::AddExpression(
+    std::unique_ptr<internal::ExpressionProfile> profile) {
+  absl::MutexLock lock(&mutex_);
+  expressions_.push_back(std::move(profile));
+}
+
+std::vector<EvaluationProfiler::ExpressionStats> EvaluationProfiler::GetStats()
+    const {
+  absl::MutexLock lock(&mutex_);
+  std::vector<ExpressionStats> stats;
+  stats.reserve(expressions_.size());
+  for (const auto& expression : expressions_) {
+    stats.push_back(expression->GetStats());
+  }
+  return stats;
+}
+
+std::vector<EvaluationProfiler::ExpressionStats>
+EvaluationProfiler::MostExpensive(int n) const {
+  std::vector<ExpressionStats> stats = GetStats();
+  std::stable_sort(stats.begin(), stats.end(),
+                   [](const ExpressionStats& a, const ExpressionStats& b) {
+                     return a.wall_time() > b.wall_time();
+                   });
+  stats.resize(std::min(stats.size(), static_cast<size_t>(std::max(n, 0))));
+  return stats;
+}
+
+std::string EvaluationProfiler::Report(int n) const {
+  std::string report;
+  for (const ExpressionStats& stats : MostExpensive(n)) {
+    absl::StrAppend(&report, Explain(stats), "\n");
+  }
+  return report;
+}
+
+std::string EvaluationProfiler::Explain(const ExpressionStats& stats) {
+  std::string explanation = absl::StrCat(
+      stats.descriptor != nullptr ? stats.descriptor->full_name() : "?", ": ",
+      stats.fhir_path, "\n",
+      absl::StrFormat("%12s %10s %10s %10s %12s  %s\n", "evaluations", "input",
+                      "output", "temporaries", "time (us)", "expression"));
+  for (const NodeStats& node : stats.nodes) {
+    absl::StrAppend(
+        &explanation,
+        absl::StrFormat("%12d %10d %10d %10d %12.1f  %s%s\n", node.evaluations,
+                        node.input_size, node.output_size, node.temporaries,
+                        absl::ToDoubleMicroseconds(node.wall_time),
+                        std::string(2 * node.depth, ' '), node.expression));
+  }
+  return explanation;
+}
+
+void EvaluationProfiler::Clear() {
+  absl::MutexLock lock(&mutex_);
+  for (const auto& expression : expressions_) {
+    expression->Clear();
+  }
+}
+
+ParsedExpressions::ParsedExpressions() {}
+ParsedExpressions::~ParsedExpressions() {}
+
+ParsedExpressions::ParsedExpressions(ParsedExpressions&& other) = default;
+ParsedExpressions& ParsedExpressions::operator=(ParsedExpressions&& other) =
+    default;
+
+StatusOr<ParsedExpressions> ParsedExpressions::FromProto(
+    const proto::ParsedFhirPathExpressions& expressions) {
+  ParsedExpressions result;
+  for (const auto& expression : expressions.expression()) {
+    StatusOr<std::unique_ptr<AstNode>> root =
+        internal::AstFromProto(expression.ast());
+    if (!root.ok()) {
+      return InvalidArgumentError(
+          absl::StrCat("Invalid syntax tree for \"", expression.fhir_path(),
+                       "\": ", root.status().message()));
+    }
+    result.syntax_trees_[expression.fhir_path()] =
+        std::move(root).ValueOrDie();
+  }
+  return result;
+}
+
+StatusOr<ParsedExpressions> ParsedExpressions::FromSerializedProto(
+    absl::string_view serialized) {
+  proto::ParsedFhirPathExpressions expressions;
+  if (!expressions.ParseFromArray(serialized.data(), serialized.size())) {
+    return InvalidArgumentError("Malformed ParsedFhirPathExpressions.");
+  }
+  return FromProto(expressions);
+}
+
+Status ParsedExpressions::Add(const std::string& fhir_path) {
+  if (syntax_trees_.contains(fhir_path)) {
+    return absl::OkStatus();
+  }
+  FHIR_ASSIGN_OR_RETURN(std::unique_ptr<AstNode> root,
+                        internal::ParseFhirPath(fhir_path));
+  syntax_trees_[fhir_path] = std::move(root);
+  return absl::OkStatus();
+}
+
+proto::ParsedFhirPathExpressions ParsedExpressions::ToProto() const {
+  std::vector<const std::string*> fhir_paths;
+  fhir_paths.reserve(syntax_trees_.size());
+  for (const auto& entry : syntax_trees_) {
+    fhir_paths.push_back(&entry.first);
+  }
+  std::sort(fhir_paths.begin(), fhir_paths.end(),
+            [](const std::string* a, const std::string* b) { return *a < *b; });
+
+  proto::ParsedFhirPathExpressions result;
+  for (const std::string* fhir_path : fhir_paths) {
+    auto* expression = result.add_expression();
+    expression->set_fhir_path(*fhir_path);
+    *expression->mutable_ast() =
+        internal::AstToProto(*syntax_trees_.at(*fhir_path));
+  }
+  return result;
+}
+
+const AstNode* ParsedExpressions::Find(const std::string& fhir_path) const {
+  auto iter = syntax_trees_.find(fhir_path);
+  return iter != syntax_trees_.end() ? iter->second.get() : nullptr;
+}
+
 EvaluationResult::EvaluationResult(EvaluationResult&& result)
-    : work_space_(std::move(result.work_space_)) {}
+    : work_space_(std::move(result.work_space_)),
+      expression_(std::move(result.expression_)),
+      messages_(std::move(result.messages_)) {}
 
 EvaluationResult& EvaluationResult::operator=(EvaluationResult&& result) {
   work_space_ = std::move(result.work_space_);
+  expression_ = std::move(result.expression_);
+  messages_ = std::move(result.messages_);
 
   return *this;
 }
 
 EvaluationResult::EvaluationResult(
-    std::unique_ptr<internal::WorkSpace> work_space)
-    : work_space_(std::move(work_space)) {}
+    std::shared_ptr<internal::WorkSpace> work_space,
+    std::shared_ptr<const internal::ExpressionNode> expression,
+    std::vector<const Message*> messages)
+    : work_space_(std::move(work_space)),
+      expression_(std::move(expression)),
+      messages_(std::move(messages)) {}
 
 EvaluationResult::~EvaluationResult() {}
 
 const std::vector<const Message*>& EvaluationResult::GetMessages() const {
-  return work_space_->GetResultMessages();
+  return messages_;
 }
 
 StatusOr<bool> EvaluationResult::GetBoolean() const {
-  auto messages = work_space_->GetResultMessages();
+  const std::vector<const Message*>& messages = messages_;
   if (messages.size() != 1) {
     return InvalidArgumentError(
         "Result collection must contain exactly one element");
@@ -3844,7 +6334,7 @@ StatusOr<bool> EvaluationResult::GetBoolean() const {
 }
 
 StatusOr<int32_t> EvaluationResult::GetInteger() const {
-  auto messages = work_space_->GetResultMessages();
+  const std::vector<const Message*>& messages = messages_;
   if (messages.size() != 1) {
     return InvalidArgumentError(
         "Result collection must contain exactly one element");
@@ -3853,7 +6343,7 @@ StatusOr<int32_t> EvaluationResult::GetInteger() const {
 }
 
 StatusOr<std::string> EvaluationResult::GetDecimal() const {
-  auto messages = work_space_->GetResultMessages();
+  const std::vector<const Message*>& messages = messages_;
   if (messages.size() != 1) {
     return InvalidArgumentError(
         "Result collection must contain exactly one element");
@@ -3862,7 +6352,7 @@ StatusOr<std::string> EvaluationResult::GetDecimal() const {
 }
 
 StatusOr<std::string> EvaluationResult::GetString() const {
-  auto messages = work_space_->GetResultMessages();
+  const std::vector<const Message*>& messages = messages_;
   if (messages.size() != 1) {
     return InvalidArgumentError(
         "Result collection must contain exactly one element");
@@ -3873,12 +6363,14 @@ StatusOr<std::string> EvaluationResult::GetString() const {
 CompiledExpression::CompiledExpression(CompiledExpression&& other)
     : fhir_path_(std::move(other.fhir_path_)),
       root_expression_(std::move(other.root_expression_)),
-      primitive_handler_(other.primitive_handler_) {}
+      primitive_handler_(other.primitive_handler_),
+      context_fields_(std::move(other.context_fields_)) {}
 
 CompiledExpression& CompiledExpression::operator=(CompiledExpression&& other) {
   fhir_path_ = std::move(other.fhir_path_);
   root_expression_ = std::move(other.root_expression_);
   primitive_handler_ = other.primitive_handler_;
+  context_fields_ = std::move(other.context_fields_);
 
   return *this;
 }
@@ -3886,13 +6378,15 @@ CompiledExpression& CompiledExpression::operator=(CompiledExpression&& other) {
 CompiledExpression::CompiledExpression(const CompiledExpression& other)
     : fhir_path_(other.fhir_path_),
       root_expression_(other.root_expression_),
-      primitive_handler_(other.primitive_handler_) {}
+      primitive_handler_(other.primitive_handler_),
+      context_fields_(other.context_fields_) {}
 
 CompiledExpression& CompiledExpression::operator=(
     const CompiledExpression& other) {
   fhir_path_ = other.fhir_path_;
   root_expression_ = other.root_expression_;
   primitive_handler_ = other.primitive_handler_;
+  context_fields_ = other.context_fields_;
 
   return *this;
 }
@@ -3902,30 +6396,30 @@ const std::string& CompiledExpression::fhir_path() const { return fhir_path_; }
 CompiledExpression::CompiledExpression(
     const std::string& fhir_path,
     std::shared_ptr<internal::ExpressionNode> root_expression,
-    const PrimitiveHandler* primitive_handler)
+    const PrimitiveHandler* primitive_handler,
+    std::shared_ptr<const std::vector<const FieldDescriptor*>> context_fields)
     : fhir_path_(fhir_path),
       root_expression_(root_expression),
-      primitive_handler_(primitive_handler) {}
+      primitive_handler_(primitive_handler),
+      context_fields_(std::move(context_fields)) {}
 
 StatusOr<CompiledExpression> CompiledExpression::Compile(
     const Descriptor* descriptor, const PrimitiveHandler* primitive_handler,
     const std::string& fhir_path) {
-  ANTLRInputStream input(fhir_path);
-  FhirPathLexer lexer(&input);
-  CommonTokenStream tokens(&lexer);
-  FhirPathParser parser(&tokens);
-
-  internal::FhirPathCompilerVisitor visitor(descriptor, primitive_handler);
-  parser.addErrorListener(visitor.GetErrorListener());
-  lexer.addErrorListener(visitor.GetErrorListener());
-  antlrcpp::Any result = visitor.visit(parser.expression());
-
-  if (result.isNotNull() && visitor.GetError().ok()) {
-    auto root_node = result.as<std::shared_ptr<internal::ExpressionNode>>();
-    return CompiledExpression(fhir_path, root_node, primitive_handler);
-  } else {
-    return visitor.GetError();
-  }
+  return Compile(descriptor, primitive_handler, fhir_path, CompileOptions());
+}
+
+StatusOr<CompiledExpression> CompiledExpression::Compile(
+    const Descriptor* descriptor, const PrimitiveHandler* primitive_handler,
+    const std::string& fhir_path, const CompileOptions& options) {
+  std::shared_ptr<const std::vector<const FieldDescriptor*>> context_fields;
+  FHIR_ASSIGN_OR_RETURN(
+      std::shared_ptr<internal::ExpressionNode> root_node,
+      internal::CompileFhirPath(descriptor, primitive_handler, fhir_path,
+                                options, /*shared_subexpressions=*/nullptr,
+                                &context_fields));
+  return CompiledExpression(fhir_path, root_node, primitive_handler,
+                            std::move(context_fields));
 }
 
 StatusOr<EvaluationResult> CompiledExpression::Evaluate(
@@ -3936,7 +6430,7 @@ StatusOr<EvaluationResult> CompiledExpression::Evaluate(
 StatusOr<EvaluationResult> CompiledExpression::Evaluate(
     const internal::WorkspaceMessage& message) const {
   std::vector<internal::WorkspaceMessage> message_context_stack;
-  auto work_space = absl::make_unique<internal::WorkSpace>(
+  auto work_space = std::make_shared<internal::WorkSpace>(
       primitive_handler_, message_context_stack, message);
 
   std::vector<internal::WorkspaceMessage> workspace_results;
@@ -3949,9 +6443,358 @@ StatusOr<EvaluationResult> CompiledExpression::Evaluate(
     results.push_back(result.Message());
   }
 
-  work_space->SetResultMessages(results);
+  return EvaluationResult(std::move(work_space), root_expression_,
+                          std::move(results));
+}
+
+BatchEvaluationResult CompiledExpression::EvaluateBatch(
+    absl::Span<const Message* const> messages,
+    const BatchEvaluationOptions& options) const {
+  BatchEvaluationResult batch;
+  batch.size_ = messages.size();
+  const int64_t num_words = (messages.size() + 63) / 64;
+  batch.boolean_bits_.resize(num_words);
+  batch.true_bits_.resize(num_words);
+  batch.result_sizes_.resize(messages.size());
+
+  absl::Mutex errors_mutex;
+
+  // Evaluates the messages covered by words [begin_word, end_word) of the
+  // result bitsets. Shards are aligned to words so that concurrently running
+  // shards never write to the same word.
+  auto evaluate_shard = [&](int64_t begin_word, int64_t end_word) {
+    const size_t begin = begin_word * 64;
+    const size_t end = std::min<size_t>(messages.size(), end_word * 64);
+    if (begin >= end) {
+      return;
+    }
+
+    internal::WorkSpace work_space(primitive_handler_, messages[begin]);
+    std::vector<internal::WorkspaceMessage> results;
+    std::vector<std::pair<size_t, Status>> shard_errors;
+
+    for (size_t i = begin; i < end; ++i) {
+      work_space.Reset(internal::WorkspaceMessage(messages[i]));
+      results.clear();
+
+      Status status = root_expression_->Evaluate(&work_space, &results);
+      if (!status.ok()) {
+        shard_errors.emplace_back(i, status);
+        continue;
+      }
+
+      batch.result_sizes_[i] = results.size();
+      if (results.size() == 1 && IsBoolean(*results[0].Message())) {
+        StatusOr<bool> value =
+            primitive_handler_->GetBooleanValue(*results[0].Message());
+        if (!value.ok()) {
+          shard_errors.emplace_back(i, value.status());
+          continue;
+        }
+
+        const uint64_t bit = uint64_t{1} << (i % 64);
+        batch.boolean_bits_[i / 64] |= bit;
+        if (value.ValueOrDie()) {
+          batch.true_bits_[i / 64] |= bit;
+        }
+      }
+    }
+
+    if (!shard_errors.empty()) {
+      absl::MutexLock lock(&errors_mutex);
+      std::move(shard_errors.begin(), shard_errors.end(),
+                std::back_inserter(batch.errors_));
+    }
+  };
+
+  if (options.thread_pool == nullptr || num_words <= 1) {
+    evaluate_shard(0, num_words);
+  } else {
+    // Rough cost, in cycles, of evaluating an expression against a single
+    // message. Used by the thread pool to decide how to split the work.
+    constexpr int64_t kCostPerMessage = 10000;
+    const int64_t words_per_shard =
+        std::max(1, (options.min_shard_size + 63) / 64);
+    const int64_t num_shards =
+        (num_words + words_per_shard - 1) / words_per_shard;
+    options.thread_pool->ParallelFor(
+        num_shards, words_per_shard * 64 * kCostPerMessage,
+        [&](tensorflow::int64 begin_shard, tensorflow::int64 end_shard) {
+          evaluate_shard(
+              begin_shard * words_per_shard,
+              std::min<int64_t>(num_words, end_shard * words_per_shard));
+        });
+  }
+
+  std::sort(batch.errors_.begin(), batch.errors_.end(),
+            [](const std::pair<size_t, Status>& a,
+               const std::pair<size_t, Status>& b) {
+              return a.first < b.first;
+            });
+
+  return batch;
+}
+
+CompiledExpressionSet::CompiledExpressionSet(
+    const Descriptor* descriptor, const PrimitiveHandler* primitive_handler,
+    const CompileOptions& options)
+    : descriptor_(descriptor),
+      primitive_handler_(primitive_handler),
+      options_(options) {}
+
+Status CompiledExpressionSet::Add(const std::string& fhir_path) {
+  // A shared subexpression is only profiled as part of the first expression
+  // that contains it, so profiled expressions are compiled independently.
+  std::map<std::string, std::shared_ptr<internal::ExpressionNode>>*
+      shared_subexpressions =
+          options_.profiler == nullptr ? &shared_subexpressions_ : nullptr;
+  std::shared_ptr<const std::vector<const FieldDescriptor*>> context_fields;
+  FHIR_ASSIGN_OR_RETURN(
+      std::shared_ptr<internal::ExpressionNode> root_node,
+      internal::CompileFhirPath(descriptor_, primitive_handler_, fhir_path,
+                                options_, shared_subexpressions,
+                                &context_fields));
+  expressions_.push_back(CompiledExpression(fhir_path, root_node,
+                                            primitive_handler_,
+                                            std::move(context_fields)));
+  return absl::OkStatus();
+}
+
+std::vector<StatusOr<EvaluationResult>> CompiledExpressionSet::Evaluate(
+    const Message& message) const {
+  return Evaluate(internal::WorkspaceMessage(&message));
+}
+
+std::vector<StatusOr<EvaluationResult>> CompiledExpressionSet::Evaluate(
+    const internal::WorkspaceMessage& message) const {
+  return Evaluate(message,
+                  [](int index, const StatusOr<EvaluationResult>& result) {});
+}
+
+std::vector<StatusOr<EvaluationResult>> CompiledExpressionSet::Evaluate(
+    const internal::WorkspaceMessage& message,
+    absl::FunctionRef<void(int index, const StatusOr<EvaluationResult>& result)>
+        on_evaluated) const {
+  // All expressions are evaluated in the same workspace so that they can
+  // reuse the results of shared subexpressions.
+  std::vector<internal::WorkspaceMessage> message_context_stack;
+  auto work_space = std::make_shared<internal::WorkSpace>(
+      primitive_handler_, message_context_stack, message);
 
-  return EvaluationResult(std::move(work_space));
+  std::vector<StatusOr<EvaluationResult>> results;
+  results.reserve(expressions_.size());
+  std::vector<internal::WorkspaceMessage> workspace_results;
+  for (const CompiledExpression& expression : expressions_) {
+    workspace_results.clear();
+    Status status = expression.root_expression_->Evaluate(work_space.get(),
+                                                          &workspace_results);
+    if (!status.ok()) {
+      results.push_back(status);
+    } else {
+      std::vector<const Message*> messages;
+      messages.reserve(workspace_results.size());
+      for (const internal::WorkspaceMessage& result : workspace_results) {
+        messages.push_back(result.Message());
+      }
+      results.push_back(EvaluationResult(
+          work_space, expression.root_expression_, std::move(messages)));
+    }
+    on_evaluated(results.size() - 1, results.back());
+  }
+
+  return results;
+}
+
+ColumnarExpression::ColumnarExpression(
+    std::string fhir_path, const PrimitiveHandler* primitive_handler,
+    std::shared_ptr<const internal::ColumnarCollection> collection,
+    std::shared_ptr<const internal::ColumnarPredicate> predicate)
+    : fhir_path_(std::move(fhir_path)),
+      primitive_handler_(primitive_handler),
+      collection_(std::move(collection)),
+      predicate_(std::move(predicate)) {}
+
+StatusOr<ColumnarExpression> ColumnarExpression::Compile(
+    const Descriptor* descriptor, const PrimitiveHandler* primitive_handler,
+    const std::string& fhir_path) {
+  // Compiling the full expression first reports invalid expressions as
+  // CompiledExpression does, leaving Unimplemented for valid expressions that
+  // columnar evaluation does not support.
+  FHIR_RETURN_IF_ERROR(
+      CompiledExpression::Compile(descriptor, primitive_handler, fhir_path)
+          .status());
+
+  FHIR_ASSIGN_OR_RETURN(std::unique_ptr<AstNode> root,
+                        internal::ParseFhirPath(fhir_path));
+  internal::ColumnarCompiler compiler(descriptor, primitive_handler);
+  if (internal::ColumnarCompiler::IsPredicate(*root)) {
+    FHIR_ASSIGN_OR_RETURN(
+        std::shared_ptr<const internal::ColumnarPredicate> predicate,
+        compiler.CompilePredicate(*root, descriptor));
+    return ColumnarExpression(fhir_path, primitive_handler, nullptr,
+                              std::move(predicate));
+  }
+  FHIR_ASSIGN_OR_RETURN(
+      std::shared_ptr<const internal::ColumnarCollection> collection,
+      compiler.CompileRootCollection(*root));
+  return ColumnarExpression(fhir_path, primitive_handler,
+                            std::move(collection), nullptr);
+}
+
+BatchEvaluationResult ColumnarExpression::EvaluateBatch(
+    absl::Span<const Message* const> messages,
+    const BatchEvaluationOptions& options) const {
+  BatchEvaluationResult batch;
+  batch.size_ = messages.size();
+  const int64_t num_words = (messages.size() + 63) / 64;
+  batch.boolean_bits_.resize(num_words);
+  batch.true_bits_.resize(num_words);
+  batch.result_sizes_.resize(messages.size());
+
+  absl::Mutex errors_mutex;
+
+  // Evaluates the messages covered by words [begin_word, end_word) of the
+  // result bitsets, as in CompiledExpression::EvaluateBatch.
+  auto evaluate_shard = [&](int64_t begin_word, int64_t end_word) {
+    const size_t begin = begin_word * 64;
+    const size_t end = std::min<size_t>(messages.size(), end_word * 64);
+    if (begin >= end) {
+      return;
+    }
+    absl::Span<const Message* const> shard =
+        messages.subspan(begin, end - begin);
+    std::vector<std::pair<size_t, Status>> shard_errors;
+
+    auto set_boolean = [&](size_t i, bool value) {
+      const uint64_t bit = uint64_t{1} << (i % 64);
+      batch.boolean_bits_[i / 64] |= bit;
+      if (value) {
+        batch.true_bits_[i / 64] |= bit;
+      }
+    };
+
+    if (predicate_ != nullptr) {
+      internal::BooleanColumn column = predicate_->Evaluate(shard);
+      for (size_t i = 0; i < shard.size(); ++i) {
+        const uint8_t value = column.values[i];
+        if (value <= internal::BooleanColumn::kTrue) {
+          batch.result_sizes_[begin + i] = 1;
+          set_boolean(begin + i, value);
+        }
+      }
+      for (std::pair<size_t, Status>& error : column.errors) {
+        shard_errors.emplace_back(begin + error.first,
+                                  std::move(error.second));
+      }
+    } else {
+      internal::Column column = collection_->Evaluate(shard);
+      auto error = column.errors.begin();
+      for (size_t i = 0; i < shard.size(); ++i) {
+        if (error != column.errors.end() && error->first == i) {
+          shard_errors.emplace_back(begin + i, std::move(error->second));
+          ++error;
+          continue;
+        }
+
+        batch.result_sizes_[begin + i] = column.count(i);
+        if (column.count(i) != 1) {
+          continue;
+        }
+        const Message& result = *column.elements[column.offsets[i]];
+        if (IsBoolean(result)) {
+          StatusOr<bool> value = primitive_handler_->GetBooleanValue(result);
+          if (!value.ok()) {
+            batch.result_sizes_[begin + i] = 0;
+            shard_errors.emplace_back(begin + i, value.status());
+            continue;
+          }
+          set_boolean(begin + i, value.ValueOrDie());
+        }
+      }
+    }
+
+    if (!shard_errors.empty()) {
+      absl::MutexLock lock(&errors_mutex);
+      std::move(shard_errors.begin(), shard_errors.end(),
+                std::back_inserter(batch.errors_));
+    }
+  };
+
+  // Shards are evaluated in turn even without a thread pool, so that their
+  // columns stay small.
+  const int64_t words_per_shard =
+      std::max(1, (options.min_shard_size + 63) / 64);
+  const int64_t num_shards =
+      (num_words + words_per_shard - 1) / words_per_shard;
+  auto evaluate_shards = [&](int64_t begin_shard, int64_t end_shard) {
+    for (int64_t shard = begin_shard; shard < end_shard; ++shard) {
+      evaluate_shard(shard * words_per_shard,
+                     std::min<int64_t>(num_words,
+                                       (shard + 1) * words_per_shard));
+    }
+  };
+  if (options.thread_pool == nullptr || num_shards <= 1) {
+    evaluate_shards(0, num_shards);
+  } else {
+    // Rough cost, in cycles, of evaluating an expression against a single
+    // message.
+    constexpr int64_t kCostPerMessage = 1000;
+    options.thread_pool->ParallelFor(
+        num_shards, words_per_shard * 64 * kCostPerMessage,
+        [&](tensorflow::int64 begin_shard, tensorflow::int64 end_shard) {
+          evaluate_shards(begin_shard, end_shard);
+        });
+  }
+
+  std::sort(batch.errors_.begin(), batch.errors_.end(),
+            [](const std::pair<size_t, Status>& a,
+               const std::pair<size_t, Status>& b) {
+              return a.first < b.first;
+            });
+
+  return batch;
+}
+
+Status BatchEvaluationResult::status(size_t index) const {
+  auto error = std::lower_bound(
+      errors_.begin(), errors_.end(), index,
+      [](const std::pair<size_t, Status>& error, size_t index) {
+        return error.first < index;
+      });
+  if (error != errors_.end() && error->first == index) {
+    return error->second;
+  }
+  return absl::OkStatus();
+}
+
+StatusOr<bool> BatchEvaluationResult::GetBoolean(size_t index) const {
+  FHIR_RETURN_IF_ERROR(status(index));
+  if (result_sizes_[index] != 1) {
+    return InvalidArgumentError(
+        "Result collection must contain exactly one element");
+  }
+  if (!TestBit(boolean_bits_, index)) {
+    return InvalidArgumentError("Result is not a boolean.");
+  }
+  return TestBit(true_bits_, index);
+}
+
+size_t BatchEvaluationResult::MatchCount() const {
+  size_t count = 0;
+  for (uint64_t word : true_bits_) {
+    count += std::bitset<64>(word).count();
+  }
+  return count;
+}
+
+std::vector<size_t> BatchEvaluationResult::MatchingIndices() const {
+  std::vector<size_t> indices;
+  for (size_t i = 0; i < size_; ++i) {
+    if (Matches(i)) {
+      indices.push_back(i);
+    }
+  }
+  return indices;
 }
 
 }  // namespace fhir_path
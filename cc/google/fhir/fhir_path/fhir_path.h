@@ -15,10 +15,26 @@
 #ifndef GOOGLE_FHIR_FHIR_PATH_FHIR_PATH_H_
 #define GOOGLE_FHIR_FHIR_PATH_FHIR_PATH_H_
 
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include "google/protobuf/message.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/functional/function_ref.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
+#include "absl/types/span.h"
 #include "google/fhir/annotations.h"
 #include "google/fhir/primitive_handler.h"
 #include "google/fhir/status/statusor.h"
+#include "google/fhir/terminology.h"
+#include "proto/fhir_path.pb.h"
+#include "tensorflow/core/lib/core/threadpool.h"
 
 namespace google {
 namespace fhir {
@@ -27,6 +43,12 @@ namespace fhir_path {
 
 namespace internal {
 
+struct AstNode;
+class ColumnarCollection;
+class ColumnarPredicate;
+class ExpressionNode;
+class ExpressionProfile;
+
 // Represents a single value encountered during FHIRPath evaluation, including
 // necessary context about the value's ancestry to determine the resource
 // it was derived from (where possible.)
@@ -83,7 +105,7 @@ class WorkSpace {
   // temporary data used for a single evaluation, e.g. a call to
   // ExpressionNode::Evaluate. It contains the context message
   // (generally the resource against which the expression is run),
-  // the accumulated results, and tracks temporary data to be deleted
+  // memoized intermediate results, and tracks temporary data to be deleted
   // when the evaluation result is destroyed.
   explicit WorkSpace(const PrimitiveHandler* primitive_handler,
                      const ::google::protobuf::Message* message_context)
@@ -134,16 +156,6 @@ class WorkSpace {
     return message_context_stack_.pop_back();
   }
 
-  // Sets the results to be returned to the caller.
-  void SetResultMessages(std::vector<const ::google::protobuf::Message*> messages) {
-    messages_ = messages;
-  }
-
-  // Gets the results to return to the caller.
-  const std::vector<const ::google::protobuf::Message*>& GetResultMessages() {
-    return messages_;
-  }
-
   // Mark the message to be deleted when the workspace goes out of scope.
   // This is necessary because some messages are created on the fly,
   // while others simply return nested messages in the user-provided
@@ -153,15 +165,51 @@ class WorkSpace {
     to_delete_.push_back(std::unique_ptr<::google::protobuf::Message>(message));
   }
 
+  // Returns the number of messages marked with DeleteWhenFinished since the
+  // workspace was created or last reset.
+  size_t TemporaryCount() const { return to_delete_.size(); }
+
   const PrimitiveHandler* GetPrimitiveHandler() {
     return primitive_handler_;
   }
 
- private:
-  std::vector<const ::google::protobuf::Message*> messages_;
+  // Prepares the workspace to evaluate an expression against a new message
+  // context. Temporary messages and memoized results from the previous
+  // evaluation are released, but the capacity of the underlying containers is
+  // retained so that a single workspace can be reused across many
+  // evaluations.
+  void Reset(const WorkspaceMessage& message_context) {
+    to_delete_.clear();
+    memoized_results_.clear();
+    message_context_stack_.clear();
+    message_context_stack_.push_back(message_context);
+  }
+
+  // Returns the results previously recorded for the given node with
+  // MemoizeResult, or null if there are none.
+  //
+  // Memoized results are only valid for the message context the workspace
+  // was created with, so nodes may only be memoized if their result does not
+  // depend on anything pushed onto the context stack.
+  const std::vector<WorkspaceMessage>* FindMemoizedResult(
+      const ExpressionNode* node) const {
+    auto iter = memoized_results_.find(node);
+    return iter == memoized_results_.end() ? nullptr : &iter->second;
+  }
+
+  // Records the results of evaluating the given node. The returned pointer is
+  // invalidated by subsequent calls to MemoizeResult.
+  const std::vector<WorkspaceMessage>* MemoizeResult(
+      const ExpressionNode* node, std::vector<WorkspaceMessage> results) {
+    return &(memoized_results_[node] = std::move(results));
+  }
 
+ private:
   std::vector<WorkspaceMessage> message_context_stack_;
 
+  absl::flat_hash_map<const ExpressionNode*, std::vector<WorkspaceMessage>>
+      memoized_results_;
+
   std::vector<std::unique_ptr<::google::protobuf::Message>> to_delete_;
 
   const PrimitiveHandler* primitive_handler_;
@@ -193,6 +241,17 @@ class ExpressionNode {
       WorkSpace* work_space,
       std::vector<WorkspaceMessage>* results) const = 0;
 
+  // Calls the visitor with each of the results that Evaluate would produce,
+  // in the same order, until the visitor returns false. Nodes that can
+  // produce their results one at a time override this so that consumers that
+  // only need part of a collection (e.g. exists() or first()) stop the
+  // evaluation as soon as they have seen enough.
+  //
+  // The default implementation materializes all results with Evaluate.
+  virtual Status Stream(
+      WorkSpace* work_space,
+      absl::FunctionRef<bool(const WorkspaceMessage&)> visitor) const;
+
   // The descriptor of the message type returned by the expression.
   virtual const ::google::protobuf::Descriptor* ReturnType() const = 0;
 };
@@ -237,8 +296,9 @@ class EvaluationResult {
   //
   // Depending on the expression, these messages may be children
   // of the original Message against which the evaluation was performed,
-  // or temporary messages produced by the evaluation that will be
-  // deleted when the EvaluationResult goes out of scope.
+  // or temporary messages produced by the evaluation or held by the
+  // expression (e.g. literals) that will be deleted when the
+  // EvaluationResult goes out of scope.
   const std::vector<const ::google::protobuf::Message*>& GetMessages() const;
 
   // Returns success with a boolean value if the EvaluationResult represents
@@ -267,10 +327,248 @@ class EvaluationResult {
 
  private:
   friend class CompiledExpression;
+  friend class CompiledExpressionSet;
+
+  EvaluationResult(std::shared_ptr<internal::WorkSpace> work_space,
+                   std::shared_ptr<const internal::ExpressionNode> expression,
+                   std::vector<const ::google::protobuf::Message*> messages);
+
+  // The workspace owning any temporary messages in the result. It may be
+  // shared with the results of other expressions evaluated together with this
+  // one. See CompiledExpressionSet.
+  std::shared_ptr<internal::WorkSpace> work_space_;
+
+  // The expression that was evaluated, which owns the messages of literals
+  // in the result.
+  std::shared_ptr<const internal::ExpressionNode> expression_;
+
+  std::vector<const ::google::protobuf::Message*> messages_;
+};
+
+// Options for evaluating a CompiledExpression against a batch of messages.
+// See CompiledExpression::EvaluateBatch.
+struct BatchEvaluationOptions {
+  // Thread pool on which the batch is evaluated. The batch is split into
+  // shards and each shard is evaluated by a single task, reusing one
+  // workspace for every message in the shard. If null, the batch is evaluated
+  // on the calling thread. The pool is not owned.
+  tensorflow::thread::ThreadPool* thread_pool = nullptr;
+
+  // The minimum number of messages assigned to a single shard. Small shards
+  // make for better load balancing, large shards for less scheduling
+  // overhead.
+  int min_shard_size = 256;
+};
+
+// The result of evaluating a CompiledExpression against a batch of messages,
+// stored in a compact form that does not retain the per-message workspaces.
+//
+// For each message in the batch this records whether evaluation succeeded,
+// the number of elements in the resulting collection and, when the result is
+// a single boolean, its value. Booleans are packed into bitsets so that a
+// filter over millions of messages costs two bits per message.
+//
+// This class is immutable and thread safe.
+class BatchEvaluationResult {
+ public:
+  BatchEvaluationResult() : size_(0) {}
+
+  // Returns the number of messages in the batch.
+  size_t size() const { return size_; }
+
+  // Returns true if the expression was successfully evaluated against every
+  // message in the batch.
+  bool ok() const { return errors_.empty(); }
+
+  // Returns the status of evaluating the expression against the message at
+  // the given index in the batch.
+  Status status(size_t index) const;
+
+  // Returns the (index, status) pairs of all messages that failed to
+  // evaluate, ordered by index.
+  const std::vector<std::pair<size_t, Status>>& errors() const {
+    return errors_;
+  }
+
+  // Returns the number of elements in the collection the expression produced
+  // for the message at the given index. Zero if evaluation failed.
+  uint32_t result_size(size_t index) const { return result_sizes_[index]; }
+
+  // Returns success with a boolean value if the expression produced a single
+  // boolean for the message at the given index. See
+  // EvaluationResult::GetBoolean.
+  StatusOr<bool> GetBoolean(size_t index) const;
+
+  // Returns true if the expression produced the single boolean value true for
+  // the message at the given index. This is the usual semantics when a
+  // FHIRPath expression is used as a filter.
+  bool Matches(size_t index) const {
+    return TestBit(true_bits_, index);
+  }
+
+  // Returns the number of messages for which Matches() is true.
+  size_t MatchCount() const;
+
+  // Returns the indices of the messages for which Matches() is true, in
+  // ascending order.
+  std::vector<size_t> MatchingIndices() const;
+
+ private:
+  friend class ColumnarExpression;
+  friend class CompiledExpression;
+
+  static bool TestBit(const std::vector<uint64_t>& bits, size_t index) {
+    return (bits[index / 64] >> (index % 64)) & 1;
+  }
+
+  size_t size_;
+
+  // Bit i is set if message i produced a single boolean.
+  std::vector<uint64_t> boolean_bits_;
+
+  // Bit i is set if message i produced the single boolean true.
+  std::vector<uint64_t> true_bits_;
+
+  std::vector<uint32_t> result_sizes_;
+
+  std::vector<std::pair<size_t, Status>> errors_;
+};
+
+// A collection of FHIRPath expressions that have been parsed ahead of time.
+//
+// Parsing is independent of the message type an expression is evaluated
+// against, so the syntax trees of a fixed set of expressions, such as the
+// constraints annotated on the resources of a FHIR version, can be produced by
+// a build step (see parse_fhir_path_constraints.cc) and loaded from their
+// serialized form at startup. Expressions compiled with this collection in
+// their CompileOptions skip parsing. They are still compiled against the
+// message type, which checks that every field they reference exists.
+//
+// This class is immutable once populated and thread safe.
+class ParsedExpressions {
+ public:
+  ParsedExpressions();
+  ~ParsedExpressions();
+
+  ParsedExpressions(ParsedExpressions&& other);
+  ParsedExpressions& operator=(ParsedExpressions&& other);
+
+  // Loads expressions from their serialized form. Returns an
+  // InvalidArgumentError if any of the syntax trees is malformed.
+  static StatusOr<ParsedExpressions> FromProto(
+      const proto::ParsedFhirPathExpressions& expressions);
+
+  // Same as above, from the bytes of a serialized ParsedFhirPathExpressions
+  // such as the output of parse_fhir_path_constraints.
+  static StatusOr<ParsedExpressions> FromSerializedProto(
+      absl::string_view serialized);
+
+  // Parses the expression and adds it to the collection, unless it has already
+  // been added. Returns an error if the expression fails to parse.
+  Status Add(const std::string& fhir_path);
 
-  explicit EvaluationResult(std::unique_ptr<internal::WorkSpace> work_space);
+  // Returns the serialized form of the collection, with expressions ordered
+  // by their text.
+  proto::ParsedFhirPathExpressions ToProto() const;
 
-  std::unique_ptr<internal::WorkSpace> work_space_;
+  // Returns the syntax tree of the expression, or nullptr if it is not in the
+  // collection.
+  const internal::AstNode* Find(const std::string& fhir_path) const;
+
+  size_t size() const { return syntax_trees_.size(); }
+
+ private:
+  absl::flat_hash_map<std::string, std::unique_ptr<internal::AstNode>>
+      syntax_trees_;
+};
+
+// Records how much work each part of a FHIRPath expression does, for
+// expressions compiled with this profiler in their CompileOptions.
+//
+// Every subexpression of a profiled expression records the number of times it
+// was evaluated, the number of values in its inputs (the values produced by
+// the subexpressions it is applied to) and in its results, the number of
+// temporary messages it created, and the wall time spent evaluating it,
+// including its subexpressions. Expressions compiled without a profiler are
+// not instrumented at all.
+//
+// This class is thread safe.
+class EvaluationProfiler {
+ public:
+  // The statistics of a subexpression.
+  struct NodeStats {
+    // The subexpression, e.g. "code.coding".
+    std::string expression;
+    // The depth of the subexpression in the expression's syntax tree; the
+    // whole expression has depth 0.
+    int depth = 0;
+    int64_t evaluations = 0;
+    int64_t input_size = 0;
+    int64_t output_size = 0;
+    int64_t temporaries = 0;
+    absl::Duration wall_time;
+  };
+
+  // The statistics of a compiled expression.
+  struct ExpressionStats {
+    std::string fhir_path;
+    // The message type the expression was compiled for.
+    const ::google::protobuf::Descriptor* descriptor = nullptr;
+    // The expression's subexpressions in pre-order, so nodes[0] is the whole
+    // expression.
+    std::vector<NodeStats> nodes;
+
+    absl::Duration wall_time() const {
+      return nodes.empty() ? absl::ZeroDuration() : nodes[0].wall_time;
+    }
+  };
+
+  EvaluationProfiler();
+  ~EvaluationProfiler();
+
+  EvaluationProfiler(const EvaluationProfiler&) = delete;
+  EvaluationProfiler& operator=(const EvaluationProfiler&) = delete;
+
+  // Returns the statistics of every expression compiled with this profiler,
+  // in the order they were compiled.
+  std::vector<ExpressionStats> GetStats() const;
+
+  // Returns the statistics of the n expressions with the most wall time,
+  // most expensive first.
+  std::vector<ExpressionStats> MostExpensive(int n) const;
+
+  // Returns a listing of the n expressions with the most wall time, each with
+  // its subexpressions annotated with their statistics.
+  std::string Report(int n) const;
+
+  // Returns the subexpressions of the expression, indented by depth and
+  // annotated with their statistics.
+  static std::string Explain(const ExpressionStats& stats);
+
+  // Resets the statistics of all expressions to zero.
+  void Clear();
+
+  // Registers the profile of an expression compiled with this profiler.
+  void AddExpression(std::unique_ptr<internal::ExpressionProfile> profile);
+
+ private:
+  mutable absl::Mutex mutex_;
+  std::vector<std::unique_ptr<internal::ExpressionProfile>> expressions_;
+};
+
+// Options for compiling FHIRPath expressions.
+struct CompileOptions {
+  // Expressions parsed ahead of time, which are compiled from their syntax
+  // trees instead of being parsed again. Must outlive compilation.
+  const ParsedExpressions* parsed_expressions = nullptr;
+
+  // Profiler that records statistics of every evaluation of the compiled
+  // expressions. Must outlive them.
+  EvaluationProfiler* profiler = nullptr;
+
+  // The value sets checked by memberOf(). Expressions that call memberOf()
+  // fail to compile without an index. Must outlive the compiled expressions.
+  const TerminologyIndex* terminology = nullptr;
 };
 
 // Represents a FHIRPath expression that has been "compiled" to run efficiently
@@ -296,6 +594,12 @@ class CompiledExpression {
       const ::google::protobuf::Descriptor* descriptor,
       const PrimitiveHandler* primitive_handler, const std::string& fhir_path);
 
+  // Same as above, using the given options.
+  static StatusOr<CompiledExpression> Compile(
+      const ::google::protobuf::Descriptor* descriptor,
+      const PrimitiveHandler* primitive_handler, const std::string& fhir_path,
+      const CompileOptions& options);
+
   // Evaluates the compiled expression against the given message.
   StatusOr<EvaluationResult> Evaluate(const ::google::protobuf::Message& message) const;
 
@@ -307,15 +611,190 @@ class CompiledExpression {
   StatusOr<EvaluationResult> Evaluate(
       const internal::WorkspaceMessage& message) const;
 
+  // Evaluates the compiled expression against each of the given messages.
+  //
+  // Unlike Evaluate, which allocates a new workspace for every message, this
+  // reuses a single workspace for each shard of the batch and optionally
+  // evaluates the shards in parallel (see BatchEvaluationOptions.) Failure to
+  // evaluate an individual message is recorded in the returned result rather
+  // than aborting the batch.
+  //
+  // All messages must be of the type the expression was compiled for and
+  // must remain unmodified for the duration of the call.
+  BatchEvaluationResult EvaluateBatch(
+      absl::Span<const ::google::protobuf::Message* const> messages,
+      const BatchEvaluationOptions& options = BatchEvaluationOptions()) const;
+
+  // Returns the fields of the message the expression is evaluated against
+  // that the expression reads, in field number order, or null if they are not
+  // statically known. The expression depends on the message only through the
+  // values of these fields, so it has the same result for any two messages
+  // that agree on them, e.g. for any message in which none of them are set.
+  //
+  // The fields are not known for expressions that see the message as a
+  // whole, through $this, %context or %resource, or by calling a function
+  // such as children() on it.
+  const std::vector<const ::google::protobuf::FieldDescriptor*>* context_fields()
+      const {
+    return context_fields_.get();
+  }
+
  private:
+  friend class CompiledExpressionSet;
+
   explicit CompiledExpression(
       const std::string& fhir_path,
       std::shared_ptr<internal::ExpressionNode> root_expression,
-      const PrimitiveHandler* primitive_handler_);
+      const PrimitiveHandler* primitive_handler_,
+      std::shared_ptr<const std::vector<const ::google::protobuf::FieldDescriptor*>>
+          context_fields);
 
   std::string fhir_path_;
   std::shared_ptr<const internal::ExpressionNode> root_expression_;
   const PrimitiveHandler* primitive_handler_;
+  std::shared_ptr<const std::vector<const ::google::protobuf::FieldDescriptor*>>
+      context_fields_;
+};
+
+// A set of FHIRPath expressions compiled against the same protobuf message
+// type, and evaluated together against the same message.
+//
+// Expressions added to the set share the compiled form of subexpressions that
+// they have in common (e.g. "text.div" or "extension.exists()") with the
+// expressions added before them. When the set is evaluated, the result of a
+// shared subexpression is computed once and reused by every expression that
+// contains it.
+//
+// Only subexpressions evaluated against the message the set is evaluated
+// against are shared. Subexpressions whose input depends on an enclosing
+// function, such as the criteria of where(), are compiled independently.
+//
+// Nothing is shared when the set is compiled with a profiler, so that the
+// profile of each expression covers all of its subexpressions and only the
+// work done for that expression.
+//
+// Adding expressions is not thread safe. Once all expressions have been added,
+// the set is immutable and may be evaluated concurrently.
+class CompiledExpressionSet {
+ public:
+  CompiledExpressionSet(const ::google::protobuf::Descriptor* descriptor,
+                        const PrimitiveHandler* primitive_handler,
+                        const CompileOptions& options = CompileOptions());
+
+  // Compiles the FHIRPath expression and adds it to the set. If the
+  // expression fails to compile, an error is returned and the set is left
+  // unchanged.
+  Status Add(const std::string& fhir_path);
+
+  // Returns the expressions in the set, in the order they were added.
+  //
+  // Each may also be evaluated on its own, in which case subexpressions it
+  // contains more than once are still only computed once.
+  const std::vector<CompiledExpression>& expressions() const {
+    return expressions_;
+  }
+
+  size_t size() const { return expressions_.size(); }
+
+  bool empty() const { return expressions_.empty(); }
+
+  // Evaluates every expression in the set against the given message,
+  // returning the result of each expression in the order the expressions
+  // were added.
+  std::vector<StatusOr<EvaluationResult>> Evaluate(
+      const ::google::protobuf::Message& message) const;
+
+  // Same as Evaluate(const ::google::protobuf::Message&) but accepts additional
+  // metadata about the message (e.g. the message's ancestry.)
+  std::vector<StatusOr<EvaluationResult>> Evaluate(
+      const internal::WorkspaceMessage& message) const;
+
+  // Same as above, calling on_evaluated with the index and result of each
+  // expression as soon as it has been evaluated, e.g. to time each
+  // expression. Expressions are evaluated in order, so the work of an
+  // expression includes computing the shared subexpressions that no earlier
+  // expression computed.
+  std::vector<StatusOr<EvaluationResult>> Evaluate(
+      const internal::WorkspaceMessage& message,
+      absl::FunctionRef<void(int index,
+                             const StatusOr<EvaluationResult>& result)>
+          on_evaluated) const;
+
+ private:
+  const ::google::protobuf::Descriptor* descriptor_;
+  const PrimitiveHandler* primitive_handler_;
+  CompileOptions options_;
+  std::vector<CompiledExpression> expressions_;
+
+  // Compiled subexpressions available for reuse by expressions added to the
+  // set, keyed by their canonical text.
+  std::map<std::string, std::shared_ptr<internal::ExpressionNode>>
+      shared_subexpressions_;
+};
+
+// A FHIRPath expression compiled for evaluation against large batches of
+// messages of a single type, such as all the Observations of a cohort.
+//
+// Rather than evaluating the whole expression against one message at a time,
+// each subexpression is evaluated against every message of the batch before
+// moving on to the next. The fields the expression navigates are extracted
+// into columns, which hold the elements produced for all messages in a single
+// array along with the offset of each message's elements. Comparisons, boolean
+// logic and where() criteria are then applied to entire columns in loops over
+// arrays of primitive values, which the compiler can vectorize, so the cost of
+// dispatching on the expression tree is paid once per batch rather than once
+// per message.
+//
+// Only a subset of FHIRPath is supported:
+//   * navigation of fields, other than choice types and contained resources,
+//   * $this and where(criteria),
+//   * exists(), empty() and not(),
+//   * "=" and "!=" between a collection and a string, boolean or number
+//     literal,
+//   * "<", "<=", ">" and ">=" between an integer field and an integer literal,
+//   * "and" and "or".
+// Compile returns an Unimplemented error for valid expressions outside the
+// subset, which callers can evaluate with CompiledExpression::EvaluateBatch
+// instead.
+//
+// For every message, EvaluateBatch gives the result that
+// CompiledExpression::EvaluateBatch gives.
+//
+// This class is immutable and thread safe.
+class ColumnarExpression {
+ public:
+  // Compiles the FHIRPath expression for messages of the given type.
+  static StatusOr<ColumnarExpression> Compile(
+      const ::google::protobuf::Descriptor* descriptor,
+      const PrimitiveHandler* primitive_handler, const std::string& fhir_path);
+
+  // Returns the FHIRPath string used to compile this expression.
+  const std::string& fhir_path() const { return fhir_path_; }
+
+  // Evaluates the expression against each of the given messages. The batch is
+  // split into shards as described by BatchEvaluationOptions, and the columns
+  // of each shard are discarded once it has been evaluated, so the memory used
+  // is proportional to the shard size rather than the batch size.
+  //
+  // All messages must be of the type the expression was compiled for and
+  // must remain unmodified for the duration of the call.
+  BatchEvaluationResult EvaluateBatch(
+      absl::Span<const ::google::protobuf::Message* const> messages,
+      const BatchEvaluationOptions& options = BatchEvaluationOptions()) const;
+
+ private:
+  ColumnarExpression(
+      std::string fhir_path, const PrimitiveHandler* primitive_handler,
+      std::shared_ptr<const internal::ColumnarCollection> collection,
+      std::shared_ptr<const internal::ColumnarPredicate> predicate);
+
+  std::string fhir_path_;
+  const PrimitiveHandler* primitive_handler_;
+
+  // The compiled expression, which is either a collection or a predicate. The
+  // other is null.
+  std::shared_ptr<const internal::ColumnarCollection> collection_;
+  std::shared_ptr<const internal::ColumnarPredicate> predicate_;
 };
 
 }  // namespace fhir_path
@@ -0,0 +1,436 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Benchmarks for FHIRPath evaluation over the R4 example resources.
+//
+// Run with:
+//   bazel test //cc/google/fhir/fhir_path:fhir_path_benchmark \
+//       --test_output=streamed
+
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "google/protobuf/message.h"
+#include "absl/memory/memory.h"
+#include "absl/strings/str_cat.h"
+#include "google/fhir/fhir_path/compiled_expression_cache.h"
+#include "google/fhir/fhir_path/fhir_path.h"
+#include "google/fhir/fhir_path/fhir_path_validation.h"
+#include "google/fhir/fhir_path/parsed_fhir_path_constraints.h"
+#include "google/fhir/fhir_path/r4_fhir_path_validation.h"
+#include "proto/annotations.pb.h"
+#include "google/fhir/r4/primitive_handler.h"
+#include "google/fhir/status/statusor.h"
+#include "proto/r4/core/resources/observation.pb.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/platform/env.h"
+#include "tensorflow/core/platform/logging.h"
+#include "tensorflow/core/platform/test_benchmark.h"
+
+namespace google {
+namespace fhir {
+namespace fhir_path {
+
+namespace {
+
+using ::google::fhir::r4::core::Observation;
+using ::google::protobuf::Message;
+
+// The examples are replicated so that a batch is large enough to keep every
+// thread of the pool busy.
+constexpr int kCopiesPerExample = 100;
+
+constexpr char kFilterExpression[] =
+    "code.coding.where(code = '85354-9').exists()";
+
+std::vector<Observation> LoadObservations() {
+  std::vector<std::string> paths;
+  TF_CHECK_OK(tensorflow::Env::Default()->GetMatchingPaths(
+      absl::StrCat(getenv("TEST_SRCDIR"),
+                   "/com_google_fhir/testdata/r4/examples/"
+                   "Observation-*.prototxt"),
+      &paths));
+  CHECK(!paths.empty());
+
+  std::vector<Observation> examples(paths.size());
+  for (int i = 0; i < paths.size(); ++i) {
+    TF_CHECK_OK(tensorflow::ReadTextProto(tensorflow::Env::Default(), paths[i],
+                                          &examples[i]));
+  }
+
+  std::vector<Observation> observations;
+  observations.reserve(examples.size() * kCopiesPerExample);
+  for (int copy = 0; copy < kCopiesPerExample; ++copy) {
+    observations.insert(observations.end(), examples.begin(), examples.end());
+  }
+  return observations;
+}
+
+const std::vector<const Message*>& Observations() {
+  static const std::vector<Observation>* observations =
+      new std::vector<Observation>(LoadObservations());
+  static const std::vector<const Message*>* messages = [] {
+    auto* messages = new std::vector<const Message*>();
+    for (const Observation& observation : *observations) {
+      messages->push_back(&observation);
+    }
+    return messages;
+  }();
+  return *messages;
+}
+
+CompiledExpression CompileObservationExpression(const std::string& fhir_path) {
+  return CompiledExpression::Compile(Observation::descriptor(),
+                                     r4::R4PrimitiveHandler::GetInstance(),
+                                     fhir_path)
+      .ValueOrDie();
+}
+
+// Evaluates the filter one message at a time with
+// CompiledExpression::Evaluate.
+void BM_EvaluateEach(int iters) {
+  tensorflow::testing::StopTiming();
+  const std::vector<const Message*>& messages = Observations();
+  CompiledExpression expression =
+      CompileObservationExpression(kFilterExpression);
+  tensorflow::testing::StartTiming();
+
+  int matches = 0;
+  for (int i = 0; i < iters; ++i) {
+    for (const Message* message : messages) {
+      EvaluationResult result = expression.Evaluate(*message).ValueOrDie();
+      if (result.GetBoolean().ValueOrDie()) {
+        ++matches;
+      }
+    }
+  }
+
+  CHECK_GT(matches, 0);
+  tensorflow::testing::ItemsProcessed(static_cast<int64_t>(iters) *
+                                      messages.size());
+}
+BENCHMARK(BM_EvaluateEach);
+
+// Evaluates the filter with CompiledExpression::EvaluateBatch on a pool of
+// the given number of threads, or on the calling thread if zero.
+void BM_EvaluateBatch(int iters, int num_threads) {
+  tensorflow::testing::StopTiming();
+  tensorflow::testing::UseRealTime();
+  const std::vector<const Message*>& messages = Observations();
+  CompiledExpression expression =
+      CompileObservationExpression(kFilterExpression);
+
+  std::unique_ptr<tensorflow::thread::ThreadPool> thread_pool;
+  BatchEvaluationOptions options;
+  if (num_threads > 0) {
+    thread_pool = absl::make_unique<tensorflow::thread::ThreadPool>(
+        tensorflow::Env::Default(), "fhir_path_benchmark", num_threads);
+    options.thread_pool = thread_pool.get();
+  }
+  tensorflow::testing::StartTiming();
+
+  size_t matches = 0;
+  for (int i = 0; i < iters; ++i) {
+    matches += expression.EvaluateBatch(messages, options).MatchCount();
+  }
+
+  CHECK_GT(matches, 0);
+  tensorflow::testing::ItemsProcessed(static_cast<int64_t>(iters) *
+                                      messages.size());
+}
+BENCHMARK(BM_EvaluateBatch)->Arg(0)->Arg(1)->Arg(2)->Arg(4)->Arg(8)->Arg(16);
+
+// Evaluates the filter with ColumnarExpression::EvaluateBatch on the calling
+// thread, for comparison with BM_EvaluateBatch/0.
+void BM_EvaluateColumnar(int iters) {
+  tensorflow::testing::StopTiming();
+  const std::vector<const Message*>& messages = Observations();
+  ColumnarExpression expression =
+      ColumnarExpression::Compile(Observation::descriptor(),
+                                  r4::R4PrimitiveHandler::GetInstance(),
+                                  kFilterExpression)
+          .ValueOrDie();
+  tensorflow::testing::StartTiming();
+
+  size_t matches = 0;
+  for (int i = 0; i < iters; ++i) {
+    matches += expression.EvaluateBatch(messages).MatchCount();
+  }
+
+  CHECK_GT(matches, 0);
+  tensorflow::testing::ItemsProcessed(static_cast<int64_t>(iters) *
+                                      messages.size());
+}
+BENCHMARK(BM_EvaluateColumnar);
+
+// Evaluates an expression that only needs the first matching descendant of
+// each message.
+void BM_EvaluateDescendantsExists(int iters) {
+  tensorflow::testing::StopTiming();
+  const std::vector<const Message*>& messages = Observations();
+  CompiledExpression expression =
+      CompileObservationExpression("descendants().ofType(Coding).exists()");
+  tensorflow::testing::StartTiming();
+
+  int matches = 0;
+  for (int i = 0; i < iters; ++i) {
+    for (const Message* message : messages) {
+      EvaluationResult result = expression.Evaluate(*message).ValueOrDie();
+      if (result.GetBoolean().ValueOrDie()) {
+        ++matches;
+      }
+    }
+  }
+
+  CHECK_GT(matches, 0);
+  tensorflow::testing::ItemsProcessed(static_cast<int64_t>(iters) *
+                                      messages.size());
+}
+BENCHMARK(BM_EvaluateDescendantsExists);
+
+// Evaluates a set operation over every descendant of each message.
+void BM_EvaluateDistinctDescendants(int iters) {
+  tensorflow::testing::StopTiming();
+  const std::vector<const Message*>& messages = Observations();
+  CompiledExpression expression =
+      CompileObservationExpression("descendants().distinct().count()");
+  tensorflow::testing::StartTiming();
+
+  int64_t distinct = 0;
+  for (int i = 0; i < iters; ++i) {
+    for (const Message* message : messages) {
+      EvaluationResult result = expression.Evaluate(*message).ValueOrDie();
+      distinct += result.GetInteger().ValueOrDie();
+    }
+  }
+
+  CHECK_GT(distinct, 0);
+  tensorflow::testing::ItemsProcessed(static_cast<int64_t>(iters) *
+                                      messages.size());
+}
+BENCHMARK(BM_EvaluateDistinctDescendants);
+
+// Evaluates a member invocation on every descendant of each message. The
+// descendants have many types, so the field is looked up at evaluation time.
+void BM_EvaluateDescendantsField(int iters) {
+  tensorflow::testing::StopTiming();
+  const std::vector<const Message*>& messages = Observations();
+  CompiledExpression expression =
+      CompileObservationExpression("descendants().system.count()");
+  tensorflow::testing::StartTiming();
+
+  int64_t systems = 0;
+  for (int i = 0; i < iters; ++i) {
+    for (const Message* message : messages) {
+      EvaluationResult result = expression.Evaluate(*message).ValueOrDie();
+      systems += result.GetInteger().ValueOrDie();
+    }
+  }
+
+  CHECK_GT(systems, 0);
+  tensorflow::testing::ItemsProcessed(static_cast<int64_t>(iters) *
+                                      messages.size());
+}
+BENCHMARK(BM_EvaluateDescendantsField);
+
+// Evaluates decimal equality and a set operation, which hashes decimals, over
+// the quantities of each message.
+void BM_EvaluateDecimalEquality(int iters) {
+  tensorflow::testing::StopTiming();
+  const std::vector<const Message*>& messages = Observations();
+  CompiledExpression expression = CompileObservationExpression(
+      "(value.ofType(Quantity).value | component.value.ofType(Quantity).value)"
+      ".where($this = 10.0).count()");
+  tensorflow::testing::StartTiming();
+
+  int64_t matches = 0;
+  for (int i = 0; i < iters; ++i) {
+    for (const Message* message : messages) {
+      EvaluationResult result = expression.Evaluate(*message).ValueOrDie();
+      matches += result.GetInteger().ValueOrDie();
+    }
+  }
+
+  CHECK_GT(matches, 0);
+  tensorflow::testing::ItemsProcessed(static_cast<int64_t>(iters) *
+                                      messages.size());
+}
+BENCHMARK(BM_EvaluateDecimalEquality);
+
+// Evaluates the FHIRPath constraints defined on Observation. Constraints that
+// use unsupported FHIRPath features are skipped.
+void BM_EvaluateConstraints(int iters) {
+  tensorflow::testing::StopTiming();
+  const std::vector<const Message*>& messages = Observations();
+
+  std::vector<CompiledExpression> constraints;
+  const ::google::protobuf::MessageOptions& message_options =
+      Observation::descriptor()->options();
+  for (int i = 0;
+       i < message_options.ExtensionSize(proto::fhir_path_message_constraint);
+       ++i) {
+    StatusOr<CompiledExpression> constraint = CompiledExpression::Compile(
+        Observation::descriptor(), r4::R4PrimitiveHandler::GetInstance(),
+        message_options.GetExtension(proto::fhir_path_message_constraint, i));
+    if (constraint.ok()) {
+      constraints.push_back(constraint.ValueOrDie());
+    }
+  }
+  CHECK(!constraints.empty());
+  tensorflow::testing::StartTiming();
+
+  int satisfied = 0;
+  for (int i = 0; i < iters; ++i) {
+    for (const Message* message : messages) {
+      for (const CompiledExpression& constraint : constraints) {
+        StatusOr<EvaluationResult> result = constraint.Evaluate(*message);
+        if (result.ok() && result.ValueOrDie().GetBoolean().ok() &&
+            result.ValueOrDie().GetBoolean().ValueOrDie()) {
+          ++satisfied;
+        }
+      }
+    }
+  }
+
+  CHECK_GT(satisfied, 0);
+  tensorflow::testing::ItemsProcessed(static_cast<int64_t>(iters) *
+                                      messages.size());
+}
+BENCHMARK(BM_EvaluateConstraints);
+
+// Compiles the filter, either directly or through a CompiledExpressionCache
+// that already holds it.
+void BM_Compile(int iters, int cached) {
+  tensorflow::testing::StopTiming();
+  CompiledExpressionCache cache;
+  CHECK(cache
+            .WarmUp(Observation::descriptor(),
+                    r4::R4PrimitiveHandler::GetInstance(), {kFilterExpression})
+            .ok());
+  tensorflow::testing::StartTiming();
+
+  for (int i = 0; i < iters; ++i) {
+    if (cached) {
+      CHECK(cache
+                .Compile(Observation::descriptor(),
+                         r4::R4PrimitiveHandler::GetInstance(),
+                         kFilterExpression)
+                .ok());
+    } else {
+      CompileObservationExpression(kFilterExpression);
+    }
+  }
+
+  tensorflow::testing::ItemsProcessed(iters);
+}
+BENCHMARK(BM_Compile)->Arg(0)->Arg(1);
+
+// Parses and compiles each of the FHIRPath constraints defined on Observation,
+// including those that fail to compile because they use unsupported FHIRPath
+// features.
+void BM_CompileConstraints(int iters) {
+  tensorflow::testing::StopTiming();
+  const ::google::protobuf::MessageOptions& message_options =
+      Observation::descriptor()->options();
+  std::vector<std::string> constraints;
+  for (int i = 0;
+       i < message_options.ExtensionSize(proto::fhir_path_message_constraint);
+       ++i) {
+    constraints.push_back(
+        message_options.GetExtension(proto::fhir_path_message_constraint, i));
+  }
+  CHECK(!constraints.empty());
+  tensorflow::testing::StartTiming();
+
+  int compiled = 0;
+  for (int i = 0; i < iters; ++i) {
+    for (const std::string& constraint : constraints) {
+      if (CompiledExpression::Compile(Observation::descriptor(),
+                                      r4::R4PrimitiveHandler::GetInstance(),
+                                      constraint)
+              .ok()) {
+        ++compiled;
+      }
+    }
+  }
+
+  CHECK_GT(compiled, 0);
+  tensorflow::testing::ItemsProcessed(static_cast<int64_t>(iters) *
+                                      constraints.size());
+}
+BENCHMARK(BM_CompileConstraints);
+
+// Creates a validator and validates a single Observation with it, which
+// compiles the constraints of Observation and of every type it contains. If
+// parsed is set, the validator compiles the constraints from the syntax trees
+// parsed at build time, as the shared validator does.
+void BM_ValidateColdStart(int iters, int parsed) {
+  tensorflow::testing::StopTiming();
+  const Message& message = *Observations().front();
+  const ParsedExpressions parsed_constraints =
+      ParsedExpressions::FromSerializedProto(
+          internal::R4ParsedFhirPathConstraints())
+          .ValueOrDie();
+  CompileOptions options;
+  if (parsed) {
+    options.parsed_expressions = &parsed_constraints;
+  }
+  tensorflow::testing::StartTiming();
+
+  for (int i = 0; i < iters; ++i) {
+    r4::FhirPathValidator validator(options);
+    validator.Validate(message);
+  }
+
+  tensorflow::testing::ItemsProcessed(iters);
+}
+BENCHMARK(BM_ValidateColdStart)->Arg(0)->Arg(1);
+
+// Validates every Observation with a validator that has already compiled
+// their constraints, recording ValidationMetrics if with_metrics is set, to
+// measure the overhead of the metrics.
+void BM_ValidateWithMetrics(int iters, int with_metrics) {
+  tensorflow::testing::StopTiming();
+  const std::vector<const Message*>& messages = Observations();
+  r4::FhirPathValidator validator;
+  ValidationMetrics metrics;
+  ValidationOptions options;
+  if (with_metrics) {
+    options.metrics = &metrics;
+  }
+  validator.Validate(*messages.front(), options);
+  tensorflow::testing::StartTiming();
+
+  int valid = 0;
+  for (int i = 0; i < iters; ++i) {
+    for (const Message* message : messages) {
+      if (validator.Validate(*message, options).IsValid()) {
+        ++valid;
+      }
+    }
+  }
+
+  CHECK_GT(valid, 0);
+  tensorflow::testing::ItemsProcessed(static_cast<int64_t>(iters) *
+                                      messages.size());
+}
+BENCHMARK(BM_ValidateWithMetrics)->Arg(0)->Arg(1);
+
+}  // namespace
+
+}  // namespace fhir_path
+}  // namespace fhir
+}  // namespace google
@@ -26,6 +26,7 @@
 #include "google/fhir/r4/primitive_handler.h"
 #include "google/fhir/status/status.h"
 #include "google/fhir/stu3/primitive_handler.h"
+#include "google/fhir/terminology.h"
 #include "google/fhir/testutil/proto_matchers.h"
 #include "proto/r4/core/codes.pb.h"
 #include "proto/r4/core/datatypes.pb.h"
@@ -43,6 +44,8 @@
 #include "proto/stu3/resources.pb.h"
 #include "proto/stu3/uscore.pb.h"
 #include "proto/stu3/uscore_codes.pb.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/platform/env.h"
 
 namespace google {
 namespace fhir {
@@ -76,8 +79,10 @@ namespace {
 using ::absl::InvalidArgumentError;
 using ::absl::StatusCode;
 using ::google::protobuf::Message;
+using ::testing::ElementsAre;
 using ::testing::ElementsAreArray;
 using ::testing::Eq;
+using ::testing::IsEmpty;
 using ::testing::StrEq;
 using ::testing::UnorderedElementsAreArray;
 using testutil::EqualsProto;
@@ -548,10 +553,104 @@ FHIR_VERSION_TEST(FhirPathTest, TestFunctionDescendants, {
                structure_definition.differential().element(0).label())}));
 });
 
+FHIR_VERSION_TEST(FhirPathTest, TestFunctionDescendantsOfType, {
+  StructureDefinition structure_definition =
+      ParseFromString<StructureDefinition>(R"proto(
+        name {value: "foo"}
+        context_invariant {value: "bar"}
+        snapshot {element {label {value: "snapshot"}}}
+        differential {element {label {value: "differential"}}}
+      )proto");
+
+  // ofType() limits the traversal of descendants() to fields that can lead to
+  // the type, which must not change the results.
+  EXPECT_THAT(
+      Evaluate(structure_definition, "descendants().ofType(ElementDefinition)")
+          .ValueOrDie()
+          .GetMessages(),
+      UnorderedElementsAreArray(
+          {EqualsProto(structure_definition.snapshot().element(0)),
+           EqualsProto(structure_definition.differential().element(0))}));
+
+  EXPECT_THAT(
+      Evaluate(structure_definition, "descendants().ofType(String)")
+          .ValueOrDie()
+          .GetMessages(),
+      UnorderedElementsAreArray(
+          {EqualsProto(structure_definition.name()),
+           EqualsProto(structure_definition.context_invariant(0)),
+           EqualsProto(structure_definition.snapshot().element(0).label()),
+           EqualsProto(
+               structure_definition.differential().element(0).label())}));
+
+  EXPECT_THAT(Evaluate(structure_definition, "descendants().ofType(Patient)"),
+              EvalsToEmpty());
+});
+
+FHIR_VERSION_TEST(FhirPathTest, TestFieldResolvedAtEvaluationTime, {
+  StructureDefinition structure_definition =
+      ParseFromString<StructureDefinition>(R"proto(
+        url {value: "http://example.com"}
+        name {value: "foo"}
+        date {value_us: 0}
+        snapshot {element {label {value: "snapshot"}}}
+        differential {element {label {value: "differential"}}}
+      )proto");
+
+  // The input of "element" has a mix of types, more than are cached, so the
+  // field is looked up in the descriptor of each message. Evaluating twice
+  // uses the lookups cached by the first evaluation.
+  CompiledExpression expression =
+      Compile(StructureDefinition::descriptor(), "descendants().element")
+          .ValueOrDie();
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_THAT(
+        expression.Evaluate(structure_definition).ValueOrDie().GetMessages(),
+        UnorderedElementsAreArray(
+            {EqualsProto(structure_definition.snapshot().element(0)),
+             EqualsProto(structure_definition.differential().element(0))}));
+  }
+});
+
 FHIR_VERSION_TEST(FhirPathTest, TestFunctionDescendantsOnEmptyCollection, {
   EXPECT_THAT(Evaluate("{}.descendants()"), EvalsToEmpty());
 });
 
+FHIR_VERSION_TEST(FhirPathTest, TestFunctionsStopAtFirstDecidingElement, {
+  // The criteria below can't be evaluated against the second entry of
+  // statusHistory, which has both a status and a period. Functions that are
+  // decided by the first entry never evaluate it.
+  Encounter encounter = ParseFromString<Encounter>(R"proto(
+    status { value: TRIAGED }
+    status_history { status { value: ARRIVED } }
+    status_history {
+      status { value: PLANNED }
+      period {
+        start: { value_us: 1556750153000 timezone: "America/Los_Angeles" }
+      }
+    }
+  )proto");
+
+  EXPECT_THAT(Evaluate(encounter, "statusHistory.where(status | period)"),
+              HasStatusCode(StatusCode::kInvalidArgument));
+  EXPECT_THAT(
+      Evaluate(encounter, "statusHistory.where(status | period).exists()"),
+      EvalsToTrue());
+  EXPECT_THAT(
+      Evaluate(encounter, "statusHistory.where(status | period).empty()"),
+      EvalsToFalse());
+  EXPECT_THAT(
+      Evaluate(encounter, "statusHistory.where(status | period).first()")
+          .ValueOrDie()
+          .GetMessages(),
+      ElementsAreArray({EqualsProto(encounter.status_history(0))}));
+  EXPECT_THAT(
+      Evaluate(encounter, "statusHistory.all(period.exists() and (status | "
+                          "period))"),
+      EvalsToFalse());
+  EXPECT_THAT(Evaluate(encounter, "descendants().exists()"), EvalsToTrue());
+});
+
 FHIR_VERSION_TEST(FhirPathTest, TestFunctionContains, {
   // Wrong number and/or types of arguments.
   EXPECT_THAT(Evaluate("'foo'.contains()"),
@@ -1179,6 +1278,57 @@ FHIR_VERSION_TEST(FhirPathTest, TestIsDistinct, {
   EXPECT_THAT(Evaluate("true.combine(true).isDistinct()"), EvalsToFalse());
 })
 
+FHIR_VERSION_TEST(FhirPathTest, TestDistinctComparesByValue, {
+  Parameters parameters =
+      ParseFromString<Parameters>(R"proto(
+        parameter {value {string_value {value: "a\"b"}}}
+        parameter {value {code {value: "a\"b"}}}
+        parameter {value {uri {value: "caf\303\251"}}}
+        parameter {value {string_value {value: "caf\303\251"}}}
+        parameter {value {integer {value: 1}}}
+        parameter {value {decimal {value: "1"}}}
+        parameter {value {decimal {value: "1.0"}}}
+      )proto");
+
+  // Primitives of different types are distinct only if their values are.
+  EXPECT_THAT(Evaluate(parameters, "parameter.value.distinct().count() = 4"),
+              EvalsToTrue());
+  EXPECT_THAT(Evaluate(parameters, "parameter.value.isDistinct()"),
+              EvalsToFalse());
+  EXPECT_THAT(
+      Evaluate(parameters, "(parameter[0].value | parameter[1].value).count()"
+                           " = 1"),
+      EvalsToTrue());
+  EXPECT_THAT(Evaluate(parameters,
+                       "parameter[2].value.intersect(parameter[3].value)"
+                       ".exists()"),
+              EvalsToTrue());
+
+  // Other messages are distinct if any of their fields differ.
+  Parameters repeated_parameters =
+      ParseFromString<Parameters>(R"proto(
+        parameter {
+          name {value: "foo"}
+          value {integer {value: 1}}
+        }
+        parameter {
+          name {value: "foo"}
+          value {integer {value: 1}}
+        }
+        parameter {
+          name {value: "foo"}
+          value {integer {value: 2}}
+        }
+        parameter {name {value: "foo"}}
+      )proto");
+  EXPECT_THAT(
+      Evaluate(repeated_parameters, "parameter.distinct().count() = 3"),
+      EvalsToTrue());
+  EXPECT_THAT(Evaluate(repeated_parameters,
+                       "(parameter[0] | parameter[1]).count() = 1"),
+              EvalsToTrue());
+})
+
 FHIR_VERSION_TEST(FhirPathTest, TestIndexer, {
   EXPECT_THAT(Evaluate("true[0]"), EvalsToTrue());
   EXPECT_THAT(Evaluate("true[1]"), EvalsToEmpty());
@@ -1531,6 +1681,22 @@ FHIR_VERSION_TEST(FhirPathTest, TestStringAddition, {
   EXPECT_THAT(Evaluate("('foo' + {})"), EvalsToEmpty());
 })
 
+FHIR_VERSION_TEST(FhirPathTest, TestDecimalAddition, {
+  EXPECT_EQ(Evaluate("1.50 + 0.25").ValueOrDie().GetDecimal().ValueOrDie(),
+            "1.75");
+  EXPECT_EQ(Evaluate("0.1 + 0.2").ValueOrDie().GetDecimal().ValueOrDie(),
+            "0.3");
+  EXPECT_EQ(Evaluate("1.50 + 1").ValueOrDie().GetDecimal().ValueOrDie(),
+            "2.50");
+  EXPECT_EQ(Evaluate("2 + 0.5").ValueOrDie().GetDecimal().ValueOrDie(), "2.5");
+  EXPECT_THAT(Evaluate("(0.1 + 0.2) = 0.3"), EvalsToTrue());
+  EXPECT_THAT(Evaluate("({} + 1.5)"), EvalsToEmpty());
+  EXPECT_THAT(Evaluate("(1.5 + {})"), EvalsToEmpty());
+
+  EXPECT_THAT(Evaluate("1.5 + 'foo'"),
+              HasStatusCode(StatusCode::kInvalidArgument));
+})
+
 FHIR_VERSION_TEST(FhirPathTest, TestStringConcatenation, {
   EXPECT_THAT(Evaluate("('foo' & 'bar')"),
               EvalsToStringThatMatches(StrEq("foobar")));
@@ -1627,6 +1793,31 @@ FHIR_VERSION_TEST(FhirPathTest, TestIntegerLikeComparison, {
               EvalsToTrue());
 })
 
+FHIR_VERSION_TEST(FhirPathTest, TestIntegerLikeEquality, {
+  Parameters parameters =
+      ParseFromString<Parameters>(R"proto(
+        parameter {value {integer {value: 0}}}
+        parameter {value {unsigned_int {value: 0}}}
+        parameter {value {integer {id {value: "foo"} value: 0}}}
+        parameter {value {integer {value: 1}}}
+      )proto");
+
+  EXPECT_THAT(Evaluate(parameters, "parameter[0].value = 0"), EvalsToTrue());
+  EXPECT_THAT(Evaluate(parameters, "parameter[3].value = 0"), EvalsToFalse());
+
+  // Integers of different types are compared by value.
+  EXPECT_THAT(Evaluate(parameters, "parameter[0].value = parameter[1].value"),
+              EvalsToTrue());
+  EXPECT_THAT(Evaluate(parameters, "parameter[3].value = parameter[1].value"),
+              EvalsToFalse());
+  EXPECT_THAT(Evaluate(parameters, "parameter[2].value = parameter[1].value"),
+              EvalsToTrue());
+
+  // Integers of the same type are compared as messages.
+  EXPECT_THAT(Evaluate(parameters, "parameter[0].value = parameter[2].value"),
+              EvalsToFalse());
+})
+
 FHIR_VERSION_TEST(FhirPathTest, TestDecimalLiteral, {
   EvaluationResult result = Evaluate("1.25").ValueOrDie();
   EXPECT_EQ("1.25", result.GetDecimal().ValueOrDie());
@@ -1656,6 +1847,41 @@ FHIR_VERSION_TEST(FhirPathTest, TestDecimalComparisons, {
   EXPECT_THAT(Evaluate("1.25 <= 1.26"), EvalsToTrue());
   EXPECT_THAT(Evaluate("1.26 <= 1.25"), EvalsToFalse());
   EXPECT_THAT(Evaluate("1.26 <= 1"), EvalsToFalse());
+
+  // Comparisons are exact, regardless of precision.
+  EXPECT_THAT(Evaluate("0.1 < 0.10000000000000001"), EvalsToTrue());
+  EXPECT_THAT(Evaluate("12345678901234567.1 > 12345678901234567.0"),
+              EvalsToTrue());
+  EXPECT_THAT(Evaluate("1.0 <= 1.00"), EvalsToTrue());
+  EXPECT_THAT(Evaluate("1.00 >= 1"), EvalsToTrue());
+  EXPECT_THAT(Evaluate("1.00 < 1"), EvalsToFalse());
+
+  // Equality agrees with the comparisons above, and so do distinct() and
+  // union, which hash decimals.
+  EXPECT_THAT(Evaluate("1.0 = 1.00"), EvalsToTrue());
+  EXPECT_THAT(Evaluate("1.0 != 1.00"), EvalsToFalse());
+  EXPECT_THAT(Evaluate("-0.0 = 0.00"), EvalsToTrue());
+  EXPECT_THAT(Evaluate("1.50 = 1.05"), EvalsToFalse());
+  EXPECT_THAT(Evaluate("(1.0 | 1.00 | 1.5 | 1.50).count() = 2"),
+              EvalsToTrue());
+  EXPECT_THAT(Evaluate("1.0.combine(1.000).distinct().count() = 1"),
+              EvalsToTrue());
+})
+
+FHIR_VERSION_TEST(FhirPathTest, TestMultiplication, {
+  EXPECT_EQ(Evaluate("2 * 3").ValueOrDie().GetInteger().ValueOrDie(), 6);
+  EXPECT_EQ(Evaluate("1.5 * 2.0").ValueOrDie().GetDecimal().ValueOrDie(),
+            "3.00");
+  EXPECT_EQ(Evaluate("0.5 * 3").ValueOrDie().GetDecimal().ValueOrDie(),
+            "1.5");
+  EXPECT_THAT(Evaluate("(0.1 * 3) = 0.3"), EvalsToTrue());
+  EXPECT_THAT(Evaluate("({} * 2)"), EvalsToEmpty());
+  EXPECT_THAT(Evaluate("(2 * {})"), EvalsToEmpty());
+
+  EXPECT_THAT(Evaluate("65536 * 65536"),
+              HasStatusCode(StatusCode::kInvalidArgument));
+  EXPECT_THAT(Evaluate("2 * 'foo'"),
+              HasStatusCode(StatusCode::kInvalidArgument));
 })
 
 FHIR_VERSION_TEST(FhirPathTest, TestStringLiteral, {
@@ -1937,6 +2163,17 @@ FHIR_VERSION_TEST(FhirPathTest, TimeCompareMicroseconds, {
   EXPECT_THAT(Evaluate(CreatePeriod<Period, DateTime>(start_micros, end_micros),
                        "start <= end"),
               EvalsToFalse());
+
+  // Times with second and millisecond precision are comparable.
+  DateTime end_millis = start_micros;
+  end_millis.set_precision(DateTime::MILLISECOND);
+  end_millis.set_value_us(1556750000000000);
+  DateTime start_seconds = start_micros;
+  start_seconds.set_precision(DateTime::SECOND);
+  EXPECT_THAT(Evaluate(CreatePeriod<Period, DateTime>(start_seconds,
+                                                      end_millis),
+                       "start > end"),
+              EvalsToTrue());
 })
 
 FHIR_VERSION_TEST(FhirPathTest, SimpleQuantityComparisons, {
@@ -1962,6 +2199,13 @@ FHIR_VERSION_TEST(FhirPathTest, SimpleQuantityComparisons, {
           system { value: "http://valuesystem.example.org/different" }
           code { value: "bar" }
         }
+        area_under_curve {
+          value { value: "1.10" }
+          system { value: "http://valuesystem.example.org/foo" }
+          code { value: "bar" }
+        }
+        area_under_curve { value { value: "2" } }
+        area_under_curve { value { value: "3" } }
       )proto");
 
   EXPECT_THAT(Evaluate(kinetics, "areaUnderCurve[0] < areaUnderCurve[0]"),
@@ -1991,6 +2235,20 @@ FHIR_VERSION_TEST(FhirPathTest, SimpleQuantityComparisons, {
   EXPECT_THAT(Evaluate(kinetics, "areaUnderCurve[0] > areaUnderCurve[1]"),
               EvalsToFalse());
 
+  // Values of different precision are compared exactly.
+  EXPECT_THAT(Evaluate(kinetics, "areaUnderCurve[0] <= areaUnderCurve[4]"),
+              EvalsToTrue());
+  EXPECT_THAT(Evaluate(kinetics, "areaUnderCurve[4] >= areaUnderCurve[0]"),
+              EvalsToTrue());
+  EXPECT_THAT(Evaluate(kinetics, "areaUnderCurve[4] < areaUnderCurve[0]"),
+              EvalsToFalse());
+
+  // Quantities without units are compared with each other.
+  EXPECT_THAT(Evaluate(kinetics, "areaUnderCurve[5] < areaUnderCurve[6]"),
+              EvalsToTrue());
+  EXPECT_THAT(Evaluate(kinetics, "areaUnderCurve[0] < areaUnderCurve[5]"),
+              HasStatusCode(StatusCode::kInvalidArgument));
+
   // Different quantity codes
   EXPECT_THAT(Evaluate(kinetics, "areaUnderCurve[0] > areaUnderCurve[2]"),
               HasStatusCode(StatusCode::kInvalidArgument));
@@ -2036,6 +2294,21 @@ TEST(FhirPathTest, PathNavigationAfterContainedResourceR4Any) {
               EvalsToStringThatMatches(StrEq("bar")));
 }
 
+TEST(FhirPathTest, ContainedResourcesUnpackedOnlyAsNeededR4Any) {
+  auto contained = ParseFromString<r4::core::ContainedResource>(
+      "observation { value: { string_value: { value: 'bar' } } } ");
+  r4::core::Patient patient;
+  patient.add_contained()->PackFrom(contained);
+  patient.add_contained()->set_type_url("type.googleapis.com/not.a.Resource");
+
+  // Only navigating to the second contained resource unpacks it.
+  EXPECT_THAT(r4test::Evaluate(patient, "contained"),
+              HasStatusCode(StatusCode::kUnimplemented));
+  EXPECT_THAT(r4test::Evaluate(patient, "contained.exists()"), EvalsToTrue());
+  EXPECT_THAT(r4test::Evaluate(patient, "contained.first().value"),
+              EvalsToStringThatMatches(StrEq("bar")));
+}
+
 FHIR_VERSION_TEST(FhirPathTest, ResourceReference, {
   Bundle bundle = ParseFromString<Bundle>(
       R"proto(entry: {
@@ -2151,6 +2424,589 @@ FHIR_VERSION_TEST(FhirPathTest, ResourceReference, {
                    EqualsProto(bundle)}));
 })
 
+FHIR_VERSION_TEST(FhirPathTest, TestCompiledExpressionSet, {
+  Encounter encounter = ValidEncounter<Encounter>();
+  CompiledExpressionSet expression_set(
+      Encounter::descriptor(),
+      GetPrimitiveHandler(Encounter::descriptor()).ValueOrDie());
+
+  FHIR_ASSERT_OK(expression_set.Add("id.toString() = '123'"));
+  FHIR_ASSERT_OK(expression_set.Add("id.toString()"));
+  FHIR_ASSERT_OK(
+      expression_set.Add("period.start.exists() and id.toString().exists()"));
+  FHIR_ASSERT_OK(expression_set.Add("id.toString().first()"));
+  FHIR_ASSERT_OK(expression_set.Add("status.combine(status).single()"));
+  FHIR_ASSERT_OK(expression_set.Add("statusHistory.where(status.exists())"));
+  EXPECT_EQ(expression_set.Add("id.doesNotExist").code(),
+            StatusCode::kNotFound);
+  EXPECT_FALSE(expression_set.Add("id.where(").ok());
+  ASSERT_EQ(expression_set.size(), 6);
+
+  std::vector<StatusOr<EvaluationResult>> results =
+      expression_set.Evaluate(encounter);
+  ASSERT_EQ(results.size(), 6);
+  EXPECT_THAT(results[0], EvalsToTrue());
+  EXPECT_THAT(results[1], EvalsToStringThatMatches(StrEq("123")));
+  EXPECT_THAT(results[2], EvalsToTrue());
+  EXPECT_THAT(results[3], EvalsToStringThatMatches(StrEq("123")));
+  EXPECT_THAT(results[4], HasStatusCode(StatusCode::kFailedPrecondition));
+  EXPECT_THAT(results[5].ValueOrDie().GetMessages(),
+              ElementsAreArray({EqualsProto(encounter.status_history(0))}));
+
+  // The temporary produced by the shared "id.toString()" subexpression is
+  // computed once and shared by the results of each expression using it.
+  EXPECT_EQ(results[1].ValueOrDie().GetMessages()[0],
+            results[3].ValueOrDie().GetMessages()[0]);
+
+  // Results outlive the evaluation of the set and match those of evaluating
+  // each expression on its own.
+  for (int i = 0; i < expression_set.size(); ++i) {
+    StatusOr<EvaluationResult> result =
+        expression_set.expressions()[i].Evaluate(encounter);
+    ASSERT_EQ(result.ok(), results[i].ok());
+    if (result.ok()) {
+      ASSERT_EQ(result.ValueOrDie().GetMessages().size(),
+                results[i].ValueOrDie().GetMessages().size());
+      for (int j = 0; j < result.ValueOrDie().GetMessages().size(); ++j) {
+        EXPECT_THAT(*result.ValueOrDie().GetMessages()[j],
+                    EqualsProto(*results[i].ValueOrDie().GetMessages()[j]));
+      }
+    }
+  }
+})
+
+FHIR_VERSION_TEST(FhirPathTest, TestContextFields, {
+  const ::google::protobuf::Descriptor* descriptor = Encounter::descriptor();
+  // The fields are owned by the expressions, which are kept alive here.
+  std::vector<CompiledExpression> expressions;
+  auto context_fields = [&](const std::string& fhir_path) {
+    expressions.push_back(Compile(descriptor, fhir_path).ValueOrDie());
+    return expressions.back().context_fields();
+  };
+
+  EXPECT_THAT(
+      *context_fields("period.start.exists() and id.toString().exists()"),
+      ElementsAre(descriptor->FindFieldByName("id"),
+                  descriptor->FindFieldByName("period")));
+  // The criteria of where() read the elements of its input, not the
+  // encounter, while the parameter of combine() is read from the encounter.
+  EXPECT_THAT(*context_fields("statusHistory.where(status.exists())"),
+              ElementsAre(descriptor->FindFieldByName("status_history")));
+  EXPECT_THAT(*context_fields("statusHistory.status.combine(status).count()"),
+              ElementsAre(descriptor->FindFieldByName("status"),
+                          descriptor->FindFieldByName("status_history")));
+  EXPECT_THAT(*context_fields("statusHistory.where($this.period.exists())"),
+              ElementsAre(descriptor->FindFieldByName("status_history")));
+  EXPECT_THAT(*context_fields("1 + 1 = 2"), IsEmpty());
+
+  // Expressions that see the encounter as a whole.
+  for (const std::string& fhir_path : {
+           "$this.id.exists()",
+           "exists()",
+           "children().exists()",
+           "%context.id.exists()",
+           "%resource.id.exists()",
+           "statusHistory.where(%resource.id.exists()).exists()",
+       }) {
+    EXPECT_EQ(context_fields(fhir_path), nullptr) << fhir_path;
+  }
+})
+
+FHIR_VERSION_TEST(FhirPathTest, TestParsedExpressions, {
+  Encounter encounter = ValidEncounter<Encounter>();
+
+  ParsedExpressions parsed;
+  FHIR_ASSERT_OK(parsed.Add("id.toString() = '123'"));
+  FHIR_ASSERT_OK(parsed.Add("id.doesNotExist"));
+  EXPECT_FALSE(parsed.Add("id.where(").ok());
+
+  // The saved syntax tree of an expression is used in place of parsing its
+  // text.
+  proto::ParsedFhirPathExpressions saved = parsed.ToProto();
+  ASSERT_EQ(saved.expression_size(), 2);
+  auto* substituted = saved.add_expression();
+  substituted->set_fhir_path("not a valid expression (");
+  substituted->mutable_ast()->set_type(proto::FhirPathAstNode::IDENTIFIER);
+  substituted->mutable_ast()->set_text("status");
+
+  ParsedExpressions loaded = ParsedExpressions::FromProto(saved).ValueOrDie();
+  EXPECT_EQ(loaded.size(), 3);
+  CompileOptions options;
+  options.parsed_expressions = &loaded;
+  const PrimitiveHandler* primitive_handler =
+      GetPrimitiveHandler(Encounter::descriptor()).ValueOrDie();
+
+  EXPECT_THAT(CompiledExpression::Compile(Encounter::descriptor(),
+                                          primitive_handler,
+                                          "id.toString() = '123'", options)
+                  .ValueOrDie()
+                  .Evaluate(encounter),
+              EvalsToTrue());
+  EXPECT_THAT(CompiledExpression::Compile(Encounter::descriptor(),
+                                          primitive_handler,
+                                          "not a valid expression (", options)
+                  .ValueOrDie()
+                  .Evaluate(encounter)
+                  .ValueOrDie()
+                  .GetMessages(),
+              ElementsAreArray({EqualsProto(encounter.status())}));
+
+  // Saved expressions are still checked against the message type.
+  EXPECT_THAT(CompiledExpression::Compile(Encounter::descriptor(),
+                                          primitive_handler, "id.doesNotExist",
+                                          options),
+              HasStatusCode(StatusCode::kNotFound));
+
+  // Expressions that were not saved are parsed.
+  CompiledExpressionSet expression_set(Encounter::descriptor(),
+                                       primitive_handler, options);
+  FHIR_ASSERT_OK(expression_set.Add("id.toString() = '123'"));
+  FHIR_ASSERT_OK(expression_set.Add("status.exists()"));
+  EXPECT_FALSE(expression_set.Add("id.where(").ok());
+  ASSERT_EQ(expression_set.size(), 2);
+
+  // Expressions are also loaded from their serialized form.
+  EXPECT_EQ(ParsedExpressions::FromSerializedProto(saved.SerializeAsString())
+                .ValueOrDie()
+                .size(),
+            3);
+  EXPECT_THAT(ParsedExpressions::FromSerializedProto("not a proto"),
+              HasStatusCode(StatusCode::kInvalidArgument));
+
+  // Malformed syntax trees are rejected when loaded.
+  saved.mutable_expression(0)->mutable_ast()->clear_children();
+  EXPECT_THAT(ParsedExpressions::FromProto(saved),
+              HasStatusCode(StatusCode::kInvalidArgument));
+})
+
+FHIR_VERSION_TEST(FhirPathTest, TestMemberOf, {
+  TerminologyIndex::Builder builder;
+  ValueSetDefinition value_set;
+  value_set.url = "http://example.com/vs";
+  value_set.includes.push_back({"foo", {"bar", "baz"}});
+  builder.AddValueSet(value_set);
+  const TerminologyIndex terminology = builder.Build().ValueOrDie();
+
+  // memberOf() requires an index of value sets.
+  EXPECT_EQ(Compile(Observation::descriptor(),
+                    "code.memberOf('http://example.com/vs')")
+                .status()
+                .code(),
+            StatusCode::kInvalidArgument);
+
+  Observation observation = ValidObservation<Observation>();
+  CompileOptions options;
+  options.terminology = &terminology;
+  const PrimitiveHandler* primitive_handler =
+      GetPrimitiveHandler(Observation::descriptor()).ValueOrDie();
+  auto evaluate = [&](const std::string& fhir_path) {
+    return CompiledExpression::Compile(Observation::descriptor(),
+                                       primitive_handler, fhir_path, options)
+        .ValueOrDie()
+        .Evaluate(observation);
+  };
+
+  EXPECT_THAT(evaluate("code.memberOf('http://example.com/vs')"),
+              EvalsToTrue());
+  EXPECT_THAT(evaluate("code.coding.memberOf('http://example.com/vs')"),
+              EvalsToTrue());
+  EXPECT_THAT(evaluate("code.coding.code.memberOf('http://example.com/vs')"),
+              EvalsToTrue());
+  EXPECT_THAT(evaluate("'baz'.memberOf('http://example.com/vs')"),
+              EvalsToTrue());
+  EXPECT_THAT(evaluate("'qux'.memberOf('http://example.com/vs')"),
+              EvalsToFalse());
+  EXPECT_THAT(evaluate("code.memberOf('http://example.com/unknown')"),
+              EvalsToEmpty());
+  EXPECT_THAT(evaluate("method.memberOf('http://example.com/vs')"),
+              EvalsToEmpty());
+
+  // Codings of other systems are not members, but their codes are.
+  observation.mutable_code()->mutable_coding(0)->mutable_system()->set_value(
+      "other");
+  EXPECT_THAT(evaluate("code.memberOf('http://example.com/vs')"),
+              EvalsToFalse());
+  EXPECT_THAT(evaluate("code.coding.code.memberOf('http://example.com/vs')"),
+              EvalsToTrue());
+})
+
+FHIR_VERSION_TEST(FhirPathTest, TestEvaluationProfiler, {
+  Observation observation = ValidObservation<Observation>();
+
+  EvaluationProfiler profiler;
+  CompileOptions options;
+  options.profiler = &profiler;
+  CompiledExpression expression =
+      CompiledExpression::Compile(
+          Observation::descriptor(),
+          GetPrimitiveHandler(Observation::descriptor()).ValueOrDie(),
+          "code.coding.where(code = 'bar').exists()", options)
+          .ValueOrDie();
+  EXPECT_FALSE(CompiledExpression::Compile(
+                   Observation::descriptor(),
+                   GetPrimitiveHandler(Observation::descriptor()).ValueOrDie(),
+                   "code.doesNotExist", options)
+                   .ok());
+
+  EXPECT_THAT(expression.Evaluate(observation), EvalsToTrue());
+  EXPECT_THAT(expression.Evaluate(observation), EvalsToTrue());
+
+  // Only the expression that compiled is profiled.
+  std::vector<EvaluationProfiler::ExpressionStats> stats = profiler.GetStats();
+  ASSERT_EQ(stats.size(), 1);
+  EXPECT_EQ(stats[0].fhir_path, "code.coding.where(code = 'bar').exists()");
+  EXPECT_EQ(stats[0].descriptor, Observation::descriptor());
+
+  // Subexpressions are listed in pre-order, with the criteria of where()
+  // following its input.
+  std::vector<std::string> nodes;
+  for (const EvaluationProfiler::NodeStats& node : stats[0].nodes) {
+    nodes.push_back(absl::StrCat(node.depth, ": ", node.expression));
+  }
+  EXPECT_THAT(nodes,
+              ElementsAreArray(
+                  {"0: code . coding . where ( code = 'bar' ) . exists ( )",
+                   "1: code . coding . where ( code = 'bar' )",
+                   "2: code . coding", "3: code", "2: code = 'bar'", "3: code",
+                   "3: 'bar'"}));
+
+  const EvaluationProfiler::NodeStats& root = stats[0].nodes[0];
+  EXPECT_EQ(root.evaluations, 2);
+  EXPECT_EQ(root.input_size, 2);
+  EXPECT_EQ(root.output_size, 2);
+  // Boolean results are shared rather than allocated by the workspace.
+  EXPECT_EQ(root.temporaries, 0);
+  EXPECT_GT(root.wall_time, absl::ZeroDuration());
+
+  // The criteria are evaluated once for each coding.
+  const EvaluationProfiler::NodeStats& criteria = stats[0].nodes[4];
+  EXPECT_EQ(criteria.evaluations, 2);
+  EXPECT_EQ(criteria.input_size, 4);
+  EXPECT_EQ(criteria.output_size, 2);
+
+  EXPECT_EQ(profiler.MostExpensive(5).size(), 1);
+  EXPECT_TRUE(profiler.MostExpensive(0).empty());
+  EXPECT_THAT(profiler.Report(5),
+              ::testing::HasSubstr("      code = 'bar'\n"));
+
+  profiler.Clear();
+  EXPECT_EQ(profiler.GetStats()[0].nodes[0].evaluations, 0);
+  EXPECT_EQ(profiler.GetStats()[0].wall_time(), absl::ZeroDuration());
+})
+
+FHIR_VERSION_TEST(FhirPathTest, TestEvaluationProfilerWithExpressionSet, {
+  Observation observation = ValidObservation<Observation>();
+
+  EvaluationProfiler profiler;
+  CompileOptions options;
+  options.profiler = &profiler;
+  CompiledExpressionSet expression_set(
+      Observation::descriptor(),
+      GetPrimitiveHandler(Observation::descriptor()).ValueOrDie(), options);
+  FHIR_ASSERT_OK(expression_set.Add("code.coding.exists()"));
+  FHIR_ASSERT_OK(expression_set.Add("code.coding.count() = 1"));
+
+  for (const StatusOr<EvaluationResult>& result :
+       expression_set.Evaluate(observation)) {
+    EXPECT_THAT(result, EvalsToTrue());
+  }
+
+  // The subexpression "code.coding" is profiled as part of each expression,
+  // rather than only as part of the first one.
+  std::vector<EvaluationProfiler::ExpressionStats> stats = profiler.GetStats();
+  ASSERT_EQ(stats.size(), 2);
+  std::vector<std::vector<std::string>> nodes;
+  for (const EvaluationProfiler::ExpressionStats& expression : stats) {
+    nodes.emplace_back();
+    for (const EvaluationProfiler::NodeStats& node : expression.nodes) {
+      nodes.back().push_back(absl::StrCat(node.depth, ": ", node.expression));
+    }
+  }
+  EXPECT_THAT(nodes[0], ElementsAreArray({"0: code . coding . exists ( )",
+                                          "1: code . coding", "2: code"}));
+  EXPECT_THAT(nodes[1],
+              ElementsAreArray({"0: code . coding . count ( ) = 1",
+                                "1: code . coding . count ( )",
+                                "2: code . coding", "3: code", "1: 1"}));
+
+  for (const EvaluationProfiler::ExpressionStats& expression : stats) {
+    for (const EvaluationProfiler::NodeStats& node : expression.nodes) {
+      EXPECT_EQ(node.evaluations, 1) << node.expression;
+    }
+  }
+  EXPECT_EQ(stats[1].nodes[2].output_size, 1);
+})
+
+FHIR_VERSION_TEST(FhirPathTest, TestEvaluateBatch, {
+  std::vector<Observation> observations(300, ValidObservation<Observation>());
+  for (int i = 0; i < observations.size(); i += 3) {
+    observations[i].mutable_code()->mutable_coding(0)->mutable_code()
+        ->set_value("baz");
+  }
+  std::vector<const Message*> messages;
+  for (const Observation& observation : observations) {
+    messages.push_back(&observation);
+  }
+
+  CompiledExpression expression =
+      Compile(Observation::descriptor(),
+              "code.coding.where(code = 'bar').exists()")
+          .ValueOrDie();
+
+  tensorflow::thread::ThreadPool thread_pool(tensorflow::Env::Default(),
+                                             "fhir_path_test", 4);
+  BatchEvaluationOptions parallel_options;
+  parallel_options.thread_pool = &thread_pool;
+  parallel_options.min_shard_size = 1;
+
+  for (const BatchEvaluationOptions& options :
+       {BatchEvaluationOptions(), parallel_options}) {
+    BatchEvaluationResult result = expression.EvaluateBatch(messages, options);
+    ASSERT_EQ(result.size(), messages.size());
+    EXPECT_TRUE(result.ok());
+    EXPECT_EQ(result.MatchCount(), 200);
+    for (int i = 0; i < messages.size(); ++i) {
+      EXPECT_EQ(result.result_size(i), 1);
+      EXPECT_EQ(result.Matches(i), i % 3 != 0);
+      EXPECT_EQ(result.GetBoolean(i).ValueOrDie(), i % 3 != 0);
+    }
+    EXPECT_EQ(result.MatchingIndices().front(), 1);
+    EXPECT_EQ(result.MatchingIndices().back(), 299);
+  }
+})
+
+FHIR_VERSION_TEST(FhirPathTest, TestEvaluateBatchNonBooleanAndErrors, {
+  std::vector<Observation> observations(100, ValidObservation<Observation>());
+  for (int i = 0; i < observations.size(); i += 2) {
+    *observations[i].mutable_code()->add_coding() =
+        observations[i].code().coding(0);
+  }
+  std::vector<const Message*> messages;
+  for (const Observation& observation : observations) {
+    messages.push_back(&observation);
+  }
+
+  BatchEvaluationResult result =
+      Compile(Observation::descriptor(), "code.coding.single()")
+          .ValueOrDie()
+          .EvaluateBatch(messages);
+  ASSERT_EQ(result.size(), messages.size());
+  EXPECT_FALSE(result.ok());
+  EXPECT_EQ(result.errors().size(), 50);
+  EXPECT_EQ(result.MatchCount(), 0);
+  for (int i = 0; i < messages.size(); ++i) {
+    EXPECT_EQ(result.status(i).ok(), i % 2 != 0);
+    EXPECT_EQ(result.result_size(i), i % 2 != 0 ? 1 : 0);
+    EXPECT_THAT(result.GetBoolean(i),
+                HasStatusCode(i % 2 != 0 ? StatusCode::kInvalidArgument
+                                         : result.status(i).code()));
+  }
+
+  EXPECT_EQ(Compile(Observation::descriptor(), "true")
+                .ValueOrDie()
+                .EvaluateBatch({})
+                .size(),
+            0);
+})
+
+// Expects columnar evaluation of each expression against the batch to agree
+// with evaluating the expression against each message in turn.
+void ExpectColumnarAgreement(const std::vector<const Message*>& messages,
+                             const std::vector<std::string>& expressions) {
+  const ::google::protobuf::Descriptor* descriptor =
+      messages[0]->GetDescriptor();
+  const ::google::fhir::PrimitiveHandler* primitive_handler =
+      GetPrimitiveHandler(descriptor).ValueOrDie();
+
+  tensorflow::thread::ThreadPool thread_pool(tensorflow::Env::Default(),
+                                             "fhir_path_test", 4);
+  BatchEvaluationOptions parallel_options;
+  parallel_options.thread_pool = &thread_pool;
+  parallel_options.min_shard_size = 1;
+
+  for (const std::string& fhir_path : expressions) {
+    StatusOr<ColumnarExpression> columnar =
+        ColumnarExpression::Compile(descriptor, primitive_handler, fhir_path);
+    ASSERT_TRUE(columnar.ok()) << fhir_path << ": " << columnar.status();
+    EXPECT_EQ(columnar.ValueOrDie().fhir_path(), fhir_path);
+    CompiledExpression expression =
+        Compile(descriptor, fhir_path).ValueOrDie();
+
+    for (const BatchEvaluationOptions& options :
+         {BatchEvaluationOptions(), parallel_options}) {
+      BatchEvaluationResult batch =
+          columnar.ValueOrDie().EvaluateBatch(messages, options);
+      ASSERT_EQ(batch.size(), messages.size());
+      for (int i = 0; i < messages.size(); ++i) {
+        StatusOr<EvaluationResult> result = expression.Evaluate(*messages[i]);
+        EXPECT_EQ(batch.status(i).code(), result.status().code())
+            << fhir_path << " on message " << i;
+        if (!result.ok()) {
+          continue;
+        }
+        EXPECT_EQ(batch.result_size(i),
+                  result.ValueOrDie().GetMessages().size())
+            << fhir_path << " on message " << i;
+        StatusOr<bool> value = result.ValueOrDie().GetBoolean();
+        EXPECT_EQ(batch.GetBoolean(i).ok(), value.ok())
+            << fhir_path << " on message " << i;
+        EXPECT_EQ(batch.Matches(i), value.ok() && value.ValueOrDie())
+            << fhir_path << " on message " << i;
+      }
+    }
+  }
+}
+
+FHIR_VERSION_TEST(FhirPathTest, TestColumnarExpressionAgreesWithEvaluation, {
+  // The initializer is parenthesized for the benefit of FHIR_VERSION_TEST.
+  std::vector<Observation> observations({
+      ValidObservation<Observation>(),
+      ParseFromString<Observation>(R"proto(
+        status { value: AMENDED }
+        code {
+          coding {
+            system { value: "foo" }
+            code { value: "baz" }
+          }
+          coding {
+            system { value: "loinc" }
+            code { value: "bar" }
+            user_selected { value: true }
+          }
+          text { value: "caf\303\251" }
+        }
+      )proto"),
+      ParseFromString<Observation>(R"proto(
+        status { value: FINAL id { value: "s" } }
+        code {
+          coding {
+            code { value: "bar" id { value: "c" } }
+            user_selected { value: false }
+          }
+        }
+        id { value: "123" }
+      )proto"),
+      ParseFromString<Observation>(R"proto(
+        code { text { value: "café" } }
+      )proto"),
+      ParseFromString<Observation>(R"proto(
+        status { value: PRELIMINARY }
+        code {
+          coding {
+            system { value: "foo" }
+            code { value: "bar" }
+            user_selected { value: true }
+          }
+          coding {
+            system { value: "foo" }
+            code { value: "bar" }
+            user_selected { value: false }
+          }
+        }
+      )proto"),
+      Observation(),
+  });
+  std::vector<const Message*> messages;
+  for (int i = 0; i < 50; ++i) {
+    for (const Observation& observation : observations) {
+      messages.push_back(&observation);
+    }
+  }
+
+  ExpectColumnarAgreement(
+      messages,
+      {
+          "status = 'final'",
+          "status != 'final'",
+          "'amended' = status",
+          "id = '123'",
+          "code.text = 'caf\\u00e9'",
+          "code.coding.code = 'bar'",
+          "code.coding.code != 'bar'",
+          "code.coding.userSelected = false",
+          "code.coding.exists()",
+          "code.coding.empty()",
+          "code.coding.exists().not()",
+          "code.coding.where(code = 'bar').exists()",
+          "code.coding.where(system = 'foo' and code = 'bar').exists()",
+          "code.coding.where(userSelected = true).empty()",
+          "code.coding.where(userSelected).exists()",
+          "code.coding.where(code.where($this = 'bar').exists()).exists()",
+          "code.coding.where(exists())",
+          "id = '123' or status = 'amended'",
+          "(id = '123' or status = 'amended') and code.coding.exists()",
+          "code.coding.code",
+          "code.coding.userSelected",
+          "code.coding.where(code != 'bar')",
+          // Evaluation errors.
+          "code.where(coding.code).exists()",
+          "code.where(coding.code).empty()",
+          "code.coding.userSelected or status = 'final'",
+          "status = 'final' or code.coding.userSelected",
+          "status = 'final' and code.coding.userSelected",
+          "code.coding.userSelected.exists() and code.where(coding.code)"
+          ".exists()",
+      });
+})
+
+FHIR_VERSION_TEST(FhirPathTest, TestColumnarExpressionUnsupported, {
+  const ::google::fhir::PrimitiveHandler* primitive_handler =
+      GetPrimitiveHandler(Observation::descriptor()).ValueOrDie();
+  for (const std::string& fhir_path : {
+           "code.coding.count() = 1",
+           "value.exists()",
+           "contained.exists()",
+           "code.coding.code | status",
+           "status = status",
+           "code.coding.code.not()",
+           "status < 1",
+       }) {
+    EXPECT_EQ(ColumnarExpression::Compile(Observation::descriptor(),
+                                          primitive_handler, fhir_path)
+                  .status()
+                  .code(),
+              StatusCode::kUnimplemented)
+        << fhir_path;
+  }
+
+  // Invalid expressions fail as they fail to compile for full evaluation.
+  EXPECT_EQ(ColumnarExpression::Compile(Observation::descriptor(),
+                                        primitive_handler, "bogus.exists()")
+                .status(),
+            Compile(Observation::descriptor(), "bogus.exists()").status());
+})
+
+TEST(FhirPathTest, TestColumnarExpressionIntegerComparisons) {
+  std::vector<r4::core::ValueSet> value_sets = {
+      ParseFromString<r4::core::ValueSet>(R"proto(
+        expansion { total { value: 3 } offset { value: 0 } }
+      )proto"),
+      ParseFromString<r4::core::ValueSet>(R"proto(
+        expansion { total { value: 2 id { value: "t" } } }
+      )proto"),
+      ParseFromString<r4::core::ValueSet>(R"proto(
+        expansion { total { value: -4 } }
+      )proto"),
+      r4::core::ValueSet(),
+  };
+  std::vector<const Message*> messages;
+  for (const r4::core::ValueSet& value_set : value_sets) {
+    messages.push_back(&value_set);
+  }
+
+  ExpectColumnarAgreement(messages, {
+                                        "expansion.total > 2",
+                                        "expansion.total >= 2",
+                                        "expansion.total < 0",
+                                        "expansion.total <= 0",
+                                        "3 <= expansion.total",
+                                        "2 > expansion.total",
+                                        "expansion.total = 3",
+                                        "expansion.total = 2",
+                                        "expansion.offset < 1",
+                                    });
+}
+
 }  // namespace
 
 }  // namespace fhir_path
@@ -14,9 +14,18 @@
 
 #include "google/fhir/fhir_path/fhir_path_validation.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <string>
 #include <utility>
 
 #include "google/protobuf/descriptor.h"
+#include "google/protobuf/message.h"
 #include "google/protobuf/util/message_differencer.h"
 #include "absl/memory/memory.h"
 #include "absl/status/status.h"
@@ -24,12 +33,16 @@
 #include "absl/strings/match.h"
 #include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
+#include "absl/synchronization/mutex.h"
 #include "absl/time/civil_time.h"
+#include "absl/time/clock.h"
 #include "absl/time/time.h"
 #include "absl/types/optional.h"
 #include "google/fhir/annotations.h"
 #include "google/fhir/fhir_path/fhir_path.h"
+#include "google/fhir/fhir_path/parser.h"
 #include "google/fhir/fhir_path/utils.h"
+#include "google/fhir/fhir_types.h"
 #include "google/fhir/primitive_wrapper.h"
 #include "google/fhir/proto_util.h"
 #include "google/fhir/status/status.h"
@@ -49,6 +62,7 @@ using ::google::fhir::StatusOr;
 using ::google::protobuf::Descriptor;
 using ::google::protobuf::FieldDescriptor;
 using ::google::protobuf::Message;
+using ::google::protobuf::Reflection;
 
 bool ValidationResults::StrictValidationFn(const ValidationResult& result) {
   return result.EvaluationResult().ok() &&
@@ -65,24 +79,252 @@ bool ValidationResults::IsValid(
   return std::all_of(results_.begin(), results_.end(), validation_fn);
 }
 
-std::vector<ValidationResult> ValidationResults::Results() const {
-  return results_;
+size_t ValidationCache::size() const {
+  absl::MutexLock lock(&mutex_);
+  return valid_subtrees_.size();
+}
+
+bool ValidationCache::Contains(const tensorflow::Fprint128& fingerprint) const {
+  absl::MutexLock lock(&mutex_);
+  return valid_subtrees_.contains(fingerprint);
+}
+
+void ValidationCache::Insert(const tensorflow::Fprint128& fingerprint) {
+  absl::MutexLock lock(&mutex_);
+  if (valid_subtrees_.size() >= max_size_) {
+    valid_subtrees_.clear();
+  }
+  valid_subtrees_.insert(fingerprint);
+}
+
+constexpr int ValidationMetrics::kLatencyBuckets;
+constexpr int ValidationMetrics::kShards;
+constexpr int ValidationMetrics::kChunkSize;
+constexpr int ValidationMetrics::kMaxChunks;
+
+ValidationMetrics::ValidationMetrics()
+    : shards_(absl::make_unique<Shard[]>(kShards)) {}
+
+ValidationMetrics::~ValidationMetrics() {
+  for (int shard = 0; shard < kShards; ++shard) {
+    for (std::atomic<Chunk*>& chunk : shards_[shard].chunks) {
+      Chunk* counters_chunk = chunk.load(std::memory_order_relaxed);
+      if (counters_chunk == nullptr) {
+        continue;
+      }
+      for (Counters& counters : *counters_chunk) {
+        delete counters.constraint.load(std::memory_order_relaxed);
+      }
+      delete counters_chunk;
+    }
+  }
+}
+
+void ValidationMetrics::Record(const ConstraintKey& key,
+                               const StatusOr<EvaluationResult>& result,
+                               int64_t nanoseconds) {
+  if (key.id >= kChunkSize * kMaxChunks) {
+    return;
+  }
+
+  // Threads are assigned shards in turn, so that threads validating at the
+  // same time rarely update the same counters.
+  static std::atomic<int> next_shard{0};
+  static thread_local const int shard =
+      next_shard.fetch_add(1, std::memory_order_relaxed) % kShards;
+
+  std::atomic<Chunk*>& chunk = shards_[shard].chunks[key.id / kChunkSize];
+  Chunk* counters_chunk = chunk.load(std::memory_order_acquire);
+  if (counters_chunk == nullptr) {
+    auto new_chunk = absl::make_unique<Chunk>();
+    if (chunk.compare_exchange_strong(counters_chunk, new_chunk.get(),
+                                      std::memory_order_acq_rel)) {
+      counters_chunk = new_chunk.release();
+    }
+  }
+  Counters& counters = (*counters_chunk)[key.id % kChunkSize];
+
+  if (counters.constraint.load(std::memory_order_acquire) == nullptr) {
+    auto constraint = absl::make_unique<RecordedConstraint>(RecordedConstraint{
+        key.id, key.type, key.field, key.expression->fhir_path()});
+    const RecordedConstraint* expected = nullptr;
+    if (counters.constraint.compare_exchange_strong(
+            expected, constraint.get(), std::memory_order_acq_rel)) {
+      constraint.release();
+    }
+  }
+  counters.evaluations.fetch_add(1, std::memory_order_relaxed);
+  StatusOr<bool> met =
+      result.ok() ? result.ValueOrDie().GetBoolean() : result.status();
+  if (!met.ok()) {
+    counters.errors.fetch_add(1, std::memory_order_relaxed);
+  } else if (!met.ValueOrDie()) {
+    counters.failures.fetch_add(1, std::memory_order_relaxed);
+  }
+  counters.nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+
+  int bucket = 0;
+  for (int64_t microseconds = nanoseconds / 1000;
+       microseconds > 0 && bucket < kLatencyBuckets - 1; microseconds >>= 1) {
+    ++bucket;
+  }
+  counters.latency_histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+std::vector<ValidationMetrics::ConstraintStats> ValidationMetrics::Snapshot()
+    const {
+  // Statistics by constraint id, for the constraints recorded in any shard.
+  std::map<int, ConstraintStats> stats;
+  for (int shard = 0; shard < kShards; ++shard) {
+    for (int i = 0; i < kMaxChunks; ++i) {
+      const Chunk* chunk =
+          shards_[shard].chunks[i].load(std::memory_order_acquire);
+      if (chunk == nullptr) {
+        continue;
+      }
+      for (const Counters& counters : *chunk) {
+        const RecordedConstraint* constraint =
+            counters.constraint.load(std::memory_order_acquire);
+        if (constraint == nullptr) {
+          continue;
+        }
+        ConstraintStats& constraint_stats = stats[constraint->id];
+        constraint_stats.type = constraint->type;
+        constraint_stats.field = constraint->field;
+        constraint_stats.constraint = constraint->constraint;
+        constraint_stats.evaluations +=
+            counters.evaluations.load(std::memory_order_relaxed);
+        constraint_stats.failures +=
+            counters.failures.load(std::memory_order_relaxed);
+        constraint_stats.errors +=
+            counters.errors.load(std::memory_order_relaxed);
+        constraint_stats.wall_time += absl::Nanoseconds(
+            counters.nanoseconds.load(std::memory_order_relaxed));
+        for (int bucket = 0; bucket < kLatencyBuckets; ++bucket) {
+          constraint_stats.latency_histogram[bucket] +=
+              counters.latency_histogram[bucket].load(
+                  std::memory_order_relaxed);
+        }
+      }
+    }
+  }
+
+  std::vector<ConstraintStats> snapshot;
+  snapshot.reserve(stats.size());
+  for (auto& constraint_stats : stats) {
+    snapshot.push_back(std::move(constraint_stats.second));
+  }
+  return snapshot;
 }
 
 FhirPathValidator::~FhirPathValidator() {}
 
+// Returns the cost of calling the named function, not counting its input or
+// parameters. Functions that resolve references, match regular expressions or
+// walk whole subtrees cost more than navigating a field.
+int64_t FunctionCost(const std::string& name) {
+  if (name == "matches" || name == "replaceMatches" || name == "resolve") {
+    return 20;
+  }
+  if (name == "htmlChecks" || name == "htmlchecks" || name == "descendants" ||
+      name == "memberOf" || name == "conformsTo") {
+    return 50;
+  }
+  return 1;
+}
+
+// Returns a static estimate of the relative cost of evaluating the syntax
+// tree, used to check cheap constraints first. Parameters of functions that
+// evaluate them for each element of their input, such as the criteria of
+// where(), are assumed to be evaluated several times.
+int64_t EstimateCost(const internal::AstNode& node) {
+  constexpr int64_t kElementsPerCollection = 4;
+  int64_t cost = 1;
+  int64_t parameter_evaluations = 1;
+  if (node.type == internal::AstNode::Type::kFunction) {
+    cost = FunctionCost(node.text);
+    if (node.text == "where" || node.text == "select" || node.text == "all" ||
+        node.text == "exists" || node.text == "repeat" ||
+        node.text == "aggregate") {
+      parameter_evaluations = kElementsPerCollection;
+    }
+  }
+  for (const std::unique_ptr<internal::AstNode>& child : node.children) {
+    cost += parameter_evaluations * EstimateCost(*child);
+  }
+  return cost;
+}
+
+// Returns true if the syntax tree refers to %resource, the resource that
+// contains the node being evaluated.
+bool RefersToResource(const internal::AstNode& node) {
+  if (node.type == internal::AstNode::Type::kExternalConstant &&
+      node.text == "resource") {
+    return true;
+  }
+  return std::any_of(node.children.begin(), node.children.end(),
+                     [](const std::unique_ptr<internal::AstNode>& child) {
+                       return RefersToResource(*child);
+                     });
+}
+
+// Returns true if the expression is known to be met by every message of the
+// given type in which none of the fields it reads are set. Since it depends on
+// nothing else, evaluating it against the default instance shows whether it
+// is. Singular primitive fields count as set only when they differ from their
+// default, which the expression still reads, so they are not considered.
+bool MetWhenAbsent(const CompiledExpression& expression,
+                   const Descriptor* descriptor) {
+  const std::vector<const FieldDescriptor*>* fields =
+      expression.context_fields();
+  if (fields == nullptr ||
+      std::any_of(fields->begin(), fields->end(),
+                  [](const FieldDescriptor* field) {
+                    return !field->is_repeated() &&
+                           field->cpp_type() !=
+                               FieldDescriptor::CPPTYPE_MESSAGE;
+                  })) {
+    return false;
+  }
+  const Message* prototype =
+      ::google::protobuf::MessageFactory::generated_factory()->GetPrototype(
+          descriptor);
+  if (prototype == nullptr) {
+    return false;
+  }
+  StatusOr<EvaluationResult> result = expression.Evaluate(*prototype);
+  if (!result.ok()) {
+    return false;
+  }
+  StatusOr<bool> met = result.ValueOrDie().GetBoolean();
+  return met.ok() && met.ValueOrDie();
+}
+
+// Returns true if none of the fields are set on the message.
+bool NoneSet(const Message& message,
+             const std::vector<const FieldDescriptor*>& fields) {
+  const Reflection* reflection = message.GetReflection();
+  return std::none_of(fields.begin(), fields.end(),
+                      [&](const FieldDescriptor* field) {
+                        return field->is_repeated()
+                                   ? reflection->FieldSize(message, field) > 0
+                                   : reflection->HasField(message, field);
+                      });
+}
+
 // Build the constraints for the given message type and
 // add it to the constraints cache.
 FhirPathValidator::MessageConstraints* FhirPathValidator::ConstraintsFor(
     const Descriptor* descriptor) {
   // Simply return the cached constraint if it exists.
-  auto iter = constraints_cache_.find(descriptor->full_name());
+  auto iter = constraints_cache_.find(descriptor);
 
   if (iter != constraints_cache_.end()) {
     return iter->second.get();
   }
 
-  auto constraints = absl::make_unique<MessageConstraints>();
+  auto constraints = absl::make_unique<MessageConstraints>(
+      descriptor, primitive_handler_, compile_options_);
   AddMessageConstraints(descriptor, constraints.get());
 
   for (int i = 0; i < descriptor->field_count(); i++) {
@@ -95,33 +337,85 @@ FhirPathValidator::MessageConstraints* FhirPathValidator::ConstraintsFor(
       int ext_size =
           field->options().ExtensionSize(proto::fhir_path_constraint);
 
+      // All constraints on the field are evaluated against the same
+      // messages, so they are compiled together to share subexpressions.
+      CompiledExpressionSet field_constraints(field_type, primitive_handler_,
+                                              compile_options_);
       for (int j = 0; j < ext_size; ++j) {
         const std::string& fhir_path =
             field->options().GetExtension(proto::fhir_path_constraint, j);
 
-        auto constraint = CompiledExpression::Compile(
-            field_type, primitive_handler_, fhir_path);
-
-        if (constraint.ok()) {
-          constraints->field_expressions.push_back(
-              std::make_pair(field, constraint.ValueOrDie()));
-        } else {
+        Status status = field_constraints.Add(fhir_path);
+        if (!status.ok()) {
           LOG(WARNING) << "Ignoring field constraint on " << descriptor->name()
                        << "." << field_type->name() << " (" << fhir_path
-                       << "). " << constraint.status().message();
+                       << "). " << status.message();
         }
 
         // TODO: Unsupported FHIRPath expressions are simply not
         // validated for now; this should produce an error once we support
         // all of FHIRPath.
       }
+
+      if (!field_constraints.empty()) {
+        constraints->field_expressions.push_back(
+            std::make_pair(field, std::move(field_constraints)));
+      }
+    }
+  }
+
+  // Ranked constraints point to their metrics keys, so the keys are not
+  // moved once they have been added.
+  int constraint_count = constraints->message_expressions.size();
+  for (const auto& field_expressions : constraints->field_expressions) {
+    constraint_count += field_expressions.second.size();
+  }
+  constraints->metrics_keys.reserve(constraint_count);
+  const int first_id = constraint_count_;
+  constraint_count_ += constraint_count;
+
+  // Ranks the constraint by its estimated cost. Expressions that compiled
+  // also parse, but if one did not it is checked last and assumed to refer to
+  // %resource.
+  auto rank = [&constraints, descriptor, first_id](
+                  const FieldDescriptor* field,
+                  const CompiledExpression& expression) {
+    constraints->metrics_keys.push_back(
+        {first_id + static_cast<int>(constraints->metrics_keys.size()),
+         descriptor, field, &expression});
+    StatusOr<std::unique_ptr<internal::AstNode>> ast =
+        internal::ParseFhirPath(expression.fhir_path());
+    constraints->ranked_constraints.push_back(
+        {field, &expression,
+         ast.ok() ? EstimateCost(*ast.ValueOrDie())
+                  : std::numeric_limits<int64_t>::max(),
+         MetWhenAbsent(expression,
+                       field == nullptr ? descriptor : field->message_type()),
+         &constraints->metrics_keys.back()});
+    constraints->uses_resource = constraints->uses_resource || !ast.ok() ||
+                                 RefersToResource(*ast.ValueOrDie());
+  };
+  for (const CompiledExpression& expression :
+       constraints->message_expressions.expressions()) {
+    rank(nullptr, expression);
+  }
+  for (const auto& field_expressions : constraints->field_expressions) {
+    for (const CompiledExpression& expression :
+         field_expressions.second.expressions()) {
+      rank(field_expressions.first, expression);
     }
   }
+  std::stable_sort(constraints->ranked_constraints.begin(),
+                   constraints->ranked_constraints.end(),
+                   [](const MessageConstraints::RankedConstraint& a,
+                      const MessageConstraints::RankedConstraint& b) {
+                     return a.cost < b.cost;
+                   });
 
   // Add the successful constraints to the cache while keeping a local
   // reference.
   MessageConstraints* constraints_local = constraints.get();
-  constraints_cache_[descriptor->full_name()] = std::move(constraints);
+  constraints_cache_[descriptor] = std::move(constraints);
 
   // Now we recursively look for fields with constraints.
   for (int i = 0; i < descriptor->field_count(); i++) {
@@ -139,7 +433,8 @@ FhirPathValidator::MessageConstraints* FhirPathValidator::ConstraintsFor(
       if (!child_constraints->message_expressions.empty() ||
           !child_constraints->field_expressions.empty() ||
           !child_constraints->nested_with_constraints.empty()) {
-        constraints_local->nested_with_constraints.push_back(field);
+        constraints_local->nested_with_constraints.push_back(
+            std::make_pair(field, child_constraints));
       }
     }
   }
@@ -147,6 +442,64 @@ FhirPathValidator::MessageConstraints* FhirPathValidator::ConstraintsFor(
   return constraints_local;
 }
 
+const FhirPathValidator::MessageConstraints*
+FhirPathValidator::RootConstraintsFor(const Descriptor* descriptor) {
+  const ConstraintTable* table =
+      constraint_table_.load(std::memory_order_acquire);
+  if (table != nullptr) {
+    auto iter = table->find(descriptor);
+    if (iter != table->end()) {
+      return iter->second;
+    }
+  }
+
+  // ConstraintsFor may recursively build constraints, so they are built
+  // under the mutex and then published in a new table that also has the
+  // message types of the current one.
+  absl::MutexLock lock(&mutex_);
+  table = constraint_table_.load(std::memory_order_relaxed);
+  if (table != nullptr) {
+    auto iter = table->find(descriptor);
+    if (iter != table->end()) {
+      return iter->second;
+    }
+  }
+
+  const MessageConstraints* constraints = ConstraintsFor(descriptor);
+
+  // Whether validating a message depends on the resource that encloses it is
+  // only known once the constraints of all messages nested in it are built.
+  // Constraints that are already published never change here, since all of
+  // the messages nested in them were built with them.
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (const auto& entry : constraints_cache_) {
+      MessageConstraints* message_constraints = entry.second.get();
+      if (message_constraints->needs_enclosing_resource ||
+          IsResource(entry.first)) {
+        continue;
+      }
+      if (message_constraints->uses_resource ||
+          std::any_of(message_constraints->nested_with_constraints.begin(),
+                      message_constraints->nested_with_constraints.end(),
+                      [](const auto& nested) {
+                        return nested.second->needs_enclosing_resource;
+                      })) {
+        message_constraints->needs_enclosing_resource = true;
+        changed = true;
+      }
+    }
+  }
+
+  auto new_table = table != nullptr ? absl::make_unique<ConstraintTable>(*table)
+                                    : absl::make_unique<ConstraintTable>();
+  new_table->emplace(descriptor, constraints);
+  constraint_table_.store(new_table.get(), std::memory_order_release);
+  published_tables_.push_back(std::move(new_table));
+  return constraints;
+}
+
 // Build the message constraints for the given message type and
 // add it to the constraints cache.
 void FhirPathValidator::AddMessageConstraints(const Descriptor* descriptor,
@@ -157,15 +510,10 @@ void FhirPathValidator::AddMessageConstraints(const Descriptor* descriptor,
   for (int i = 0; i < ext_size; ++i) {
     const std::string& fhir_path = descriptor->options().GetExtension(
         proto::fhir_path_message_constraint, i);
-    auto constraint =
-        CompiledExpression::Compile(descriptor, primitive_handler_, fhir_path);
-    if (constraint.ok()) {
-      CompiledExpression expression = constraint.ValueOrDie();
-      constraints->message_expressions.push_back(expression);
-    } else {
+    Status status = constraints->message_expressions.Add(fhir_path);
+    if (!status.ok()) {
       LOG(WARNING) << "Ignoring message constraint on " << descriptor->name()
-                   << " (" << fhir_path << "). "
-                   << constraint.status().message();
+                   << " (" << fhir_path << "). " << status.message();
     }
 
     // TODO: Unsupported FHIRPath expressions are simply not
@@ -174,78 +522,406 @@ void FhirPathValidator::AddMessageConstraints(const Descriptor* descriptor,
   }
 }
 
-// Validates that the given message satisfies the given FHIRPath expression.
-ValidationResult ValidateConstraint(
-    const absl::string_view constraint_parent_path,
-    const absl::string_view node_parent_path,
-    const internal::WorkspaceMessage& message,
-    const CompiledExpression& expression) {
-  StatusOr<EvaluationResult> expr_result = expression.Evaluate(message);
-  return ValidationResult(std::string(constraint_parent_path),
-                          std::string(node_parent_path), expression.fhir_path(),
-                          expr_result.ok()
-                              ? expr_result.ValueOrDie().GetBoolean()
-                              : expr_result.status());
-}
-
-std::string PathTerm(const Message& message, const FieldDescriptor* field) {
-  return IsContainedResource(message) ||
-                 IsChoiceTypeContainer(message.GetDescriptor())
+// Returns the term of a FHIRPath expression that selects the field from a
+// message that contains it.
+std::string PathTerm(const FieldDescriptor* field) {
+  const Descriptor* containing_type = field->containing_type();
+  return IsContainedResource(containing_type) ||
+                 IsChoiceTypeContainer(containing_type)
              ? absl::StrCat("ofType(", field->message_type()->name(), ")")
              : field->json_name();
 }
 
-void FhirPathValidator::Validate(absl::string_view constraint_path,
-                                 absl::string_view node_path,
-                                 const internal::WorkspaceMessage& message,
-                                 std::vector<ValidationResult>* results) {
-  // ConstraintsFor may recursively build constraints so
-  // we lock the mutex here to ensure thread safety.
-  mutex_.Lock();
-  MessageConstraints* constraints =
-      ConstraintsFor(message.Message()->GetDescriptor());
-  mutex_.Unlock();
+std::string ValidationResult::TrailPath(bool with_indices) const {
+  std::string path = root_->name();
+  for (const PathStep& step : trail_) {
+    absl::StrAppend(&path, ".", PathTerm(step.field));
+    if (with_indices && step.index >= 0) {
+      absl::StrAppend(&path, "[", step.index, "]");
+    }
+  }
+  return path;
+}
 
-  // Validate the constraints attached to the message root.
-  for (const CompiledExpression& expr : constraints->message_expressions) {
-    results->push_back(
-        ValidateConstraint(constraint_path, node_path, message, expr));
+std::string ValidationResult::ConstraintPath() const {
+  return root_ != nullptr ? TrailPath(false) : constraint_path_;
+}
+
+std::string ValidationResult::NodePath() const {
+  return root_ != nullptr ? TrailPath(true) : node_path_;
+}
+
+StatusOr<EvaluationResult> FhirPathValidator::Evaluate(
+    const Walk& walk, const ValidationMetrics::ConstraintKey& key,
+    const internal::WorkspaceMessage& message) {
+  if (walk.metrics == nullptr) {
+    return key.expression->Evaluate(message);
   }
+  const int64_t start = absl::GetCurrentTimeNanos();
+  StatusOr<EvaluationResult> result = key.expression->Evaluate(message);
+  walk.metrics->Record(key, result, absl::GetCurrentTimeNanos() - start);
+  return result;
+}
 
-  // Validate the constraints attached to the message's fields.
-  for (const auto& expression : constraints->field_expressions) {
-    const FieldDescriptor* field = expression.first;
-    const CompiledExpression& expr = expression.second;
-    const std::string path_term = PathTerm(*message.Message(), field);
-    const Message& proto = *message.Message();
+std::vector<StatusOr<EvaluationResult>> FhirPathValidator::EvaluateSet(
+    const Walk& walk, const CompiledExpressionSet& expression_set,
+    const ValidationMetrics::ConstraintKey* keys,
+    const internal::WorkspaceMessage& message) {
+  if (walk.metrics == nullptr) {
+    return expression_set.Evaluate(message);
+  }
+  // The set is still evaluated as a whole, so that constraints share their
+  // common subexpressions, and each constraint is charged the time since the
+  // previous one finished.
+  int64_t start = absl::GetCurrentTimeNanos();
+  return expression_set.Evaluate(
+      message, [&](int index, const StatusOr<EvaluationResult>& result) {
+        const int64_t end = absl::GetCurrentTimeNanos();
+        walk.metrics->Record(keys[index], result, end - start);
+        start = end;
+      });
+}
 
+bool FhirPathValidator::AddResult(const Descriptor* root,
+                                  const ValidationResult::Trail& trail,
+                                  const CompiledExpression& expression,
+                                  const StatusOr<EvaluationResult>& expr_result,
+                                  ValidationReport report,
+                                  std::vector<ValidationResult>* results) {
+  StatusOr<bool> result = expr_result.ok()
+                              ? expr_result.ValueOrDie().GetBoolean()
+                              : expr_result.status();
+  if (report != ValidationReport::kAllResults && result.ok() &&
+      result.ValueOrDie()) {
+    return true;
+  }
+  const bool met = !result.ok() || result.ValueOrDie();
+  results->push_back(
+      ValidationResult(root, trail, expression.fhir_path(), result));
+  return met;
+}
+
+bool FhirPathValidator::ValidateCheapestFirst(
+    const Walk& walk, const internal::WorkspaceMessage& message,
+    const MessageConstraints& constraints, ValidationResult::Trail* trail,
+    std::vector<ValidationResult>* results) const {
+  for (const MessageConstraints::RankedConstraint& constraint :
+       constraints.ranked_constraints) {
+    // Constraints that are met on nodes without the fields they read are not
+    // evaluated on those nodes; since met constraints are not reported, the
+    // results are the same.
+    auto vacuous = [&constraint](const Message& node) {
+      return constraint.met_when_absent &&
+             NoneSet(node, *constraint.expression->context_fields());
+    };
+
+    if (constraint.field == nullptr) {
+      if (vacuous(*message.Message())) {
+        continue;
+      }
+      if (!AddResult(walk.root, *trail, *constraint.expression,
+                     Evaluate(walk, *constraint.metrics_key, message),
+                     ValidationReport::kFirstViolation, results)) {
+        return false;
+      }
+      continue;
+    }
+
+    const FieldDescriptor* field = constraint.field;
+    const Message& proto = *message.Message();
     for (int i = 0; i < PotentiallyRepeatedFieldSize(proto, field); i++) {
       const Message& child = GetPotentiallyRepeatedMessage(proto, field, i);
+      if (vacuous(child)) {
+        continue;
+      }
+      trail->push_back({field, field->is_repeated() ? i : -1});
+      const bool met = AddResult(
+          walk.root, *trail, *constraint.expression,
+          Evaluate(walk, *constraint.metrics_key,
+                   internal::WorkspaceMessage(message, &child)),
+          ValidationReport::kFirstViolation, results);
+      trail->pop_back();
+      if (!met) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+template <typename T>
+void AppendBytes(const T& value, std::string* bytes) {
+  bytes->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
 
-      results->push_back(ValidateConstraint(
-          absl::StrCat(constraint_path, ".", path_term),
-          field->is_repeated()
-              ? absl::StrCat(node_path, ".", path_term, "[", i, "]")
-              : absl::StrCat(node_path, ".", path_term),
-          internal::WorkspaceMessage(message, &child), expr));
+// Appends the value of the field, or of the element of the repeated field at
+// the given index, read with the given reflection accessors.
+template <typename T>
+void AppendValue(const Message& message, const FieldDescriptor* field,
+                 int index,
+                 T (Reflection::*get)(const Message&, const FieldDescriptor*)
+                     const,
+                 T (Reflection::*get_repeated)(const Message&,
+                                               const FieldDescriptor*, int)
+                     const,
+                 std::string* bytes) {
+  const Reflection* reflection = message.GetReflection();
+  AppendBytes(field->is_repeated()
+                  ? (reflection->*get_repeated)(message, field, index)
+                  : (reflection->*get)(message, field),
+              bytes);
+}
+
+// Returns a fingerprint of the type and contents of the message, and adds it
+// and the fingerprints of all messages nested in it to the map.
+tensorflow::Fprint128 AddFingerprints(
+    const Message& message,
+    absl::flat_hash_map<const Message*, tensorflow::Fprint128>* fingerprints) {
+  const Reflection* reflection = message.GetReflection();
+  std::vector<const FieldDescriptor*> fields;
+  reflection->ListFields(message, &fields);
+
+  std::string bytes = message.GetDescriptor()->full_name();
+  std::string scratch;
+  for (const FieldDescriptor* field : fields) {
+    const int size =
+        field->is_repeated() ? reflection->FieldSize(message, field) : 1;
+    AppendBytes(field->number(), &bytes);
+    AppendBytes(size, &bytes);
+    for (int i = 0; i < size; ++i) {
+      switch (field->cpp_type()) {
+        case FieldDescriptor::CPPTYPE_INT32:
+          AppendValue(message, field, i, &Reflection::GetInt32,
+                      &Reflection::GetRepeatedInt32, &bytes);
+          break;
+        case FieldDescriptor::CPPTYPE_INT64:
+          AppendValue(message, field, i, &Reflection::GetInt64,
+                      &Reflection::GetRepeatedInt64, &bytes);
+          break;
+        case FieldDescriptor::CPPTYPE_UINT32:
+          AppendValue(message, field, i, &Reflection::GetUInt32,
+                      &Reflection::GetRepeatedUInt32, &bytes);
+          break;
+        case FieldDescriptor::CPPTYPE_UINT64:
+          AppendValue(message, field, i, &Reflection::GetUInt64,
+                      &Reflection::GetRepeatedUInt64, &bytes);
+          break;
+        case FieldDescriptor::CPPTYPE_DOUBLE:
+          AppendValue(message, field, i, &Reflection::GetDouble,
+                      &Reflection::GetRepeatedDouble, &bytes);
+          break;
+        case FieldDescriptor::CPPTYPE_FLOAT:
+          AppendValue(message, field, i, &Reflection::GetFloat,
+                      &Reflection::GetRepeatedFloat, &bytes);
+          break;
+        case FieldDescriptor::CPPTYPE_BOOL:
+          AppendValue(message, field, i, &Reflection::GetBool,
+                      &Reflection::GetRepeatedBool, &bytes);
+          break;
+        case FieldDescriptor::CPPTYPE_ENUM:
+          AppendValue(message, field, i, &Reflection::GetEnumValue,
+                      &Reflection::GetRepeatedEnumValue, &bytes);
+          break;
+        case FieldDescriptor::CPPTYPE_STRING: {
+          const std::string& value =
+              field->is_repeated()
+                  ? reflection->GetRepeatedStringReference(message, field, i,
+                                                           &scratch)
+                  : reflection->GetStringReference(message, field, &scratch);
+          AppendBytes(value.size(), &bytes);
+          bytes.append(value);
+          break;
+        }
+        case FieldDescriptor::CPPTYPE_MESSAGE:
+          AppendBytes(
+              AddFingerprints(
+                  GetPotentiallyRepeatedMessage(message, field, i),
+                  fingerprints),
+              &bytes);
+          break;
+      }
     }
   }
 
+  const tensorflow::Fprint128 fingerprint = tensorflow::Fingerprint128(bytes);
+  (*fingerprints)[&message] = fingerprint;
+  return fingerprint;
+}
+
+// Returns true if the elements of the field are validated in parallel when a
+// thread pool is given: the entries of a Bundle, and repeated fields of
+// contained resources.
+bool IsParallelField(const FieldDescriptor* field) {
+  return field->is_repeated() &&
+         ((IsBundle(field->containing_type()) && field->name() == "entry") ||
+          IsContainedResource(field->message_type()));
+}
+
+bool FhirPathValidator::Validate(const Walk& walk,
+                                 const internal::WorkspaceMessage& message,
+                                 const MessageConstraints& constraints,
+                                 ValidationResult::Trail* trail,
+                                 std::vector<ValidationResult>* results) const {
+  // Subtrees whose validation does not depend on where they are found are
+  // skipped if they were found valid before.
+  const tensorflow::Fprint128* fingerprint = nullptr;
+  if (walk.fingerprints != nullptr && !constraints.needs_enclosing_resource) {
+    auto iter = walk.fingerprints->find(message.Message());
+    if (iter != walk.fingerprints->end()) {
+      fingerprint = &iter->second;
+      if (walk.cache->Contains(*fingerprint)) {
+        return true;
+      }
+    }
+  }
+  const size_t num_results = results->size();
+
+  if (walk.report == ValidationReport::kFirstViolation) {
+    if (!ValidateCheapestFirst(walk, message, constraints, trail, results)) {
+      return false;
+    }
+  } else {
+    ValidateInOrder(walk, message, constraints, trail, results);
+  }
+
   // Recursively validate constraints for nested messages that have them.
-  for (const FieldDescriptor* field : constraints->nested_with_constraints) {
-    const std::string path_term = PathTerm(*message.Message(), field);
+  for (const auto& nested : constraints.nested_with_constraints) {
+    const FieldDescriptor* field = nested.first;
     const Message& proto = *message.Message();
 
+    if (walk.thread_pool != nullptr && IsParallelField(field) &&
+        PotentiallyRepeatedFieldSize(proto, field) > 1) {
+      if (!ValidateInParallel(walk, message, field, *nested.second, trail,
+                              results)) {
+        return false;
+      }
+      continue;
+    }
+
     for (int i = 0; i < PotentiallyRepeatedFieldSize(proto, field); i++) {
       const Message& child = GetPotentiallyRepeatedMessage(proto, field, i);
 
-      Validate(absl::StrCat(constraint_path, ".", path_term),
-               field->is_repeated()
-                   ? absl::StrCat(node_path, ".", path_term, "[", i, "]")
-                   : absl::StrCat(node_path, ".", path_term),
-               internal::WorkspaceMessage(message, &child), results);
+      trail->push_back({field, field->is_repeated() ? i : -1});
+      const bool keep_going =
+          Validate(walk, internal::WorkspaceMessage(message, &child),
+                   *nested.second, trail, results);
+      trail->pop_back();
+      if (!keep_going) {
+        return false;
+      }
     }
   }
+
+  if (fingerprint != nullptr && results->size() == num_results) {
+    walk.cache->Insert(*fingerprint);
+  }
+  return true;
+}
+
+bool FhirPathValidator::ValidateInParallel(
+    const Walk& walk, const internal::WorkspaceMessage& message,
+    const FieldDescriptor* field, const MessageConstraints& constraints,
+    ValidationResult::Trail* trail,
+    std::vector<ValidationResult>* results) const {
+  const Message& proto = *message.Message();
+  const int field_size = PotentiallyRepeatedFieldSize(proto, field);
+
+  // The results of each element, and the index of the first element at which
+  // validation stopped, after which elements need not be validated.
+  std::vector<std::vector<ValidationResult>> element_results(field_size);
+  std::atomic<int> first_stopped(field_size);
+
+  // Rough cost, in cycles, of validating a single entry or resource. Used by
+  // the thread pool to decide how to split the work.
+  constexpr int64_t kCostPerElement = 1000000;
+  // Elements are validated on a single thread, since tasks waiting on nested
+  // parallel work would hold up the pool.
+  Walk element_walk = walk;
+  element_walk.thread_pool = nullptr;
+  walk.thread_pool->ParallelFor(
+      field_size, kCostPerElement,
+      [&](tensorflow::int64 begin, tensorflow::int64 end) {
+        ValidationResult::Trail element_trail = *trail;
+        for (int i = begin; i < end; ++i) {
+          if (i > first_stopped.load(std::memory_order_relaxed)) {
+            return;
+          }
+          const Message& child =
+              GetPotentiallyRepeatedMessage(proto, field, i);
+          element_trail.push_back({field, i});
+          const bool keep_going = Validate(
+              element_walk, internal::WorkspaceMessage(message, &child),
+              constraints, &element_trail, &element_results[i]);
+          element_trail.pop_back();
+
+          if (!keep_going) {
+            int stopped = first_stopped.load(std::memory_order_relaxed);
+            while (i < stopped && !first_stopped.compare_exchange_weak(
+                                      stopped, i, std::memory_order_relaxed)) {
+            }
+          }
+        }
+      });
+
+  const int stopped = first_stopped.load();
+  for (int i = 0; i < field_size && i <= stopped; ++i) {
+    std::move(element_results[i].begin(), element_results[i].end(),
+              std::back_inserter(*results));
+  }
+  return stopped == field_size;
+}
+
+void FhirPathValidator::ValidateInOrder(
+    const Walk& walk, const internal::WorkspaceMessage& message,
+    const MessageConstraints& constraints, ValidationResult::Trail* trail,
+    std::vector<ValidationResult>* results) const {
+  const ValidationMetrics::ConstraintKey* keys =
+      constraints.metrics_keys.data();
+
+  // Validate the constraints attached to the message root.
+  if (!constraints.message_expressions.empty()) {
+    const std::vector<CompiledExpression>& expressions =
+        constraints.message_expressions.expressions();
+    std::vector<StatusOr<EvaluationResult>> expr_results =
+        EvaluateSet(walk, constraints.message_expressions, keys, message);
+    for (int i = 0; i < expressions.size(); i++) {
+      AddResult(walk.root, *trail, expressions[i], expr_results[i],
+                walk.report, results);
+    }
+  }
+  keys += constraints.message_expressions.size();
+
+  // Validate the constraints attached to the message's fields.
+  for (const auto& field_expressions : constraints.field_expressions) {
+    const FieldDescriptor* field = field_expressions.first;
+    const CompiledExpressionSet& expression_set = field_expressions.second;
+    const Message& proto = *message.Message();
+    const int field_size = PotentiallyRepeatedFieldSize(proto, field);
+
+    // Each value of the field is checked against all of the field's
+    // constraints at once, but results are reported per constraint to
+    // preserve their order.
+    std::vector<std::vector<StatusOr<EvaluationResult>>> expr_results;
+    expr_results.reserve(field_size);
+    for (int i = 0; i < field_size; i++) {
+      const Message& child = GetPotentiallyRepeatedMessage(proto, field, i);
+      expr_results.push_back(
+          EvaluateSet(walk, expression_set, keys,
+                      internal::WorkspaceMessage(message, &child)));
+    }
+
+    const std::vector<CompiledExpression>& expressions =
+        expression_set.expressions();
+    for (int j = 0; j < expressions.size(); j++) {
+      for (int i = 0; i < field_size; i++) {
+        trail->push_back({field, field->is_repeated() ? i : -1});
+        AddResult(walk.root, *trail, expressions[j], expr_results[i][j],
+                  walk.report, results);
+        trail->pop_back();
+      }
+    }
+    keys += expression_set.size();
+  }
 }
 
 Status ValidationResults::LegacyValidationResult() const {
@@ -253,22 +929,93 @@ Status ValidationResults::LegacyValidationResult() const {
     return absl::OkStatus();
   }
 
-  auto result = find_if(results_.begin(), results_.end(), [](auto result) {
-    return !result.EvaluationResult().ok() ||
-           !result.EvaluationResult().ValueOrDie();
-  });
+  auto result =
+      find_if(results_.begin(), results_.end(), [](const auto& result) {
+        return !result.EvaluationResult().ok() ||
+               !result.EvaluationResult().ValueOrDie();
+      });
 
   return ::absl::FailedPreconditionError(
       absl::StrCat("fhirpath-constraint-violation-", (*result).ConstraintPath(),
                    ": \"", (*result).Constraint(), "\""));
 }
 
+int FhirPathValidator::TypeConstraints::nested_count() const {
+  return constraints_ == nullptr
+             ? 0
+             : constraints_->nested_with_constraints.size();
+}
+
+const FieldDescriptor* FhirPathValidator::TypeConstraints::nested_field(
+    int i) const {
+  return constraints_->nested_with_constraints[i].first;
+}
+
+FhirPathValidator::TypeConstraints
+FhirPathValidator::TypeConstraints::nested_constraints(int i) const {
+  return TypeConstraints(constraints_->nested_with_constraints[i].second);
+}
+
+FhirPathValidator::TypeConstraints FhirPathValidator::ConstraintsOf(
+    const Descriptor* descriptor) {
+  const MessageConstraints* constraints = RootConstraintsFor(descriptor);
+  return constraints->ranked_constraints.empty() &&
+                 constraints->nested_with_constraints.empty()
+             ? TypeConstraints()
+             : TypeConstraints(constraints);
+}
+
+bool FhirPathValidator::ValidateNode(
+    const internal::WorkspaceMessage& message, TypeConstraints constraints,
+    const Descriptor* root, ValidationResult::Trail* trail,
+    std::vector<ValidationResult>* results, ValidationMetrics* metrics) const {
+  if (constraints.empty()) {
+    return true;
+  }
+  const Walk walk = {root,
+                     ValidationReport::kFirstViolation,
+                     /*thread_pool=*/nullptr,
+                     /*cache=*/nullptr,
+                     /*fingerprints=*/nullptr,
+                     metrics};
+  return ValidateCheapestFirst(walk, message, *constraints.constraints_, trail,
+                               results);
+}
+
 ValidationResults FhirPathValidator::Validate(
-    const ::google::protobuf::Message& message) {
+    const ::google::protobuf::Message& message, ValidationReport report) {
+  ValidationOptions options;
+  options.report = report;
+  return Validate(message, options);
+}
+
+ValidationResults FhirPathValidator::Validate(
+    const ::google::protobuf::Message& message,
+    const ValidationOptions& options) {
+  const Descriptor* descriptor = message.GetDescriptor();
+  const MessageConstraints* constraints = RootConstraintsFor(descriptor);
+
+  // Only subtrees with no results are cached, which is all that a report of
+  // all results never has.
+  ValidationCache* cache = options.report != ValidationReport::kAllResults
+                               ? options.cache
+                               : nullptr;
+  Fingerprints fingerprints;
+  if (cache != nullptr) {
+    AddFingerprints(message, &fingerprints);
+  }
+
+  const Walk walk = {descriptor,
+                     options.report,
+                     options.thread_pool,
+                     cache,
+                     cache != nullptr ? &fingerprints : nullptr,
+                     options.metrics};
   std::vector<ValidationResult> results;
-  Validate(message.GetDescriptor()->name(), message.GetDescriptor()->name(),
-           internal::WorkspaceMessage(&message), &results);
-  return ValidationResults(results);
+  ValidationResult::Trail trail;
+  Validate(walk, internal::WorkspaceMessage(&message), *constraints, &trail,
+           &results);
+  return ValidationResults(std::move(results));
 }
 
 }  // namespace fhir_path
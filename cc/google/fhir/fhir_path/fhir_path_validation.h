@@ -15,15 +15,28 @@
 #ifndef GOOGLE_FHIR_FHIR_PATH_FHIR_PATH_VALIDATION_H_
 #define GOOGLE_FHIR_FHIR_PATH_FHIR_PATH_VALIDATION_H_
 
-#include <unordered_map>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "google/protobuf/message.h"
 #include "absl/base/macros.h"
+#include "absl/base/thread_annotations.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/container/inlined_vector.h"
 #include "absl/synchronization/mutex.h"
+#include "absl/time/time.h"
 #include "google/fhir/annotations.h"
 #include "google/fhir/fhir_path/fhir_path.h"
 #include "google/fhir/primitive_handler.h"
 #include "google/fhir/status/statusor.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/platform/fingerprint.h"
 
 namespace google {
 namespace fhir {
@@ -47,14 +60,14 @@ class ValidationResult {
   //
   // Example: "Bundle.entry.resource.ofType(Organization).telecom"
   //
-  std::string ConstraintPath() const { return constraint_path_; }
+  std::string ConstraintPath() const;
 
   // Returns a FHIRPath expression to the specific node that the FHIRPath
   // constraint was evaluated on.
   //
   // Example: "Bundle.entry[3].resource.ofType(Organization).telecom[2]"
   //
-  std::string NodePath() const { return node_path_; }
+  std::string NodePath() const;
 
   // Returns the FHIRPath constraint that was evaluated.
   std::string Constraint() const { return fhirpath_constraint_; }
@@ -65,11 +78,39 @@ class ValidationResult {
   // boolean, a status other than OK is returned.
   StatusOr<bool> EvaluationResult() const { return result_; }
 
+  // A step from a message to a value of one of its fields, with the index of
+  // the value if the field is repeated and -1 otherwise.
+  struct PathStep {
+    const ::google::protobuf::FieldDescriptor* field;
+    int index;
+  };
+
+  // The steps from the message being validated to a node in it.
+  using Trail = absl::InlinedVector<PathStep, 8>;
+
  private:
+  friend class FhirPathValidator;
+
+  // Creates a result for the node at the end of the trail of fields from a
+  // message of the root type. Its paths are only built when asked for.
+  ValidationResult(const ::google::protobuf::Descriptor* root, const Trail& trail,
+                   const std::string& fhirpath_constraint,
+                   StatusOr<bool> result)
+      : fhirpath_constraint_(fhirpath_constraint),
+        result_(result),
+        root_(root),
+        trail_(trail) {}
+
+  // Returns the path along the trail, with the indices of repeated fields if
+  // requested.
+  std::string TrailPath(bool with_indices) const;
+
   const std::string constraint_path_;
   const std::string node_path_;
   const std::string fhirpath_constraint_;
   const StatusOr<bool> result_;
+  const ::google::protobuf::Descriptor* const root_ = nullptr;
+  const Trail trail_;
 };
 
 // A ValidationRule is a function that takes a ValidationResult and returns
@@ -97,7 +138,7 @@ class ValidationResults {
   static bool RelaxedValidationFn(const ValidationResult& result);
 
   explicit ValidationResults(std::vector<ValidationResult> results)
-      : results_(results) {}
+      : results_(std::move(results)) {}
 
   // Returns true if all FHIRPath constraints on the particular resource satisfy
   // the provided validation function.
@@ -111,62 +152,446 @@ class ValidationResults {
   // encountered.
   Status LegacyValidationResult() const;
 
-  // Returns the result for each FHIRPath expressions that was evaluated.
+  // Returns the result for each FHIRPath expressions that was evaluated, or
+  // only for those that failed if the results were produced with
+  // ValidationReport::kFailuresOnly or kFirstViolation.
   // TODO: Expose expressions that failed to compile.
-  std::vector<ValidationResult> Results() const;
+  const std::vector<ValidationResult>& Results() const { return results_; }
 
  private:
   const std::vector<ValidationResult> results_;
 };
 
+// The results reported by FhirPathValidator::Validate.
+enum class ValidationReport {
+  // The result of every constraint that was evaluated.
+  kAllResults,
+
+  // Only the results of constraints that were not met or that did not
+  // evaluate to a boolean. These are all that ValidationResults::IsValid,
+  // with either StrictValidationFn or RelaxedValidationFn, and
+  // LegacyValidationResult need, and constraints that are met cost nothing to
+  // report.
+  kFailuresOnly,
+
+  // Stops at the first constraint that is not met, reporting it and, as with
+  // kFailuresOnly, any constraints evaluated before it that did not evaluate
+  // to a boolean; those do not stop validation since RelaxedValidationFn and
+  // LegacyValidationResult accept them. The constraints of each message are
+  // evaluated cheapest first, by a static estimate of their cost, rather than
+  // in the order they are defined, so the violation reported may not be the
+  // first one kAllResults would report. IsValid and whether
+  // LegacyValidationResult is OK are the same as for the other reports.
+  kFirstViolation,
+};
+
+// Subtrees of messages that earlier validations found to satisfy all of their
+// constraints, for revalidating messages that have only been changed in part
+// (e.g. by rewriting references or stamping metadata).
+//
+// Subtrees are identified by a fingerprint of their type and contents, so a
+// subtree that is unchanged since it was found valid is not validated again,
+// wherever it appears. Subtrees with constraints that refer to %resource
+// outside of themselves are always validated.
+//
+// Only subtrees with no failures are recorded, which add nothing to the
+// results of ValidationReport::kFailuresOnly and kFirstViolation; the cache is
+// not used for kAllResults. When the cache holds max_size subtrees, it is
+// cleared.
+//
+// This class is thread safe. A cache must only be used with a single
+// FhirPathValidator.
+class ValidationCache {
+ public:
+  explicit ValidationCache(size_t max_size = 1 << 20) : max_size_(max_size) {}
+
+  // Returns the number of subtrees recorded as valid.
+  size_t size() const;
+
+ private:
+  friend class FhirPathValidator;
+
+  bool Contains(const tensorflow::Fprint128& fingerprint) const;
+
+  void Insert(const tensorflow::Fprint128& fingerprint);
+
+  const size_t max_size_;
+  mutable absl::Mutex mutex_;
+  absl::flat_hash_set<tensorflow::Fprint128, tensorflow::Fprint128Hasher>
+      valid_subtrees_ ABSL_GUARDED_BY(mutex_);
+};
+
+// Statistics of the FHIRPath constraints evaluated by validations, aggregated
+// across calls and threads, to find the constraints that are evaluated, not
+// met or slow most often in production.
+//
+// Every evaluation of a constraint is counted, so constraints that are not
+// evaluated, e.g. because a ValidationCache holds the subtree or because the
+// constraint is met wherever the fields it reads are absent, add nothing.
+//
+// Statistics are recorded without locks into counters sharded by thread. A
+// snapshot may be taken at any time, including while validations are
+// recording statistics, in which case it includes some of their evaluations.
+//
+// This class is thread safe. Metrics must only be used with a single
+// FhirPathValidator, which they may outlive.
+class ValidationMetrics {
+ public:
+  // The number of buckets of the latency histogram of each constraint.
+  static constexpr int kLatencyBuckets = 24;
+
+  // The statistics of a constraint.
+  struct ConstraintStats {
+    // The message type the constraint is defined on.
+    const ::google::protobuf::Descriptor* type = nullptr;
+    // The field of the type the constraint is on, or null for constraints on
+    // the message itself.
+    const ::google::protobuf::FieldDescriptor* field = nullptr;
+    std::string constraint;
+
+    int64_t evaluations = 0;
+    // The evaluations to false, where the constraint was not met.
+    int64_t failures = 0;
+    // The evaluations that failed or did not produce a boolean.
+    int64_t errors = 0;
+    absl::Duration wall_time;
+
+    // latency_histogram[0] counts the evaluations that took less than a
+    // microsecond, and latency_histogram[i] those that took at least 2^(i-1)
+    // but less than 2^i microseconds. The last bucket also counts every
+    // evaluation that took longer.
+    std::array<int64_t, kLatencyBuckets> latency_histogram = {};
+  };
+
+  ValidationMetrics();
+  ~ValidationMetrics();
+
+  ValidationMetrics(const ValidationMetrics&) = delete;
+  ValidationMetrics& operator=(const ValidationMetrics&) = delete;
+
+  // Returns the statistics of every constraint evaluated so far, in the order
+  // the validator compiled the constraints.
+  std::vector<ConstraintStats> Snapshot() const;
+
+ private:
+  friend class FhirPathValidator;
+
+  // Identifies a constraint of the validator, which owns it.
+  struct ConstraintKey {
+    // Numbered from 0 in the order the validator compiled the constraints.
+    int id;
+    const ::google::protobuf::Descriptor* type;
+    const ::google::protobuf::FieldDescriptor* field;
+    const CompiledExpression* expression;
+  };
+
+  // Records an evaluation of the constraint that took the given time.
+  void Record(const ConstraintKey& key,
+              const StatusOr<EvaluationResult>& result, int64_t nanoseconds);
+
+  // A constraint as of its first evaluation recorded in a shard, copied from
+  // its key so that snapshots do not read from the validator.
+  struct RecordedConstraint {
+    int id;
+    const ::google::protobuf::Descriptor* type;
+    const ::google::protobuf::FieldDescriptor* field;
+    std::string constraint;
+  };
+
+  // Counters are allocated in chunks of constraints as constraints with
+  // higher ids are first recorded, and never freed before the metrics.
+  // Constraints beyond the last chunk are not recorded.
+  static constexpr int kShards = 16;
+  static constexpr int kChunkSize = 64;
+  static constexpr int kMaxChunks = 1024;
+
+  struct Counters {
+    std::atomic<const RecordedConstraint*> constraint{nullptr};
+    std::atomic<int64_t> evaluations{0};
+    std::atomic<int64_t> failures{0};
+    std::atomic<int64_t> errors{0};
+    std::atomic<int64_t> nanoseconds{0};
+    std::array<std::atomic<int64_t>, kLatencyBuckets> latency_histogram = {};
+  };
+
+  using Chunk = std::array<Counters, kChunkSize>;
+
+  struct Shard {
+    std::array<std::atomic<Chunk*>, kMaxChunks> chunks = {};
+  };
+
+  std::unique_ptr<Shard[]> shards_;
+};
+
+// Options for validating a message with FhirPathValidator.
+struct ValidationOptions {
+  ValidationReport report = ValidationReport::kAllResults;
+
+  // Thread pool on which the entries of a Bundle, or the contained resources
+  // of a resource, are validated in parallel. The results are the same as
+  // those of validating on the calling thread, in the same order. If null,
+  // the message is validated on the calling thread. The pool is not owned.
+  tensorflow::thread::ThreadPool* thread_pool = nullptr;
+
+  // Cache of subtrees found valid by earlier validations, which is consulted
+  // and updated by the validation. If null, every subtree is validated. The
+  // cache is not owned.
+  ValidationCache* cache = nullptr;
+
+  // Metrics that the evaluation of each constraint is recorded in. If null,
+  // no metrics are recorded. The metrics are not owned.
+  ValidationMetrics* metrics = nullptr;
+};
+
 // This class validates that all fhir_path_constraint annotations on
 // the given messages are valid. It will compile and cache the
 // constraint expressions as it encounters them, so users are encouraged
 // to create a single instance of this for the lifetime of the process.
-// This class is thread safe.
+// This class is thread safe, and once the constraints of a message type have
+// been compiled, validating messages of that type takes no locks.
 class FhirPathValidator {
+ private:
+  struct MessageConstraints;
+
  public:
   FhirPathValidator(const PrimitiveHandler* primitive_handler)
       : primitive_handler_(primitive_handler) {}
+
+  // Compiles constraints with the given options, e.g. to load them from
+  // ParsedExpressions produced by parse_fhir_path_constraints, to find the
+  // most expensive constraints with an EvaluationProfiler, or to check the
+  // bindings of constraints that call memberOf() against a TerminologyIndex.
+  // Anything the options refer to must outlive the validator.
+  FhirPathValidator(const PrimitiveHandler* primitive_handler,
+                    const CompileOptions& compile_options)
+      : primitive_handler_(primitive_handler),
+        compile_options_(compile_options) {}
   virtual ~FhirPathValidator();
 
   ABSL_MUST_USE_RESULT
-  ValidationResults Validate(const ::google::protobuf::Message& message);
+  ValidationResults Validate(
+      const ::google::protobuf::Message& message,
+      ValidationReport report = ValidationReport::kAllResults);
+
+  // Same as above, with the given options.
+  ABSL_MUST_USE_RESULT
+  ValidationResults Validate(const ::google::protobuf::Message& message,
+                             const ValidationOptions& options);
+
+  // The constraints on messages of a type and on the messages nested in them,
+  // for validating messages in a walk of their own, such as one that makes
+  // other checks of each message in the same pass. Types with no constraints,
+  // either of their own or of nested messages, have empty constraints.
+  class TypeConstraints {
+   public:
+    TypeConstraints() = default;
+
+    bool empty() const { return constraints_ == nullptr; }
+
+    // The fields that hold messages with constraints, in the order they are
+    // defined, together with the constraints of those messages.
+    int nested_count() const;
+    const ::google::protobuf::FieldDescriptor* nested_field(int i) const;
+    TypeConstraints nested_constraints(int i) const;
+
+   private:
+    friend class FhirPathValidator;
+
+    explicit TypeConstraints(const MessageConstraints* constraints)
+        : constraints_(constraints) {}
+
+    const MessageConstraints* constraints_ = nullptr;
+  };
+
+  // Returns the constraints on messages of the type.
+  TypeConstraints ConstraintsOf(const ::google::protobuf::Descriptor* descriptor);
+
+  // Validates the constraints on the message and its fields, but not those on
+  // nested messages, as for ValidationReport::kFirstViolation, and adds the
+  // results to the vector. The message must have the ancestry that %resource
+  // needs, and be at the end of the trail from a message of the root type.
+  // Evaluations are recorded in the metrics unless they are null. Returns
+  // false if a constraint was not met.
+  bool ValidateNode(const internal::WorkspaceMessage& message,
+                    TypeConstraints constraints,
+                    const ::google::protobuf::Descriptor* root,
+                    ValidationResult::Trail* trail,
+                    std::vector<ValidationResult>* results,
+                    ValidationMetrics* metrics) const;
 
  private:
   // A cache of constraints for a given message definition
   struct MessageConstraints {
+    explicit MessageConstraints(const ::google::protobuf::Descriptor* descriptor,
+                                const PrimitiveHandler* primitive_handler,
+                                const CompileOptions& compile_options)
+        : message_expressions(descriptor, primitive_handler, compile_options) {}
+
     // FHIRPath constraints at the "root" FHIR element, which is just the
     // protobuf message.
-    std::vector<CompiledExpression> message_expressions;
+    CompiledExpressionSet message_expressions;
 
-    // FHIRPath constraints on fields
+    // FHIRPath constraints on fields, grouped by field.
     std::vector<
-        std::pair<const ::google::protobuf::FieldDescriptor*, const CompiledExpression>>
+        std::pair<const ::google::protobuf::FieldDescriptor*, CompiledExpressionSet>>
         field_expressions;
 
-    // Nested messages that have constraints, so the evaluation logic
-    // knows to check them.
-    std::vector<const ::google::protobuf::FieldDescriptor*> nested_with_constraints;
+    // A constraint on the message or on one of its fields, with an estimate
+    // of the cost of evaluating it.
+    struct RankedConstraint {
+      // The field the constraint is on, or null for message constraints.
+      const ::google::protobuf::FieldDescriptor* field;
+      const CompiledExpression* expression;
+      int64_t cost;
+      // True if the constraint is met wherever none of the fields that its
+      // expression reads are set, so it need not be evaluated there.
+      bool met_when_absent;
+      const ValidationMetrics::ConstraintKey* metrics_key;
+    };
+
+    // Every constraint on the message and its fields, cheapest first, for
+    // ValidationReport::kFirstViolation.
+    std::vector<RankedConstraint> ranked_constraints;
+
+    // The keys that evaluations of the constraints are recorded under, in the
+    // order the constraints are defined: those on the message, followed by
+    // those on each field in field_expressions.
+    std::vector<ValidationMetrics::ConstraintKey> metrics_keys;
+
+    // True if any of the constraints on the message or its fields refers to
+    // %resource.
+    bool uses_resource = false;
+
+    // True if a constraint on the message or on a message nested in it refers
+    // to a resource that encloses the message, so validating the message
+    // depends on more than its own contents.
+    bool needs_enclosing_resource = false;
+
+    // Nested messages that have constraints, together with the constraints of
+    // their types, so the evaluation logic knows to check them without looking
+    // the constraints up again.
+    std::vector<std::pair<const ::google::protobuf::FieldDescriptor*,
+                          const MessageConstraints*>>
+        nested_with_constraints;
   };
 
+  // The constraints of each message type that has been validated as a root,
+  // by descriptor. A table is never modified once it has been published.
+  using ConstraintTable =
+      absl::flat_hash_map<const ::google::protobuf::Descriptor*,
+                          const MessageConstraints*>;
+
+  // Returns the constraints for messages of the given type, loading them and
+  // publishing a new constraint table if the type has not been validated
+  // before.
+  const MessageConstraints* RootConstraintsFor(
+      const ::google::protobuf::Descriptor* descriptor);
+
   // Loads constraints for the given descriptor.
-  MessageConstraints* ConstraintsFor(const ::google::protobuf::Descriptor* descriptor);
+  MessageConstraints* ConstraintsFor(const ::google::protobuf::Descriptor* descriptor)
+      ABSL_EXCLUSIVE_LOCKS_REQUIRED(mutex_);
 
   // Adds message-level constraints
   void AddMessageConstraints(const ::google::protobuf::Descriptor* descriptor,
                              MessageConstraints* constraints);
 
+  // Fingerprints of the message being validated and of the messages nested in
+  // it.
+  using Fingerprints = absl::flat_hash_map<const ::google::protobuf::Message*,
+                                           tensorflow::Fprint128>;
+
+  // What stays the same throughout the walk of the message being validated.
+  struct Walk {
+    // The type of the message being validated, where all trails begin.
+    const ::google::protobuf::Descriptor* root;
+    ValidationReport report;
+    tensorflow::thread::ThreadPool* thread_pool;
+    ValidationCache* cache;
+    // Fingerprints of every subtree of the message, if there is a cache.
+    const Fingerprints* fingerprints;
+    ValidationMetrics* metrics;
+  };
+
   // Recursively called validation method that aggregates results into the
-  // provided vector.
-  void Validate(absl::string_view constraint_path, absl::string_view node_path,
-                const internal::WorkspaceMessage& message,
-                std::vector<ValidationResult>* results);
+  // provided vector. The trail leads from the root message to the given one.
+  // Returns false if validation stopped at a violation. If the walk has a
+  // thread pool, the elements of the first fields found that hold Bundle
+  // entries or contained resources are validated on it.
+  bool Validate(const Walk& walk, const internal::WorkspaceMessage& message,
+                const MessageConstraints& constraints,
+                ValidationResult::Trail* trail,
+                std::vector<ValidationResult>* results) const;
+
+  // Validates each element of the repeated field of the message in parallel
+  // on the thread pool of the walk, and adds their results in order. Returns
+  // false if validation stopped at a violation.
+  bool ValidateInParallel(const Walk& walk,
+                          const internal::WorkspaceMessage& message,
+                          const ::google::protobuf::FieldDescriptor* field,
+                          const MessageConstraints& constraints,
+                          ValidationResult::Trail* trail,
+                          std::vector<ValidationResult>* results) const;
+
+  // Validates the constraints on the message, but not on nested messages, in
+  // the order they are defined.
+  void ValidateInOrder(const Walk& walk,
+                       const internal::WorkspaceMessage& message,
+                       const MessageConstraints& constraints,
+                       ValidationResult::Trail* trail,
+                       std::vector<ValidationResult>* results) const;
+
+  // Validates the constraints on the message, but not on nested messages,
+  // cheapest first, stopping at the first that is not met. Returns false if
+  // one was not met.
+  bool ValidateCheapestFirst(const Walk& walk,
+                             const internal::WorkspaceMessage& message,
+                             const MessageConstraints& constraints,
+                             ValidationResult::Trail* trail,
+                             std::vector<ValidationResult>* results) const;
+
+  // Evaluates the constraint against the message, recording the evaluation in
+  // the metrics of the walk, if any.
+  static StatusOr<EvaluationResult> Evaluate(
+      const Walk& walk, const ValidationMetrics::ConstraintKey& key,
+      const internal::WorkspaceMessage& message);
+
+  // Evaluates the set of constraints against the message as a whole. If the
+  // walk has metrics, each constraint is recorded, under the keys that start
+  // at the given one, with the time since the previous constraint's result,
+  // so a shared subexpression is charged to the first constraint using it.
+  static std::vector<StatusOr<EvaluationResult>> EvaluateSet(
+      const Walk& walk, const CompiledExpressionSet& expression_set,
+      const ValidationMetrics::ConstraintKey* keys,
+      const internal::WorkspaceMessage& message);
+
+  // Adds the result of evaluating a FHIRPath constraint on the node at the end
+  // of the trail, unless only failures are reported and the constraint is met.
+  // Returns false if the constraint was not met.
+  static bool AddResult(const ::google::protobuf::Descriptor* root,
+                        const ValidationResult::Trail& trail,
+                        const CompiledExpression& expression,
+                        const StatusOr<EvaluationResult>& expr_result,
+                        ValidationReport report,
+                        std::vector<ValidationResult>* results);
 
   const PrimitiveHandler* primitive_handler_;
+  const CompileOptions compile_options_;
   absl::Mutex mutex_;
-  std::unordered_map<std::string, std::unique_ptr<MessageConstraints>>
-      constraints_cache_;
+  absl::flat_hash_map<const ::google::protobuf::Descriptor*,
+                      std::unique_ptr<MessageConstraints>>
+      constraints_cache_ ABSL_GUARDED_BY(mutex_);
+
+  // The number of constraints compiled so far, which numbers their metrics
+  // keys.
+  int constraint_count_ ABSL_GUARDED_BY(mutex_) = 0;
+
+  // The most recently published constraint table, read without locking.
+  std::atomic<const ConstraintTable*> constraint_table_{nullptr};
+
+  // Every table that has been published, since readers may still be using
+  // one that has been replaced. There is at most one per root message type.
+  std::vector<std::unique_ptr<const ConstraintTable>> published_tables_
+      ABSL_GUARDED_BY(mutex_);
 };
 
 // Validates the fhir_path_constraint annotations on the given message.
@@ -14,6 +14,12 @@
 
 #include "google/fhir/fhir_path/fhir_path_validation.h"
 
+#include <cstdint>
+#include <numeric>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
 #include "google/protobuf/message.h"
 #include "google/protobuf/text_format.h"
 #include "gmock/gmock.h"
@@ -23,11 +29,13 @@
 #include "google/fhir/fhir_path/stu3_fhir_path_validation.h"
 #include "google/fhir/status/statusor.h"
 #include "proto/r4/core/resources/bundle_and_contained_resource.pb.h"
+#include "proto/r4/core/codes.pb.h"
 #include "proto/r4/core/datatypes.pb.h"
 #include "proto/r4/core/resources/encounter.pb.h"
 #include "proto/r4/core/resources/medication_knowledge.pb.h"
 #include "proto/r4/core/resources/observation.pb.h"
 #include "proto/r4/core/resources/organization.pb.h"
+#include "proto/r4/core/resources/structure_definition.pb.h"
 #include "proto/r4/core/resources/value_set.pb.h"
 #include "proto/r4/uscore.pb.h"
 #include "proto/r4/uscore_codes.pb.h"
@@ -37,6 +45,8 @@
 #include "proto/stu3/resources.pb.h"
 #include "proto/stu3/uscore.pb.h"
 #include "proto/stu3/uscore_codes.pb.h"
+#include "tensorflow/core/lib/core/threadpool.h"
+#include "tensorflow/core/platform/env.h"
 
 namespace google {
 namespace fhir {
@@ -60,11 +70,17 @@ namespace {
 
 using ::testing::AllOf;
 using ::testing::Contains;
+using ::testing::Each;
+using ::testing::ElementsAre;
+using ::testing::ElementsAreArray;
 using ::testing::Eq;
+using ::testing::IsEmpty;
 using ::testing::IsSupersetOf;
+using ::testing::Not;
 using ::testing::Property;
 using ::testing::ResultOf;
 using ::testing::StrEq;
+using ::testing::Truly;
 
 static ::google::protobuf::TextFormat::Parser parser;  // NOLINT
 
@@ -198,6 +214,45 @@ FHIR_VERSION_TEST(FhirPathTest, ConstraintViolationResultPaths, {
                           StrEq("Bundle.entry[0]")))}));
 })
 
+FHIR_VERSION_TEST(FhirPathTest, FailuresOnlyReport, {
+  auto bundle = ParseFromString<Bundle>(
+      R"proto(entry: {
+                resource: {
+                  organization: { telecom: { use: { value: HOME } } }
+                }
+              })proto");
+
+  VersionedMessageValidator validator;
+  ValidationResults all_results = validator.Validate(bundle);
+  ValidationResults failures =
+      validator.Validate(bundle, ValidationReport::kFailuresOnly);
+
+  EXPECT_FALSE(failures.IsValid());
+  EXPECT_FALSE(failures.IsValid(&ValidationResults::RelaxedValidationFn));
+  EXPECT_EQ(failures.LegacyValidationResult(),
+            all_results.LegacyValidationResult());
+  EXPECT_LT(failures.Results().size(), all_results.Results().size());
+  EXPECT_THAT(failures.Results(),
+              Each(Not(Truly(&ValidationResults::StrictValidationFn))));
+  EXPECT_THAT(
+      failures.Results(),
+      Contains(AllOf(
+          Property(&ValidationResult::Constraint,
+                   StrEq("where(use = 'home').empty()")),
+          Property(
+              &ValidationResult::ConstraintPath,
+              StrEq("Bundle.entry.resource.ofType(Organization).telecom")),
+          Property(&ValidationResult::NodePath,
+                   StrEq("Bundle.entry[0].resource.ofType(Organization)."
+                         "telecom[0]")))));
+
+  EXPECT_THAT(
+      validator.Validate(ValidObservation<Observation>(),
+                         ValidationReport::kFailuresOnly)
+          .Results(),
+      IsEmpty());
+})
+
 FHIR_VERSION_TEST(FhirPathTest, ConstraintSatisfied, {
   Observation observation = ValidObservation<Observation>();
 
@@ -272,6 +327,69 @@ FHIR_VERSION_TEST(FhirPathTest, MessageLevelConstraint, {
   EXPECT_TRUE(VersionedMessageValidator().Validate(period).IsValid());
 })
 
+TEST(FhirPathTest, ValidationMetrics) {
+  // Violates both the message constraint of Organization and the constraint
+  // on its first telecom.
+  auto organization = ParseFromString<r4::core::Organization>(R"proto(
+    telecom: { use: { value: HOME } }
+    telecom: { use: { value: WORK } }
+  )proto");
+
+  ValidationMetrics metrics;
+  {
+    r4::FhirPathValidator validator;
+    ValidationOptions options;
+    options.metrics = &metrics;
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t) {
+      threads.emplace_back([&]() {
+        for (int i = 0; i < 10; ++i) {
+          EXPECT_FALSE(validator.Validate(organization, options).IsValid());
+        }
+      });
+    }
+    for (std::thread& thread : threads) {
+      thread.join();
+    }
+    options.report = ValidationReport::kFirstViolation;
+    EXPECT_FALSE(validator.Validate(organization, options).IsValid());
+  }
+
+  // The metrics outlive the validator.
+  auto stats_of = [&metrics](const std::string& constraint) {
+    for (const ValidationMetrics::ConstraintStats& stats : metrics.Snapshot()) {
+      if (stats.constraint == constraint) {
+        return stats;
+      }
+    }
+    ADD_FAILURE() << "No statistics for " << constraint;
+    return ValidationMetrics::ConstraintStats();
+  };
+
+  const ValidationMetrics::ConstraintStats name =
+      stats_of("(identifier.count() + name.count()) > 0");
+  EXPECT_EQ(name.type, r4::core::Organization::descriptor());
+  EXPECT_EQ(name.field, nullptr);
+  EXPECT_EQ(name.evaluations, 41);
+  EXPECT_EQ(name.failures, 41);
+  EXPECT_EQ(name.errors, 0);
+  EXPECT_EQ(std::accumulate(name.latency_histogram.begin(),
+                            name.latency_histogram.end(), int64_t{0}),
+            name.evaluations);
+
+  // The telecom constraint is evaluated on each telecom when all results are
+  // reported, but validation stops at the cheaper message constraint before
+  // reaching it when only the first violation is.
+  const ValidationMetrics::ConstraintStats telecom =
+      stats_of("where(use = 'home').empty()");
+  EXPECT_EQ(telecom.type, r4::core::Organization::descriptor());
+  EXPECT_EQ(telecom.field,
+            r4::core::Organization::descriptor()->FindFieldByName("telecom"));
+  EXPECT_EQ(telecom.evaluations, 80);
+  EXPECT_EQ(telecom.failures, 40);
+  EXPECT_EQ(telecom.errors, 0);
+}
+
 // TODO: Templatize tests to work with both STU3 and R4
 TEST(FhirPathTest, MessageLevelConstraintViolated) {
   auto end_before_start_period = ParseFromString<r4::core::Period>(R"proto(
@@ -311,6 +429,309 @@ TEST(FhirPathTest, NestedMessageLevelConstraintViolated) {
       r4::FhirPathValidator().Validate(end_before_start_encounter).IsValid());
 }
 
+TEST(FhirPathTest, FirstViolationReport) {
+  // Violates both the message constraint of Organization and the constraint
+  // on its telecom field.
+  auto organization = ParseFromString<r4::core::Organization>(R"proto(
+    telecom: { use: { value: HOME } }
+    telecom: { use: { value: WORK } }
+  )proto");
+
+  r4::FhirPathValidator validator;
+  ValidationResults all_results = validator.Validate(organization);
+  ValidationResults first_violation =
+      validator.Validate(organization, ValidationReport::kFirstViolation);
+
+  EXPECT_FALSE(all_results.IsValid());
+  EXPECT_FALSE(first_violation.IsValid());
+  EXPECT_FALSE(first_violation.LegacyValidationResult().ok());
+
+  // Only the cheaper of the two violations is evaluated and reported.
+  EXPECT_THAT(
+      first_violation.Results(),
+      ElementsAre(AllOf(
+          Property(&ValidationResult::Constraint,
+                   StrEq("(identifier.count() + name.count()) > 0")),
+          Property(&ValidationResult::NodePath, StrEq("Organization")),
+          ResultOf([](auto x) { return x.EvaluationResult().ValueOrDie(); },
+                   Eq(false)))));
+
+  EXPECT_THAT(validator
+                  .Validate(ValidObservation<r4::core::Observation>(),
+                            ValidationReport::kFirstViolation)
+                  .Results(),
+              IsEmpty());
+}
+
+// Returns a description of each result, in order.
+std::vector<std::string> DescribeResults(const ValidationResults& results) {
+  std::vector<std::string> descriptions;
+  for (const ValidationResult& result : results.Results()) {
+    descriptions.push_back(absl::StrCat(
+        result.NodePath(), " ", result.ConstraintPath(), " ",
+        result.Constraint(), " ",
+        result.EvaluationResult().ok()
+            ? (result.EvaluationResult().ValueOrDie() ? "true" : "false")
+            : result.EvaluationResult().status().ToString()));
+  }
+  return descriptions;
+}
+
+TEST(FhirPathTest, FirstViolationSkipsConstraintsOnAbsentFields) {
+  EvaluationProfiler profiler;
+  CompileOptions options;
+  options.profiler = &profiler;
+  r4::FhirPathValidator validator(options);
+  const std::string constraint = "dataAbsentReason.empty() or value.empty()";
+  auto evaluations = [&profiler, &constraint]() {
+    for (const EvaluationProfiler::ExpressionStats& stats :
+         profiler.GetStats()) {
+      if (stats.fhir_path == constraint) {
+        return stats.nodes[0].evaluations;
+      }
+    }
+    return int64_t{-1};
+  };
+
+  r4::core::Observation observation = ValidObservation<r4::core::Observation>();
+  EXPECT_THAT(
+      validator.Validate(observation, ValidationReport::kFirstViolation)
+          .Results(),
+      IsEmpty());
+  const int64_t compiled_evaluations = evaluations();
+  ASSERT_GE(compiled_evaluations, 0);
+
+  // The constraint is met by observations with neither of the fields it
+  // reads, so it is not evaluated on them.
+  EXPECT_THAT(
+      validator.Validate(observation, ValidationReport::kFirstViolation)
+          .Results(),
+      IsEmpty());
+  EXPECT_EQ(evaluations(), compiled_evaluations);
+
+  // It is still evaluated, and reported, for all results.
+  EXPECT_TRUE(validator.Validate(observation).IsValid());
+  EXPECT_EQ(evaluations(), compiled_evaluations + 1);
+
+  // And wherever one of the fields is set.
+  observation.mutable_value()->mutable_string_value()->set_value("x");
+  observation.mutable_data_absent_reason()->mutable_text()->set_value("y");
+  EXPECT_THAT(
+      DescribeResults(
+          validator.Validate(observation, ValidationReport::kFirstViolation)),
+      ElementsAre(
+          absl::StrCat("Observation Observation ", constraint, " false")));
+  EXPECT_EQ(evaluations(), compiled_evaluations + 2);
+}
+
+TEST(FhirPathTest, ParallelBundleValidation) {
+  r4::core::Bundle bundle;
+  for (int i = 0; i < 60; ++i) {
+    r4::core::Organization* organization =
+        bundle.add_entry()->mutable_resource()->mutable_organization();
+    organization->mutable_name()->set_value(absl::StrCat("org", i));
+    if (i % 7 == 3) {
+      organization->add_telecom()->mutable_use()->set_value(
+          r4::core::ContactPointUseCode::HOME);
+    }
+  }
+
+  tensorflow::thread::ThreadPool thread_pool(tensorflow::Env::Default(),
+                                             "fhir_path_validation_test", 4);
+  r4::FhirPathValidator validator;
+  ValidationOptions options;
+  options.thread_pool = &thread_pool;
+  for (ValidationReport report :
+       {ValidationReport::kAllResults, ValidationReport::kFailuresOnly,
+        ValidationReport::kFirstViolation}) {
+    options.report = report;
+    ValidationResults serial = validator.Validate(bundle, report);
+    ValidationResults parallel = validator.Validate(bundle, options);
+    EXPECT_FALSE(parallel.IsValid());
+    EXPECT_EQ(parallel.LegacyValidationResult(),
+              serial.LegacyValidationResult());
+    EXPECT_THAT(DescribeResults(parallel),
+                ElementsAreArray(DescribeResults(serial)));
+  }
+
+  // Contained resources, which are only messages of their own in STU3, are
+  // validated in parallel as well.
+  stu3::proto::Organization organization;
+  for (int i = 0; i < 10; ++i) {
+    stu3::proto::Organization* contained =
+        organization.add_contained()->mutable_organization();
+    contained->mutable_name()->set_value(absl::StrCat("org", i));
+    if (i % 3 == 1) {
+      contained->add_telecom()->mutable_use()->set_value(
+          stu3::proto::ContactPointUseCode::HOME);
+    }
+  }
+  stu3::FhirPathValidator stu3_validator;
+  options.report = ValidationReport::kAllResults;
+  ValidationResults contained_results =
+      stu3_validator.Validate(organization, options);
+  EXPECT_FALSE(contained_results.IsValid());
+  EXPECT_THAT(DescribeResults(contained_results),
+              ElementsAreArray(DescribeResults(stu3_validator.Validate(
+                  organization, ValidationReport::kAllResults))));
+
+  bundle.mutable_entry(3)->mutable_resource()->mutable_organization()
+      ->clear_telecom();
+  bundle.mutable_entry(10)->mutable_resource()->mutable_organization()
+      ->clear_telecom();
+  options.report = ValidationReport::kFailuresOnly;
+  ValidationResults failures = validator.Validate(bundle, options);
+  EXPECT_THAT(DescribeResults(failures),
+              ElementsAreArray(DescribeResults(validator.Validate(
+                  bundle, ValidationReport::kFailuresOnly))));
+}
+
+TEST(FhirPathTest, CachedValidation) {
+  r4::core::Bundle bundle;
+  bundle.mutable_type()->set_value(r4::core::BundleTypeCode::COLLECTION);
+  for (int i = 0; i < 20; ++i) {
+    r4::core::Organization* organization =
+        bundle.add_entry()->mutable_resource()->mutable_organization();
+    organization->mutable_name()->set_value(absl::StrCat("org", i));
+    if (i % 7 == 3) {
+      organization->add_telecom()->mutable_use()->set_value(
+          r4::core::ContactPointUseCode::HOME);
+    }
+  }
+
+  r4::FhirPathValidator validator;
+  ValidationCache cache;
+  ValidationOptions options;
+  options.cache = &cache;
+  for (ValidationReport report :
+       {ValidationReport::kFailuresOnly, ValidationReport::kFirstViolation}) {
+    options.report = report;
+    ValidationResults uncached = validator.Validate(bundle, report);
+    EXPECT_FALSE(uncached.IsValid());
+    EXPECT_THAT(DescribeResults(validator.Validate(bundle, options)),
+                ElementsAreArray(DescribeResults(uncached)));
+  }
+  const size_t cache_size = cache.size();
+  EXPECT_GT(cache_size, 0);
+
+  // Revalidating an unchanged message finds nothing new to cache.
+  options.report = ValidationReport::kFailuresOnly;
+  EXPECT_THAT(DescribeResults(validator.Validate(bundle, options)),
+              ElementsAreArray(DescribeResults(validator.Validate(
+                  bundle, ValidationReport::kFailuresOnly))));
+  EXPECT_EQ(cache.size(), cache_size);
+
+  // Edited entries are validated again.
+  bundle.mutable_entry(3)->mutable_resource()->mutable_organization()
+      ->clear_telecom();
+  bundle.mutable_entry(5)->mutable_resource()->mutable_organization()
+      ->add_telecom()->mutable_use()->set_value(
+          r4::core::ContactPointUseCode::HOME);
+  EXPECT_THAT(DescribeResults(validator.Validate(bundle, options)),
+              ElementsAreArray(DescribeResults(validator.Validate(
+                  bundle, ValidationReport::kFailuresOnly))));
+  for (int i : {5, 10, 17}) {
+    bundle.mutable_entry(i)->mutable_resource()->mutable_organization()
+        ->clear_telecom();
+  }
+  EXPECT_TRUE(validator.Validate(bundle, options).IsValid());
+
+  // Reports of all results do not use the cache.
+  const size_t valid_cache_size = cache.size();
+  options.report = ValidationReport::kAllResults;
+  EXPECT_THAT(DescribeResults(validator.Validate(bundle, options)),
+              ElementsAreArray(DescribeResults(validator.Validate(bundle))));
+  EXPECT_EQ(cache.size(), valid_cache_size);
+}
+
+TEST(FhirPathTest, CachedValidationOfResourceDependentConstraints) {
+  // The constraints on a snapshot refer to the structure definition that
+  // contains it, so an unchanged snapshot is validated again when the
+  // structure definition changes.
+  auto structure_definition =
+      ParseFromString<r4::core::StructureDefinition>(R"proto(
+        kind { value: LOGICAL }
+        type { value: "Patient" }
+        snapshot {
+          element {
+            path { value: "Patient" }
+            definition { value: "A patient" }
+            min { value: 0 }
+            max { value: "*" }
+            base {
+              path { value: "Patient" }
+              min { value: 0 }
+              max { value: "*" }
+            }
+          }
+        }
+      )proto");
+
+  r4::FhirPathValidator validator;
+  ValidationCache cache;
+  ValidationOptions options;
+  options.report = ValidationReport::kFailuresOnly;
+  options.cache = &cache;
+  EXPECT_THAT(
+      DescribeResults(validator.Validate(structure_definition, options)),
+      ElementsAreArray(DescribeResults(validator.Validate(
+          structure_definition, ValidationReport::kFailuresOnly))));
+
+  structure_definition.mutable_kind()->set_value(
+      r4::core::StructureDefinitionKindCode::RESOURCE);
+  structure_definition.mutable_type()->set_value("Observation");
+  ValidationResults uncached = validator.Validate(
+      structure_definition, ValidationReport::kFailuresOnly);
+  EXPECT_THAT(uncached.Results(),
+              Contains(Property(&ValidationResult::ConstraintPath,
+                                "StructureDefinition.snapshot")));
+  EXPECT_THAT(
+      DescribeResults(validator.Validate(structure_definition, options)),
+      ElementsAreArray(DescribeResults(uncached)));
+}
+
+// Validates messages of several types concurrently on a shared validator,
+// including while the constraints of each type are first being compiled.
+TEST(FhirPathTest, SharedValidatorIsThreadSafe) {
+  auto end_before_start_encounter = ParseFromString<r4::core::Encounter>(R"proto(
+    status { value: TRIAGED }
+    id { value: "123" }
+    period {
+      start: { value_us: 1556750153000000 timezone: "America/Los_Angeles" }
+      end: { value_us: 1556750000000000 timezone: "America/Los_Angeles" }
+    }
+  )proto");
+  auto organization = ParseFromString<r4::core::Organization>(R"proto(
+    name: { value: 'myorg' }
+    telecom: { use: { value: HOME } }
+  )proto");
+  auto observation = ValidObservation<r4::core::Observation>();
+  const std::vector<const ::google::protobuf::Message*> messages = {
+      &end_before_start_encounter, &organization, &observation};
+
+  std::vector<size_t> expected_sizes;
+  for (const ::google::protobuf::Message* message : messages) {
+    expected_sizes.push_back(
+        r4::FhirPathValidator().Validate(*message).Results().size());
+  }
+
+  r4::FhirPathValidator validator;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < 8; ++t) {
+    threads.emplace_back([&, t]() {
+      for (int i = 0; i < 20; ++i) {
+        const int m = (t + i) % messages.size();
+        ValidationResults results = validator.Validate(*messages[m]);
+        EXPECT_EQ(results.Results().size(), expected_sizes[m]);
+        EXPECT_EQ(results.IsValid(), messages[m] == &observation);
+      }
+    });
+  }
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+}
+
 // TODO: Templatize tests to work with both STU3 and R4
 TEST(FhirPathTest, ProfiledEmptyExtension) {
   r4::uscore::USCorePatientProfile patient =
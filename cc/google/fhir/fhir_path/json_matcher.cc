@@ -0,0 +1,1010 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "google/fhir/fhir_path/json_matcher.h"
+
+#include <algorithm>
+#include <memory>
+#include <utility>
+#include <vector>
+
+#include "google/protobuf/any.pb.h"
+#include "google/protobuf/descriptor.h"
+#include "google/protobuf/message.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/functional/function_ref.h"
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/types/optional.h"
+#include "google/fhir/annotations.h"
+#include "google/fhir/fhir_path/fhir_path.h"
+#include "google/fhir/fhir_path/parser.h"
+#include "google/fhir/fhir_path/utils.h"
+#include "google/fhir/fhir_types.h"
+#include "google/fhir/status/status.h"
+#include "google/fhir/status/statusor.h"
+#include "google/fhir/util.h"
+
+namespace google {
+namespace fhir {
+namespace fhir_path {
+
+using ::absl::InvalidArgumentError;
+using ::absl::NotFoundError;
+using ::absl::UnimplementedError;
+using ::google::protobuf::Descriptor;
+using ::google::protobuf::FieldDescriptor;
+using ::google::protobuf::Message;
+using ::google::protobuf::Reflection;
+using internal::AstNode;
+
+namespace internal {
+
+namespace {
+
+// Scanning of JSON text. Values are returned as views of the text they were
+// read from, so that navigating a record neither copies nor allocates. Only
+// the structure needed to find the end of a value is checked.
+
+void SkipWhitespace(absl::string_view* json) {
+  while (!json->empty() && (json->front() == ' ' || json->front() == '\t' ||
+                            json->front() == '\n' || json->front() == '\r')) {
+    json->remove_prefix(1);
+  }
+}
+
+Status UnexpectedEnd() {
+  return InvalidArgumentError("Unexpected end of JSON");
+}
+
+// Consumes the JSON string at the start of the input, including its quotes.
+Status SkipString(absl::string_view* json) {
+  for (size_t i = 1; i < json->size(); ++i) {
+    if ((*json)[i] == '\\') {
+      ++i;
+    } else if ((*json)[i] == '"') {
+      json->remove_prefix(i + 1);
+      return absl::OkStatus();
+    }
+  }
+  return UnexpectedEnd();
+}
+
+// Consumes the JSON value at the start of the input, and returns its text.
+StatusOr<absl::string_view> ConsumeValue(absl::string_view* json) {
+  SkipWhitespace(json);
+  const char* start = json->data();
+  int depth = 0;
+  do {
+    if (json->empty()) {
+      return UnexpectedEnd();
+    }
+    switch (json->front()) {
+      case '"':
+        FHIR_RETURN_IF_ERROR(SkipString(json));
+        break;
+      case '{':
+      case '[':
+        ++depth;
+        json->remove_prefix(1);
+        break;
+      case '}':
+      case ']':
+        if (depth == 0) {
+          return InvalidArgumentError(
+              absl::StrCat("Unexpected '", json->substr(0, 1), "' in JSON"));
+        }
+        --depth;
+        json->remove_prefix(1);
+        break;
+      default:
+        if (depth > 0) {
+          json->remove_prefix(1);
+          break;
+        }
+        // A number, true, false or null.
+        size_t end = json->find_first_of(" \t\n\r,:]}");
+        if (end == 0) {
+          return InvalidArgumentError(
+              absl::StrCat("Unexpected '", json->substr(0, 1), "' in JSON"));
+        }
+        json->remove_prefix(std::min(end, json->size()));
+    }
+  } while (depth > 0);
+  return absl::string_view(start, json->data() - start);
+}
+
+// Consumes the given character, after any whitespace.
+Status Expect(char c, absl::string_view* json) {
+  SkipWhitespace(json);
+  if (json->empty() || json->front() != c) {
+    return InvalidArgumentError(absl::StrCat("Expected '", std::string(1, c),
+                                             "' in JSON"));
+  }
+  json->remove_prefix(1);
+  return absl::OkStatus();
+}
+
+// Returns true, after consuming it, if the next character is the given one.
+bool Consume(char c, absl::string_view* json) {
+  SkipWhitespace(json);
+  if (!json->empty() && json->front() == c) {
+    json->remove_prefix(1);
+    return true;
+  }
+  return false;
+}
+
+void AppendUtf8(uint32_t code_point, std::string* out) {
+  if (code_point < 0x80) {
+    out->push_back(static_cast<char>(code_point));
+  } else if (code_point < 0x800) {
+    out->push_back(static_cast<char>(0xC0 | (code_point >> 6)));
+    out->push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+  } else if (code_point < 0x10000) {
+    out->push_back(static_cast<char>(0xE0 | (code_point >> 12)));
+    out->push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+    out->push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+  } else {
+    out->push_back(static_cast<char>(0xF0 | (code_point >> 18)));
+    out->push_back(static_cast<char>(0x80 | ((code_point >> 12) & 0x3F)));
+    out->push_back(static_cast<char>(0x80 | ((code_point >> 6) & 0x3F)));
+    out->push_back(static_cast<char>(0x80 | (code_point & 0x3F)));
+  }
+}
+
+StatusOr<uint32_t> ReadHex4(absl::string_view text) {
+  uint32_t value = 0;
+  if (text.size() < 4) {
+    return InvalidArgumentError("Incomplete \\u escape in JSON string");
+  }
+  for (char c : text.substr(0, 4)) {
+    value <<= 4;
+    if (c >= '0' && c <= '9') {
+      value |= c - '0';
+    } else if (c >= 'a' && c <= 'f') {
+      value |= c - 'a' + 10;
+    } else if (c >= 'A' && c <= 'F') {
+      value |= c - 'A' + 10;
+    } else {
+      return InvalidArgumentError("Invalid \\u escape in JSON string");
+    }
+  }
+  return value;
+}
+
+// Returns the contents of the JSON string, which is the complete text of a
+// string value. Strings without escapes are returned as a view of the JSON,
+// others are decoded into the scratch string.
+StatusOr<absl::string_view> DecodeString(absl::string_view json,
+                                         std::string* scratch) {
+  if (json.size() < 2 || json.front() != '"' || json.back() != '"') {
+    return InvalidArgumentError(absl::StrCat("Expected a JSON string: ", json));
+  }
+  absl::string_view text = json.substr(1, json.size() - 2);
+  size_t escape = text.find('\\');
+  if (escape == absl::string_view::npos) {
+    return text;
+  }
+
+  scratch->assign(text.data(), escape);
+  for (size_t i = escape; i < text.size(); ++i) {
+    if (text[i] != '\\') {
+      scratch->push_back(text[i]);
+      continue;
+    }
+    if (++i == text.size()) {
+      return UnexpectedEnd();
+    }
+    switch (text[i]) {
+      case '"':
+      case '\\':
+      case '/':
+        scratch->push_back(text[i]);
+        break;
+      case 'b':
+        scratch->push_back('\b');
+        break;
+      case 'f':
+        scratch->push_back('\f');
+        break;
+      case 'n':
+        scratch->push_back('\n');
+        break;
+      case 'r':
+        scratch->push_back('\r');
+        break;
+      case 't':
+        scratch->push_back('\t');
+        break;
+      case 'u': {
+        FHIR_ASSIGN_OR_RETURN(uint32_t code_point,
+                              ReadHex4(text.substr(i + 1)));
+        i += 4;
+        if (code_point >= 0xD800 && code_point < 0xDC00 &&
+            text.substr(i + 1, 2) == "\\u") {
+          FHIR_ASSIGN_OR_RETURN(uint32_t low, ReadHex4(text.substr(i + 3)));
+          if (low >= 0xDC00 && low < 0xE000) {
+            code_point = 0x10000 + ((code_point - 0xD800) << 10) +
+                         (low - 0xDC00);
+            i += 6;
+          }
+        }
+        AppendUtf8(code_point, scratch);
+        break;
+      }
+      default:
+        return InvalidArgumentError(
+            absl::StrCat("Invalid escape in JSON string: ", json));
+    }
+  }
+  return absl::string_view(*scratch);
+}
+
+bool IsObject(absl::string_view value) {
+  return !value.empty() && value.front() == '{';
+}
+
+bool IsArray(absl::string_view value) {
+  return !value.empty() && value.front() == '[';
+}
+
+bool IsNull(absl::string_view value) { return value == "null"; }
+
+// Calls the visitor with the key and value of each member of the JSON object,
+// until it returns false.
+Status ForEachMember(
+    absl::string_view object,
+    absl::FunctionRef<StatusOr<bool>(absl::string_view key,
+                                     absl::string_view value)>
+        visitor) {
+  FHIR_RETURN_IF_ERROR(Expect('{', &object));
+  if (Consume('}', &object)) {
+    return absl::OkStatus();
+  }
+  do {
+    SkipWhitespace(&object);
+    FHIR_ASSIGN_OR_RETURN(absl::string_view key_json, ConsumeValue(&object));
+    std::string scratch;
+    FHIR_ASSIGN_OR_RETURN(absl::string_view key,
+                          DecodeString(key_json, &scratch));
+    FHIR_RETURN_IF_ERROR(Expect(':', &object));
+    FHIR_ASSIGN_OR_RETURN(absl::string_view value, ConsumeValue(&object));
+    FHIR_ASSIGN_OR_RETURN(bool more, visitor(key, value));
+    if (!more) {
+      return absl::OkStatus();
+    }
+  } while (Consume(',', &object));
+  return Expect('}', &object);
+}
+
+// Returns the value of the member of the JSON object with the given key, or
+// an empty view if there is none.
+StatusOr<absl::string_view> FindMember(absl::string_view object,
+                                       absl::string_view key) {
+  absl::string_view found;
+  FHIR_RETURN_IF_ERROR(ForEachMember(
+      object,
+      [&](absl::string_view member_key,
+          absl::string_view value) -> StatusOr<bool> {
+        if (member_key != key) {
+          return true;
+        }
+        found = value;
+        return false;
+      }));
+  return found;
+}
+
+// Appends the elements of the JSON array to the results.
+Status AppendElements(absl::string_view array,
+                      std::vector<absl::string_view>* results) {
+  FHIR_RETURN_IF_ERROR(Expect('[', &array));
+  if (Consume(']', &array)) {
+    return absl::OkStatus();
+  }
+  do {
+    FHIR_ASSIGN_OR_RETURN(absl::string_view value, ConsumeValue(&array));
+    results->push_back(value);
+  } while (Consume(',', &array));
+  return Expect(']', &array);
+}
+
+}  // namespace
+
+// An element of a collection, as the JSON text it is read from. FHIR JSON
+// splits primitives in two: the value, and an object holding the id and
+// extensions of the element under the field name prefixed with "_". Either
+// may be missing, in which case its view is empty. Other elements are JSON
+// objects held by the value.
+struct JsonElement {
+  absl::string_view value;
+  absl::string_view element;
+};
+
+// A compiled expression that evaluates to a collection.
+class JsonCollection {
+ public:
+  virtual ~JsonCollection() = default;
+
+  // Appends the collection that the expression evaluates to against the given
+  // context (i.e. $this) to the results.
+  virtual Status Evaluate(const JsonElement& context,
+                          std::vector<JsonElement>* results) const = 0;
+};
+
+// A compiled expression that evaluates to a boolean, or to the empty
+// collection.
+class JsonPredicate {
+ public:
+  virtual ~JsonPredicate() = default;
+
+  // Returns the value of the expression against the given context (i.e.
+  // $this), or nullopt if it evaluates to the empty collection.
+  virtual StatusOr<absl::optional<bool>> Evaluate(
+      const JsonElement& context) const = 0;
+};
+
+namespace {
+
+// Returns true if messages of the given type are held by the JSON as strings
+// and convert to System.String, so that comparing them with a string literal
+// compares the strings. Codes bound to a value set may be held as enums, in
+// which case the JSON string is the code.
+bool IsStringValued(const Descriptor* descriptor) {
+  static const auto* kStringTypeUrls = new absl::flat_hash_set<std::string>({
+      "http://hl7.org/fhir/StructureDefinition/canonical",
+      "http://hl7.org/fhir/StructureDefinition/id",
+      "http://hl7.org/fhir/StructureDefinition/markdown",
+      "http://hl7.org/fhir/StructureDefinition/oid",
+      "http://hl7.org/fhir/StructureDefinition/string",
+      "http://hl7.org/fhir/StructureDefinition/uri",
+      "http://hl7.org/fhir/StructureDefinition/url",
+      "http://hl7.org/fhir/StructureDefinition/uuid",
+  });
+  return IsTypeOrProfileOfCode(descriptor) ||
+         kStringTypeUrls->contains(GetStructureDefinitionUrl(descriptor));
+}
+
+bool IsIntegerValued(const Descriptor* descriptor) {
+  return IsInteger(descriptor) || IsPositiveInt(descriptor) ||
+         IsUnsignedInt(descriptor);
+}
+
+// The id and extensions of a primitive make it unequal to a literal of the
+// same type, as literals have neither.
+StatusOr<bool> HasIdOrExtensions(absl::string_view element) {
+  bool found = false;
+  if (element.empty()) {
+    return found;
+  }
+  FHIR_RETURN_IF_ERROR(ForEachMember(
+      element,
+      [&](absl::string_view key, absl::string_view value) -> StatusOr<bool> {
+        if (key == "id") {
+          found = true;
+        } else if (key == "extension") {
+          std::vector<absl::string_view> extensions;
+          FHIR_RETURN_IF_ERROR(AppendElements(value, &extensions));
+          found = !extensions.empty();
+        }
+        return !found;
+      }));
+  return found;
+}
+
+// Implements navigation to a field of the messages in the parent collection,
+// or of $this if there is no parent.
+class JsonField : public JsonCollection {
+ public:
+  JsonField(std::shared_ptr<const JsonCollection> parent,
+            const FieldDescriptor* field)
+      : parent_(std::move(parent)),
+        field_(field),
+        name_(field->json_name()),
+        element_name_(absl::StrCat("_", field->json_name())),
+        primitive_(IsPrimitive(field->message_type())),
+        reference_(field->containing_oneof() != nullptr) {}
+
+  Status Evaluate(const JsonElement& context,
+                  std::vector<JsonElement>* results) const override {
+    if (parent_ == nullptr) {
+      return AppendField(context, results);
+    }
+
+    std::vector<JsonElement> parents;
+    FHIR_RETURN_IF_ERROR(parent_->Evaluate(context, &parents));
+    for (const JsonElement& parent : parents) {
+      FHIR_RETURN_IF_ERROR(AppendField(parent, results));
+    }
+    return absl::OkStatus();
+  }
+
+ private:
+  Status AppendField(const JsonElement& parent,
+                     std::vector<JsonElement>* results) const {
+    if (!IsObject(parent.value)) {
+      return InvalidArgumentError(
+          absl::StrCat("Expected a JSON object holding ", name_));
+    }
+
+    FHIR_ASSIGN_OR_RETURN(absl::string_view value,
+                          FindMember(parent.value, name_));
+    if (!primitive_) {
+      return AppendMessages(value, results);
+    }
+
+    FHIR_ASSIGN_OR_RETURN(absl::string_view element,
+                          FindMember(parent.value, element_name_));
+    if (reference_) {
+      return AppendReference(value, element, results);
+    }
+    if (field_->is_repeated()) {
+      return AppendRepeatedPrimitive(value, element, results);
+    }
+    if (IsNull(value) || IsNull(element) || IsArray(value)) {
+      return InvalidArgumentError(
+          absl::StrCat("Unsupported JSON value of ", name_));
+    }
+    if (!value.empty() || !element.empty()) {
+      results->push_back({value, element});
+    }
+    return absl::OkStatus();
+  }
+
+  Status AppendMessages(absl::string_view value,
+                        std::vector<JsonElement>* results) const {
+    if (value.empty()) {
+      return absl::OkStatus();
+    }
+
+    // As in the Parser, a single message may be given as an array of one.
+    std::vector<absl::string_view> messages;
+    if (IsArray(value)) {
+      FHIR_RETURN_IF_ERROR(AppendElements(value, &messages));
+      if (!field_->is_repeated() && messages.size() != 1) {
+        return InvalidArgumentError(
+            absl::StrCat("Expected a single value of ", name_));
+      }
+    } else if (field_->is_repeated()) {
+      return InvalidArgumentError(
+          absl::StrCat("Expected a JSON array as the value of ", name_));
+    } else {
+      messages.push_back(value);
+    }
+
+    for (absl::string_view message : messages) {
+      if (!IsObject(message)) {
+        return InvalidArgumentError(
+            absl::StrCat("Expected JSON objects as values of ", name_));
+      }
+      results->push_back({message, {}});
+    }
+    return absl::OkStatus();
+  }
+
+  // The values and elements of a repeated primitive are held by parallel
+  // arrays, either of which may be missing. Null stands for the missing half
+  // of an element.
+  Status AppendRepeatedPrimitive(absl::string_view value,
+                                 absl::string_view element,
+                                 std::vector<JsonElement>* results) const {
+    std::vector<absl::string_view> values;
+    std::vector<absl::string_view> elements;
+    if (!value.empty()) {
+      FHIR_RETURN_IF_ERROR(AppendElements(value, &values));
+    }
+    if (!element.empty()) {
+      FHIR_RETURN_IF_ERROR(AppendElements(element, &elements));
+    }
+    if (!values.empty() && !elements.empty() &&
+        values.size() != elements.size()) {
+      return InvalidArgumentError(
+          absl::StrCat("Lengths of ", name_, " and ", element_name_,
+                       " do not match"));
+    }
+
+    for (size_t i = 0; i < std::max(values.size(), elements.size()); ++i) {
+      JsonElement result;
+      if (i < values.size() && !IsNull(values[i])) {
+        result.value = values[i];
+      }
+      if (i < elements.size() && !IsNull(elements[i])) {
+        result.element = elements[i];
+      }
+      if (result.value.empty() && result.element.empty()) {
+        return InvalidArgumentError(
+            absl::StrCat("Unsupported null value of ", name_));
+      }
+      results->push_back(result);
+    }
+    return absl::OkStatus();
+  }
+
+  // The Parser splits relative and internal references into the typed ids of
+  // the Reference, leaving only other references in Reference.reference. The
+  // reference is split the same way to find out whether it remains.
+  Status AppendReference(absl::string_view value, absl::string_view element,
+                         std::vector<JsonElement>* results) const {
+    if (value.empty()) {
+      if (!element.empty()) {
+        results->push_back({value, element});
+      }
+      return absl::OkStatus();
+    }
+
+    std::string scratch;
+    FHIR_ASSIGN_OR_RETURN(absl::string_view uri_value,
+                          DecodeString(value, &scratch));
+
+    const Descriptor* reference_type = field_->containing_type();
+    std::unique_ptr<Message> reference = absl::WrapUnique(
+        ::google::protobuf::MessageFactory::generated_factory()
+            ->GetPrototype(reference_type)
+            ->New());
+    const Reflection* reflection = reference->GetReflection();
+    Message* uri = reflection->MutableMessage(reference.get(), field_);
+    uri->GetReflection()->SetString(
+        uri, uri->GetDescriptor()->FindFieldByName("value"),
+        std::string(uri_value));
+    FHIR_RETURN_IF_ERROR(SplitIfRelativeReference(reference.get()));
+
+    if (reflection->HasField(*reference, field_)) {
+      results->push_back({value, element});
+    }
+    return absl::OkStatus();
+  }
+
+  const std::shared_ptr<const JsonCollection> parent_;
+  const FieldDescriptor* field_;
+  const std::string name_;
+  const std::string element_name_;
+  const bool primitive_;
+  const bool reference_;
+};
+
+// Implements $this.
+class JsonThis : public JsonCollection {
+ public:
+  Status Evaluate(const JsonElement& context,
+                  std::vector<JsonElement>* results) const override {
+    results->push_back(context);
+    return absl::OkStatus();
+  }
+};
+
+// Implements the FHIRPath .where() function.
+class JsonWhere : public JsonCollection {
+ public:
+  JsonWhere(std::shared_ptr<const JsonCollection> child,
+            std::shared_ptr<const JsonPredicate> criteria)
+      : child_(std::move(child)), criteria_(std::move(criteria)) {}
+
+  Status Evaluate(const JsonElement& context,
+                  std::vector<JsonElement>* results) const override {
+    std::vector<JsonElement> child_results;
+    FHIR_RETURN_IF_ERROR(child_->Evaluate(context, &child_results));
+    for (const JsonElement& element : child_results) {
+      FHIR_ASSIGN_OR_RETURN(absl::optional<bool> allowed,
+                            criteria_->Evaluate(element));
+      if (allowed.value_or(false)) {
+        results->push_back(element);
+      }
+    }
+    return absl::OkStatus();
+  }
+
+ private:
+  const std::shared_ptr<const JsonCollection> child_;
+  const std::shared_ptr<const JsonPredicate> criteria_;
+};
+
+// Implements the FHIRPath .exists() function.
+class JsonExists : public JsonPredicate {
+ public:
+  explicit JsonExists(std::shared_ptr<const JsonCollection> child)
+      : child_(std::move(child)) {}
+
+  StatusOr<absl::optional<bool>> Evaluate(
+      const JsonElement& context) const override {
+    std::vector<JsonElement> child_results;
+    FHIR_RETURN_IF_ERROR(child_->Evaluate(context, &child_results));
+    return absl::optional<bool>(!child_results.empty());
+  }
+
+ private:
+  const std::shared_ptr<const JsonCollection> child_;
+};
+
+// A string, boolean or integer literal.
+struct JsonLiteral {
+  enum class Type { kString, kBoolean, kInteger };
+
+  Type type;
+  std::string string_value;
+  bool boolean_value = false;
+  int64_t integer_value = 0;
+};
+
+// Implements the "=" operator between a collection of primitives and a
+// literal, as EqualsOperator does: the result is empty if the collection is,
+// and otherwise true if the collection holds a single element whose value
+// equals the literal. Elements with an id or extensions are unequal to
+// literals of the same message type, and compared by value with others.
+class JsonEquals : public JsonPredicate {
+ public:
+  JsonEquals(std::shared_ptr<const JsonCollection> child, JsonLiteral literal,
+             bool same_type)
+      : child_(std::move(child)),
+        literal_(std::move(literal)),
+        same_type_(same_type) {}
+
+  StatusOr<absl::optional<bool>> Evaluate(
+      const JsonElement& context) const override {
+    std::vector<JsonElement> child_results;
+    FHIR_RETURN_IF_ERROR(child_->Evaluate(context, &child_results));
+    if (child_results.empty()) {
+      return absl::optional<bool>();
+    }
+    if (child_results.size() != 1 || child_results[0].value.empty()) {
+      return absl::optional<bool>(false);
+    }
+
+    const JsonElement& element = child_results[0];
+    if (same_type_) {
+      FHIR_ASSIGN_OR_RETURN(bool has_id_or_extensions,
+                            HasIdOrExtensions(element.element));
+      if (has_id_or_extensions) {
+        return absl::optional<bool>(false);
+      }
+    }
+    FHIR_ASSIGN_OR_RETURN(bool equal, EqualsLiteral(element.value));
+    return absl::optional<bool>(equal);
+  }
+
+ private:
+  StatusOr<bool> EqualsLiteral(absl::string_view value) const {
+    switch (literal_.type) {
+      case JsonLiteral::Type::kString: {
+        std::string scratch;
+        FHIR_ASSIGN_OR_RETURN(absl::string_view string_value,
+                              DecodeString(value, &scratch));
+        return string_value == literal_.string_value;
+      }
+      case JsonLiteral::Type::kBoolean:
+        if (value != "true" && value != "false") {
+          return InvalidArgumentError(
+              absl::StrCat("Expected a JSON boolean: ", value));
+        }
+        return (value == "true") == literal_.boolean_value;
+      case JsonLiteral::Type::kInteger: {
+        int64_t integer_value;
+        if (!absl::SimpleAtoi(value, &integer_value) || value.front() == '+') {
+          return InvalidArgumentError(
+              absl::StrCat("Expected a JSON integer: ", value));
+        }
+        return integer_value == literal_.integer_value;
+      }
+    }
+    return false;
+  }
+
+  const std::shared_ptr<const JsonCollection> child_;
+  const JsonLiteral literal_;
+  const bool same_type_;
+};
+
+// Implements the "and" and "or" operators, including their handling of the
+// empty collection and short circuiting as in AndOperator and OrOperator.
+class JsonBooleanOperator : public JsonPredicate {
+ public:
+  JsonBooleanOperator(bool is_and, std::shared_ptr<const JsonPredicate> left,
+                      std::shared_ptr<const JsonPredicate> right)
+      : is_and_(is_and), left_(std::move(left)), right_(std::move(right)) {}
+
+  StatusOr<absl::optional<bool>> Evaluate(
+      const JsonElement& context) const override {
+    // "and" is decided by a false operand, and "or" by a true one.
+    const bool decisive = !is_and_;
+    FHIR_ASSIGN_OR_RETURN(absl::optional<bool> left, left_->Evaluate(context));
+    if (left.has_value() && left.value() == decisive) {
+      return left;
+    }
+    FHIR_ASSIGN_OR_RETURN(absl::optional<bool> right,
+                          right_->Evaluate(context));
+    if (right.has_value() && right.value() == decisive) {
+      return right;
+    }
+    if (left.has_value() && right.has_value()) {
+      return absl::optional<bool>(!decisive);
+    }
+    return absl::optional<bool>();
+  }
+
+ private:
+  const bool is_and_;
+  const std::shared_ptr<const JsonPredicate> left_;
+  const std::shared_ptr<const JsonPredicate> right_;
+};
+
+// Compiles syntax trees of the supported subset of FHIRPath. The descriptor
+// passed along with each node is the type of $this, which is a primitive in
+// the criteria of where() on primitives.
+class JsonMatcherCompiler {
+ public:
+  JsonMatcherCompiler(const Descriptor* descriptor,
+                      const PrimitiveHandler* primitive_handler)
+      : descriptor_(descriptor), primitive_handler_(primitive_handler) {}
+
+  StatusOr<std::shared_ptr<const JsonPredicate>> CompilePredicate(
+      const AstNode& node, const Descriptor* this_type) {
+    switch (node.type) {
+      case AstNode::Type::kParenthesized:
+        return CompilePredicate(*node.children[0], this_type);
+
+      case AstNode::Type::kBinary:
+        if (node.text == "and" || node.text == "or") {
+          FHIR_ASSIGN_OR_RETURN(std::shared_ptr<const JsonPredicate> left,
+                                CompilePredicate(*node.children[0], this_type));
+          FHIR_ASSIGN_OR_RETURN(
+              std::shared_ptr<const JsonPredicate> right,
+              CompilePredicate(*node.children[1], this_type));
+          return std::shared_ptr<const JsonPredicate>(
+              std::make_shared<JsonBooleanOperator>(node.text == "and", left,
+                                                    right));
+        }
+        if (node.text == "=") {
+          return CompileEquals(node, this_type);
+        }
+        break;
+
+      case AstNode::Type::kInvocation:
+        if (IsFunction(*node.children[1], "exists", 0)) {
+          FHIR_ASSIGN_OR_RETURN(
+              TypedCollection child,
+              CompileCollection(*node.children[0], this_type));
+          return std::shared_ptr<const JsonPredicate>(
+              std::make_shared<JsonExists>(child.collection));
+        }
+        break;
+
+      case AstNode::Type::kFunction:
+        if (IsFunction(node, "exists", 0)) {
+          return std::shared_ptr<const JsonPredicate>(
+              std::make_shared<JsonExists>(std::make_shared<JsonThis>()));
+        }
+        break;
+
+      default:
+        break;
+    }
+    return Unsupported(node);
+  }
+
+ private:
+  struct TypedCollection {
+    std::shared_ptr<const JsonCollection> collection;
+    // The type of the elements of the collection.
+    const Descriptor* type;
+  };
+
+  StatusOr<TypedCollection> CompileCollection(const AstNode& node,
+                                              const Descriptor* this_type) {
+    switch (node.type) {
+      case AstNode::Type::kParenthesized:
+        return CompileCollection(*node.children[0], this_type);
+
+      case AstNode::Type::kThis:
+        return TypedCollection{std::make_shared<JsonThis>(), this_type};
+
+      case AstNode::Type::kIdentifier:
+        return CompileField(nullptr, this_type, node.text);
+
+      case AstNode::Type::kFunction:
+        if (IsFunction(node, "where", 1)) {
+          return CompileWhere(
+              TypedCollection{std::make_shared<JsonThis>(), this_type}, node);
+        }
+        break;
+
+      case AstNode::Type::kInvocation: {
+        const AstNode& invocation = *node.children[1];
+        if (invocation.type != AstNode::Type::kIdentifier &&
+            !IsFunction(invocation, "where", 1)) {
+          break;
+        }
+        FHIR_ASSIGN_OR_RETURN(TypedCollection parent,
+                              CompileCollection(*node.children[0], this_type));
+        if (invocation.type == AstNode::Type::kIdentifier) {
+          return CompileField(parent.collection, parent.type, invocation.text);
+        }
+        return CompileWhere(parent, invocation);
+      }
+
+      default:
+        break;
+    }
+    return Unsupported(node);
+  }
+
+  StatusOr<TypedCollection> CompileField(
+      std::shared_ptr<const JsonCollection> parent, const Descriptor* type,
+      const std::string& name) {
+    if (IsPrimitive(type)) {
+      return UnimplementedError(absl::StrCat(
+          "Navigation of primitives to ", name, " is not supported on JSON"));
+    }
+    const FieldDescriptor* field = FindFieldByJsonName(type, name);
+    if (field == nullptr) {
+      return NotFoundError(absl::StrCat("Unable to find field ", name));
+    }
+
+    const Descriptor* field_type = field->message_type();
+    if (IsChoiceType(field) || IsContainedResource(field_type) ||
+        field_type->full_name() ==
+            ::google::protobuf::Any::descriptor()->full_name()) {
+      return UnimplementedError(absl::StrCat(
+          "Navigation to ", name, " is not supported on JSON"));
+    }
+    // The only member of a oneof held by the JSON is Reference.reference, the
+    // others being the typed ids the Parser splits references into.
+    if (field->containing_oneof() != nullptr &&
+        !(IsReference(type) && IsPrimitive(field_type) &&
+          field->json_name() == "reference")) {
+      return UnimplementedError(absl::StrCat(
+          "Navigation to ", name, " is not supported on JSON"));
+    }
+
+    return TypedCollection{std::make_shared<JsonField>(parent, field),
+                           field_type};
+  }
+
+  StatusOr<TypedCollection> CompileWhere(const TypedCollection& child,
+                                         const AstNode& function) {
+    FHIR_ASSIGN_OR_RETURN(std::shared_ptr<const JsonPredicate> criteria,
+                          CompilePredicate(*function.children[0], child.type));
+    return TypedCollection{
+        std::make_shared<JsonWhere>(child.collection, criteria), child.type};
+  }
+
+  StatusOr<std::shared_ptr<const JsonPredicate>> CompileEquals(
+      const AstNode& node, const Descriptor* this_type) {
+    const AstNode* path = node.children[0].get();
+    const AstNode* literal_node = node.children[1].get();
+    if (IsLiteral(*path)) {
+      std::swap(path, literal_node);
+    }
+    if (!IsLiteral(*literal_node)) {
+      return Unsupported(node);
+    }
+
+    FHIR_ASSIGN_OR_RETURN(TypedCollection collection,
+                          CompileCollection(*path, this_type));
+
+    // Literals are evaluated as the full implementation does, so that they
+    // hold the same value and type.
+    FHIR_ASSIGN_OR_RETURN(
+        CompiledExpression expression,
+        CompiledExpression::Compile(descriptor_, primitive_handler_,
+                                    literal_node->Text()));
+    FHIR_ASSIGN_OR_RETURN(
+        EvaluationResult result,
+        expression.Evaluate(
+            *::google::protobuf::MessageFactory::generated_factory()->GetPrototype(
+                descriptor_)));
+    if (result.GetMessages().size() != 1) {
+      return Unsupported(node);
+    }
+    const Descriptor* literal_type =
+        result.GetMessages()[0]->GetDescriptor();
+
+    JsonLiteral literal;
+    bool supported = false;
+    if (literal_node->type == AstNode::Type::kStringLiteral) {
+      literal.type = JsonLiteral::Type::kString;
+      FHIR_ASSIGN_OR_RETURN(literal.string_value, result.GetString());
+      supported = IsStringValued(collection.type);
+    } else if (literal_node->type == AstNode::Type::kBooleanLiteral) {
+      literal.type = JsonLiteral::Type::kBoolean;
+      FHIR_ASSIGN_OR_RETURN(literal.boolean_value, result.GetBoolean());
+      supported = IsBoolean(collection.type);
+    } else if (IsInteger(literal_type)) {
+      literal.type = JsonLiteral::Type::kInteger;
+      FHIR_ASSIGN_OR_RETURN(literal.integer_value, result.GetInteger());
+      supported = IsIntegerValued(collection.type);
+    }
+    if (!supported) {
+      return UnimplementedError(
+          absl::StrCat("Comparison of ", path->Key(), " with ",
+                       literal_node->Key(), " is not supported on JSON"));
+    }
+
+    return std::shared_ptr<const JsonPredicate>(std::make_shared<JsonEquals>(
+        collection.collection, std::move(literal),
+        collection.type == literal_type));
+  }
+
+  static bool IsFunction(const AstNode& node, absl::string_view name,
+                         size_t param_count) {
+    return node.type == AstNode::Type::kFunction && node.text == name &&
+           node.children.size() == param_count;
+  }
+
+  static bool IsLiteral(const AstNode& node) {
+    return node.type == AstNode::Type::kStringLiteral ||
+           node.type == AstNode::Type::kBooleanLiteral ||
+           node.type == AstNode::Type::kNumberLiteral;
+  }
+
+  static Status Unsupported(const AstNode& node) {
+    return UnimplementedError(absl::StrCat(
+        "FHIRPath expression is not supported on JSON: ", node.Key()));
+  }
+
+  const Descriptor* descriptor_;
+  const PrimitiveHandler* primitive_handler_;
+};
+
+}  // namespace
+
+}  // namespace internal
+
+JsonMatcher::JsonMatcher(const Descriptor* descriptor, std::string fhir_path,
+                         std::shared_ptr<const internal::JsonPredicate> root)
+    : descriptor_(descriptor),
+      fhir_path_(std::move(fhir_path)),
+      root_(std::move(root)) {}
+
+StatusOr<JsonMatcher> JsonMatcher::Compile(
+    const Descriptor* descriptor, const PrimitiveHandler* primitive_handler,
+    const std::string& fhir_path) {
+  FHIR_ASSIGN_OR_RETURN(std::unique_ptr<AstNode> root,
+                        internal::ParseFhirPath(fhir_path));
+  internal::JsonMatcherCompiler compiler(descriptor, primitive_handler);
+  FHIR_ASSIGN_OR_RETURN(std::shared_ptr<const internal::JsonPredicate> predicate,
+                        compiler.CompilePredicate(*root, descriptor));
+  return JsonMatcher(descriptor, fhir_path, std::move(predicate));
+}
+
+StatusOr<bool> JsonMatcher::Matches(absl::string_view json) const {
+  internal::SkipWhitespace(&json);
+  FHIR_ASSIGN_OR_RETURN(absl::string_view resource,
+                        internal::ConsumeValue(&json));
+  if (!internal::IsObject(resource)) {
+    return InvalidArgumentError("Expected a JSON object");
+  }
+
+  FHIR_ASSIGN_OR_RETURN(absl::string_view resource_type_json,
+                        internal::FindMember(resource, "resourceType"));
+  if (!resource_type_json.empty()) {
+    std::string scratch;
+    FHIR_ASSIGN_OR_RETURN(
+        absl::string_view resource_type,
+        internal::DecodeString(resource_type_json, &scratch));
+    if (resource_type != descriptor_->name()) {
+      return false;
+    }
+  }
+
+  FHIR_ASSIGN_OR_RETURN(absl::optional<bool> result,
+                        root_->Evaluate({resource, {}}));
+  return result.value_or(false);
+}
+
+}  // namespace fhir_path
+}  // namespace fhir
+}  // namespace google
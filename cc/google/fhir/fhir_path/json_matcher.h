@@ -0,0 +1,95 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GOOGLE_FHIR_FHIR_PATH_JSON_MATCHER_H_
+#define GOOGLE_FHIR_FHIR_PATH_JSON_MATCHER_H_
+
+#include <memory>
+#include <string>
+
+#include "google/protobuf/descriptor.h"
+#include "absl/strings/string_view.h"
+#include "google/fhir/primitive_handler.h"
+#include "google/fhir/status/statusor.h"
+
+namespace google {
+namespace fhir {
+namespace fhir_path {
+
+namespace internal {
+class JsonPredicate;
+}  // namespace internal
+
+// A FHIRPath predicate compiled to run directly on the FHIR JSON of a
+// resource, without parsing the resource into a proto. Jobs that discard most
+// of the records they read can match the raw JSON first, and only parse the
+// records that match:
+//
+//   FHIR_ASSIGN_OR_RETURN(
+//       JsonMatcher matcher,
+//       JsonMatcher::Compile(Observation::descriptor(), primitive_handler,
+//                            "status = 'final' and code.coding.exists()"));
+//   FHIR_ASSIGN_OR_RETURN(bool matches, matcher.Matches(json));
+//
+// Only a subset of FHIRPath is supported:
+//   * navigation of fields, other than choice types, contained resources and
+//     the typed ids of a Reference,
+//   * $this and where(criteria),
+//   * exists(),
+//   * "=" between a field and a string, boolean or integer literal,
+//   * "and" and "or".
+// Compile returns an Unimplemented error for expressions outside the subset.
+//
+// For every record that the Parser accepts, Matches returns true if and only
+// if evaluating the expression against the parsed resource gives true. In
+// particular, relative references such as "Patient/123" are parsed into the
+// typed ids of a Reference, so Reference.reference only holds the other
+// references, as it does after parsing.
+//
+// This class is immutable and thread safe.
+class JsonMatcher {
+ public:
+  // Compiles the FHIRPath expression for resources of the given type. The
+  // expression must evaluate to a boolean.
+  static StatusOr<JsonMatcher> Compile(
+      const ::google::protobuf::Descriptor* descriptor,
+      const PrimitiveHandler* primitive_handler, const std::string& fhir_path);
+
+  // Returns the FHIRPath string used to compile this matcher.
+  const std::string& fhir_path() const { return fhir_path_; }
+
+  // Returns true if the JSON is a resource of the type the matcher was
+  // compiled for, and the expression evaluates to true against it.
+  //
+  // Only the parts of the record that the expression navigates are read, so
+  // records that the Parser rejects may match. An error is returned if those
+  // parts are not valid FHIR JSON, or hold values whose parsed form cannot be
+  // determined without the Parser. Callers can parse such records to decide.
+  StatusOr<bool> Matches(absl::string_view json) const;
+
+ private:
+  JsonMatcher(const ::google::protobuf::Descriptor* descriptor,
+              std::string fhir_path,
+              std::shared_ptr<const internal::JsonPredicate> root);
+
+  const ::google::protobuf::Descriptor* descriptor_;
+  std::string fhir_path_;
+  std::shared_ptr<const internal::JsonPredicate> root_;
+};
+
+}  // namespace fhir_path
+}  // namespace fhir
+}  // namespace google
+
+#endif  // GOOGLE_FHIR_FHIR_PATH_JSON_MATCHER_H_
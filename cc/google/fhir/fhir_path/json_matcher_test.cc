@@ -0,0 +1,228 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "google/fhir/fhir_path/json_matcher.h"
+
+#include <string>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "absl/time/time.h"
+#include "google/fhir/fhir_path/fhir_path.h"
+#include "google/fhir/r4/json_format.h"
+#include "google/fhir/r4/primitive_handler.h"
+#include "google/fhir/status/statusor.h"
+#include "proto/r4/core/resources/observation.pb.h"
+#include "proto/r4/core/resources/patient.pb.h"
+#include "proto/r4/core/resources/value_set.pb.h"
+
+namespace google {
+namespace fhir {
+namespace fhir_path {
+
+namespace {
+
+using ::google::fhir::r4::core::Observation;
+using ::google::fhir::r4::core::Patient;
+using ::google::fhir::r4::core::ValueSet;
+
+const PrimitiveHandler* R4Handler() {
+  return r4::R4PrimitiveHandler::GetInstance();
+}
+
+// Expects the matcher to agree with full evaluation of the expression against
+// the parsed record.
+template <typename R>
+void ExpectAgreement(const std::vector<std::string>& records,
+                     const std::vector<std::string>& expressions) {
+  for (const std::string& fhir_path : expressions) {
+    StatusOr<JsonMatcher> matcher =
+        JsonMatcher::Compile(R::descriptor(), R4Handler(), fhir_path);
+    ASSERT_TRUE(matcher.ok()) << fhir_path << ": " << matcher.status();
+    StatusOr<CompiledExpression> expression =
+        CompiledExpression::Compile(R::descriptor(), R4Handler(), fhir_path);
+    ASSERT_TRUE(expression.ok()) << fhir_path << ": " << expression.status();
+
+    for (const std::string& record : records) {
+      StatusOr<R> resource = r4::JsonFhirStringToProtoWithoutValidating<R>(
+          record, absl::UTCTimeZone());
+      ASSERT_TRUE(resource.ok()) << record << ": " << resource.status();
+      StatusOr<EvaluationResult> result =
+          expression.ValueOrDie().Evaluate(resource.ValueOrDie());
+      ASSERT_TRUE(result.ok()) << fhir_path << ": " << result.status();
+      StatusOr<bool> value = result.ValueOrDie().GetBoolean();
+
+      StatusOr<bool> matches = matcher.ValueOrDie().Matches(record);
+      ASSERT_TRUE(matches.ok()) << fhir_path << ": " << matches.status();
+      EXPECT_EQ(matches.ValueOrDie(), value.ok() && value.ValueOrDie())
+          << fhir_path << " on " << record;
+    }
+  }
+}
+
+TEST(JsonMatcherTest, AgreesWithEvaluation) {
+  const std::vector<std::string> records = {
+      R"json({"resourceType": "Observation", "id": "1", "status": "final",
+              "code": {"coding": [
+                  {"system": "http://loinc.org", "code": "1234-5"},
+                  {"system": "http://example.com", "code": "bar",
+                   "userSelected": true}]},
+              "subject": {"reference": "Patient/123"}})json",
+      R"json({"resourceType": "Observation", "status": "preliminary",
+              "code": {"coding": [{"system": "http://loinc.org",
+                                   "code": "bar", "userSelected": false}],
+                       "text": "café \"x\"", "_text": {"id": "t"}},
+              "subject": {"reference": "urn:uuid:5e2b4f6e"}})json",
+      R"json({"resourceType": "Observation", "status": "final",
+              "_status": {"extension": [{"url": "http://example.com/e",
+                                         "valueString": "x"}]},
+              "code": {"text": "café \"x\""},
+              "subject": {"display": "no reference"}})json",
+      R"json({"resourceType": "Observation", "status": "amended",
+              "code": {}, "subject": {"reference": "#contained"}})json",
+  };
+  ExpectAgreement<Observation>(
+      records, {
+                   "status = 'final'",
+                   "'final' = status",
+                   "status = 'final' and code.coding.exists()",
+                   "status = 'amended' or subject.reference.exists()",
+                   "code.coding.code = 'bar'",
+                   "code.coding.where(code = 'bar').exists()",
+                   "code.coding.where(system = 'http://loinc.org' and "
+                   "code = '1234-5').exists()",
+                   "code.coding.where(userSelected = true).exists()",
+                   "code.coding.userSelected = false",
+                   "code.text = 'caf\\u00e9 \"x\"'",
+                   "code.text.exists()",
+                   "subject.reference.exists()",
+                   "subject.reference = 'urn:uuid:5e2b4f6e'",
+                   "subject.reference = 'Patient/123'",
+                   "id = '1'",
+                   "(id = '1' or status = 'preliminary') and code.exists()",
+                   "code.coding.where(code.where($this = 'bar').exists())"
+                   ".exists()",
+               });
+}
+
+TEST(JsonMatcherTest, AgreesOnRepeatedPrimitives) {
+  const std::vector<std::string> records = {
+      R"json({"resourceType": "Patient",
+              "name": [{"given": ["Jo", "Ann"]}, {"given": ["Jo"]}]})json",
+      R"json({"resourceType": "Patient",
+              "name": [{"given": ["Jo", null], "_given": [null, {"extension":
+                  [{"url": "http://example.com/e", "valueString": "x"}]}]}],
+              "active": true})json",
+      R"json({"resourceType": "Patient", "name": [{"family": "Doe"}],
+              "active": false})json",
+  };
+  ExpectAgreement<Patient>(records, {
+                                        "name.given.exists()",
+                                        "name.given = 'Jo'",
+                                        "name.given.where($this = 'Jo')"
+                                        ".exists()",
+                                        "name.where(given = 'Jo').exists()",
+                                        "active = true",
+                                        "active = false or name.exists()",
+                                    });
+}
+
+TEST(JsonMatcherTest, AgreesOnIntegers) {
+  const std::vector<std::string> records = {
+      R"json({"resourceType": "ValueSet", "status": "active",
+              "expansion": {"timestamp": "2020-01-01", "total": 3}})json",
+      R"json({"resourceType": "ValueSet", "status": "active",
+              "expansion": {"timestamp": "2020-01-01", "total": 3,
+                            "_total": {"id": "t"}, "offset": 0}})json",
+      R"json({"resourceType": "ValueSet", "status": "draft"})json",
+  };
+  ExpectAgreement<ValueSet>(records, {
+                                         "expansion.total = 3",
+                                         "expansion.offset = 0",
+                                         "expansion.offset.exists()",
+                                     });
+}
+
+TEST(JsonMatcherTest, OtherResourceTypesDoNotMatch) {
+  JsonMatcher matcher = JsonMatcher::Compile(Observation::descriptor(),
+                                             R4Handler(), "status.exists()")
+                            .ValueOrDie();
+  EXPECT_EQ(matcher.fhir_path(), "status.exists()");
+
+  StatusOr<bool> observation =
+      matcher.Matches(R"json({"resourceType": "Observation",
+                              "status": "final"})json");
+  ASSERT_TRUE(observation.ok()) << observation.status();
+  EXPECT_TRUE(observation.ValueOrDie());
+
+  StatusOr<bool> encounter =
+      matcher.Matches(R"json({"resourceType": "Encounter",
+                              "status": "finished"})json");
+  ASSERT_TRUE(encounter.ok()) << encounter.status();
+  EXPECT_FALSE(encounter.ValueOrDie());
+}
+
+TEST(JsonMatcherTest, UnsupportedExpressions) {
+  for (const std::string& fhir_path : {
+           "value.exists()",
+           "contained.exists()",
+           "subject.patientId.exists()",
+           "status != 'final'",
+           "code.coding.count() = 1",
+           "code.coding.code",
+           "status = 1",
+           "issued = '2020-01-01'",
+           "status.extension.exists()",
+       }) {
+    EXPECT_EQ(JsonMatcher::Compile(Observation::descriptor(), R4Handler(),
+                                   fhir_path)
+                  .status()
+                  .code(),
+              absl::StatusCode::kUnimplemented)
+        << fhir_path;
+  }
+
+  EXPECT_EQ(JsonMatcher::Compile(Observation::descriptor(), R4Handler(),
+                                 "bogus.exists()")
+                .status()
+                .code(),
+            absl::StatusCode::kNotFound);
+}
+
+TEST(JsonMatcherTest, MalformedJson) {
+  JsonMatcher matcher =
+      JsonMatcher::Compile(Observation::descriptor(), R4Handler(),
+                           "code.coding.where(code = 'bar').exists()")
+          .ValueOrDie();
+
+  for (const std::string& json : {
+           R"json([])json",
+           R"json({"resourceType": "Observation", "code": )json",
+           R"json({"resourceType": "Observation", "code": "bar"})json",
+           R"json({"resourceType": "Observation",
+                   "code": {"coding": [{"code": 5}]}})json",
+       }) {
+    EXPECT_EQ(matcher.Matches(json).status().code(),
+              absl::StatusCode::kInvalidArgument)
+        << json;
+  }
+}
+
+}  // namespace
+
+}  // namespace fhir_path
+}  // namespace fhir
+}  // namespace google
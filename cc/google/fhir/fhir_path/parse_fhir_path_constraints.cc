@@ -0,0 +1,160 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Parses the FHIRPath constraints annotated on every resource of a FHIR
+// version, and writes them as a serialized ParsedFhirPathExpressions proto.
+// Loading the output into ParsedExpressions lets a FhirPathValidator compile
+// constraints without parsing them.
+//
+// If the output file ends in ".cc", it is instead a C++ source that embeds the
+// serialized proto as the function declared in parsed_fhir_path_constraints.h
+// for the version, which the shared validator of the version loads.
+//
+// Usage: parse_fhir_path_constraints <r4|stu3> <output file>
+
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "google/protobuf/descriptor.h"
+#include "absl/container/flat_hash_set.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_format.h"
+#include "google/fhir/fhir_path/fhir_path.h"
+#include "google/fhir/status/status.h"
+#include "proto/annotations.pb.h"
+#include "proto/fhir_path.pb.h"
+#include "proto/r4/core/resources/bundle_and_contained_resource.pb.h"
+#include "proto/stu3/resources.pb.h"
+
+using ::google::fhir::fhir_path::ParsedExpressions;
+using ::google::fhir::proto::fhir_path_constraint;
+using ::google::fhir::proto::fhir_path_message_constraint;
+using ::google::protobuf::Descriptor;
+using ::google::protobuf::FieldDescriptor;
+
+namespace {
+
+// Adds the constraints of the message types reachable from the root to the
+// expressions. Constraints that fail to parse are skipped, as the validator
+// ignores them.
+void AddConstraints(const Descriptor* root, ParsedExpressions* expressions) {
+  auto add = [&](const std::string& fhir_path) {
+    ::google::fhir::Status status = expressions->Add(fhir_path);
+    if (!status.ok()) {
+      LOG(WARNING) << "Ignoring constraint (" << fhir_path << "). "
+                   << status.message();
+    }
+  };
+
+  std::vector<const Descriptor*> types = {root};
+  absl::flat_hash_set<const Descriptor*> seen = {root};
+  while (!types.empty()) {
+    const Descriptor* descriptor = types.back();
+    types.pop_back();
+
+    const auto& options = descriptor->options();
+    for (int i = 0; i < options.ExtensionSize(fhir_path_message_constraint);
+         ++i) {
+      add(options.GetExtension(fhir_path_message_constraint, i));
+    }
+
+    for (int i = 0; i < descriptor->field_count(); ++i) {
+      const FieldDescriptor* field = descriptor->field(i);
+      if (field->message_type() == nullptr) {
+        continue;
+      }
+      for (int j = 0;
+           j < field->options().ExtensionSize(fhir_path_constraint); ++j) {
+        add(field->options().GetExtension(fhir_path_constraint, j));
+      }
+      if (seen.insert(field->message_type()).second) {
+        types.push_back(field->message_type());
+      }
+    }
+  }
+}
+
+// Writes a C++ source defining a function that returns the serialized
+// expressions.
+void WriteSource(const std::string& function, const std::string& serialized,
+                 std::ostream* output) {
+  *output << "// Generated by parse_fhir_path_constraints. Do not edit.\n\n"
+          << "#include \"google/fhir/fhir_path/parsed_fhir_path_constraints.h\""
+          << "\n\nnamespace google {\nnamespace fhir {\nnamespace fhir_path {"
+          << "\nnamespace internal {\n\n"
+          << "absl::string_view " << function << "() {\n"
+          << "  static const char kSerialized[] =";
+  // Every byte is written as a three digit octal escape, so that no escape
+  // runs into the character after it.
+  constexpr size_t kBytesPerLine = 16;
+  for (size_t i = 0; i < serialized.size(); ++i) {
+    if (i % kBytesPerLine == 0) {
+      *output << (i == 0 ? "\n      \"" : "\"\n      \"");
+    }
+    *output << absl::StrFormat("\\%03o",
+                               static_cast<unsigned char>(serialized[i]));
+  }
+  *output << (serialized.empty() ? " \"\";\n" : "\";\n")
+          << "  return absl::string_view(kSerialized, sizeof(kSerialized) - 1);"
+          << "\n}\n\n}  // namespace internal\n}  // namespace fhir_path\n"
+          << "}  // namespace fhir\n}  // namespace google\n";
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " <r4|stu3> <output file>"
+              << std::endl;
+    return 1;
+  }
+
+  const std::string version = argv[1];
+  const Descriptor* root;
+  std::string function;
+  if (version == "r4") {
+    root = google::fhir::r4::core::ContainedResource::descriptor();
+    function = "R4ParsedFhirPathConstraints";
+  } else if (version == "stu3") {
+    root = google::fhir::stu3::proto::ContainedResource::descriptor();
+    function = "Stu3ParsedFhirPathConstraints";
+  } else {
+    std::cerr << "Unsupported FHIR version: " << version << std::endl;
+    return 1;
+  }
+
+  ParsedExpressions expressions;
+  AddConstraints(root, &expressions);
+
+  std::string serialized;
+  if (!expressions.ToProto().SerializeToString(&serialized)) {
+    std::cerr << "Failed to serialize the constraints." << std::endl;
+    return 1;
+  }
+
+  std::ofstream output(argv[2], std::ios::binary);
+  if (absl::EndsWith(argv[2], ".cc")) {
+    WriteSource(function, serialized, &output);
+  } else {
+    output << serialized;
+  }
+  if (!output.good()) {
+    std::cerr << "Failed to write " << argv[2] << std::endl;
+    return 1;
+  }
+  std::cout << "Parsed " << expressions.size() << " constraints." << std::endl;
+  return 0;
+}
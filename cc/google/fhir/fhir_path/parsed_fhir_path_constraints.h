@@ -0,0 +1,36 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GOOGLE_FHIR_FHIR_PATH_PARSED_FHIR_PATH_CONSTRAINTS_H_
+#define GOOGLE_FHIR_FHIR_PATH_PARSED_FHIR_PATH_CONSTRAINTS_H_
+
+#include "absl/strings/string_view.h"
+
+namespace google {
+namespace fhir {
+namespace fhir_path {
+namespace internal {
+
+// The serialized ParsedFhirPathExpressions of the constraints annotated on the
+// resources of each FHIR version, which parse_fhir_path_constraints generates
+// at build time. Each is defined by the library of its version.
+absl::string_view R4ParsedFhirPathConstraints();
+absl::string_view Stu3ParsedFhirPathConstraints();
+
+}  // namespace internal
+}  // namespace fhir_path
+}  // namespace fhir
+}  // namespace google
+
+#endif  // GOOGLE_FHIR_FHIR_PATH_PARSED_FHIR_PATH_CONSTRAINTS_H_
@@ -0,0 +1,832 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "google/fhir/fhir_path/parser.h"
+
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+#include "absl/base/macros.h"
+#include "absl/memory/memory.h"
+#include "absl/status/status.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_replace.h"
+#include "google/fhir/status/status.h"
+
+namespace google {
+namespace fhir {
+namespace fhir_path {
+namespace internal {
+
+namespace {
+
+using ::absl::InternalError;
+using ::absl::InvalidArgumentError;
+
+struct Token {
+  enum class Type {
+    kEnd,
+    kIdentifier,
+    kDelimitedIdentifier,
+    kString,
+    kNumber,
+    kDate,
+    kDateTime,
+    kTime,
+    // $this, $index and $total.
+    kSpecialInvocation,
+    // Any other fixed token: punctuation and symbolic operators.
+    kSymbol,
+  };
+
+  Type type;
+  absl::string_view text;
+  size_t position;
+};
+
+// Symbols of the grammar, longest first so that e.g. "<=" is preferred over
+// "<".
+constexpr absl::string_view kSymbols[] = {
+    "<=", ">=", "!=", "!~", ".", "[", "]", "(", ")", "{", "}", ",", "%",
+    "+",  "-",  "*",  "/",  "&", "|", "<", ">", "=", "~",
+};
+
+// Splits a FHIRPath expression into tokens, following the lexical rules of
+// the FHIRPath grammar.
+class Lexer {
+ public:
+  explicit Lexer(absl::string_view input) : input_(input) {}
+
+  StatusOr<std::vector<Token>> Tokenize() {
+    std::vector<Token> tokens;
+    while (true) {
+      SkipWhitespaceAndComments();
+      if (position_ >= input_.size()) {
+        tokens.push_back({Token::Type::kEnd, "", position_});
+        return tokens;
+      }
+      FHIR_ASSIGN_OR_RETURN(Token token, NextToken());
+      tokens.push_back(token);
+    }
+  }
+
+ private:
+  void SkipWhitespaceAndComments() {
+    while (position_ < input_.size()) {
+      const char c = input_[position_];
+      if (c == ' ' || c == '\r' || c == '\n' || c == '\t') {
+        ++position_;
+      } else if (Remaining().substr(0, 2) == "//") {
+        size_t end = input_.find_first_of("\r\n", position_);
+        position_ = end == absl::string_view::npos ? input_.size() : end;
+      } else if (Remaining().substr(0, 2) == "/*") {
+        // An unterminated comment is not a comment, but a '/' followed by a
+        // '*'.
+        size_t end = input_.find("*/", position_ + 2);
+        if (end == absl::string_view::npos) {
+          return;
+        }
+        position_ = end + 2;
+      } else {
+        return;
+      }
+    }
+  }
+
+  StatusOr<Token> NextToken() {
+    const size_t start = position_;
+    const char c = input_[position_];
+
+    if (IsIdentifierStart(c)) {
+      while (position_ < input_.size() && IsIdentifierPart(input_[position_])) {
+        ++position_;
+      }
+      return MakeToken(Token::Type::kIdentifier, start);
+    }
+
+    if (absl::ascii_isdigit(c)) {
+      SkipDigits();
+      if (position_ + 1 < input_.size() && input_[position_] == '.' &&
+          absl::ascii_isdigit(input_[position_ + 1])) {
+        ++position_;
+        SkipDigits();
+      }
+      return MakeToken(Token::Type::kNumber, start);
+    }
+
+    if (c == '\'' || c == '`') {
+      ++position_;
+      while (position_ < input_.size() && input_[position_] != c) {
+        position_ += EscapeLength();
+      }
+      if (position_ >= input_.size()) {
+        return InvalidArgumentError(absl::StrCat(
+            "Unterminated ", c == '\'' ? "string" : "delimited identifier",
+            " at position ", start));
+      }
+      ++position_;
+      return MakeToken(c == '\'' ? Token::Type::kString
+                                 : Token::Type::kDelimitedIdentifier,
+                       start);
+    }
+
+    if (c == '@') {
+      return DateTimeToken();
+    }
+
+    if (c == '$') {
+      ++position_;
+      while (position_ < input_.size() && IsIdentifierPart(input_[position_])) {
+        ++position_;
+      }
+      Token token = MakeToken(Token::Type::kSpecialInvocation, start);
+      if (token.text != "$this" && token.text != "$index" &&
+          token.text != "$total") {
+        return InvalidArgumentError(
+            absl::StrCat("Unknown token ", token.text, " at position ", start));
+      }
+      return token;
+    }
+
+    for (absl::string_view symbol : kSymbols) {
+      if (Remaining().substr(0, symbol.size()) == symbol) {
+        position_ += symbol.size();
+        return MakeToken(Token::Type::kSymbol, start);
+      }
+    }
+
+    return InvalidArgumentError(absl::StrCat("Unexpected character '",
+                                             input_.substr(start, 1),
+                                             "' at position ", start));
+  }
+
+  // Returns the length of the character or escape sequence (ESC in the
+  // grammar) at the current position of a string or delimited identifier.
+  size_t EscapeLength() const {
+    absl::string_view rest = Remaining();
+    if (rest.size() < 2 || rest[0] != '\\') {
+      return 1;
+    }
+    if (absl::string_view("`'\\/fnrt").find(rest[1]) !=
+        absl::string_view::npos) {
+      return 2;
+    }
+    if (rest[1] == 'u' && rest.size() >= 6 &&
+        std::all_of(rest.begin() + 2, rest.begin() + 6,
+                    [](char c) { return absl::ascii_isxdigit(c); })) {
+      return 6;
+    }
+    return 1;
+  }
+
+  // Lexes the DATE, DATETIME and TIME tokens, which start with '@'.
+  StatusOr<Token> DateTimeToken() {
+    const size_t start = position_++;
+    if (Peek() == 'T') {
+      ++position_;
+      if (!MatchTimeFormat()) {
+        return InvalidArgumentError(
+            absl::StrCat("Malformed time literal at position ", start));
+      }
+      return MakeToken(Token::Type::kTime, start);
+    }
+
+    if (!MatchDateFormat()) {
+      return InvalidArgumentError(
+          absl::StrCat("Malformed date literal at position ", start));
+    }
+    if (Peek() != 'T') {
+      return MakeToken(Token::Type::kDate, start);
+    }
+
+    ++position_;
+    if (MatchTimeFormat()) {
+      MatchTimeZoneOffsetFormat();
+    }
+    return MakeToken(Token::Type::kDateTime, start);
+  }
+
+  // DATEFORMAT: [0-9][0-9][0-9][0-9] ('-'[0-9][0-9] ('-'[0-9][0-9])?)?
+  bool MatchDateFormat() {
+    if (!MatchDigits(4)) {
+      return false;
+    }
+    if (MatchSeparatedDigits('-', 2)) {
+      MatchSeparatedDigits('-', 2);
+    }
+    return true;
+  }
+
+  // TIMEFORMAT:
+  //   [0-9][0-9] (':'[0-9][0-9] (':'[0-9][0-9] ('.'[0-9]+)?)?)?
+  bool MatchTimeFormat() {
+    if (!MatchDigits(2)) {
+      return false;
+    }
+    if (MatchSeparatedDigits(':', 2) && MatchSeparatedDigits(':', 2) &&
+        Peek() == '.' && absl::ascii_isdigit(Peek(1))) {
+      ++position_;
+      SkipDigits();
+    }
+    return true;
+  }
+
+  // TIMEZONEOFFSETFORMAT: ('Z' | ('+' | '-') [0-9][0-9]':'[0-9][0-9])
+  void MatchTimeZoneOffsetFormat() {
+    if (Peek() == 'Z') {
+      ++position_;
+      return;
+    }
+    if (Peek() != '+' && Peek() != '-') {
+      return;
+    }
+    const size_t start = position_++;
+    if (!MatchDigits(2) || !MatchSeparatedDigits(':', 2)) {
+      position_ = start;
+    }
+  }
+
+  // Consumes exactly the given number of digits, or nothing if there are
+  // fewer.
+  bool MatchDigits(int count) {
+    for (int i = 0; i < count; ++i) {
+      if (!absl::ascii_isdigit(Peek(i))) {
+        return false;
+      }
+    }
+    position_ += count;
+    return true;
+  }
+
+  // Consumes the separator followed by exactly the given number of digits,
+  // or nothing if they don't follow.
+  bool MatchSeparatedDigits(char separator, int count) {
+    if (Peek() != separator) {
+      return false;
+    }
+    ++position_;
+    if (!MatchDigits(count)) {
+      --position_;
+      return false;
+    }
+    return true;
+  }
+
+  void SkipDigits() {
+    while (absl::ascii_isdigit(Peek())) {
+      ++position_;
+    }
+  }
+
+  char Peek(size_t offset = 0) const {
+    return position_ + offset < input_.size() ? input_[position_ + offset]
+                                              : '\0';
+  }
+
+  absl::string_view Remaining() const { return input_.substr(position_); }
+
+  Token MakeToken(Token::Type type, size_t start) const {
+    return {type, input_.substr(start, position_ - start), start};
+  }
+
+  static bool IsIdentifierStart(char c) {
+    return absl::ascii_isalpha(c) || c == '_';
+  }
+
+  static bool IsIdentifierPart(char c) {
+    return absl::ascii_isalnum(c) || c == '_';
+  }
+
+  const absl::string_view input_;
+  size_t position_ = 0;
+};
+
+// Binding powers of the operators of the grammar. Operators listed earlier in
+// the "expression" rule bind more tightly.
+constexpr int kImpliesPower = 1;
+constexpr int kOrPower = 2;
+constexpr int kAndPower = 3;
+constexpr int kMembershipPower = 4;
+constexpr int kEqualityPower = 5;
+constexpr int kInequalityPower = 6;
+constexpr int kUnionPower = 7;
+constexpr int kTypePower = 8;
+constexpr int kAdditivePower = 9;
+constexpr int kMultiplicativePower = 10;
+constexpr int kPolarityPower = 11;
+
+// Returns the binding power of the binary operator, or 0 if the token is not
+// one.
+int BinaryOperatorPower(const Token& token) {
+  if (token.type == Token::Type::kSymbol) {
+    const absl::string_view text = token.text;
+    if (text == "*" || text == "/") return kMultiplicativePower;
+    if (text == "+" || text == "-" || text == "&") return kAdditivePower;
+    if (text == "|") return kUnionPower;
+    if (text == "<=" || text == "<" || text == ">" || text == ">=") {
+      return kInequalityPower;
+    }
+    if (text == "=" || text == "~" || text == "!=" || text == "!~") {
+      return kEqualityPower;
+    }
+    return 0;
+  }
+
+  if (token.type == Token::Type::kIdentifier) {
+    const absl::string_view text = token.text;
+    if (text == "div" || text == "mod") return kMultiplicativePower;
+    if (text == "in" || text == "contains") return kMembershipPower;
+    if (text == "and") return kAndPower;
+    if (text == "or" || text == "xor") return kOrPower;
+    if (text == "implies") return kImpliesPower;
+  }
+  return 0;
+}
+
+// Returns true if the token may be used as an identifier. Besides plain
+// identifiers, the grammar allows the keywords "as", "contains", "in" and
+// "is", so that they may be called as functions.
+bool IsIdentifier(const Token& token) {
+  if (token.type == Token::Type::kDelimitedIdentifier) {
+    return true;
+  }
+  if (token.type != Token::Type::kIdentifier) {
+    return false;
+  }
+  const absl::string_view text = token.text;
+  return text != "true" && text != "false" && text != "div" && text != "mod" &&
+         text != "and" && text != "or" && text != "xor" && text != "implies";
+}
+
+// Returns true if the token is a unit of a quantity literal that is a
+// calendar duration, e.g. the "days" of "4 days".
+bool IsDateTimePrecision(const Token& token) {
+  static constexpr absl::string_view kPrecisions[] = {
+      "year",   "month",   "week",   "day",          "hour",
+      "minute", "second",  "millisecond",            "years",
+      "months", "weeks",   "days",   "hours",        "minutes",
+      "seconds", "milliseconds"};
+  return token.type == Token::Type::kIdentifier &&
+         std::find(std::begin(kPrecisions), std::end(kPrecisions),
+                   token.text) != std::end(kPrecisions);
+}
+
+// A Pratt parser for the "expression" rule of the FHIRPath grammar.
+class Parser {
+ public:
+  explicit Parser(std::vector<Token> tokens) : tokens_(std::move(tokens)) {}
+
+  StatusOr<std::unique_ptr<AstNode>> ParseExpression(int min_power) {
+    FHIR_ASSIGN_OR_RETURN(std::unique_ptr<AstNode> left, ParsePrefix());
+
+    while (true) {
+      const Token& token = Peek();
+
+      if (IsSymbol(token, ".")) {
+        Next();
+        FHIR_ASSIGN_OR_RETURN(std::unique_ptr<AstNode> invocation,
+                              ParseInvocation());
+        left = MakeNode(AstNode::Type::kInvocation, "", std::move(left),
+                        std::move(invocation));
+        continue;
+      }
+
+      if (IsSymbol(token, "[")) {
+        Next();
+        FHIR_ASSIGN_OR_RETURN(std::unique_ptr<AstNode> index,
+                              ParseExpression(0));
+        FHIR_RETURN_IF_ERROR(Expect("]"));
+        left = MakeNode(AstNode::Type::kIndexer, "", std::move(left),
+                        std::move(index));
+        continue;
+      }
+
+      if (token.type == Token::Type::kIdentifier &&
+          (token.text == "is" || token.text == "as")) {
+        if (kTypePower < min_power) {
+          break;
+        }
+        const std::string op(Next().text);
+        FHIR_ASSIGN_OR_RETURN(std::string type_name,
+                              ParseQualifiedIdentifier());
+        left = MakeNode(AstNode::Type::kTypeOperator, op, std::move(left));
+        left->type_name = std::move(type_name);
+        continue;
+      }
+
+      const int power = BinaryOperatorPower(token);
+      if (power == 0 || power < min_power) {
+        break;
+      }
+      const std::string op(Next().text);
+      // Operators are left associative, so the right operand only extends
+      // over operators that bind more tightly.
+      FHIR_ASSIGN_OR_RETURN(std::unique_ptr<AstNode> right,
+                            ParseExpression(power + 1));
+      left = MakeNode(AstNode::Type::kBinary, op, std::move(left),
+                      std::move(right));
+    }
+
+    return left;
+  }
+
+ private:
+  // Parses a term, or a polarity expression.
+  StatusOr<std::unique_ptr<AstNode>> ParsePrefix() {
+    const Token& token = Peek();
+    switch (token.type) {
+      case Token::Type::kString:
+        return MakeNode(AstNode::Type::kStringLiteral, Next().text);
+
+      case Token::Type::kNumber: {
+        const Token& number = Next();
+        if (Peek().type == Token::Type::kString ||
+            IsDateTimePrecision(Peek())) {
+          const Token& unit = Next();
+          return MakeNode(AstNode::Type::kQuantityLiteral,
+                          absl::StrCat(number.text, " ", unit.text));
+        }
+        return MakeNode(AstNode::Type::kNumberLiteral, number.text);
+      }
+
+      case Token::Type::kDate:
+        return MakeNode(AstNode::Type::kDateLiteral, Next().text);
+
+      case Token::Type::kDateTime:
+        return MakeNode(AstNode::Type::kDateTimeLiteral, Next().text);
+
+      case Token::Type::kTime:
+        return MakeNode(AstNode::Type::kTimeLiteral, Next().text);
+
+      case Token::Type::kSymbol:
+        if (token.text == "(") {
+          Next();
+          FHIR_ASSIGN_OR_RETURN(std::unique_ptr<AstNode> expression,
+                                ParseExpression(0));
+          FHIR_RETURN_IF_ERROR(Expect(")"));
+          return MakeNode(AstNode::Type::kParenthesized, "",
+                          std::move(expression));
+        }
+        if (token.text == "{") {
+          Next();
+          FHIR_RETURN_IF_ERROR(Expect("}"));
+          return MakeNode(AstNode::Type::kNullLiteral, "{}");
+        }
+        if (token.text == "%") {
+          Next();
+          if (Peek().type != Token::Type::kString && !IsIdentifier(Peek())) {
+            return SyntaxError("an identifier or string");
+          }
+          return MakeNode(AstNode::Type::kExternalConstant, Next().text);
+        }
+        if (token.text == "+" || token.text == "-") {
+          const std::string op(Next().text);
+          FHIR_ASSIGN_OR_RETURN(std::unique_ptr<AstNode> operand,
+                                ParseExpression(kPolarityPower));
+          return MakeNode(AstNode::Type::kPolarity, op, std::move(operand));
+        }
+        return SyntaxError("an expression");
+
+      case Token::Type::kIdentifier:
+        if (token.text == "true" || token.text == "false") {
+          return MakeNode(AstNode::Type::kBooleanLiteral, Next().text);
+        }
+        return ParseInvocation();
+
+      default:
+        return ParseInvocation();
+    }
+  }
+
+  // Parses the "invocation" rule: a member, a function call, $this, $index or
+  // $total.
+  StatusOr<std::unique_ptr<AstNode>> ParseInvocation() {
+    const Token& token = Peek();
+    if (token.type == Token::Type::kSpecialInvocation) {
+      Next();
+      if (token.text == "$this") {
+        return MakeNode(AstNode::Type::kThis, "$this");
+      }
+      if (token.text == "$index") {
+        return MakeNode(AstNode::Type::kIndex, "$index");
+      }
+      return MakeNode(AstNode::Type::kTotal, "$total");
+    }
+
+    if (!IsIdentifier(token)) {
+      return SyntaxError("an identifier");
+    }
+
+    const bool delimited = token.type == Token::Type::kDelimitedIdentifier;
+    const Token& identifier = Next();
+    std::string name(delimited ? identifier.text.substr(
+                                     1, identifier.text.size() - 2)
+                               : identifier.text);
+
+    if (!IsSymbol(Peek(), "(")) {
+      auto member = MakeNode(AstNode::Type::kIdentifier, std::move(name));
+      member->delimited = delimited;
+      return member;
+    }
+
+    Next();
+    auto function = MakeNode(AstNode::Type::kFunction, std::move(name));
+    function->delimited = delimited;
+    if (!IsSymbol(Peek(), ")")) {
+      do {
+        FHIR_ASSIGN_OR_RETURN(std::unique_ptr<AstNode> param,
+                              ParseExpression(0));
+        function->children.push_back(std::move(param));
+      } while (IsSymbol(Peek(), ",") && (Next(), true));
+    }
+    FHIR_RETURN_IF_ERROR(Expect(")"));
+    return function;
+  }
+
+  // Parses the "qualifiedIdentifier" rule, returning its text.
+  StatusOr<std::string> ParseQualifiedIdentifier() {
+    std::string name;
+    do {
+      if (!IsIdentifier(Peek())) {
+        return SyntaxError("a type name");
+      }
+      absl::StrAppend(&name, name.empty() ? "" : ".", Next().text);
+    } while (IsSymbol(Peek(), ".") && (Next(), true));
+    return name;
+  }
+
+  Status Expect(absl::string_view symbol) {
+    if (!IsSymbol(Peek(), symbol)) {
+      return SyntaxError(absl::StrCat("'", symbol, "'"));
+    }
+    Next();
+    return absl::OkStatus();
+  }
+
+  absl::Status SyntaxError(absl::string_view expected) const {
+    const Token& token = Peek();
+    return InternalError(absl::StrCat(
+        "Syntax error at position ", token.position, ": expected ", expected,
+        " but found ",
+        token.type == Token::Type::kEnd
+            ? "end of expression"
+            : absl::StrCat("'", token.text, "'")));
+  }
+
+  static bool IsSymbol(const Token& token, absl::string_view symbol) {
+    return token.type == Token::Type::kSymbol && token.text == symbol;
+  }
+
+  static std::unique_ptr<AstNode> MakeNode(
+      AstNode::Type type, absl::string_view text,
+      std::unique_ptr<AstNode> first = nullptr,
+      std::unique_ptr<AstNode> second = nullptr) {
+    auto node = absl::make_unique<AstNode>(type, std::string(text));
+    if (first != nullptr) {
+      node->children.push_back(std::move(first));
+    }
+    if (second != nullptr) {
+      node->children.push_back(std::move(second));
+    }
+    return node;
+  }
+
+  const Token& Peek() const { return tokens_[next_]; }
+
+  // Consumes the next token. The final kEnd token is never consumed.
+  const Token& Next() {
+    const Token& token = tokens_[next_];
+    if (token.type != Token::Type::kEnd) {
+      ++next_;
+    }
+    return token;
+  }
+
+  const std::vector<Token> tokens_;
+  size_t next_ = 0;
+};
+
+// Appends the tokens of the subexpression rooted at the node to the output,
+// separated by the given separator.
+void AppendTokens(const AstNode& node, absl::string_view separator,
+                  std::string* out) {
+  auto append = [&](absl::string_view token) {
+    absl::StrAppend(out, out->empty() ? "" : separator, token);
+  };
+
+  switch (node.type) {
+    case AstNode::Type::kIdentifier:
+    case AstNode::Type::kFunction:
+      if (node.delimited) {
+        append(absl::StrCat("`", node.text, "`"));
+      } else {
+        append(node.text);
+      }
+      if (node.type == AstNode::Type::kFunction) {
+        append("(");
+        for (size_t i = 0; i < node.children.size(); ++i) {
+          if (i > 0) {
+            append(",");
+          }
+          AppendTokens(*node.children[i], separator, out);
+        }
+        append(")");
+      }
+      return;
+
+    case AstNode::Type::kQuantityLiteral:
+      // The number and unit are separated by a space in the node's text.
+      append(separator.empty() ? absl::StrReplaceAll(node.text, {{" ", ""}})
+                               : node.text);
+      return;
+
+    case AstNode::Type::kExternalConstant:
+      append("%");
+      append(node.text);
+      return;
+
+    case AstNode::Type::kParenthesized:
+      append("(");
+      AppendTokens(*node.children[0], separator, out);
+      append(")");
+      return;
+
+    case AstNode::Type::kInvocation:
+      AppendTokens(*node.children[0], separator, out);
+      append(".");
+      AppendTokens(*node.children[1], separator, out);
+      return;
+
+    case AstNode::Type::kIndexer:
+      AppendTokens(*node.children[0], separator, out);
+      append("[");
+      AppendTokens(*node.children[1], separator, out);
+      append("]");
+      return;
+
+    case AstNode::Type::kPolarity:
+      append(node.text);
+      AppendTokens(*node.children[0], separator, out);
+      return;
+
+    case AstNode::Type::kBinary:
+      AppendTokens(*node.children[0], separator, out);
+      append(node.text);
+      AppendTokens(*node.children[1], separator, out);
+      return;
+
+    case AstNode::Type::kTypeOperator:
+      AppendTokens(*node.children[0], separator, out);
+      append(node.text);
+      append(node.type_name);
+      return;
+
+    default:
+      append(node.text);
+      return;
+  }
+}
+
+}  // namespace
+
+std::string AstNode::Text() const {
+  std::string text;
+  AppendTokens(*this, "", &text);
+  return text;
+}
+
+std::string AstNode::Key() const {
+  std::string key;
+  AppendTokens(*this, " ", &key);
+  return key;
+}
+
+StatusOr<std::unique_ptr<AstNode>> ParseFhirPath(absl::string_view fhir_path) {
+  FHIR_ASSIGN_OR_RETURN(std::vector<Token> tokens,
+                        Lexer(fhir_path).Tokenize());
+  return Parser(std::move(tokens)).ParseExpression(0);
+}
+
+namespace {
+
+// The node types in the order of the values of proto::FhirPathAstNode::Type,
+// which start at IDENTIFIER = 1.
+constexpr AstNode::Type kProtoNodeTypes[] = {
+    AstNode::Type::kIdentifier,      AstNode::Type::kFunction,
+    AstNode::Type::kThis,            AstNode::Type::kIndex,
+    AstNode::Type::kTotal,           AstNode::Type::kNullLiteral,
+    AstNode::Type::kBooleanLiteral,  AstNode::Type::kStringLiteral,
+    AstNode::Type::kNumberLiteral,   AstNode::Type::kDateLiteral,
+    AstNode::Type::kDateTimeLiteral, AstNode::Type::kTimeLiteral,
+    AstNode::Type::kQuantityLiteral, AstNode::Type::kExternalConstant,
+    AstNode::Type::kParenthesized,   AstNode::Type::kInvocation,
+    AstNode::Type::kIndexer,         AstNode::Type::kPolarity,
+    AstNode::Type::kBinary,          AstNode::Type::kTypeOperator,
+};
+
+proto::FhirPathAstNode::Type ToProtoType(AstNode::Type type) {
+  for (int i = 0; i < ABSL_ARRAYSIZE(kProtoNodeTypes); ++i) {
+    if (kProtoNodeTypes[i] == type) {
+      return static_cast<proto::FhirPathAstNode::Type>(i + 1);
+    }
+  }
+  return proto::FhirPathAstNode::TYPE_UNKNOWN;
+}
+
+// Returns an error unless the node has the number of children that its type
+// requires.
+Status CheckChildren(const proto::FhirPathAstNode& node, AstNode::Type type) {
+  int expected;
+  switch (type) {
+    case AstNode::Type::kFunction:
+      return absl::OkStatus();
+    case AstNode::Type::kParenthesized:
+    case AstNode::Type::kPolarity:
+    case AstNode::Type::kTypeOperator:
+      expected = 1;
+      break;
+    case AstNode::Type::kInvocation:
+    case AstNode::Type::kIndexer:
+    case AstNode::Type::kBinary:
+      expected = 2;
+      break;
+    default:
+      expected = 0;
+      break;
+  }
+  if (node.children_size() != expected) {
+    return InvalidArgumentError(absl::StrCat(
+        "Syntax tree node of type ",
+        proto::FhirPathAstNode::Type_Name(node.type()), " has ",
+        node.children_size(), " children; expected ", expected, "."));
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace
+
+proto::FhirPathAstNode AstToProto(const AstNode& node) {
+  proto::FhirPathAstNode result;
+  result.set_type(ToProtoType(node.type));
+  result.set_text(node.text);
+  result.set_type_name(node.type_name);
+  result.set_delimited(node.delimited);
+  for (const std::unique_ptr<AstNode>& child : node.children) {
+    *result.add_children() = AstToProto(*child);
+  }
+  return result;
+}
+
+StatusOr<std::unique_ptr<AstNode>> AstFromProto(
+    const proto::FhirPathAstNode& node) {
+  if (node.type() < 1 ||
+      node.type() > static_cast<int>(ABSL_ARRAYSIZE(kProtoNodeTypes))) {
+    return InvalidArgumentError(
+        absl::StrCat("Unknown syntax tree node type: ", node.type()));
+  }
+  const AstNode::Type type = kProtoNodeTypes[node.type() - 1];
+  FHIR_RETURN_IF_ERROR(CheckChildren(node, type));
+
+  auto result = absl::make_unique<AstNode>(type, node.text());
+  result->type_name = node.type_name();
+  result->delimited = node.delimited();
+  for (const proto::FhirPathAstNode& child : node.children()) {
+    FHIR_ASSIGN_OR_RETURN(std::unique_ptr<AstNode> converted,
+                          AstFromProto(child));
+    result->children.push_back(std::move(converted));
+  }
+
+  // The member of an invocation must itself be an invocation.
+  if (type == AstNode::Type::kInvocation) {
+    switch (result->children[1]->type) {
+      case AstNode::Type::kIdentifier:
+      case AstNode::Type::kFunction:
+      case AstNode::Type::kThis:
+      case AstNode::Type::kIndex:
+      case AstNode::Type::kTotal:
+        break;
+      default:
+        return InvalidArgumentError(
+            "The right side of an invocation must be a member or function.");
+    }
+  }
+  return result;
+}
+
+}  // namespace internal
+}  // namespace fhir_path
+}  // namespace fhir
+}  // namespace google
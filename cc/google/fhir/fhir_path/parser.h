@@ -0,0 +1,129 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GOOGLE_FHIR_FHIR_PATH_PARSER_H_
+#define GOOGLE_FHIR_FHIR_PATH_PARSER_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "google/fhir/status/statusor.h"
+#include "proto/fhir_path.pb.h"
+
+namespace google {
+namespace fhir {
+namespace fhir_path {
+namespace internal {
+
+// A node of the syntax tree of a FHIRPath expression. The node types mirror
+// the rules of the FHIRPath grammar, http://hl7.org/fhirpath/grammar.html
+struct AstNode {
+  enum class Type {
+    // Invocations, which are terms on their own or follow a '.'.
+    //
+    // A member; text is the member's name.
+    kIdentifier,
+    // A function call; text is the function's name and children are the
+    // parameters.
+    kFunction,
+    // $this, $index and $total.
+    kThis,
+    kIndex,
+    kTotal,
+
+    // Literals; text is the literal as written, including the quotes around
+    // strings and the '@' before dates and times.
+    kNullLiteral,
+    kBooleanLiteral,
+    kStringLiteral,
+    kNumberLiteral,
+    kDateLiteral,
+    kDateTimeLiteral,
+    kTimeLiteral,
+    // A number followed by a unit; text is the number and unit as written.
+    kQuantityLiteral,
+
+    // '%' followed by an identifier or string; text is the identifier or the
+    // string as written.
+    kExternalConstant,
+
+    // '(' children[0] ')'.
+    kParenthesized,
+
+    // children[0] '.' children[1], where children[1] is an invocation.
+    kInvocation,
+    // children[0] '[' children[1] ']'.
+    kIndexer,
+    // A prefix '+' or '-' (text) applied to children[0].
+    kPolarity,
+    // children[0] text children[1], where text is one of the binary operators
+    // of the grammar: * / div mod + - & | <= < > >= = ~ != !~ in contains and
+    // or xor implies.
+    kBinary,
+    // children[0] text type_name, where text is "is" or "as".
+    kTypeOperator,
+  };
+
+  AstNode(Type type, std::string text) : type(type), text(std::move(text)) {}
+
+  // Returns the node's source text with whitespace and comments removed,
+  // e.g. "FHIR.Patient" for the parameter of "ofType(FHIR.Patient)".
+  std::string Text() const;
+
+  // Returns a canonical form of the subexpression rooted at this node, in
+  // which tokens are separated by single spaces. Two subexpressions have the
+  // same key if and only if they consist of the same tokens.
+  std::string Key() const;
+
+  Type type;
+  std::string text;
+
+  // The qualified type name of a kTypeOperator node.
+  std::string type_name;
+
+  // True if the identifier of a kIdentifier or kFunction node was delimited
+  // by backticks, which are not included in text.
+  bool delimited = false;
+
+  std::vector<std::unique_ptr<AstNode>> children;
+};
+
+// Parses a FHIRPath expression into its syntax tree.
+//
+// As with the "expression" rule of the grammar, which is not anchored to the
+// end of its input, any text that follows a complete expression is ignored.
+//
+// Malformed tokens, such as unterminated strings, produce an
+// InvalidArgumentError. Tokens that do not fit the grammar produce an
+// InternalError.
+StatusOr<std::unique_ptr<AstNode>> ParseFhirPath(absl::string_view fhir_path);
+
+// Converts the syntax tree to its serialized form.
+proto::FhirPathAstNode AstToProto(const AstNode& node);
+
+// Converts a serialized syntax tree back into the tree it was produced from.
+// Since the serialized form may come from an untrusted or outdated source,
+// the shape of the tree is checked: every node must have the children its type
+// requires. Malformed trees produce an InvalidArgumentError.
+StatusOr<std::unique_ptr<AstNode>> AstFromProto(
+    const proto::FhirPathAstNode& node);
+
+}  // namespace internal
+}  // namespace fhir_path
+}  // namespace fhir
+}  // namespace google
+
+#endif  // GOOGLE_FHIR_FHIR_PATH_PARSER_H_
@@ -0,0 +1,243 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "google/fhir/fhir_path/parser.h"
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "gmock/gmock.h"
+#include "gtest/gtest.h"
+#include "google/protobuf/text_format.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "google/fhir/status/statusor.h"
+#include "proto/fhir_path.pb.h"
+
+namespace google {
+namespace fhir {
+namespace fhir_path {
+namespace internal {
+
+namespace {
+
+// Describes the syntax tree with every operator application parenthesized.
+std::string Describe(const AstNode& node) {
+  switch (node.type) {
+    case AstNode::Type::kFunction: {
+      std::vector<std::string> params;
+      for (const std::unique_ptr<AstNode>& param : node.children) {
+        params.push_back(Describe(*param));
+      }
+      return absl::StrCat(node.text, "(", absl::StrJoin(params, ", "), ")");
+    }
+    case AstNode::Type::kParenthesized:
+      return Describe(*node.children[0]);
+    case AstNode::Type::kInvocation:
+      return absl::StrCat(Describe(*node.children[0]), ".",
+                          Describe(*node.children[1]));
+    case AstNode::Type::kIndexer:
+      return absl::StrCat(Describe(*node.children[0]), "[",
+                          Describe(*node.children[1]), "]");
+    case AstNode::Type::kPolarity:
+      return absl::StrCat("(", node.text, Describe(*node.children[0]), ")");
+    case AstNode::Type::kBinary:
+      return absl::StrCat("(", Describe(*node.children[0]), " ", node.text,
+                          " ", Describe(*node.children[1]), ")");
+    case AstNode::Type::kTypeOperator:
+      return absl::StrCat("(", Describe(*node.children[0]), " ", node.text,
+                          " ", node.type_name, ")");
+    default:
+      return node.Text();
+  }
+}
+
+std::string Parse(absl::string_view fhir_path) {
+  StatusOr<std::unique_ptr<AstNode>> root = ParseFhirPath(fhir_path);
+  EXPECT_TRUE(root.ok()) << fhir_path << ": " << root.status();
+  return root.ok() ? Describe(*root.ValueOrDie()) : "";
+}
+
+absl::StatusCode ParseError(absl::string_view fhir_path) {
+  return ParseFhirPath(fhir_path).status().code();
+}
+
+TEST(ParserTest, OperatorPrecedence) {
+  EXPECT_EQ(Parse("a implies b or c xor d and e"),
+            "(a implies ((b or c) xor (d and e)))");
+  EXPECT_EQ(Parse("a and b in c = d"), "(a and (b in (c = d)))");
+  EXPECT_EQ(Parse("a != b <= c | d"), "(a != (b <= (c | d)))");
+  EXPECT_EQ(Parse("a | b is T + c"), "(a | ((b is T) + c))");
+  EXPECT_EQ(Parse("a + b * c - d div e"), "((a + (b * c)) - (d div e))");
+  EXPECT_EQ(Parse("-a.b + 1"), "((-a.b) + 1)");
+  EXPECT_EQ(Parse("(a or b) and c"), "((a or b) and c)");
+}
+
+TEST(ParserTest, OperatorsAreLeftAssociative) {
+  EXPECT_EQ(Parse("a - b - c"), "((a - b) - c)");
+  EXPECT_EQ(Parse("a and b and c"), "((a and b) and c)");
+  EXPECT_EQ(Parse("a is B as C"), "((a is B) as C)");
+}
+
+TEST(ParserTest, Invocations) {
+  EXPECT_EQ(Parse("name.given[0].exists()"), "name.given[0].exists()");
+  EXPECT_EQ(Parse("iif(a, b.where($this > 1), {})"),
+            "iif(a, b.where(($this > 1)), {})");
+  EXPECT_EQ(Parse("a.ofType(FHIR.Patient)"), "a.ofType(FHIR.Patient)");
+  EXPECT_EQ(Parse("value is FHIR.Quantity"), "(value is FHIR.Quantity)");
+}
+
+TEST(ParserTest, KeywordsAsIdentifiers) {
+  EXPECT_EQ(Parse("a contains b"), "(a contains b)");
+  EXPECT_EQ(Parse("a.contains('b')"), "a.contains('b')");
+  EXPECT_EQ(Parse("a.is(B) and as(C)"), "(a.is(B) and as(C))");
+}
+
+TEST(ParserTest, Literals) {
+  EXPECT_EQ(Parse("true or false"), "(true or false)");
+  EXPECT_EQ(Parse("'a \\'b\\' \\u00e9'"), "'a \\'b\\' \\u00e9'");
+  EXPECT_EQ(Parse("1.5 + 2"), "(1.5 + 2)");
+  EXPECT_EQ(Parse("1.a"), "1.a");
+  EXPECT_EQ(Parse("4 days + 5 'mg'"), "(4days + 5'mg')");
+  EXPECT_EQ(Parse("%ucum | %`vs-x` | %'ext'"), "((%ucum | %`vs-x`) | %'ext')");
+
+  StatusOr<std::unique_ptr<AstNode>> quantity = ParseFhirPath("4 days");
+  ASSERT_TRUE(quantity.ok());
+  EXPECT_EQ(quantity.ValueOrDie()->type, AstNode::Type::kQuantityLiteral);
+  EXPECT_EQ(quantity.ValueOrDie()->Key(), "4 days");
+}
+
+TEST(ParserTest, DateTimeLiterals) {
+  const std::vector<std::pair<std::string, AstNode::Type>> literals = {
+      {"@2014", AstNode::Type::kDateLiteral},
+      {"@2014-01-25", AstNode::Type::kDateLiteral},
+      {"@2014T", AstNode::Type::kDateTimeLiteral},
+      {"@2014-01-25T14:30", AstNode::Type::kDateTimeLiteral},
+      {"@2014-01-25T14:30:14.559Z", AstNode::Type::kDateTimeLiteral},
+      {"@2014-01-25T14:30:14+10:00", AstNode::Type::kDateTimeLiteral},
+      {"@T14:30:14.559", AstNode::Type::kTimeLiteral},
+  };
+  for (const auto& literal : literals) {
+    StatusOr<std::unique_ptr<AstNode>> root = ParseFhirPath(literal.first);
+    ASSERT_TRUE(root.ok()) << literal.first << ": " << root.status();
+    EXPECT_EQ(root.ValueOrDie()->type, literal.second) << literal.first;
+    EXPECT_EQ(root.ValueOrDie()->text, literal.first);
+  }
+
+  // An incomplete time zone offset is not part of the literal.
+  EXPECT_EQ(Parse("@2014-01-25T14:30 - 10"), "(@2014-01-25T14:30 - 10)");
+}
+
+TEST(ParserTest, DelimitedIdentifiers) {
+  StatusOr<std::unique_ptr<AstNode>> root = ParseFhirPath("`div`.exists()");
+  ASSERT_TRUE(root.ok()) << root.status();
+
+  const AstNode& member = *root.ValueOrDie()->children[0];
+  EXPECT_EQ(member.type, AstNode::Type::kIdentifier);
+  EXPECT_EQ(member.text, "div");
+  EXPECT_TRUE(member.delimited);
+  EXPECT_EQ(root.ValueOrDie()->Text(), "`div`.exists()");
+}
+
+TEST(ParserTest, TextAndKey) {
+  StatusOr<std::unique_ptr<AstNode>> root =
+      ParseFhirPath("a /* comment */ and\n  b // comment");
+  ASSERT_TRUE(root.ok()) << root.status();
+
+  EXPECT_EQ(root.ValueOrDie()->Text(), "aandb");
+  EXPECT_EQ(root.ValueOrDie()->Key(), "a and b");
+}
+
+TEST(ParserTest, IgnoresTextAfterExpression) {
+  EXPECT_EQ(Parse("a b"), "a");
+  EXPECT_EQ(Parse("a.b) + c"), "a.b");
+}
+
+TEST(ParserTest, LexicalErrors) {
+  EXPECT_EQ(ParseError("'unterminated"), absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(ParseError("`unterminated"), absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(ParseError("$that"), absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(ParseError("a # b"), absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(ParseError("@201"), absl::StatusCode::kInvalidArgument);
+}
+
+TEST(ParserTest, SyntaxErrors) {
+  EXPECT_EQ(ParseError(""), absl::StatusCode::kInternal);
+  EXPECT_EQ(ParseError("expression->not->valid"), absl::StatusCode::kInternal);
+  EXPECT_EQ(ParseError("a."), absl::StatusCode::kInternal);
+  EXPECT_EQ(ParseError("a.(b)"), absl::StatusCode::kInternal);
+  EXPECT_EQ(ParseError("where(a"), absl::StatusCode::kInternal);
+  EXPECT_EQ(ParseError("a[0"), absl::StatusCode::kInternal);
+  EXPECT_EQ(ParseError("a and or b"), absl::StatusCode::kInternal);
+  EXPECT_EQ(ParseError("a is 1"), absl::StatusCode::kInternal);
+}
+
+TEST(ParserTest, ProtoRoundTrip) {
+  const std::vector<std::string> expressions = {
+      "name.given[0].exists() and `div`.empty()",
+      "-a.b + 4 days | %ucum",
+      "value is FHIR.Quantity implies iif($this > 1, {}, $index)",
+      "@2014-01-25T14:30 - 10 'mg'",
+  };
+  for (const std::string& expression : expressions) {
+    StatusOr<std::unique_ptr<AstNode>> root = ParseFhirPath(expression);
+    ASSERT_TRUE(root.ok()) << expression << ": " << root.status();
+
+    StatusOr<std::unique_ptr<AstNode>> converted =
+        AstFromProto(AstToProto(*root.ValueOrDie()));
+    ASSERT_TRUE(converted.ok()) << expression << ": " << converted.status();
+    EXPECT_EQ(Describe(*converted.ValueOrDie()),
+              Describe(*root.ValueOrDie()));
+    EXPECT_EQ(converted.ValueOrDie()->Key(), root.ValueOrDie()->Key());
+  }
+}
+
+TEST(ParserTest, MalformedProto) {
+  const std::vector<std::string> malformed = {
+      // No type.
+      R"proto(text: "a")proto",
+      // Unknown type.
+      R"proto(type: 99 text: "a")proto",
+      // A binary operator with a single operand.
+      R"proto(type: BINARY
+              text: "and"
+              children { type: IDENTIFIER text: "a" })proto",
+      // An identifier with children.
+      R"proto(type: IDENTIFIER
+              text: "a"
+              children { type: IDENTIFIER text: "b" })proto",
+      // An invocation of a literal.
+      R"proto(type: INVOCATION
+              children { type: IDENTIFIER text: "a" }
+              children { type: NUMBER_LITERAL text: "1" })proto",
+  };
+  for (const std::string& text : malformed) {
+    proto::FhirPathAstNode node;
+    ASSERT_TRUE(google::protobuf::TextFormat::ParseFromString(text, &node))
+        << text;
+    EXPECT_EQ(AstFromProto(node).status().code(),
+              absl::StatusCode::kInvalidArgument)
+        << text;
+  }
+}
+
+}  // namespace
+
+}  // namespace internal
+}  // namespace fhir_path
+}  // namespace fhir
+}  // namespace google
@@ -14,6 +14,11 @@
 
 #include "google/fhir/fhir_path/stu3_fhir_path_validation.h"
 
+#include <utility>
+
+#include "google/fhir/fhir_path/fhir_path.h"
+#include "google/fhir/fhir_path/parsed_fhir_path_constraints.h"
+#include "google/fhir/status/statusor.h"
 #include "google/fhir/stu3/primitive_handler.h"
 
 namespace google {
@@ -24,9 +29,38 @@ FhirPathValidator::FhirPathValidator()
     : google::fhir::fhir_path::FhirPathValidator(
           google::fhir::stu3::Stu3PrimitiveHandler::GetInstance()) {}
 
+FhirPathValidator::FhirPathValidator(
+    const google::fhir::fhir_path::CompileOptions& compile_options)
+    : google::fhir::fhir_path::FhirPathValidator(
+          google::fhir::stu3::Stu3PrimitiveHandler::GetInstance(), compile_options) {}
+
+namespace {
+
+using ::google::fhir::fhir_path::ParsedExpressions;
+
+// Returns the constraints of STU3 resources parsed at build time, or nullptr if
+// they fail to load, in which case constraints are parsed as they are
+// compiled.
+const ParsedExpressions* LoadParsedConstraints() {
+  StatusOr<ParsedExpressions> expressions =
+      ParsedExpressions::FromSerializedProto(
+          google::fhir::fhir_path::internal::Stu3ParsedFhirPathConstraints());
+  if (!expressions.ok()) {
+    LOG(WARNING) << "Parsing constraints at startup. "
+                 << expressions.status().message();
+    return nullptr;
+  }
+  return new ParsedExpressions(std::move(expressions).ValueOrDie());
+}
+
+}  // namespace
+
 google::fhir::fhir_path::FhirPathValidator* GetFhirPathValidator() {
-  static google::fhir::fhir_path::FhirPathValidator* validator =
-      new FhirPathValidator;
+  static google::fhir::fhir_path::FhirPathValidator* validator = [] {
+    google::fhir::fhir_path::CompileOptions options;
+    options.parsed_expressions = LoadParsedConstraints();
+    return new FhirPathValidator(options);
+  }();
   return validator;
 }
 
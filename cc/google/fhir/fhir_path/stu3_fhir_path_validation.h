@@ -32,9 +32,14 @@ namespace stu3 {
 class FhirPathValidator : public ::google::fhir::fhir_path::FhirPathValidator {
  public:
   FhirPathValidator();
+
+  // See ::google::fhir::fhir_path::FhirPathValidator.
+  explicit FhirPathValidator(
+      const ::google::fhir::fhir_path::CompileOptions& compile_options);
 };
 
-// Returns a shared instance of the STU3 message validator.
+// Returns a shared instance of the STU3 message validator. It compiles
+// constraints from syntax trees parsed at build time rather than parsing them.
 ABSL_MUST_USE_RESULT
 ::google::fhir::fhir_path::FhirPathValidator* GetFhirPathValidator();
 
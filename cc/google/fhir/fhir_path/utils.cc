@@ -115,26 +115,32 @@ Status RetrieveField(
 
   return ForEachMessageWithStatus<Message>(
       root, &field, [&](const Message& child) {
-        // R4+ packs contained resources in Any protos.
-        if (IsMessageType<google::protobuf::Any>(child)) {
-          auto any = dynamic_cast<const google::protobuf::Any&>(child);
-
-          FHIR_ASSIGN_OR_RETURN(
-              Message * unpacked_message,
-              UnpackAnyAsContainedResource(any, message_factory));
-
-          return OneofMessageFromContainer(*unpacked_message, results);
-        }
-
-        if (IsChoiceType(&field) || IsContainedResource(field.message_type())) {
-          return OneofMessageFromContainer(child, results);
-        } else {
-          results->push_back(&child);
-          return absl::OkStatus();
-        }
+        return RetrieveFieldValue(child, field, message_factory, results);
       });
 }
 
+Status RetrieveFieldValue(
+    const Message& value, const FieldDescriptor& field,
+    std::function<google::protobuf::Message*(const Descriptor*)> message_factory,
+    std::vector<const Message*>* results) {
+  // R4+ packs contained resources in Any protos.
+  if (IsMessageType<google::protobuf::Any>(value)) {
+    const auto& any = dynamic_cast<const google::protobuf::Any&>(value);
+
+    FHIR_ASSIGN_OR_RETURN(Message * unpacked_message,
+                          UnpackAnyAsContainedResource(any, message_factory));
+
+    return OneofMessageFromContainer(*unpacked_message, results);
+  }
+
+  if (IsChoiceType(&field) || IsContainedResource(field.message_type())) {
+    return OneofMessageFromContainer(value, results);
+  } else {
+    results->push_back(&value);
+    return absl::OkStatus();
+  }
+}
+
 bool HasFieldWithJsonName(const Descriptor* descriptor,
                           absl::string_view json_name) {
   if (IsContainedResource(descriptor) || IsChoiceTypeContainer(descriptor)) {
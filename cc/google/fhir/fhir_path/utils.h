@@ -46,6 +46,18 @@ absl::Status RetrieveField(
     std::function<google::protobuf::Message*(const google::protobuf::Descriptor*)> message_factory,
     std::vector<const google::protobuf::Message*>* results);
 
+// Places the message(s) that RetrieveField retrieves for one value of the
+// field in the results vector. Unlike RetrieveField, the field must not be the
+// value field of a FHIR primitive (see IsFhirPrimitiveValue).
+absl::Status RetrieveFieldValue(
+    const google::protobuf::Message& value, const google::protobuf::FieldDescriptor& field,
+    std::function<google::protobuf::Message*(const google::protobuf::Descriptor*)> message_factory,
+    std::vector<const google::protobuf::Message*>* results);
+
+// Returns true if the given field is accessing the logical "value"
+// field on FHIR primitives.
+bool IsFhirPrimitiveValue(const google::protobuf::FieldDescriptor& field);
+
 // Returns true if the message descriptor contains a field whose JSON name
 // matches the provided json_name. In the case that the descriptor describes a
 // proto wrapper used for ValueX or contained resources, a search for a matching
@@ -99,6 +99,11 @@ class PrimitiveHandler {
 
   virtual ::google::protobuf::Message* NewBoolean(const bool value) const = 0;
 
+  // Returns a Boolean with the given value that is owned by the handler, for
+  // callers that would otherwise create and discard a Boolean per use, such as
+  // FHIRPath evaluation. It must not be modified.
+  virtual const ::google::protobuf::Message& BooleanConstant(const bool value) const = 0;
+
   virtual const ::google::protobuf::Descriptor* BooleanDescriptor() const = 0;
 
   virtual StatusOr<int> GetIntegerValue(
@@ -336,6 +341,10 @@ class PrimitiveHandlerTemplate : public PrimitiveHandler {
     return msg;
   }
 
+  const ::google::protobuf::Message& BooleanConstant(const bool value) const override {
+    return boolean_constants_[value];
+  }
+
   const ::google::protobuf::Descriptor* BooleanDescriptor() const override {
     return Boolean::GetDescriptor();
   }
@@ -530,7 +539,13 @@ class PrimitiveHandlerTemplate : public PrimitiveHandler {
 
  protected:
   PrimitiveHandlerTemplate()
-      : PrimitiveHandler(GetFhirVersion(ExtensionType::descriptor())) {}
+      : PrimitiveHandler(GetFhirVersion(ExtensionType::descriptor())) {
+    boolean_constants_[1].set_value(true);
+  }
+
+ private:
+  // The Booleans false and true, returned by BooleanConstant.
+  Boolean boolean_constants_[2];
 };
 
 // Helper function for handling primitive types that are universally present in
@@ -33,6 +33,14 @@ Status ValidateResourceWithFhirPath(const ::google::protobuf::Message& resource)
       resource, R4PrimitiveHandler::GetInstance(), GetFhirPathValidator());
 }
 
+Status ValidateResourceWithFhirPath(
+    const ::google::protobuf::Message& resource,
+    ::google::fhir::fhir_path::ValidationMetrics* metrics) {
+  return ValidateResourceWithFhirPath(
+      resource, R4PrimitiveHandler::GetInstance(), GetFhirPathValidator(),
+      metrics);
+}
+
 }  // namespace r4
 }  // namespace fhir
 }  // namespace google
@@ -33,6 +33,11 @@ namespace r4 {
 namespace {
 
 using namespace google::fhir::r4::core;  // NOLINT
+using ::testing::AllOf;
+using ::testing::Contains;
+using ::testing::Eq;
+using ::testing::Field;
+using ::testing::StrEq;
 
 template <typename T>
 void ValidTest(const std::string& name) {
@@ -75,6 +80,31 @@ TEST(ResourceValidationTest, FHIRPathViolation) {
   InvalidTest<Observation>("observation_invalid_fhirpath_violation");
 }
 
+TEST(ResourceValidationTest, FHIRPathViolationRecordedInMetrics) {
+  fhir_path::ValidationMetrics metrics;
+  const Observation observation = ReadProto<Observation>(
+      "testdata/r4/validation/observation_invalid_fhirpath_violation.prototxt");
+  EXPECT_FALSE(ValidateResourceWithFhirPath(observation, &metrics).ok());
+  EXPECT_FALSE(ValidateResourceWithFhirPath(observation, &metrics).ok());
+
+  EXPECT_THAT(
+      metrics.Snapshot(),
+      Contains(AllOf(
+          Field(&fhir_path::ValidationMetrics::ConstraintStats::type,
+                Eq(Observation::ReferenceRange::descriptor())),
+          Field(&fhir_path::ValidationMetrics::ConstraintStats::constraint,
+                StrEq("low.exists() or high.exists() or text.exists()")),
+          Field(&fhir_path::ValidationMetrics::ConstraintStats::evaluations,
+                Eq(2)),
+          Field(&fhir_path::ValidationMetrics::ConstraintStats::failures,
+                Eq(2)))));
+}
+
+TEST(ResourceValidationTest, ReferenceErrorTakesPrecedenceOverFHIRPath) {
+  InvalidTest<Observation>(
+      "observation_invalid_fhirpath_violation_and_reference");
+}
+
 TEST(ResourceValidationTest, RepeatedReferenceValid) {
   ValidTest<Encounter>("encounter_valid_repeated_reference");
 }
@@ -89,6 +119,10 @@ TEST(ResourceValidationTest, EmptyOneof) {
 
 TEST(BundleValidationTest, Valid) { ValidTest<Bundle>("bundle_valid"); }
 
+TEST(BundleValidationTest, MissingRequiredFieldInEntry) {
+  InvalidTest<Bundle>("bundle_invalid_entry_missing_required");
+}
+
 TEST(EncounterValidationTest, StartLaterThanEnd) {
   InvalidTest<Encounter>("encounter_invalid_start_later_than_end");
 }
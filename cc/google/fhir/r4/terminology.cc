@@ -0,0 +1,164 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "google/fhir/r4/terminology.h"
+
+#include <string>
+
+#include "absl/status/status.h"
+#include "absl/strings/ascii.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "absl/time/time.h"
+#include "google/fhir/codes.h"
+#include "google/fhir/r4/json_format.h"
+#include "google/fhir/status/statusor.h"
+
+namespace google {
+namespace fhir {
+namespace r4 {
+
+namespace {
+
+using ::google::fhir::r4::core::Bundle;
+using ::google::fhir::r4::core::CodeSystem;
+using ::google::fhir::r4::core::ContainedResource;
+using ::google::fhir::r4::core::ValueSet;
+
+void AddConcepts(
+    const std::string& system, const std::string& parent,
+    const ::google::protobuf::RepeatedPtrField<CodeSystem::ConceptDefinition>&
+        concepts,
+    TerminologyIndex::Builder* builder) {
+  for (const CodeSystem::ConceptDefinition& concept : concepts) {
+    builder->AddConcept(system, concept.code().value(), parent);
+    AddConcepts(system, concept.code().value(), concept.concept(), builder);
+  }
+}
+
+// Returns the URL of a canonical reference, without any version.
+std::string CanonicalUrl(const std::string& canonical) {
+  return canonical.substr(0, canonical.find('|'));
+}
+
+StatusOr<ValueSetDefinition::Rule> ToRule(
+    const ValueSet::Compose::ConceptSet& concept_set) {
+  ValueSetDefinition::Rule rule;
+  rule.system = concept_set.system().value();
+  for (const auto& concept : concept_set.concept()) {
+    rule.codes.push_back(concept.code().value());
+  }
+  for (const auto& filter : concept_set.filter()) {
+    FHIR_ASSIGN_OR_RETURN(std::string op, GetCodeAsString(filter.op()));
+    rule.filters.push_back(
+        {filter.property().value(), std::move(op), filter.value().value()});
+  }
+  for (const auto& value_set : concept_set.value_set()) {
+    rule.value_sets.push_back(CanonicalUrl(value_set.value()));
+  }
+  return rule;
+}
+
+void AddExpansion(
+    const ::google::protobuf::RepeatedPtrField<ValueSet::Expansion::Contains>&
+        contains,
+    ValueSetDefinition* definition) {
+  for (const ValueSet::Expansion::Contains& entry : contains) {
+    if (entry.has_code()) {
+      definition->expansion.push_back(
+          {entry.system().value(), entry.code().value()});
+    }
+    AddExpansion(entry.contains(), definition);
+  }
+}
+
+}  // namespace
+
+Status AddCodeSystem(const CodeSystem& code_system,
+                     TerminologyIndex::Builder* builder) {
+  if (code_system.url().value().empty()) {
+    return absl::InvalidArgumentError(absl::StrCat(
+        "CodeSystem ", code_system.id().value(), " has no url."));
+  }
+  AddConcepts(code_system.url().value(), "", code_system.concept(), builder);
+  return absl::OkStatus();
+}
+
+Status AddValueSet(const ValueSet& value_set,
+                   TerminologyIndex::Builder* builder) {
+  if (value_set.url().value().empty()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("ValueSet ", value_set.id().value(), " has no url."));
+  }
+
+  ValueSetDefinition definition;
+  definition.url = value_set.url().value();
+  for (const auto& include : value_set.compose().include()) {
+    FHIR_ASSIGN_OR_RETURN(ValueSetDefinition::Rule rule, ToRule(include));
+    definition.includes.push_back(std::move(rule));
+  }
+  for (const auto& exclude : value_set.compose().exclude()) {
+    FHIR_ASSIGN_OR_RETURN(ValueSetDefinition::Rule rule, ToRule(exclude));
+    definition.excludes.push_back(std::move(rule));
+  }
+  AddExpansion(value_set.expansion().contains(), &definition);
+  builder->AddValueSet(std::move(definition));
+  return absl::OkStatus();
+}
+
+Status AddTerminologyResource(const ContainedResource& resource,
+                              TerminologyIndex::Builder* builder) {
+  switch (resource.oneof_resource_case()) {
+    case ContainedResource::kCodeSystem:
+      return AddCodeSystem(resource.code_system(), builder);
+    case ContainedResource::kValueSet:
+      return AddValueSet(resource.value_set(), builder);
+    default:
+      return absl::OkStatus();
+  }
+}
+
+Status AddTerminologyBundle(const Bundle& bundle,
+                            TerminologyIndex::Builder* builder) {
+  for (const Bundle::Entry& entry : bundle.entry()) {
+    FHIR_RETURN_IF_ERROR(AddTerminologyResource(entry.resource(), builder));
+  }
+  return absl::OkStatus();
+}
+
+Status AddTerminologyNdjson(absl::string_view ndjson,
+                            TerminologyIndex::Builder* builder) {
+  int line_number = 0;
+  for (absl::string_view line : absl::StrSplit(ndjson, '\n')) {
+    ++line_number;
+    if (absl::StripAsciiWhitespace(line).empty()) {
+      continue;
+    }
+    StatusOr<ContainedResource> resource =
+        JsonFhirStringToProtoWithoutValidating<ContainedResource>(
+            std::string(line), absl::UTCTimeZone());
+    if (!resource.ok()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("Invalid resource on line ", line_number, ": ",
+                       resource.status().message()));
+    }
+    FHIR_RETURN_IF_ERROR(
+        AddTerminologyResource(resource.ValueOrDie(), builder));
+  }
+  return absl::OkStatus();
+}
+
+}  // namespace r4
+}  // namespace fhir
+}  // namespace google
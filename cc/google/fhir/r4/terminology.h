@@ -0,0 +1,58 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GOOGLE_FHIR_R4_TERMINOLOGY_H_
+#define GOOGLE_FHIR_R4_TERMINOLOGY_H_
+
+#include "absl/strings/string_view.h"
+#include "google/fhir/status/status.h"
+#include "google/fhir/terminology.h"
+#include "proto/r4/core/resources/bundle_and_contained_resource.pb.h"
+#include "proto/r4/core/resources/code_system.pb.h"
+#include "proto/r4/core/resources/value_set.pb.h"
+
+namespace google {
+namespace fhir {
+namespace r4 {
+
+// Adds the concepts of the code system to the builder. Nested concepts are
+// specializations of the concept they are nested in.
+Status AddCodeSystem(const core::CodeSystem& code_system,
+                     TerminologyIndex::Builder* builder);
+
+// Adds the value set defined by the compose or, if it has none, the
+// expansion of the ValueSet to the builder. Versions of code systems and
+// value sets are ignored.
+Status AddValueSet(const core::ValueSet& value_set,
+                   TerminologyIndex::Builder* builder);
+
+// Adds the resource to the builder if it is a CodeSystem or ValueSet, and
+// ignores it otherwise.
+Status AddTerminologyResource(const core::ContainedResource& resource,
+                              TerminologyIndex::Builder* builder);
+
+// Adds the CodeSystem and ValueSet resources of the bundle to the builder.
+Status AddTerminologyBundle(const core::Bundle& bundle,
+                            TerminologyIndex::Builder* builder);
+
+// Adds the CodeSystem and ValueSet resources of newline delimited FHIR JSON
+// to the builder. Blank lines are skipped.
+Status AddTerminologyNdjson(absl::string_view ndjson,
+                            TerminologyIndex::Builder* builder);
+
+}  // namespace r4
+}  // namespace fhir
+}  // namespace google
+
+#endif  // GOOGLE_FHIR_R4_TERMINOLOGY_H_
@@ -0,0 +1,248 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "google/fhir/r4/terminology.h"
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/time/time.h"
+#include "google/fhir/r4/json_format.h"
+#include "google/fhir/status/status.h"
+#include "google/fhir/status/statusor.h"
+#include "google/fhir/terminology.h"
+#include "google/fhir/test_helper.h"
+#include "proto/r4/core/resources/bundle_and_contained_resource.pb.h"
+#include "proto/r4/core/resources/code_system.pb.h"
+#include "proto/r4/core/resources/value_set.pb.h"
+#include "tensorflow/core/platform/env.h"
+
+namespace google {
+namespace fhir {
+namespace r4 {
+
+namespace {
+
+using ::google::fhir::r4::core::Bundle;
+using ::google::fhir::r4::core::CodeSystem;
+using ::google::fhir::r4::core::ContainedResource;
+using ::google::fhir::r4::core::ValueSet;
+
+constexpr char kShapes[] = "http://example.com/shapes";
+
+TEST(TerminologyTest, CodeSystemsAndValueSets) {
+  CodeSystem code_system = PARSE_FHIR_PROTO(R"proto(
+    url { value: "http://example.com/shapes" }
+    concept {
+      code { value: "polygon" }
+      concept {
+        code { value: "rectangle" }
+        concept { code { value: "square" } }
+      }
+      concept { code { value: "triangle" } }
+    }
+    concept { code { value: "circle" } }
+  )proto");
+  ValueSet rectangles = PARSE_FHIR_PROTO(R"proto(
+    url { value: "http://example.com/rectangles" }
+    compose {
+      include {
+        system { value: "http://example.com/shapes" }
+        filter {
+          property { value: "concept" }
+          op { value: IS_A }
+          value { value: "rectangle" }
+        }
+      }
+    }
+  )proto");
+  ValueSet polygons = PARSE_FHIR_PROTO(R"proto(
+    url { value: "http://example.com/polygons" }
+    compose {
+      include { value_set { value: "http://example.com/rectangles|1.0" } }
+      include {
+        system { value: "http://example.com/shapes" }
+        concept { code { value: "triangle" } }
+      }
+      exclude {
+        system { value: "http://example.com/shapes" }
+        concept { code { value: "rectangle" } }
+      }
+    }
+  )proto");
+  ValueSet expanded = PARSE_FHIR_PROTO(R"proto(
+    url { value: "http://example.com/expanded" }
+    expansion {
+      contains {
+        system { value: "http://example.com/shapes" }
+        code { value: "circle" }
+        contains {
+          system { value: "http://example.com/shapes" }
+          code { value: "triangle" }
+        }
+      }
+    }
+  )proto");
+
+  TerminologyIndex::Builder builder;
+  FHIR_ASSERT_OK(AddCodeSystem(code_system, &builder));
+  FHIR_ASSERT_OK(AddValueSet(rectangles, &builder));
+  FHIR_ASSERT_OK(AddValueSet(polygons, &builder));
+  FHIR_ASSERT_OK(AddValueSet(expanded, &builder));
+  StatusOr<TerminologyIndex> index = builder.Build();
+  ASSERT_TRUE(index.ok()) << index.status();
+  const TerminologyIndex& terminology = index.ValueOrDie();
+
+  EXPECT_TRUE(terminology.Contains("http://example.com/rectangles", kShapes,
+                                   "rectangle"));
+  EXPECT_TRUE(terminology.Contains("http://example.com/rectangles", kShapes,
+                                   "square"));
+  EXPECT_FALSE(terminology.Contains("http://example.com/rectangles", kShapes,
+                                    "polygon"));
+
+  EXPECT_TRUE(terminology.Contains("http://example.com/polygons", kShapes,
+                                   "square"));
+  EXPECT_TRUE(terminology.Contains("http://example.com/polygons", kShapes,
+                                   "triangle"));
+  EXPECT_FALSE(terminology.Contains("http://example.com/polygons", kShapes,
+                                    "rectangle"));
+
+  EXPECT_TRUE(terminology.Contains("http://example.com/expanded", kShapes,
+                                   "circle"));
+  EXPECT_TRUE(terminology.Contains("http://example.com/expanded", kShapes,
+                                   "triangle"));
+  EXPECT_FALSE(terminology.Contains("http://example.com/expanded", kShapes,
+                                    "square"));
+}
+
+TEST(TerminologyTest, Bundles) {
+  Bundle bundle = PARSE_FHIR_PROTO(R"proto(
+    entry { resource { patient { id { value: "1" } } } }
+    entry {
+      resource {
+        value_set {
+          url { value: "http://example.com/colors" }
+          compose {
+            include {
+              system { value: "http://example.com/colors" }
+              concept { code { value: "red" } }
+            }
+          }
+        }
+      }
+    }
+  )proto");
+
+  TerminologyIndex::Builder builder;
+  FHIR_ASSERT_OK(AddTerminologyBundle(bundle, &builder));
+  TerminologyIndex terminology = builder.Build().ValueOrDie();
+  EXPECT_EQ(terminology.value_set_count(), 1);
+  EXPECT_TRUE(terminology.Contains("http://example.com/colors",
+                                   "http://example.com/colors", "red"));
+}
+
+TEST(TerminologyTest, Ndjson) {
+  TerminologyIndex::Builder builder;
+  FHIR_ASSERT_OK(AddTerminologyNdjson(
+      R"json({"resourceType": "CodeSystem", )json"
+      R"json("url": "http://example.com/shapes", "status": "active", )json"
+      R"json("content": "complete", "concept": [{"code": "polygon", )json"
+      R"json("concept": [{"code": "square"}]}, {"code": "circle"}]})json"
+      "\n\n"
+      R"json({"resourceType": "ValueSet", )json"
+      R"json("url": "http://example.com/polygons", "status": "active", )json"
+      R"json("compose": {"include": [{)json"
+      R"json("system": "http://example.com/shapes", )json"
+      R"json("filter": [{"property": "concept", "op": "is-a", )json"
+      R"json("value": "polygon"}]}]}})json"
+      "\n"
+      R"json({"resourceType": "Patient", "id": "1"})json"
+      "\n",
+      &builder));
+  TerminologyIndex terminology = builder.Build().ValueOrDie();
+  EXPECT_TRUE(terminology.Contains("http://example.com/polygons", kShapes,
+                                   "square"));
+  EXPECT_FALSE(terminology.Contains("http://example.com/polygons", kShapes,
+                                    "circle"));
+
+  EXPECT_EQ(AddTerminologyNdjson("{\"resourceType\": \"ValueSet\"\n", &builder)
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+}
+
+// Adds the resources of the given type from the FHIR examples package.
+void AddSpecExamples(const std::string& resource_type,
+                     TerminologyIndex::Builder* builder) {
+  std::vector<std::string> paths;
+  TF_CHECK_OK(tensorflow::Env::Default()->GetMatchingPaths(
+      absl::StrCat(getenv("TEST_SRCDIR"),
+                   "/com_google_fhir/spec/hl7.fhir.r4.examples/4.0.1/package/",
+                   resource_type, "-*.json"),
+      &paths));
+  ASSERT_FALSE(paths.empty());
+  for (const std::string& path : paths) {
+    std::string json;
+    TF_CHECK_OK(tensorflow::ReadFileToString(tensorflow::Env::Default(), path,
+                                              &json));
+    StatusOr<ContainedResource> resource =
+        JsonFhirStringToProtoWithoutValidating<ContainedResource>(
+            json, absl::UTCTimeZone());
+    ASSERT_TRUE(resource.ok()) << path << ": " << resource.status();
+    FHIR_ASSERT_OK(AddTerminologyResource(resource.ValueOrDie(), builder));
+  }
+}
+
+TEST(TerminologyTest, SpecExamples) {
+  TerminologyIndex::Builder builder;
+  AddSpecExamples("CodeSystem", &builder);
+  AddSpecExamples("ValueSet", &builder);
+  std::map<std::string, Status> unexpanded;
+  StatusOr<TerminologyIndex> index = builder.Build(&unexpanded);
+  ASSERT_TRUE(index.ok()) << index.status();
+  const TerminologyIndex& terminology = index.ValueOrDie();
+  EXPECT_GT(terminology.value_set_count(), 1000);
+
+  EXPECT_TRUE(terminology.Contains(
+      "http://hl7.org/fhir/ValueSet/administrative-gender",
+      "http://hl7.org/fhir/administrative-gender", "female"));
+  EXPECT_FALSE(terminology.Contains(
+      "http://hl7.org/fhir/ValueSet/administrative-gender",
+      "http://hl7.org/fhir/administrative-gender", "woman"));
+
+  // Value sets that filter SNOMED CT, whose concepts are not in the package,
+  // use unsupported filters, or include value sets that are not in the
+  // package are left out of the index.
+  EXPECT_FALSE(terminology.HasValueSet(
+      "http://hl7.org/fhir/ValueSet/clinical-findings"));
+  EXPECT_EQ(unexpanded["http://hl7.org/fhir/ValueSet/clinical-findings"].code(),
+            absl::StatusCode::kNotFound);
+  EXPECT_FALSE(
+      terminology.HasValueSet("http://hl7.org/fhir/ValueSet/iso3166-1-3"));
+  EXPECT_EQ(unexpanded["http://hl7.org/fhir/ValueSet/iso3166-1-3"].code(),
+            absl::StatusCode::kUnimplemented);
+  EXPECT_FALSE(
+      terminology.HasValueSet("http://hl7.org/fhir/ValueSet/use-context"));
+  EXPECT_EQ(unexpanded["http://hl7.org/fhir/ValueSet/use-context"].code(),
+            absl::StatusCode::kNotFound);
+}
+
+}  // namespace
+
+}  // namespace r4
+}  // namespace fhir
+}  // namespace google
@@ -14,11 +14,20 @@
 
 #include "google/fhir/resource_validation.h"
 
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
+
 #include "google/protobuf/any.pb.h"
 #include "google/protobuf/descriptor.pb.h"
 #include "google/protobuf/descriptor.h"
+#include "absl/container/flat_hash_map.h"
+#include "absl/memory/memory.h"
 #include "absl/status/status.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+#include "absl/synchronization/mutex.h"
 #include "google/fhir/annotations.h"
 #include "google/fhir/primitive_handler.h"
 #include "google/fhir/proto_util.h"
@@ -37,12 +46,29 @@ using ::google::fhir::proto::validation_requirement;
 using ::google::protobuf::Descriptor;
 using ::google::protobuf::FieldDescriptor;
 using ::google::protobuf::Message;
+using ::google::protobuf::OneofDescriptor;
 using ::google::protobuf::Reflection;
 
 namespace {
 
+// The path of a field from the resource being validated, such as
+// "Observation.value.quantity.value", which names the field in errors. The
+// path is only turned into a string when validation fails.
+struct FieldPath {
+  const FieldPath* parent;
+  // The name of the resource at the root, or else the JSON name of the field.
+  absl::string_view name;
+
+  std::string ToString() const {
+    if (parent == nullptr) {
+      return std::string(name);
+    }
+    return absl::StrCat(parent->ToString(), ".", name);
+  }
+};
+
 template <class TypedDateTime>
-Status ValidatePeriod(const Message& period, const std::string& base) {
+Status ValidatePeriod(const Message& period, const FieldPath& path) {
   const Descriptor* descriptor = period.GetDescriptor();
   const Reflection* reflection = period.GetReflection();
   const FieldDescriptor* start_field = descriptor->FindFieldByName("start");
@@ -70,99 +96,312 @@ Status ValidatePeriod(const Message& period, const std::string& base) {
     if (google::fhir::GetTimeFromTimelikeElement(start) >=
         google::fhir::GetUpperBoundFromTimelikeElement(end)) {
       return ::absl::FailedPreconditionError(
-          absl::StrCat(base, "-start-time-later-than-end-time"));
+          absl::StrCat(path.ToString(), "-start-time-later-than-end-time"));
     }
   }
 
   return absl::OkStatus();
 }
 
-Status CheckField(const Message& message, const FieldDescriptor* field,
-                  const std::string& field_name,
-                  const PrimitiveHandler* primitive_handler);
+// The checks ValidateFhirConstraints makes on messages of a type, worked out
+// once per type from its descriptor and annotations.
+struct ValidationPlan {
+  struct Field {
+    const FieldDescriptor* field;
+    // True if the field is required by FHIR.
+    bool required;
+    // True if the field holds references, which are validated by the
+    // primitive handler and not descended into.
+    bool reference;
+    // The plan for the type of the field, if messages of that type can fail
+    // validation, or else null.
+    const ValidationPlan* nested;
+    // An extra check on each message in the field, or null. Some types are
+    // checked here until FHIRPath validation covers them as well.
+    Status (*check)(const Message& message, const FieldPath& path);
+  };
+
+  // True if messages of the type are primitives, which are validated by the
+  // primitive handler.
+  bool primitive = false;
+
+  // The fields that are checked, in the order they are defined.
+  std::vector<Field> fields;
+
+  // Oneofs that must have a field set. Optional choice-types should have the
+  // containing message unset, so if it is set, it must have a value as well.
+  std::vector<const OneofDescriptor*> required_oneofs;
 
-Status ValidateFhirConstraints(const Message& message,
-                               const std::string& base_name,
-                               const PrimitiveHandler* primitive_handler) {
-  if (IsPrimitive(message.GetDescriptor())) {
-    return primitive_handler->ValidatePrimitive(message).ok()
-               ? absl::OkStatus()
-               : FailedPreconditionError(
-                     absl::StrCat("invalid-primitive-", base_name));
+  // True if a message of the type can fail validation.
+  bool has_checks = false;
+};
+
+using ValidationPlans =
+    absl::flat_hash_map<const Descriptor*, std::unique_ptr<ValidationPlan>>;
+
+// Builds the plan for the type, and those of the types of its fields that do
+// not have plans yet, which are added to the new plans. Whether plans have
+// checks is only set for those with checks of their own.
+ValidationPlan* BuildPlan(const Descriptor* descriptor, ValidationPlans* plans,
+                          std::vector<ValidationPlan*>* new_plans) {
+  auto iter = plans->find(descriptor);
+  if (iter != plans->end()) {
+    return iter->second.get();
   }
+  // The plan is added before those of its fields, since types can be
+  // recursive.
+  ValidationPlan* plan =
+      plans->emplace(descriptor, absl::make_unique<ValidationPlan>())
+          .first->second.get();
+  new_plans->push_back(plan);
 
-  if (IsMessageType<::google::protobuf::Any>(message)) {
+  if (IsPrimitive(descriptor)) {
+    plan->primitive = true;
+    plan->has_checks = true;
+    return plan;
+  }
+  if (IsMessageType<::google::protobuf::Any>(descriptor)) {
     // We do not validate "Any" contained resources.
     // TODO: Potentially unpack the correct type and validate?
-    return absl::OkStatus();
+    return plan;
   }
 
-  const Descriptor* descriptor = message.GetDescriptor();
-  const Reflection* reflection = message.GetReflection();
-
   for (int i = 0; i < descriptor->field_count(); i++) {
     const FieldDescriptor* field = descriptor->field(i);
-    const std::string& field_name =
-        absl::StrCat(base_name, ".", field->json_name());
-    FHIR_RETURN_IF_ERROR(
-        CheckField(message, field, field_name, primitive_handler));
-  }
-  // Also verify that oneof fields are set.
-  // Note that optional choice-types should have the containing message unset -
-  // if the containing message is set, it should have a value set as well.
+    const Descriptor* field_type = field->message_type();
+
+    ValidationPlan::Field field_plan = {field, false, false, nullptr, nullptr};
+    field_plan.required =
+        field->options().GetExtension(validation_requirement) ==
+        ::google::fhir::proto::REQUIRED_BY_FHIR;
+    if (field_type != nullptr) {
+      field_plan.reference = IsReference(field_type);
+      if (!field_plan.reference) {
+        field_plan.nested = BuildPlan(field_type, plans, new_plans);
+      }
+      if (IsMessageType<::google::fhir::stu3::proto::Period>(field_type)) {
+        field_plan.check =
+            &ValidatePeriod<::google::fhir::stu3::proto::DateTime>;
+      }
+      if (IsMessageType<::google::fhir::r4::core::Period>(field_type)) {
+        field_plan.check = &ValidatePeriod<::google::fhir::r4::core::DateTime>;
+      }
+    }
+    plan->has_checks = plan->has_checks || field_plan.required ||
+                       field_plan.reference || field_plan.check != nullptr;
+    plan->fields.push_back(field_plan);
+  }
+
   for (int i = 0; i < descriptor->oneof_decl_count(); i++) {
-    const ::google::protobuf::OneofDescriptor* oneof = descriptor->oneof_decl(i);
-    if (!reflection->HasOneof(message, oneof) &&
-        !oneof->options().GetExtension(
+    const OneofDescriptor* oneof = descriptor->oneof_decl(i);
+    if (!oneof->options().GetExtension(
             ::google::fhir::proto::fhir_oneof_is_optional)) {
-      FHIR_RETURN_IF_ERROR(::absl::FailedPreconditionError(
-          absl::StrCat("empty-oneof-", oneof->full_name())));
+      plan->required_oneofs.push_back(oneof);
     }
   }
-  return absl::OkStatus();
+  plan->has_checks = plan->has_checks || !plan->required_oneofs.empty();
+  return plan;
 }
 
-// Check if a required field is missing.
-Status CheckField(const Message& message, const FieldDescriptor* field,
-                  const std::string& field_name,
-                  const PrimitiveHandler* primitive_handler) {
-  if (field->options().HasExtension(validation_requirement) &&
-      field->options().GetExtension(validation_requirement) ==
-          ::google::fhir::proto::REQUIRED_BY_FHIR) {
-    if (!FieldHasValue(message, field)) {
-      return FailedPreconditionError(absl::StrCat("missing-", field_name));
+// Returns the plan for validating messages of the given type. Plans are
+// shared by all threads and are never deleted.
+const ValidationPlan& PlanFor(const Descriptor* descriptor) {
+  static absl::Mutex mutex(absl::kConstInit);
+  static auto* plans = new ValidationPlans();
+  absl::MutexLock lock(&mutex);
+  auto iter = plans->find(descriptor);
+  if (iter != plans->end()) {
+    return *iter->second;
+  }
+
+  std::vector<ValidationPlan*> new_plans;
+  const ValidationPlan* plan = BuildPlan(descriptor, plans, &new_plans);
+
+  // Types have checks if any of the types they descend into do. Plans that
+  // already existed are complete, since all of the types they descend into
+  // were built with them.
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (ValidationPlan* new_plan : new_plans) {
+      if (!new_plan->has_checks &&
+          std::any_of(new_plan->fields.begin(), new_plan->fields.end(),
+                      [](const ValidationPlan::Field& field) {
+                        return field.nested != nullptr &&
+                               field.nested->has_checks;
+                      })) {
+        new_plan->has_checks = true;
+        changed = true;
+      }
     }
   }
 
-  if (IsReference(field->message_type())) {
-    auto status = primitive_handler->ValidateReferenceField(message, field);
-    return status.ok() ? status
-                       : FailedPreconditionError(absl::StrCat(
-                             status.message(), "-at-", field_name));
+  // Only fields that can fail validation are kept.
+  for (ValidationPlan* new_plan : new_plans) {
+    for (ValidationPlan::Field& field : new_plan->fields) {
+      if (field.nested != nullptr && !field.nested->has_checks) {
+        field.nested = nullptr;
+      }
+    }
+    new_plan->fields.erase(
+        std::remove_if(new_plan->fields.begin(), new_plan->fields.end(),
+                       [](const ValidationPlan::Field& field) {
+                         return !field.required && !field.reference &&
+                                field.nested == nullptr &&
+                                field.check == nullptr;
+                       }),
+        new_plan->fields.end());
   }
+  return *plan;
+}
 
-  if (field->cpp_type() == ::google::protobuf::FieldDescriptor::CPPTYPE_MESSAGE) {
-    for (int i = 0; i < PotentiallyRepeatedFieldSize(message, field); i++) {
-      const auto& submessage = GetPotentiallyRepeatedMessage(message, field, i);
-      FHIR_RETURN_IF_ERROR(
-          ValidateFhirConstraints(submessage, field_name, primitive_handler));
+// The FHIRPath side of validating a resource in the same walk as its FHIR
+// constraints.
+struct FhirPathWalk {
+  fhir_path::FhirPathValidator* validator;
+  // The type of the resource, where all trails begin.
+  const Descriptor* root;
+  // Metrics that FHIRPath evaluations are recorded in, or null.
+  fhir_path::ValidationMetrics* metrics;
+  // The trail to the message being validated, kept while it has FHIRPath
+  // constraints.
+  fhir_path::ValidationResult::Trail trail;
+  std::vector<fhir_path::ValidationResult> results;
+  // True once a FHIRPath constraint was not met. Only FHIR constraints are
+  // checked after that, since they take precedence.
+  bool stopped = false;
+};
 
-      // Run extra validation for some types, until FHIRPath validation covers
-      // these cases as well.
-      if (IsMessageType<::google::fhir::stu3::proto::Period>(
-              field->message_type())) {
-        FHIR_RETURN_IF_ERROR(
-            ValidatePeriod<::google::fhir::stu3::proto::DateTime>(submessage,
-                                                                  field_name));
-      }
-      if (IsMessageType<::google::fhir::r4::core::Period>(
-              field->message_type())) {
-        FHIR_RETURN_IF_ERROR(ValidatePeriod<::google::fhir::r4::core::DateTime>(
-            submessage, field_name));
+Status ValidateFhirConstraints(
+    const Message& message, const ValidationPlan* plan,
+    fhir_path::FhirPathValidator::TypeConstraints constraints,
+    const fhir_path::internal::WorkspaceMessage* workspace_message,
+    const FieldPath& path, const PrimitiveHandler* primitive_handler,
+    FhirPathWalk* fhir_path_walk);
+
+// Validates the values of the field of the message, which has a plan for its
+// FHIR constraints, FHIRPath constraints, or both.
+Status ValidateField(
+    const Message& message, const FieldDescriptor* field,
+    const ValidationPlan::Field* field_plan,
+    fhir_path::FhirPathValidator::TypeConstraints constraints,
+    const fhir_path::internal::WorkspaceMessage* workspace_message,
+    const FieldPath& path, const PrimitiveHandler* primitive_handler,
+    FhirPathWalk* fhir_path_walk) {
+  const int field_size = PotentiallyRepeatedFieldSize(message, field);
+  const FieldPath field_path = {&path, field->json_name()};
+
+  // Check if a required field is missing.
+  if (field_size == 0) {
+    if (field_plan != nullptr && field_plan->required) {
+      return FailedPreconditionError(
+          absl::StrCat("missing-", field_path.ToString()));
+    }
+    return absl::OkStatus();
+  }
+
+  const ValidationPlan* nested_plan = nullptr;
+  if (field_plan != nullptr) {
+    if (field_plan->reference) {
+      auto status = primitive_handler->ValidateReferenceField(message, field);
+      if (!status.ok()) {
+        return FailedPreconditionError(
+            absl::StrCat(status.message(), "-at-", field_path.ToString()));
       }
     }
+    nested_plan = field_plan->nested;
   }
 
+  for (int i = 0; i < field_size; i++) {
+    const auto& submessage = GetPotentiallyRepeatedMessage(message, field, i);
+    if (!constraints.empty() && !fhir_path_walk->stopped) {
+      fhir_path_walk->trail.push_back({field, field->is_repeated() ? i : -1});
+      const fhir_path::internal::WorkspaceMessage submessage_workspace(
+          *workspace_message, &submessage);
+      Status status = ValidateFhirConstraints(
+          submessage, nested_plan, constraints, &submessage_workspace,
+          field_path, primitive_handler, fhir_path_walk);
+      fhir_path_walk->trail.pop_back();
+      FHIR_RETURN_IF_ERROR(status);
+    } else if (nested_plan != nullptr) {
+      FHIR_RETURN_IF_ERROR(ValidateFhirConstraints(
+          submessage, nested_plan, {}, nullptr, field_path, primitive_handler,
+          fhir_path_walk));
+    }
+    if (field_plan != nullptr && field_plan->check != nullptr) {
+      FHIR_RETURN_IF_ERROR(field_plan->check(submessage, field_path));
+    }
+  }
+  return absl::OkStatus();
+}
+
+// Validates the message against the plan for its FHIR constraints, if any,
+// and its FHIRPath constraints, if any, in a single walk of the message. The
+// FHIRPath constraints of each message are evaluated before its fields are
+// validated, in the same order as FhirPathValidator::Validate evaluates them.
+Status ValidateFhirConstraints(
+    const Message& message, const ValidationPlan* plan,
+    fhir_path::FhirPathValidator::TypeConstraints constraints,
+    const fhir_path::internal::WorkspaceMessage* workspace_message,
+    const FieldPath& path, const PrimitiveHandler* primitive_handler,
+    FhirPathWalk* fhir_path_walk) {
+  if (plan != nullptr && plan->primitive &&
+      !primitive_handler->ValidatePrimitive(message).ok()) {
+    return FailedPreconditionError(
+        absl::StrCat("invalid-primitive-", path.ToString()));
+  }
+
+  if (!constraints.empty() && !fhir_path_walk->stopped) {
+    fhir_path_walk->stopped = !fhir_path_walk->validator->ValidateNode(
+        *workspace_message, constraints, fhir_path_walk->root,
+        &fhir_path_walk->trail, &fhir_path_walk->results,
+        fhir_path_walk->metrics);
+  }
+
+  // The fields with FHIR constraints and those with FHIRPath constraints are
+  // both in the order they are defined, and are merged to visit each field
+  // once.
+  const int plan_size = plan != nullptr ? plan->fields.size() : 0;
+  const int nested_count = constraints.nested_count();
+  int plan_index = 0;
+  int nested_index = 0;
+  while (plan_index < plan_size || nested_index < nested_count) {
+    const FieldDescriptor* planned_field =
+        plan_index < plan_size ? plan->fields[plan_index].field : nullptr;
+    const FieldDescriptor* constrained_field =
+        nested_index < nested_count ? constraints.nested_field(nested_index)
+                                    : nullptr;
+
+    const FieldDescriptor* field;
+    const ValidationPlan::Field* field_plan = nullptr;
+    fhir_path::FhirPathValidator::TypeConstraints field_constraints;
+    if (constrained_field == nullptr ||
+        (planned_field != nullptr &&
+         planned_field->index() <= constrained_field->index())) {
+      field = planned_field;
+      field_plan = &plan->fields[plan_index++];
+    } else {
+      field = constrained_field;
+    }
+    if (field == constrained_field) {
+      field_constraints = constraints.nested_constraints(nested_index++);
+    }
+
+    FHIR_RETURN_IF_ERROR(ValidateField(
+        message, field, field_plan, field_constraints, workspace_message, path,
+        primitive_handler, fhir_path_walk));
+  }
+
+  if (plan != nullptr) {
+    // Also verify that oneof fields are set.
+    const Reflection* reflection = message.GetReflection();
+    for (const OneofDescriptor* oneof : plan->required_oneofs) {
+      if (!reflection->HasOneof(message, oneof)) {
+        return FailedPreconditionError(
+            absl::StrCat("empty-oneof-", oneof->full_name()));
+      }
+    }
+  }
   return absl::OkStatus();
 }
 
@@ -174,15 +413,37 @@ Status CheckField(const Message& message, const FieldDescriptor* field,
 Status ValidateResourceWithFhirPath(
     const Message& resource, const PrimitiveHandler* primitive_handler,
     fhir_path::FhirPathValidator* message_validator) {
+  return ValidateResourceWithFhirPath(resource, primitive_handler,
+                                      message_validator, nullptr);
+}
+
+Status ValidateResourceWithFhirPath(
+    const Message& resource, const PrimitiveHandler* primitive_handler,
+    fhir_path::FhirPathValidator* message_validator,
+    fhir_path::ValidationMetrics* metrics) {
+  // FHIR constraints and FHIRPath constraints are validated in the same walk
+  // of the resource, but a violation of FHIR constraints anywhere in the
+  // resource takes precedence.
+  const Descriptor* descriptor = resource.GetDescriptor();
+  FhirPathWalk fhir_path_walk;
+  fhir_path_walk.validator = message_validator;
+  fhir_path_walk.root = descriptor;
+  fhir_path_walk.metrics = metrics;
+  const fhir_path::internal::WorkspaceMessage workspace_message(&resource);
   FHIR_RETURN_IF_ERROR(ValidateFhirConstraints(
-      resource, resource.GetDescriptor()->name(), primitive_handler));
-  return message_validator->Validate(resource).LegacyValidationResult();
+      resource, &PlanFor(descriptor),
+      message_validator->ConstraintsOf(descriptor), &workspace_message,
+      {nullptr, descriptor->name()}, primitive_handler, &fhir_path_walk));
+  return fhir_path::ValidationResults(std::move(fhir_path_walk.results))
+      .LegacyValidationResult();
 }
 
 Status ValidateResource(const Message& resource,
                         const PrimitiveHandler* primitive_handler) {
-  return ValidateFhirConstraints(resource, resource.GetDescriptor()->name(),
-                                 primitive_handler);
+  const Descriptor* descriptor = resource.GetDescriptor();
+  return ValidateFhirConstraints(resource, &PlanFor(descriptor), {}, nullptr,
+                                 {nullptr, descriptor->name()},
+                                 primitive_handler, nullptr);
 }
 
 }  // namespace fhir
@@ -39,6 +39,14 @@ namespace fhir {
     const PrimitiveHandler* primitive_handler,
     fhir_path::FhirPathValidator* message_validator);
 
+// Same as above, recording the evaluation of each FHIRPath constraint in the
+// metrics, which must only be used with the given validator.
+::absl::Status ValidateResourceWithFhirPath(
+    const ::google::protobuf::Message& resource,
+    const PrimitiveHandler* primitive_handler,
+    fhir_path::FhirPathValidator* message_validator,
+    fhir_path::ValidationMetrics* metrics);
+
 }  // namespace fhir
 }  // namespace google
 
@@ -33,6 +33,14 @@ Status ValidateResourceWithFhirPath(const ::google::protobuf::Message& resource)
       resource, Stu3PrimitiveHandler::GetInstance(), GetFhirPathValidator());
 }
 
+Status ValidateResourceWithFhirPath(
+    const ::google::protobuf::Message& resource,
+    ::google::fhir::fhir_path::ValidationMetrics* metrics) {
+  return ValidateResourceWithFhirPath(
+      resource, Stu3PrimitiveHandler::GetInstance(), GetFhirPathValidator(),
+      metrics);
+}
+
 }  // namespace stu3
 }  // namespace fhir
 }  // namespace google
@@ -19,6 +19,7 @@
 
 #include "google/protobuf/message.h"
 #include "absl/status/status.h"
+#include "google/fhir/fhir_path/fhir_path_validation.h"
 
 namespace google {
 namespace fhir {
@@ -28,6 +29,12 @@ namespace stu3 {
 
 ::absl::Status ValidateResourceWithFhirPath(const ::google::protobuf::Message& resource);
 
+// Same as above, recording the evaluation of each FHIRPath constraint in the
+// metrics, which must only be used with the shared STU3 validator.
+::absl::Status ValidateResourceWithFhirPath(
+    const ::google::protobuf::Message& resource,
+    ::google::fhir::fhir_path::ValidationMetrics* metrics);
+
 }  // namespace stu3
 }  // namespace fhir
 }  // namespace google
@@ -0,0 +1,555 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "google/fhir/terminology.h"
+
+#include <cstring>
+#include <deque>
+
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
+#include "google/fhir/status/status.h"
+
+namespace google {
+namespace fhir {
+
+namespace {
+
+using CodeSet = std::set<std::pair<std::string, std::string>>;
+
+// The buffer begins with a header of kHeaderFields 32 bit values: the magic
+// number, the format version and then the sizes of the sections, in the order
+// of the fields of TerminologyIndex::Layout. The sections follow in the same
+// order:
+//   value sets: the (offset, length) of the URL of each value set.
+//   value set table: open addressing hash table of the value sets, holding
+//     the position of each value set plus one, or zero for empty slots.
+//   codes: the (system offset, system length, code offset, code length) of
+//     each (system, code) pair.
+//   code table: open addressing hash table of the codes, like the value set
+//     table.
+//   bitsets: for each code, words_per_code 64 bit words in which bit i is set
+//     if value set i contains the code. Aligned to 8 bytes.
+//   strings: the bytes of all URLs, systems and codes.
+constexpr uint32_t kMagic = 0x58495446;  // "FTIX"
+constexpr uint32_t kVersion = 1;
+constexpr size_t kHeaderFields = 8;
+constexpr size_t kHeaderSize = kHeaderFields * sizeof(uint32_t);
+
+// Separates the system from the code in the hashed bytes of a code. Never
+// occurs in UTF-8.
+constexpr char kCodeSeparator = '\xff';
+
+// FNV-1a, which is stable across platforms and releases, unlike std::hash, so
+// that serialized tables remain valid.
+uint64_t Hash(absl::string_view bytes, uint64_t hash = 14695981039346656037u) {
+  for (char c : bytes) {
+    hash ^= static_cast<uint8_t>(c);
+    hash *= 1099511628211u;
+  }
+  return hash;
+}
+
+uint64_t HashCode(absl::string_view system, absl::string_view code) {
+  return Hash(code, Hash(absl::string_view(&kCodeSeparator, 1), Hash(system)));
+}
+
+// Returns the smallest power of two that is at least twice the number of
+// entries, so that tables are at most half full, or zero for no entries.
+uint32_t TableSlots(uint32_t entries) {
+  if (entries == 0) {
+    return 0;
+  }
+  uint32_t slots = 2;
+  while (slots < 2 * uint64_t{entries}) {
+    slots *= 2;
+  }
+  return slots;
+}
+
+bool IsPowerOfTwoOrZero(uint32_t value) { return (value & (value - 1)) == 0; }
+
+bool InCodeSet(const CodeSet& codes, const std::string& system,
+               const std::string& code) {
+  return codes.count({system, code}) > 0 || codes.count({system, ""}) > 0;
+}
+
+CodeSet Intersect(const CodeSet& a, const CodeSet& b) {
+  CodeSet intersection;
+  for (const auto& system_code : a) {
+    const std::string& system = system_code.first;
+    if (!system_code.second.empty()) {
+      if (InCodeSet(b, system, system_code.second)) {
+        intersection.insert(system_code);
+      }
+    } else if (b.count({system, ""}) > 0) {
+      intersection.insert(system_code);
+    } else {
+      for (auto it = b.lower_bound({system, ""});
+           it != b.end() && it->first == system; ++it) {
+        intersection.insert(*it);
+      }
+    }
+  }
+  return intersection;
+}
+
+void Append32(uint32_t value, std::string* buffer) {
+  buffer->append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+// Returns true if the status is the reason a value set cannot be expanded,
+// rather than a sign that its definition is invalid.
+bool IsUnexpandable(const Status& status) {
+  return status.code() == absl::StatusCode::kNotFound ||
+         status.code() == absl::StatusCode::kUnimplemented;
+}
+
+}  // namespace
+
+TerminologyIndex::Layout TerminologyIndex::ComputeLayout(
+    const uint32_t* header) {
+  Layout layout;
+  layout.value_set_count = header[2];
+  layout.value_set_slots = header[3];
+  layout.code_count = header[4];
+  layout.code_slots = header[5];
+  layout.words_per_code = header[6];
+  layout.strings_size = header[7];
+
+  layout.value_sets = kHeaderSize;
+  layout.value_set_table =
+      layout.value_sets + 2 * sizeof(uint32_t) * layout.value_set_count;
+  layout.codes =
+      layout.value_set_table + sizeof(uint32_t) * layout.value_set_slots;
+  layout.code_table = layout.codes + 4 * sizeof(uint32_t) * layout.code_count;
+  layout.bitsets = layout.code_table + sizeof(uint32_t) * layout.code_slots;
+  layout.bitsets = (layout.bitsets + 7) / 8 * 8;
+  layout.strings = layout.bitsets + sizeof(uint64_t) *
+                                        uint64_t{layout.code_count} *
+                                        layout.words_per_code;
+  layout.size = layout.strings + layout.strings_size;
+  return layout;
+}
+
+StatusOr<TerminologyIndex> TerminologyIndex::FromBytes(
+    absl::string_view bytes) {
+  uint32_t header[kHeaderFields];
+  if (bytes.size() < kHeaderSize) {
+    return absl::InvalidArgumentError("Terminology index is truncated.");
+  }
+  std::memcpy(header, bytes.data(), kHeaderSize);
+  if (header[0] != kMagic) {
+    return absl::InvalidArgumentError("Bytes are not a terminology index.");
+  }
+  if (header[1] != kVersion) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Unsupported terminology index version ", header[1]));
+  }
+
+  const Layout layout = ComputeLayout(header);
+  if (layout.size != bytes.size()) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Terminology index should have ", layout.size,
+                     " bytes but has ", bytes.size()));
+  }
+  if (!IsPowerOfTwoOrZero(layout.value_set_slots) ||
+      !IsPowerOfTwoOrZero(layout.code_slots) ||
+      layout.value_set_slots < layout.value_set_count ||
+      layout.code_slots < layout.code_count ||
+      uint64_t{layout.words_per_code} * 64 < layout.value_set_count) {
+    return absl::InvalidArgumentError("Terminology index is corrupt.");
+  }
+  return TerminologyIndex(bytes, layout, nullptr);
+}
+
+StatusOr<TerminologyIndex> TerminologyIndex::FromString(std::string bytes) {
+  auto owned = std::make_shared<const std::string>(std::move(bytes));
+  FHIR_ASSIGN_OR_RETURN(TerminologyIndex index, FromBytes(*owned));
+  index.owned_ = std::move(owned);
+  return index;
+}
+
+uint32_t TerminologyIndex::Read32(size_t offset) const {
+  uint32_t value;
+  std::memcpy(&value, bytes_.data() + offset, sizeof(value));
+  return value;
+}
+
+absl::string_view TerminologyIndex::String(uint32_t offset,
+                                           uint32_t length) const {
+  if (uint64_t{offset} + length > layout_.strings_size) {
+    return absl::string_view();
+  }
+  return bytes_.substr(layout_.strings + offset, length);
+}
+
+int64_t TerminologyIndex::FindValueSet(absl::string_view url) const {
+  const uint32_t mask = layout_.value_set_slots - 1;
+  uint32_t slot = Hash(url) & mask;
+  for (uint32_t probes = 0; probes < layout_.value_set_slots; ++probes) {
+    const uint32_t entry =
+        Read32(layout_.value_set_table + sizeof(uint32_t) * slot);
+    if (entry == 0 || entry > layout_.value_set_count) {
+      return -1;
+    }
+    const size_t value_set = layout_.value_sets +
+                             2 * sizeof(uint32_t) * (entry - 1);
+    if (String(Read32(value_set), Read32(value_set + 4)) == url) {
+      return entry - 1;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return -1;
+}
+
+int64_t TerminologyIndex::FindCode(absl::string_view system,
+                                   absl::string_view code) const {
+  const uint32_t mask = layout_.code_slots - 1;
+  uint32_t slot = HashCode(system, code) & mask;
+  for (uint32_t probes = 0; probes < layout_.code_slots; ++probes) {
+    const uint32_t entry = Read32(layout_.code_table + sizeof(uint32_t) * slot);
+    if (entry == 0 || entry > layout_.code_count) {
+      return -1;
+    }
+    const size_t entry_code =
+        layout_.codes + 4 * sizeof(uint32_t) * (entry - 1);
+    if (String(Read32(entry_code + 8), Read32(entry_code + 12)) == code &&
+        String(Read32(entry_code), Read32(entry_code + 4)) == system) {
+      return entry - 1;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return -1;
+}
+
+bool TerminologyIndex::Test(int64_t code, int64_t value_set) const {
+  uint64_t word;
+  std::memcpy(&word,
+              bytes_.data() + layout_.bitsets +
+                  sizeof(uint64_t) * (code * layout_.words_per_code +
+                                      value_set / 64),
+              sizeof(word));
+  return (word >> (value_set % 64)) & 1;
+}
+
+bool TerminologyIndex::HasValueSet(absl::string_view value_set_url) const {
+  return FindValueSet(value_set_url) >= 0;
+}
+
+bool TerminologyIndex::Contains(absl::string_view value_set_url,
+                                absl::string_view system,
+                                absl::string_view code) const {
+  const int64_t value_set = FindValueSet(value_set_url);
+  if (value_set < 0) {
+    return false;
+  }
+  const int64_t system_code = FindCode(system, code);
+  if (system_code >= 0 && Test(system_code, value_set)) {
+    return true;
+  }
+  // Value sets that include all codes of a system that has no concepts in
+  // the index hold the system with an empty code.
+  if (system.empty() || code.empty()) {
+    return false;
+  }
+  const int64_t whole_system = FindCode(system, "");
+  return whole_system >= 0 && Test(whole_system, value_set);
+}
+
+void TerminologyIndex::Builder::AddConcept(absl::string_view system,
+                                           absl::string_view code,
+                                           absl::string_view parent) {
+  CodeSystem& code_system = code_systems_[std::string(system)];
+  code_system.codes.insert(std::string(code));
+  if (!parent.empty()) {
+    code_system.codes.insert(std::string(parent));
+    code_system.children[std::string(parent)].push_back(std::string(code));
+  }
+}
+
+void TerminologyIndex::Builder::AddValueSet(ValueSetDefinition definition) {
+  std::string url = definition.url;
+  value_sets_[url] = std::move(definition);
+}
+
+StatusOr<CodeSet> TerminologyIndex::Builder::ExpandFilter(
+    const std::string& system, const ValueSetDefinition::Filter& filter)
+    const {
+  if (filter.property != "concept") {
+    return absl::UnimplementedError(
+        absl::StrCat("Filters on property ", filter.property, " of ", system,
+                     " are not supported."));
+  }
+  auto code_system = code_systems_.find(system);
+  if (code_system == code_systems_.end()) {
+    return absl::NotFoundError(absl::StrCat(
+        "Filters on ", system, " require the concepts of the code system."));
+  }
+
+  CodeSet codes;
+  if (filter.op == "in") {
+    for (absl::string_view code : absl::StrSplit(filter.value, ',')) {
+      codes.insert({system, std::string(code)});
+    }
+    return codes;
+  }
+  if (filter.op != "is-a" && filter.op != "descendent-of" &&
+      filter.op != "is-not-a") {
+    return absl::UnimplementedError(absl::StrCat(
+        "The filter operator ", filter.op, " is not supported."));
+  }
+
+  // The concept and its descendants, found breadth first.
+  std::set<std::string> subsumed = {filter.value};
+  std::deque<std::string> pending = {filter.value};
+  while (!pending.empty()) {
+    auto children = code_system->second.children.find(pending.front());
+    pending.pop_front();
+    if (children == code_system->second.children.end()) {
+      continue;
+    }
+    for (const std::string& child : children->second) {
+      if (subsumed.insert(child).second) {
+        pending.push_back(child);
+      }
+    }
+  }
+
+  if (filter.op == "is-not-a") {
+    for (const std::string& code : code_system->second.codes) {
+      if (subsumed.count(code) == 0) {
+        codes.insert({system, code});
+      }
+    }
+    return codes;
+  }
+  if (filter.op == "descendent-of") {
+    subsumed.erase(filter.value);
+  }
+  for (const std::string& code : subsumed) {
+    codes.insert({system, code});
+  }
+  return codes;
+}
+
+StatusOr<CodeSet> TerminologyIndex::Builder::ExpandRule(
+    const ValueSetDefinition::Rule& rule, Expansions* expansions) const {
+  CodeSet codes;
+  bool selected = false;
+  if (!rule.system.empty()) {
+    selected = true;
+    if (!rule.codes.empty() && !rule.filters.empty()) {
+      return absl::InvalidArgumentError(
+          absl::StrCat("A rule for ", rule.system,
+                       " cannot have both codes and filters."));
+    }
+    for (const std::string& code : rule.codes) {
+      codes.insert({rule.system, code});
+    }
+    for (int i = 0; i < rule.filters.size(); ++i) {
+      FHIR_ASSIGN_OR_RETURN(CodeSet filtered,
+                            ExpandFilter(rule.system, rule.filters[i]));
+      codes = i == 0 ? std::move(filtered) : Intersect(codes, filtered);
+    }
+    if (rule.codes.empty() && rule.filters.empty()) {
+      auto code_system = code_systems_.find(rule.system);
+      if (code_system == code_systems_.end()) {
+        codes.insert({rule.system, ""});
+      } else {
+        for (const std::string& code : code_system->second.codes) {
+          codes.insert({rule.system, code});
+        }
+      }
+    }
+  }
+
+  for (const std::string& url : rule.value_sets) {
+    FHIR_RETURN_IF_ERROR(Expand(url, expansions));
+    const CodeSet& value_set = expansions->codes.at(url);
+    codes = selected ? Intersect(codes, value_set) : value_set;
+    selected = true;
+  }
+  return codes;
+}
+
+Status TerminologyIndex::Builder::Expand(const std::string& url,
+                                         Expansions* expansions) const {
+  if (expansions->codes.count(url) > 0) {
+    return absl::OkStatus();
+  }
+  auto unexpanded = expansions->unexpanded.find(url);
+  if (unexpanded != expansions->unexpanded.end()) {
+    return unexpanded->second;
+  }
+  auto definition = value_sets_.find(url);
+  if (definition == value_sets_.end()) {
+    return absl::NotFoundError(absl::StrCat("Unknown value set ", url));
+  }
+  if (!expansions->in_progress.insert(url).second) {
+    return absl::InvalidArgumentError(
+        absl::StrCat("Value set ", url, " includes itself."));
+  }
+
+  CodeSet codes;
+  Status status = ExpandDefinition(definition->second, expansions, &codes);
+  expansions->in_progress.erase(url);
+  if (status.ok()) {
+    expansions->codes[url] = std::move(codes);
+  } else if (IsUnexpandable(status)) {
+    expansions->unexpanded[url] = status;
+  }
+  return status;
+}
+
+Status TerminologyIndex::Builder::ExpandDefinition(
+    const ValueSetDefinition& definition, Expansions* expansions,
+    CodeSet* codes) const {
+  if (definition.includes.empty()) {
+    codes->insert(definition.expansion.begin(), definition.expansion.end());
+  }
+  for (const ValueSetDefinition::Rule& include : definition.includes) {
+    FHIR_ASSIGN_OR_RETURN(CodeSet included, ExpandRule(include, expansions));
+    codes->insert(included.begin(), included.end());
+  }
+  for (const ValueSetDefinition::Rule& exclude : definition.excludes) {
+    FHIR_ASSIGN_OR_RETURN(CodeSet excluded, ExpandRule(exclude, expansions));
+    for (const auto& system_code : excluded) {
+      const std::string& system = system_code.first;
+      if (system_code.second.empty()) {
+        auto it = codes->lower_bound({system, ""});
+        while (it != codes->end() && it->first == system) {
+          it = codes->erase(it);
+        }
+      } else if (codes->count({system, ""}) > 0) {
+        return absl::UnimplementedError(absl::StrCat(
+            "Value set ", definition.url, " excludes codes of ", system,
+            ", which has no concepts to exclude them from."));
+      } else {
+        codes->erase(system_code);
+      }
+    }
+  }
+  return absl::OkStatus();
+}
+
+StatusOr<TerminologyIndex> TerminologyIndex::Builder::Build(
+    std::map<std::string, Status>* unexpanded) const {
+  Expansions all;
+  for (const auto& value_set : value_sets_) {
+    Status status = Expand(value_set.first, &all);
+    if (!status.ok() && !IsUnexpandable(status)) {
+      return status;
+    }
+  }
+  if (unexpanded != nullptr) {
+    *unexpanded = all.unexpanded;
+  }
+  const std::map<std::string, CodeSet>& expansions = all.codes;
+
+  // Value sets are numbered in URL order. Each code is also indexed without
+  // its system, for checking codes that have none.
+  const uint32_t words_per_code = (expansions.size() + 63) / 64;
+  std::map<std::pair<std::string, std::string>, std::vector<uint64_t>>
+      bitsets;
+  uint32_t value_set = 0;
+  for (const auto& expansion : expansions) {
+    for (const auto& system_code : expansion.second) {
+      std::vector<std::pair<std::string, std::string>> keys = {system_code};
+      if (!system_code.first.empty() && !system_code.second.empty()) {
+        keys.push_back({"", system_code.second});
+      }
+      for (const auto& key : keys) {
+        std::vector<uint64_t>& bitset = bitsets[key];
+        bitset.resize(words_per_code);
+        bitset[value_set / 64] |= uint64_t{1} << (value_set % 64);
+      }
+    }
+    ++value_set;
+  }
+
+  // Strings are stored once however often they are referenced.
+  std::string strings;
+  std::map<std::string, uint32_t> string_offsets;
+  auto append_string = [&](const std::string& value, std::string* buffer) {
+    auto inserted = string_offsets.insert({value, strings.size()});
+    if (inserted.second) {
+      strings.append(value);
+    }
+    Append32(inserted.first->second, buffer);
+    Append32(value.size(), buffer);
+  };
+
+  uint32_t header[kHeaderFields] = {
+      kMagic,
+      kVersion,
+      static_cast<uint32_t>(expansions.size()),
+      TableSlots(expansions.size()),
+      static_cast<uint32_t>(bitsets.size()),
+      TableSlots(bitsets.size()),
+      words_per_code,
+      0,
+  };
+
+  std::string value_sets;
+  std::vector<uint32_t> value_set_table(header[3]);
+  value_set = 0;
+  for (const auto& expansion : expansions) {
+    append_string(expansion.first, &value_sets);
+    uint32_t slot = Hash(expansion.first) & (header[3] - 1);
+    while (value_set_table[slot] != 0) {
+      slot = (slot + 1) & (header[3] - 1);
+    }
+    value_set_table[slot] = ++value_set;
+  }
+
+  std::string codes;
+  std::string bitset_words;
+  std::vector<uint32_t> code_table(header[5]);
+  uint32_t code = 0;
+  for (const auto& bitset : bitsets) {
+    append_string(bitset.first.first, &codes);
+    append_string(bitset.first.second, &codes);
+    bitset_words.append(reinterpret_cast<const char*>(bitset.second.data()),
+                        sizeof(uint64_t) * bitset.second.size());
+    uint32_t slot =
+        HashCode(bitset.first.first, bitset.first.second) & (header[5] - 1);
+    while (code_table[slot] != 0) {
+      slot = (slot + 1) & (header[5] - 1);
+    }
+    code_table[slot] = ++code;
+  }
+  header[7] = strings.size();
+
+  const Layout layout = ComputeLayout(header);
+  std::string buffer;
+  buffer.reserve(layout.size);
+  buffer.append(reinterpret_cast<const char*>(header), kHeaderSize);
+  buffer.append(value_sets);
+  for (uint32_t entry : value_set_table) {
+    Append32(entry, &buffer);
+  }
+  buffer.append(codes);
+  for (uint32_t entry : code_table) {
+    Append32(entry, &buffer);
+  }
+  buffer.resize(layout.bitsets, '\0');
+  buffer.append(bitset_words);
+  buffer.append(strings);
+  return FromString(std::move(buffer));
+}
+
+}  // namespace fhir
+}  // namespace google
@@ -0,0 +1,230 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GOOGLE_FHIR_TERMINOLOGY_H_
+#define GOOGLE_FHIR_TERMINOLOGY_H_
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/strings/string_view.h"
+#include "google/fhir/status/status.h"
+#include "google/fhir/status/statusor.h"
+
+namespace google {
+namespace fhir {
+
+// The definition of a ValueSet, independent of the FHIR version it was read
+// from. See r4/terminology.h for loading definitions from ValueSet resources.
+struct ValueSetDefinition {
+  // A ValueSet.compose.include.filter. The supported filters are those on
+  // the "concept" property with the "is-a", "descendent-of", "is-not-a" and
+  // "in" operators, which are evaluated against the concepts of the code
+  // system added to the TerminologyIndex::Builder.
+  struct Filter {
+    std::string property;
+    std::string op;
+    std::string value;
+  };
+
+  // A ValueSet.compose.include or exclude. The rule selects the given codes
+  // of the system, or the codes of the system that pass all of the filters,
+  // or all codes of the system if neither are given. If value sets are
+  // given, the selection is restricted to the codes in all of them.
+  struct Rule {
+    std::string system;
+    std::vector<std::string> codes;
+    std::vector<Filter> filters;
+    std::vector<std::string> value_sets;
+  };
+
+  std::string url;
+  std::vector<Rule> includes;
+  std::vector<Rule> excludes;
+
+  // The (system, code) pairs of ValueSet.expansion.contains, which define the
+  // value set if it has no includes.
+  std::vector<std::pair<std::string, std::string>> expansion;
+};
+
+// An immutable index of the value sets that codes belong to, for checking
+// bindings without a terminology server.
+//
+// The index is a single flat buffer that holds hash tables of the value set
+// URLs and of the (system, code) pairs, and for each pair a bitset of the
+// value sets that contain it. Membership checks are two hash table lookups
+// and a bit test, and an index never changes once built, so it can be used
+// from any number of threads.
+//
+// The buffer can be written to a file with Serialize() and read back with
+// FromBytes() without parsing or copying, e.g. from a memory-mapped file. It
+// uses the byte order of the machine that built it.
+//
+// Example:
+//   TerminologyIndex::Builder builder;
+//   builder.AddConcept("http://example.com/cs", "parent");
+//   builder.AddConcept("http://example.com/cs", "child", "parent");
+//   ValueSetDefinition value_set;
+//   value_set.url = "http://example.com/vs";
+//   value_set.includes.push_back({"http://example.com/cs", {"parent"}});
+//   builder.AddValueSet(std::move(value_set));
+//   FHIR_ASSIGN_OR_RETURN(TerminologyIndex index, builder.Build());
+//   index.Contains("http://example.com/vs", "http://example.com/cs", "child");
+class TerminologyIndex {
+ public:
+  class Builder;
+
+  // Returns an index of no value sets.
+  TerminologyIndex() = default;
+
+  // Returns the index held by the bytes produced by Serialize(). The bytes are
+  // not copied, and must outlive the index and all copies of it. Returns an
+  // InvalidArgument error if the bytes do not hold an index.
+  static StatusOr<TerminologyIndex> FromBytes(absl::string_view bytes);
+
+  // Returns the index held by the bytes produced by Serialize(), which the
+  // index takes ownership of.
+  static StatusOr<TerminologyIndex> FromString(std::string bytes);
+
+  // Returns the bytes of the index, which are valid for the lifetime of the
+  // index.
+  absl::string_view Serialize() const { return bytes_; }
+
+  // Returns true if the value set with the given URL contains the code of
+  // the given system. If the system is empty, returns true if the value set
+  // contains the code in any system. Returns false for value sets that are
+  // not in the index.
+  bool Contains(absl::string_view value_set_url, absl::string_view system,
+                absl::string_view code) const;
+
+  bool HasValueSet(absl::string_view value_set_url) const;
+
+  uint32_t value_set_count() const { return layout_.value_set_count; }
+
+ private:
+  // The sizes of the sections of the buffer, from its header, and their
+  // offsets in the buffer.
+  struct Layout {
+    uint32_t value_set_count = 0;
+    uint32_t value_set_slots = 0;
+    uint32_t code_count = 0;
+    uint32_t code_slots = 0;
+    uint32_t words_per_code = 0;
+    uint32_t strings_size = 0;
+
+    size_t value_sets = 0;
+    size_t value_set_table = 0;
+    size_t codes = 0;
+    size_t code_table = 0;
+    size_t bitsets = 0;
+    size_t strings = 0;
+    size_t size = 0;
+  };
+
+  TerminologyIndex(absl::string_view bytes, const Layout& layout,
+                   std::shared_ptr<const std::string> owned)
+      : bytes_(bytes), layout_(layout), owned_(std::move(owned)) {}
+
+  // Returns the layout of a buffer with the given header values.
+  static Layout ComputeLayout(const uint32_t* header);
+
+  // Returns the position of the value set in the index, or -1 if it is not
+  // in the index.
+  int64_t FindValueSet(absl::string_view url) const;
+
+  // Returns the position of the (system, code) pair in the index, or -1 if it
+  // is not in the index.
+  int64_t FindCode(absl::string_view system, absl::string_view code) const;
+
+  // Returns true if the bit of the value set is set for the code.
+  bool Test(int64_t code, int64_t value_set) const;
+
+  uint32_t Read32(size_t offset) const;
+
+  // Returns the string at the given offset in the string section.
+  absl::string_view String(uint32_t offset, uint32_t length) const;
+
+  absl::string_view bytes_;
+  Layout layout_;
+  // Set if the index owns its bytes. Shared so that copies are cheap.
+  std::shared_ptr<const std::string> owned_;
+};
+
+// Collects code system concepts and value set definitions, and expands the
+// value sets into a TerminologyIndex.
+class TerminologyIndex::Builder {
+ public:
+  // Adds a concept of the code system. The parent is the code of the concept
+  // it is a specialization of, if any.
+  void AddConcept(absl::string_view system, absl::string_view code,
+                  absl::string_view parent = "");
+
+  // Adds a value set. A later definition with the same URL replaces earlier
+  // ones.
+  void AddValueSet(ValueSetDefinition definition);
+
+  // Expands all value sets and builds their index. Value sets that cannot be
+  // expanded are left out of the index, as if they had not been added: those
+  // that include a value set that has not been added, filter a code system
+  // whose concepts have not been added (e.g. SNOMED CT) or use an unsupported
+  // filter, and those that include such value sets. If unexpanded is not
+  // null, it receives the reason each value set was left out, by URL.
+  // Returns an error if a value set includes itself or is otherwise invalid.
+  StatusOr<TerminologyIndex> Build(
+      std::map<std::string, Status>* unexpanded = nullptr) const;
+
+ private:
+  // The codes of a value set as (system, code) pairs. A pair with an empty
+  // code stands for all codes of the system, and is only used for systems
+  // with no concepts added to the builder.
+  using CodeSet = std::set<std::pair<std::string, std::string>>;
+
+  struct CodeSystem {
+    std::set<std::string> codes;
+    std::map<std::string, std::vector<std::string>> children;
+  };
+
+  // The value sets expanded so far, and those that could not be.
+  struct Expansions {
+    std::map<std::string, CodeSet> codes;
+    std::map<std::string, Status> unexpanded;
+    // The value sets being expanded, to detect cycles.
+    std::set<std::string> in_progress;
+  };
+
+  Status Expand(const std::string& url, Expansions* expansions) const;
+
+  Status ExpandDefinition(const ValueSetDefinition& definition,
+                          Expansions* expansions, CodeSet* codes) const;
+
+  StatusOr<CodeSet> ExpandRule(const ValueSetDefinition::Rule& rule,
+                               Expansions* expansions) const;
+
+  StatusOr<CodeSet> ExpandFilter(const std::string& system,
+                                 const ValueSetDefinition::Filter& filter)
+      const;
+
+  std::map<std::string, CodeSystem> code_systems_;
+  std::map<std::string, ValueSetDefinition> value_sets_;
+};
+
+}  // namespace fhir
+}  // namespace google
+
+#endif  // GOOGLE_FHIR_TERMINOLOGY_H_
@@ -0,0 +1,293 @@
+// Copyright 2020 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "google/fhir/terminology.h"
+
+#include <map>
+#include <string>
+
+#include "gtest/gtest.h"
+#include "absl/status/status.h"
+#include "absl/strings/str_cat.h"
+#include "google/fhir/status/statusor.h"
+
+namespace google {
+namespace fhir {
+
+namespace {
+
+constexpr char kShapes[] = "http://example.com/shapes";
+constexpr char kColors[] = "http://example.com/colors";
+
+// Adds the shapes code system, in which squares are rectangles and
+// rectangles and triangles are polygons.
+void AddShapes(TerminologyIndex::Builder* builder) {
+  builder->AddConcept(kShapes, "polygon");
+  builder->AddConcept(kShapes, "rectangle", "polygon");
+  builder->AddConcept(kShapes, "square", "rectangle");
+  builder->AddConcept(kShapes, "triangle", "polygon");
+  builder->AddConcept(kShapes, "circle");
+}
+
+ValueSetDefinition ValueSet(const std::string& url,
+                            std::vector<ValueSetDefinition::Rule> includes,
+                            std::vector<ValueSetDefinition::Rule> excludes =
+                                {}) {
+  ValueSetDefinition value_set;
+  value_set.url = url;
+  value_set.includes = std::move(includes);
+  value_set.excludes = std::move(excludes);
+  return value_set;
+}
+
+ValueSetDefinition::Rule Filter(const std::string& op,
+                                const std::string& value) {
+  ValueSetDefinition::Rule rule;
+  rule.system = kShapes;
+  rule.filters.push_back({"concept", op, value});
+  return rule;
+}
+
+TerminologyIndex Build(const TerminologyIndex::Builder& builder) {
+  StatusOr<TerminologyIndex> index = builder.Build();
+  EXPECT_TRUE(index.ok()) << index.status();
+  return index.ok() ? index.ValueOrDie() : TerminologyIndex();
+}
+
+TEST(TerminologyIndexTest, EnumeratedCodes) {
+  TerminologyIndex::Builder builder;
+  builder.AddValueSet(ValueSet("vs", {{kColors, {"red", "green"}}}));
+  TerminologyIndex index = Build(builder);
+
+  EXPECT_EQ(index.value_set_count(), 1);
+  EXPECT_TRUE(index.HasValueSet("vs"));
+  EXPECT_FALSE(index.HasValueSet("other"));
+  EXPECT_TRUE(index.Contains("vs", kColors, "red"));
+  EXPECT_TRUE(index.Contains("vs", kColors, "green"));
+  EXPECT_FALSE(index.Contains("vs", kColors, "blue"));
+  EXPECT_FALSE(index.Contains("vs", kShapes, "red"));
+  EXPECT_FALSE(index.Contains("other", kColors, "red"));
+
+  // Codes without a system are members if they are in any system.
+  EXPECT_TRUE(index.Contains("vs", "", "red"));
+  EXPECT_FALSE(index.Contains("vs", "", "blue"));
+}
+
+TEST(TerminologyIndexTest, HierarchyFilters) {
+  TerminologyIndex::Builder builder;
+  AddShapes(&builder);
+  builder.AddValueSet(ValueSet("is-a", {Filter("is-a", "rectangle")}));
+  builder.AddValueSet(
+      ValueSet("descendent-of", {Filter("descendent-of", "polygon")}));
+  builder.AddValueSet(ValueSet("is-not-a", {Filter("is-not-a", "rectangle")}));
+  builder.AddValueSet(ValueSet("in", {Filter("in", "square,circle")}));
+  TerminologyIndex index = Build(builder);
+
+  EXPECT_TRUE(index.Contains("is-a", kShapes, "rectangle"));
+  EXPECT_TRUE(index.Contains("is-a", kShapes, "square"));
+  EXPECT_FALSE(index.Contains("is-a", kShapes, "polygon"));
+
+  EXPECT_FALSE(index.Contains("descendent-of", kShapes, "polygon"));
+  EXPECT_TRUE(index.Contains("descendent-of", kShapes, "rectangle"));
+  EXPECT_TRUE(index.Contains("descendent-of", kShapes, "square"));
+  EXPECT_TRUE(index.Contains("descendent-of", kShapes, "triangle"));
+  EXPECT_FALSE(index.Contains("descendent-of", kShapes, "circle"));
+
+  EXPECT_TRUE(index.Contains("is-not-a", kShapes, "polygon"));
+  EXPECT_TRUE(index.Contains("is-not-a", kShapes, "circle"));
+  EXPECT_FALSE(index.Contains("is-not-a", kShapes, "square"));
+
+  EXPECT_TRUE(index.Contains("in", kShapes, "square"));
+  EXPECT_TRUE(index.Contains("in", kShapes, "circle"));
+  EXPECT_FALSE(index.Contains("in", kShapes, "triangle"));
+}
+
+TEST(TerminologyIndexTest, WholeSystems) {
+  TerminologyIndex::Builder builder;
+  AddShapes(&builder);
+  ValueSetDefinition::Rule shapes;
+  shapes.system = kShapes;
+  ValueSetDefinition::Rule colors;
+  colors.system = kColors;
+  builder.AddValueSet(ValueSet("vs", {shapes, colors},
+                               {{kShapes, {"circle"}}}));
+  TerminologyIndex index = Build(builder);
+
+  // Systems with concepts include exactly those concepts.
+  EXPECT_TRUE(index.Contains("vs", kShapes, "square"));
+  EXPECT_FALSE(index.Contains("vs", kShapes, "hexagon"));
+  EXPECT_FALSE(index.Contains("vs", kShapes, "circle"));
+  EXPECT_TRUE(index.Contains("vs", "", "square"));
+
+  // Systems without concepts include any code.
+  EXPECT_TRUE(index.Contains("vs", kColors, "red"));
+  EXPECT_TRUE(index.Contains("vs", kColors, "mauve"));
+}
+
+TEST(TerminologyIndexTest, ValueSetImports) {
+  TerminologyIndex::Builder builder;
+  AddShapes(&builder);
+  builder.AddValueSet(ValueSet("polygons", {Filter("is-a", "polygon")}));
+  builder.AddValueSet(
+      ValueSet("small", {{kShapes, {"square", "circle", "triangle"}}}));
+
+  ValueSetDefinition::Rule small_polygons;
+  small_polygons.value_sets = {"polygons", "small"};
+  ValueSetDefinition::Rule squares;
+  squares.system = kShapes;
+  squares.value_sets = {"polygons"};
+  squares.filters.push_back({"concept", "is-a", "rectangle"});
+  builder.AddValueSet(ValueSet("small polygons", {small_polygons}));
+  builder.AddValueSet(ValueSet("rectangles", {squares},
+                               {{kShapes, {"rectangle"}}}));
+  TerminologyIndex index = Build(builder);
+
+  EXPECT_TRUE(index.Contains("small polygons", kShapes, "square"));
+  EXPECT_TRUE(index.Contains("small polygons", kShapes, "triangle"));
+  EXPECT_FALSE(index.Contains("small polygons", kShapes, "circle"));
+  EXPECT_FALSE(index.Contains("small polygons", kShapes, "polygon"));
+
+  EXPECT_TRUE(index.Contains("rectangles", kShapes, "square"));
+  EXPECT_FALSE(index.Contains("rectangles", kShapes, "rectangle"));
+  EXPECT_FALSE(index.Contains("rectangles", kShapes, "triangle"));
+}
+
+TEST(TerminologyIndexTest, Expansions) {
+  TerminologyIndex::Builder builder;
+  ValueSetDefinition value_set;
+  value_set.url = "expanded";
+  value_set.expansion = {{kColors, "red"}, {kShapes, "square"}};
+  builder.AddValueSet(value_set);
+  TerminologyIndex index = Build(builder);
+
+  EXPECT_TRUE(index.Contains("expanded", kColors, "red"));
+  EXPECT_TRUE(index.Contains("expanded", kShapes, "square"));
+  EXPECT_FALSE(index.Contains("expanded", kColors, "square"));
+}
+
+TEST(TerminologyIndexTest, ManyValueSets) {
+  TerminologyIndex::Builder builder;
+  for (int i = 0; i < 200; ++i) {
+    builder.AddValueSet(ValueSet(absl::StrCat("vs", i),
+                                 {{kColors, {absl::StrCat(i), "all"}}}));
+  }
+  TerminologyIndex index = Build(builder);
+
+  EXPECT_EQ(index.value_set_count(), 200);
+  for (int i = 0; i < 200; ++i) {
+    const std::string url = absl::StrCat("vs", i);
+    EXPECT_TRUE(index.Contains(url, kColors, "all"));
+    EXPECT_TRUE(index.Contains(url, kColors, absl::StrCat(i)));
+    EXPECT_FALSE(index.Contains(url, kColors, absl::StrCat(i + 1)));
+  }
+}
+
+TEST(TerminologyIndexTest, Serialization) {
+  TerminologyIndex::Builder builder;
+  AddShapes(&builder);
+  builder.AddValueSet(ValueSet("polygons", {Filter("is-a", "polygon")}));
+  builder.AddValueSet(ValueSet("colors", {{kColors, {"red"}}}));
+  const TerminologyIndex built = Build(builder);
+
+  const std::string bytes(built.Serialize());
+  StatusOr<TerminologyIndex> read = TerminologyIndex::FromBytes(bytes);
+  ASSERT_TRUE(read.ok()) << read.status();
+  const TerminologyIndex& index = read.ValueOrDie();
+  EXPECT_EQ(index.value_set_count(), 2);
+  EXPECT_TRUE(index.Contains("polygons", kShapes, "square"));
+  EXPECT_FALSE(index.Contains("polygons", kShapes, "circle"));
+  EXPECT_TRUE(index.Contains("colors", kColors, "red"));
+  EXPECT_EQ(index.Serialize(), built.Serialize());
+
+  EXPECT_EQ(TerminologyIndex::FromBytes("").status().code(),
+            absl::StatusCode::kInvalidArgument);
+  EXPECT_EQ(TerminologyIndex::FromBytes(bytes.substr(0, bytes.size() - 1))
+                .status()
+                .code(),
+            absl::StatusCode::kInvalidArgument);
+  std::string corrupt = bytes;
+  corrupt[0] ^= 1;
+  EXPECT_EQ(TerminologyIndex::FromBytes(corrupt).status().code(),
+            absl::StatusCode::kInvalidArgument);
+
+  const TerminologyIndex empty;
+  EXPECT_FALSE(empty.Contains("colors", kColors, "red"));
+}
+
+TEST(TerminologyIndexTest, UnexpandableValueSets) {
+  TerminologyIndex::Builder builder;
+  AddShapes(&builder);
+  ValueSetDefinition::Rule import_missing;
+  import_missing.value_sets = {"missing"};
+  ValueSetDefinition::Rule colors;
+  colors.system = kColors;
+  colors.filters.push_back({"concept", "is-a", "red"});
+  ValueSetDefinition::Rule import_regex;
+  import_regex.value_sets = {"regex"};
+  builder.AddValueSet(ValueSet("imports-missing", {import_missing}));
+  builder.AddValueSet(ValueSet("regex", {Filter("regex", "s.*")}));
+  builder.AddValueSet(ValueSet("colors", {colors}));
+  builder.AddValueSet(ValueSet("imports-regex", {import_regex}));
+  builder.AddValueSet(ValueSet("excludes-colors", {{kColors, {}}},
+                               {{kColors, {"red"}}}));
+  builder.AddValueSet(ValueSet("polygons", {Filter("is-a", "polygon")}));
+
+  // Value sets that cannot be expanded, and those that include them, are
+  // left out of the index rather than failing the build.
+  std::map<std::string, Status> unexpanded;
+  StatusOr<TerminologyIndex> index = builder.Build(&unexpanded);
+  ASSERT_TRUE(index.ok()) << index.status();
+  EXPECT_EQ(index.ValueOrDie().value_set_count(), 1);
+  EXPECT_TRUE(index.ValueOrDie().Contains("polygons", kShapes, "square"));
+  EXPECT_FALSE(index.ValueOrDie().HasValueSet("regex"));
+  EXPECT_FALSE(index.ValueOrDie().Contains("colors", kColors, "red"));
+
+  ASSERT_EQ(unexpanded.size(), 5);
+  EXPECT_EQ(unexpanded["imports-missing"].code(),
+            absl::StatusCode::kNotFound);
+  EXPECT_EQ(unexpanded["regex"].code(), absl::StatusCode::kUnimplemented);
+  EXPECT_EQ(unexpanded["colors"].code(), absl::StatusCode::kNotFound);
+  EXPECT_EQ(unexpanded["imports-regex"].code(),
+            absl::StatusCode::kUnimplemented);
+  EXPECT_EQ(unexpanded["excludes-colors"].code(),
+            absl::StatusCode::kUnimplemented);
+}
+
+TEST(TerminologyIndexTest, InvalidDefinitions) {
+  {
+    TerminologyIndex::Builder builder;
+    ValueSetDefinition::Rule a;
+    a.value_sets = {"a"};
+    ValueSetDefinition::Rule b;
+    b.value_sets = {"b"};
+    builder.AddValueSet(ValueSet("a", {b}));
+    builder.AddValueSet(ValueSet("b", {a}));
+    EXPECT_EQ(builder.Build().status().code(),
+              absl::StatusCode::kInvalidArgument);
+  }
+  {
+    TerminologyIndex::Builder builder;
+    AddShapes(&builder);
+    ValueSetDefinition::Rule rule = Filter("is-a", "polygon");
+    rule.codes = {"circle"};
+    builder.AddValueSet(ValueSet("vs", {rule}));
+    EXPECT_EQ(builder.Build().status().code(),
+              absl::StatusCode::kInvalidArgument);
+  }
+}
+
+}  // namespace
+
+}  // namespace fhir
+}  // namespace google